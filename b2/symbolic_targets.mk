@@ -462,7 +462,9 @@ PANDABOARD_MODULES=             \
     armv7/sbin/serial_driver    \
     armv7/sbin/hello_world      \
     armv7/sbin/mmchs            \
-    armv7/sbin/fsb              
+    armv7/sbin/fsb              \
+    armv7/sbin/ipc_bench        \
+    armv7/sbin/proxy_print      
 
 
 menu.lst.pandaboard: $(SRCDIR)/hake/menu.lst.pandaboard
@@ -512,6 +514,9 @@ menu.lst.arm_gem5: $(SRCDIR)/hake/menu.lst.arm_gem5
 menu.lst.arm_gem5_mc: $(SRCDIR)/hake/menu.lst.arm_gem5_mc
 	cp $< $@
 
+menu.lst.arm_gem5_ipc_bench: $(SRCDIR)/hake/menu.lst.arm_gem5_ipc_bench
+	cp $< $@
+
 GEM5_MODULES=\
 	armv7/sbin/cpu_arm_gem5 \
 	armv7/sbin/init         \
@@ -523,35 +528,52 @@ GEM5_MODULES=\
 	armv7/sbin/skb          \
 	armv7/sbin/memtest
 
+GEM5_IPC_BENCH_MODULES=\
+	armv7/sbin/cpu_arm_gem5 \
+	armv7/sbin/init         \
+	armv7/sbin/test_domain  \
+	armv7/sbin/ipc_bench
+
+
+# Build a gem5 boot image named $@ with arm_molly.
+# $(1): menu.lst, $(2): directory for the translated binaries, $(3): generated C file
+define arm_gem5_molly_image
+# Translate each of the binary files we need
+$(SRCDIR)/tools/arm_molly/build_data_files.sh $(1) $(2)
+# Generate appropriate linker script
+cpp -P -DBASE_ADDR=0x00100000 $(SRCDIR)/tools/arm_molly/molly_ld_script.in \
+	$(2)/molly_ld_script
+# Build a C file to link into a single image for the 2nd-stage
+# bootloader
+tools/bin/arm_molly $(1) $(3)
+# Compile the complete boot image into a single executable
+$(ARM_GCC) -std=c99 -g -fPIC -pie -Wl,-N -fno-builtin \
+	-nostdlib -march=armv7-a -mapcs -fno-unwind-tables \
+	-T$(2)/molly_ld_script \
+	-I$(SRCDIR)/include \
+	-I$(SRCDIR)/include/arch/arm \
+	-I./armv7/include \
+	-I$(SRCDIR)/include/oldc \
+	-I$(SRCDIR)/include/c \
+	-imacros $(SRCDIR)/include/deputy/nodeputy.h \
+	$(SRCDIR)/tools/arm_molly/molly_boot.S \
+	$(SRCDIR)/tools/arm_molly/molly_init.c \
+	$(SRCDIR)/tools/arm_molly/lib.c \
+	./$(3) \
+	$(SRCDIR)/lib/elf/elf32.c \
+	./$(2)/* \
+	-o $@
+endef
 
 arm_gem5_image: $(GEM5_MODULES) \
 		tools/bin/arm_molly \
 		menu.lst.arm_gem5
-	# Translate each of the binary files we need
-	$(SRCDIR)/tools/arm_molly/build_data_files.sh menu.lst.arm_gem5 molly_gem5
-	# Generate appropriate linker script
-	cpp -P -DBASE_ADDR=0x00100000 $(SRCDIR)/tools/arm_molly/molly_ld_script.in \
-		molly_gem5/molly_ld_script
-	# Build a C file to link into a single image for the 2nd-stage
-	# bootloader
-	tools/bin/arm_molly menu.lst.arm_gem5 arm_mbi.c
-	# Compile the complete boot image into a single executable
-	$(ARM_GCC) -std=c99 -g -fPIC -pie -Wl,-N -fno-builtin \
-		-nostdlib -march=armv7-a -mapcs -fno-unwind-tables \
-		-Tmolly_gem5/molly_ld_script \
-		-I$(SRCDIR)/include \
-		-I$(SRCDIR)/include/arch/arm \
-		-I./armv7/include \
-		-I$(SRCDIR)/include/oldc \
-		-I$(SRCDIR)/include/c \
-		-imacros $(SRCDIR)/include/deputy/nodeputy.h \
-		$(SRCDIR)/tools/arm_molly/molly_boot.S \
-		$(SRCDIR)/tools/arm_molly/molly_init.c \
-		$(SRCDIR)/tools/arm_molly/lib.c \
-		./arm_mbi.c \
-		$(SRCDIR)/lib/elf/elf32.c \
-		./molly_gem5/* \
-		-o arm_gem5_image
+	$(call arm_gem5_molly_image,menu.lst.arm_gem5,molly_gem5,arm_mbi.c)
+
+arm_gem5_ipc_bench_image: $(GEM5_IPC_BENCH_MODULES) \
+		tools/bin/arm_molly \
+		menu.lst.arm_gem5_ipc_bench
+	$(call arm_gem5_molly_image,menu.lst.arm_gem5_ipc_bench,molly_gem5_ipc_bench,arm_mbi_ipc_bench.c)
 
 # ARM GEM5 Simulation Targets
 ARM_FLAGS=$(SRCDIR)/tools/arm_gem5/gem5script.py --caches --l2cache --n=2 --kernel=arm_gem5_image
@@ -562,4 +584,9 @@ arm_gem5: arm_gem5_image $(SRCDIR)/tools/arm_gem5/gem5script.py
 arm_gem5_detailed: arm_gem5_image $(SRCDIR)/tools/arm_gem5/gem5script.py
 	gem5.fast $(ARM_FLAGS) --cpu-type=arm_detailed
 
-.PHONY: arm_gem5_mc arm_gem5 arm_gem5_detailed arm_gem5_detailed
+# Runs the IPC benchmarks in place of the shell
+arm_gem5_ipc_bench: arm_gem5_ipc_bench_image $(SRCDIR)/tools/arm_gem5/gem5script.py
+	gem5.fast $(SRCDIR)/tools/arm_gem5/gem5script.py --caches --l2cache --n=2 \
+		--kernel=arm_gem5_ipc_bench_image
+
+.PHONY: arm_gem5_mc arm_gem5 arm_gem5_detailed arm_gem5_detailed arm_gem5_ipc_bench
@@ -0,0 +1,147 @@
+/**
+ * Message channels between cores in shared, cacheable memory.
+ *
+ * A channel consists of two rings, one per direction. Every slot of a ring
+ * is one cache line, with the payload in front and a header word at the end.
+ * The sender writes the payload, issues a barrier and then writes the header,
+ * which contains the sequence number of the slot. The receiver polls the
+ * header of the next slot until the expected sequence number shows up.
+ *
+ * Flow control is credit-based: The receiver publishes the number of
+ * consumed slots in a separate cache line of the ring, but only once every
+ * 'ack_batch' slots. The sender only reads this line when it runs out of
+ * credits, so in the common case neither side touches a line the other
+ * one is writing.
+ *
+ * Messages larger than one slot are split over consecutive slots.
+ *
+ * A waiting thread polls for CROSS_CORE_POLL_SPINS rounds. After that it
+ * yields, or, if blocking is enabled on the channel, it sets a waiting
+ * flag in the ring and blocks until the other core sends a notification,
+ * see cross_core_notify.h. The other side only checks the flag after it
+ * published a message or credits, and only raises an interrupt if it's set.
+ */
+
+#ifndef CROSS_CORE_CHANNEL_H
+#define CROSS_CORE_CHANNEL_H
+
+#include <barrelfish/barrelfish.h>
+
+/// Size of a cache line on the Cortex-A9.
+#define CROSS_CORE_LINE_SIZE 32
+
+/// Payload bytes in a single slot.
+#define CROSS_CORE_SLOT_PAYLOAD (CROSS_CORE_LINE_SIZE - sizeof (uint32_t))
+
+/// Number of polls before a waiting thread yields.
+#define CROSS_CORE_POLL_SPINS 1000
+
+/**
+ * One slot of a ring. The header is written last.
+ * Bits 31..8 of the header are the sequence number plus one,
+ * bit 7 is set if the message continues in the next slot,
+ * bits 6..0 are the number of payload bytes in this slot.
+ */
+struct cross_core_slot {
+    uint8_t payload [CROSS_CORE_SLOT_PAYLOAD];
+    volatile uint32_t header;
+} __attribute__ ((aligned (CROSS_CORE_LINE_SIZE)));
+
+/**
+ * Shared memory layout of one direction.
+ */
+struct cross_core_ring {
+    // Number of slots consumed by the receiver, in its own cache line.
+    volatile uint32_t acknowledged __attribute__ ((aligned (CROSS_CORE_LINE_SIZE)));
+    // Set by a receiver blocked on an empty ring. It rarely changes, so it
+    // gets its own line instead of being invalidated with every acknowledgement.
+    volatile uint32_t receiver_waiting __attribute__ ((aligned (CROSS_CORE_LINE_SIZE)));
+    // Set by a sender blocked on credits.
+    volatile uint32_t sender_waiting __attribute__ ((aligned (CROSS_CORE_LINE_SIZE)));
+    struct cross_core_slot slots [];
+};
+
+/**
+ * Local state of one end of a channel.
+ */
+struct cross_core_channel {
+    struct cross_core_ring* send_ring;
+    struct cross_core_ring* receive_ring;
+    uint32_t slot_count;        // Slots per ring, a power of two.
+    uint32_t ack_batch;         // Consumed slots per acknowledgement.
+    uint32_t send_sequence;     // Slots sent so far.
+    uint32_t send_limit;        // Sequence number up to which we have credits.
+    uint32_t receive_sequence;  // Slots received so far.
+    uint32_t receive_published; // Slots acknowledged so far.
+    size_t max_message_size;    // Largest message, in bytes, sent or received.
+    bool blocking;              // Block on notifications instead of yielding.
+};
+
+/**
+ * Get the amount of shared memory needed for a channel.
+ */
+size_t cross_core_channel_size (uint32_t slot_count);
+
+/**
+ * Zero the shared memory of a channel. This has to be done once by one
+ * side, before the other side starts to use the channel.
+ */
+void cross_core_channel_clear (void* buffer, uint32_t slot_count);
+
+/**
+ * Initialize one end of a channel.
+ *
+ * \param buffer: Shared memory of cross_core_channel_size (slot_count) bytes, cache line aligned.
+ * \param slot_count: Number of slots per direction, a power of two.
+ * \param initiator: True on one end and false on the other, to tell the rings apart.
+ */
+errval_t cross_core_channel_init (struct cross_core_channel* channel, void* buffer, uint32_t slot_count, bool initiator);
+
+/**
+ * Let threads waiting on this end of the channel block until they get
+ * a notification from the other core. Notifications have to be set up
+ * with cross_core_notify_init first.
+ */
+errval_t cross_core_channel_enable_blocking (struct cross_core_channel* channel);
+
+/**
+ * Get the size of the largest message that can be sent on a channel.
+ */
+size_t cross_core_max_message_size (struct cross_core_channel* channel);
+
+/**
+ * Lower the size of the largest message on one end of a channel, such that
+ * receive buffers of that size are enough. Both ends should use the same limit:
+ * Larger messages are rejected when sent, and cut off when received.
+ */
+void cross_core_limit_message_size (struct cross_core_channel* channel, size_t size);
+
+/**
+ * Send a message if there are enough credits, otherwise fail with AOS_ERR_CROSS_CORE_FULL.
+ */
+errval_t cross_core_try_send (struct cross_core_channel* channel, const void* message, size_t size);
+
+/**
+ * Send a message, waiting for credits if necessary.
+ */
+errval_t cross_core_send (struct cross_core_channel* channel, const void* message, size_t size);
+
+/**
+ * Receive a message if there is one, otherwise fail with AOS_ERR_CROSS_CORE_EMPTY.
+ *
+ * \param buffer: Buffer of at least cross_core_max_message_size bytes.
+ * \param size: Result parameter for the size of the message. May be NULL.
+ */
+errval_t cross_core_try_receive (struct cross_core_channel* channel, void* buffer, size_t* size);
+
+/**
+ * Receive a message, waiting for it if necessary.
+ */
+errval_t cross_core_receive (struct cross_core_channel* channel, void* buffer, size_t* size);
+
+/**
+ * Publish all consumed slots to the sender, regardless of the batch size.
+ */
+void cross_core_acknowledge (struct cross_core_channel* channel);
+
+#endif // CROSS_CORE_CHANNEL_H
@@ -0,0 +1,49 @@
+/**
+ * Cross core notifications with inter-processor interrupts.
+ *
+ * A domain that owns a Notify_IPI capability for the other core can raise
+ * a software generated interrupt there. The kernel on the other core
+ * delivers it as an empty message to the endpoint registered for
+ * ARM_NOTIFY_IPI_IRQ in its IRQ table.
+ *
+ * A dedicated thread waits for these messages on a private waitset and
+ * wakes up all threads blocked in cross_core_notify_wait. Notifications
+ * don't carry any data and may be coalesced, so a woken thread has to check
+ * itself whether its condition is met.
+ */
+
+#ifndef CROSS_CORE_NOTIFY_H
+#define CROSS_CORE_NOTIFY_H
+
+#include <barrelfish/barrelfish.h>
+
+/**
+ * Register for notifications from the other core and start the notification thread.
+ *
+ * \param peer: A Notify_IPI capability for the other core.
+ * \param irq_table: The IRQ table capability, to route the interrupt to us.
+ */
+errval_t cross_core_notify_init (struct capref peer, struct capref irq_table);
+
+/**
+ * Check if notifications have been set up successfully.
+ */
+bool cross_core_notify_enabled (void);
+
+/**
+ * Send a notification to the other core. Does nothing if notifications are disabled.
+ */
+void cross_core_notify_peer (void);
+
+/**
+ * Get the number of notifications received so far.
+ * Read it before checking the condition to wait for, and then pass it to cross_core_notify_wait.
+ */
+uint32_t cross_core_notify_count (void);
+
+/**
+ * Block the calling thread until a notification arrives after 'seen' was read.
+ */
+void cross_core_notify_wait (uint32_t seen);
+
+#endif // CROSS_CORE_NOTIFY_H
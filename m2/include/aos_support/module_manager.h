@@ -3,6 +3,7 @@
 
 #include <barrelfish/barrelfish.h>
 #include <barrelfish/aos_rpc.h>
+#include <spawndomain/spawndomain.h>
 
 // Default prefix of module names on the pandaboard.
 #define BINARY_PREFIX "armv7/sbin/"
@@ -18,6 +19,8 @@ struct module_info {
     lvaddr_t virtual_address;
     genpaddr_t physical_address;
     struct mem_region* module;
+    // Loaded on the first spawn, and shared by all domains spawned from this module.
+    struct spawn_image image;
 };
 
 /**
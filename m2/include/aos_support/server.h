@@ -28,6 +28,41 @@ typedef void (*handler_function_t) (
  */
 errval_t create_channel (struct lmp_chan** ret_channel);
 
+/**
+ * Create a new channel whose messages are passed to 'forward' instead of
+ * the external handler. Only AOS_PING and AOS_RPC_CONNECTION_INIT are
+ * handled by the server itself. Used by init to relay requests to
+ * services on another core.
+ */
+errval_t create_forwarding_channel (struct lmp_chan** ret_channel, handler_function_t forward);
+
+/**
+ * Close a channel created by create_channel or create_forwarding_channel,
+ * e.g. because the client is gone. Queued messages are dropped. If a message
+ * of the channel is being handled, the channel is freed once that is done.
+ * Has to be called on the event loop.
+ */
+void destroy_channel (struct lmp_chan* channel);
+
+/**
+ * A function which is told that a channel is closed.
+ */
+typedef void (*close_handler_t) (struct lmp_chan* channel);
+
+/**
+ * Call 'handler' for each channel which is freed after destroy_channel,
+ * once its last message has been handled, such that the server can release
+ * what the client held. The handler must not call back into the server.
+ */
+void server_set_close_handler (close_handler_t handler);
+
+/**
+ * Check if the client of a channel still exists. Killing a domain
+ * revokes its dispatcher, which deletes the endpoints retyped from it.
+ * Also works in servers which can't identify capabilities.
+ */
+bool server_client_alive (struct lmp_chan* channel);
+
 /**
  * \brief Handle an unknown message.
  *
@@ -35,6 +70,14 @@ errval_t create_channel (struct lmp_chan** ret_channel);
  */
 void handle_unknown_message (struct lmp_chan* channel, struct capref capability);
 
+/**
+ * Get the string argument of a message, starting at word 'first_word'.
+ *
+ * Strings sent through a bulk slot (see AOS_RPC_BULK_STRING) are returned in place,
+ * so the result is only valid until the reply is sent. The string is always null-terminated.
+ */
+errval_t server_get_string (struct lmp_recv_msg* message, uint32_t first_word, char** string);
+
 /**
  * Initialize and start a server.
  *
@@ -43,6 +86,52 @@ void handle_unknown_message (struct lmp_chan* channel, struct capref capability)
  */
 errval_t start_server (enum aos_service service, handler_function_t handler);
 
+/**
+ * Initialize and start a server which handles client requests on a pool of worker threads.
+ *
+ * Messages of one channel are handled in order, one at a time. Messages of
+ * different channels may be handled concurrently, so the handler has to be thread-safe.
+ *
+ * \param workers Number of worker threads. With 0, requests are handled by the event loop.
+ */
+errval_t start_server_with_workers (enum aos_service service, handler_function_t handler, uint32_t workers);
+
+/**
+ * Tell the server that the handler for the current message on 'channel'
+ * will send its reply later. Further messages on the channel are held back
+ * until server_complete_reply is called.
+ */
+void server_defer_reply (struct lmp_chan* channel);
+
+/**
+ * Mark a deferred reply on 'channel' as sent.
+ */
+void server_complete_reply (struct lmp_chan* channel);
+
+/// Number of message types for which latency counters are kept.
+#define SERVER_MAX_MESSAGE_TYPE 128
+
+/**
+ * Latency counters of a message handler, measured in cycles from the
+ * arrival of a message until its reply was sent.
+ */
+struct server_stats {
+    uint32_t count;
+    uint64_t total_cycles;
+    uint32_t max_cycles;
+};
+
+/**
+ * Get the latency counters for messages of type 'type'.
+ */
+void server_get_stats (uint32_t type, struct server_stats* stats);
+
+/**
+ * Print the latency counters of all message types seen so far.
+ * Clients can trigger this with aos_rpc_print_server_stats.
+ */
+void server_print_stats (void);
+
 /**
  * NOTE: Extensions for init.
  */
@@ -2,19 +2,22 @@
 #define SHARED_BUFFER_H
 
 #include <barrelfish/barrelfish.h>
+#include <barrelfish/aos_rpc.h>
 
 /**
  * Map a user-provided shared frame.
  *
  * \param frame_capability: The frame to be mapped.
+ * \param slot_size_bits: Size of the slots in a bulk ring, or 0 for a single buffer.
  * \param memory_descriptor: Result parameter for the descriptor of the allocated buffer.
  */
-errval_t map_shared_buffer (struct capref frame_capability, uint32_t* memory_descriptor);
+errval_t map_shared_buffer (struct capref frame_capability, uint8_t slot_size_bits, uint32_t* memory_descriptor);
 
 /**
  * Get the address and size of a shared buffer.
+ * If the descriptor refers to a slot of a bulk ring, only that slot is returned.
  *
- * \param memory_descriptor: The descriptor of the buffer.
+ * \param memory_descriptor: The descriptor of the buffer or slot.
  * \param result_buffer: Result parameter for the buffer address. May be NULL.
  * \param result_size: Result parameter for the size of the buffer. May be NULL.
  *
@@ -22,8 +25,7 @@ errval_t map_shared_buffer (struct capref frame_capability, uint32_t* memory_des
 errval_t get_shared_buffer (uint32_t memory_descriptor, void** result_buffer, uint32_t* result_size);
 
 /**
- * Unmap an already mapped shared buffer.
- * TODO: This function is not implemented yet, as it needs some heavy changes in the paging code.
+ * Unmap an already mapped shared buffer and destroy its frame capability.
  *
  * \param memory_descriptor: The descriptor of the buffer.
  */
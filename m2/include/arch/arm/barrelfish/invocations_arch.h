@@ -271,14 +271,15 @@ invoke_vnode_unmap(struct capref cap, capaddr_t mapping_cptr, int mapping_bits,
 
     pte_count -= 1;
 
-    assert(entry < 1024);
+    // L1 entries for sections go up to 4096.
+    assert(entry < 4096);
     assert(pte_count < 1024);
     assert(mapping_bits <= 0xff);
 
     return syscall4((invoke_bits << 16) | (VNodeCmd_Unmap << 8) | SYSCALL_INVOKE,
                     invoke_cptr, mapping_cptr,
-		    ((mapping_bits & 0xff)<<20) | ((pte_count & 0x3ff)<<10) |
-                     (entry & 0x3ff)).error;
+		    ((mapping_bits & 0xff)<<24) | ((pte_count & 0x3ff)<<12) |
+                     (entry & 0xfff)).error;
 }
 
 /**
@@ -436,6 +437,27 @@ static inline errval_t invoke_irqtable_delete(struct capref irqcap, int irq)
                     invoke_cptr, irq).error;
 }
 
+static inline errval_t invoke_irqtable_unmask(struct capref irqcap, int irq)
+{
+    uint8_t invoke_bits = get_cap_valid_bits(irqcap);
+    capaddr_t invoke_cptr = get_cap_addr(irqcap) >> (CPTR_BITS - invoke_bits);
+
+    return syscall3((invoke_bits << 16) | (IRQTableCmd_Unmask << 8) | SYSCALL_INVOKE,
+                    invoke_cptr, irq).error;
+}
+
+/**
+ * \brief Raise the notification interrupt on the core of a Notify_IPI capability.
+ */
+static inline errval_t invoke_ipi_notify_send(struct capref notify_cap)
+{
+    uint8_t invoke_bits = get_cap_valid_bits(notify_cap);
+    capaddr_t invoke_cptr = get_cap_addr(notify_cap) >> (CPTR_BITS - invoke_bits);
+
+    return syscall2((invoke_bits << 16) | (NotifyCmd_Send << 8) | SYSCALL_INVOKE,
+                    invoke_cptr).error;
+}
+
 static inline errval_t invoke_kernel_get_core_id(struct capref kern_cap,
                                                  coreid_t *core_id)
 {
@@ -455,6 +477,94 @@ static inline errval_t invoke_kernel_get_core_id(struct capref kern_cap,
     return sysret.error;
 }
 
+/**
+ * \brief Get a copy of the kernel representation of a capability.
+ */
+static inline errval_t invoke_kernel_identify_cap(struct capref kern_cap,
+                                                  struct capref cap,
+                                                  struct capability *ret)
+{
+    assert(ret != NULL);
+
+    uint8_t invoke_bits = get_cap_valid_bits(kern_cap);
+    capaddr_t invoke_cptr = get_cap_addr(kern_cap) >> (CPTR_BITS - invoke_bits);
+
+    uint8_t bits = get_cap_valid_bits(cap);
+    capaddr_t caddr = get_cap_addr(cap) >> (CPTR_BITS - bits);
+
+    return syscall5((invoke_bits << 16) | (KernelCmd_Identify_cap << 8) | SYSCALL_INVOKE,
+                    invoke_cptr, caddr, bits, (uintptr_t) ret).error;
+}
+
+/**
+ * \brief Mark a capability as having copies on another core.
+ *
+ * \param has_descendants: Result parameter, set if the capability has descendants. May be NULL.
+ */
+static inline errval_t invoke_kernel_remote_cap(struct capref kern_cap,
+                                                struct capref cap,
+                                                bool remote,
+                                                bool *has_descendants)
+{
+    uint8_t invoke_bits = get_cap_valid_bits(kern_cap);
+    capaddr_t invoke_cptr = get_cap_addr(kern_cap) >> (CPTR_BITS - invoke_bits);
+
+    uint8_t bits = get_cap_valid_bits(cap);
+    capaddr_t caddr = get_cap_addr(cap) >> (CPTR_BITS - bits);
+
+    struct sysret sysret =
+        syscall5((invoke_bits << 16) | (KernelCmd_Remote_cap << 8) | SYSCALL_INVOKE,
+                 invoke_cptr, caddr, bits, remote);
+
+    if (sysret.error == SYS_ERR_OK && has_descendants != NULL) {
+        *has_descendants = sysret.value;
+    }
+    return sysret.error;
+}
+
+/**
+ * \brief Find out how a capability is related to others, e.g. before reusing its memory.
+ *
+ * \param relations: Result parameter, CAP_RELATION_* flags and the number of other copies.
+ */
+static inline errval_t invoke_kernel_cap_relations(struct capref kern_cap,
+                                                   struct capref cap,
+                                                   uintptr_t *relations)
+{
+    uint8_t invoke_bits = get_cap_valid_bits(kern_cap);
+    capaddr_t invoke_cptr = get_cap_addr(kern_cap) >> (CPTR_BITS - invoke_bits);
+
+    uint8_t bits = get_cap_valid_bits(cap);
+    capaddr_t caddr = get_cap_addr(cap) >> (CPTR_BITS - bits);
+
+    struct sysret sysret =
+        syscall4((invoke_bits << 16) | (KernelCmd_Cap_relations << 8) | SYSCALL_INVOKE,
+                 invoke_cptr, caddr, bits);
+
+    if (sysret.error == SYS_ERR_OK) {
+        *relations = sysret.value;
+    }
+    return sysret.error;
+}
+
+/**
+ * \brief Create a capability in slot 'dest' from its kernel representation.
+ *
+ * This is how capabilities are transferred between cores:
+ * The representation is sent over, and the receiver recreates the capability.
+ */
+static inline errval_t invoke_kernel_create_cap(struct capref kern_cap,
+                                                struct capability *cap,
+                                                struct capref dest)
+{
+    uint8_t invoke_bits = get_cap_valid_bits(kern_cap);
+    capaddr_t invoke_cptr = get_cap_addr(kern_cap) >> (CPTR_BITS - invoke_bits);
+
+    return syscall6((invoke_bits << 16) | (KernelCmd_Create_cap << 8) | SYSCALL_INVOKE,
+                    invoke_cptr, get_cnode_addr(dest), get_cnode_valid_bits(dest),
+                    dest.slot, (uintptr_t) cap).error;
+}
+
 static inline errval_t invoke_kernel_dump_ptables(struct capref kern_cap,
                                                   struct capref dispcap)
 {
@@ -18,4 +18,8 @@
 /// This CPU supports lazy FPU context switching?
 #undef FPU_LAZY_CONTEXT_SWITCH
 
+/// Software generated interrupt used by Notify_IPI capabilities.
+/// SGI 1 is taken by the core startup code.
+#define ARM_NOTIFY_IPI_IRQ 2
+
 #endif
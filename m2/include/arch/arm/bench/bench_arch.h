@@ -18,6 +18,7 @@
 #include <barrelfish/sys_debug.h>
 #include <bench/bench.h>
 #include <stdio.h>
+#include <arch/arm/barrelfish_kpi/asm_inlines_arch.h>
 
 extern uint64_t tsc_hz;
 void bench_arch_init(void);
@@ -34,5 +35,20 @@ static inline cycles_t bench_tsc(void)
     return tsc;
 }
 
+/**
+ * \brief Read the cycle counter for timing short operations
+ *
+ * gem5 doesn't implement the performance monitor extension, so there this
+ * falls back to the CPU private timer, read with #bench_tsc.
+ */
+static inline uint32_t bench_cycle_count(void)
+{
+#if defined(__gem5__)
+    return bench_tsc();
+#else
+    return get_cycle_count();
+#endif
+}
+
 
 #endif // ARCH_ARM_BARRELFISH_BENCH_H
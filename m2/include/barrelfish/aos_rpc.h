@@ -35,9 +35,45 @@ enum aos_service {
 
 #define MAX_PROCESS_NAME_LENGTH (7 * 4 - 1)
 
+// The name directory published by init.
+// The first aos_service_guard entries are reserved for the predefined services,
+// so a service identifier is simply an index into the directory.
+#define AOS_NAME_DIRECTORY_SIZE 64
+#define AOS_NAME_LENGTH (7 * 4)
+
+struct aos_name_entry {
+    char name [AOS_NAME_LENGTH];  // Null-terminated, empty if the entry is free.
+    uint32_t metadata;            // Service-defined, e.g. a protocol version.
+    bool is_registered;           // The service is ready to accept connections.
+};
+
+/**
+ * Read-only snapshot of all registered services.
+ * Init increments 'version' before and after every update,
+ * so an odd version means that an update is in progress.
+ */
+struct aos_name_directory {
+    volatile uint32_t version;
+    struct aos_name_entry entries [AOS_NAME_DIRECTORY_SIZE];
+};
+
 // Basic protocol:
 // The first argument is the type of message.
 // If there's a reply, the first argument is an errval_t. // TODO: this is currently not always implemented.
+//
+// Requests sent through aos_send_receive or aos_rpc_submit carry a request ID
+// in the upper half of the first argument. Servers handle the messages of one
+// channel in order, so replies are matched to requests in the order they were sent.
+//
+// String arguments occupy the last words of a message. If a string doesn't fit,
+// the client puts it into a slot of its bulk ring, sets AOS_RPC_BULK_STRING in
+// the first argument, and sends the slot descriptor in place of the string.
+// The layout of each message is described at its type below.
+#define AOS_RPC_BULK_STRING 0x8000
+#define AOS_RPC_MESSAGE_TYPE(word) ((word) & 0x7FFF)
+#define AOS_RPC_HAS_BULK_STRING(word) (((word) & AOS_RPC_BULK_STRING) != 0)
+#define AOS_RPC_REQUEST_ID(word) ((word) >> 16)
+#define AOS_RPC_TAGGED_TYPE(type, id) (((id) << 16) | ((type) & 0xFFFF))
 
 /**
  * Do a small exchange for testing purposes.
@@ -110,6 +146,136 @@ enum aos_service {
  */
 #define AOS_ROUTE_DELIVER_EP 4
 
+/**
+ * Register a service under a name.
+ *
+ * Type: Synchronous
+ * Target: init
+ * Send Args: metadata, name (string, up to AOS_NAME_LENGTH characters, null-terminated)
+ * Send Capability: -
+ * Receive Args: Error value, service identifier
+ * Receive Capability: -
+ */
+#define AOS_ROUTE_REGISTER_NAME 29
+
+/**
+ * Get the name directory of init.
+ *
+ * Type: Synchronous
+ * Target: init
+ * Send Args: -
+ * Send Capability: -
+ * Receive Args: Error value
+ * Receive Capability: Frame containing a struct aos_name_directory. Map it read-only.
+ */
+#define AOS_RPC_GET_NAME_DIRECTORY 30
+
+/**
+ * Do a cross-core (IKC) round trip from init.0 to init.1 and back.
+ * The second core is booted on first use. Used for benchmarking.
+ *
+ * Type: Synchronous
+ * Target: init on core 0
+ * Send Args: An arbitrary value
+ * Send Capability: -
+ * Receive Args: Error value, the value echoed by init.1, cycles spent on the IKC round trip
+ * Receive Capability: -
+ */
+#define AOS_RPC_IKC_PING 31
+
+/**
+ * Get the memory statistics of a core, in bytes.
+ * init.0 asks init.1 for the numbers of core 1.
+ *
+ * Type: Synchronous
+ * Target: init
+ * Send Args: core ID
+ * Send Capability: -
+ * Receive Args: Error value, free, used, borrowed from and lent to the other core
+ * Receive Capability: -
+ */
+#define AOS_RPC_GET_MEMORY_STATS 32
+
+/**
+ * Revoke a RAM or frame capability on both cores.
+ * Only allowed on the core which owns the memory.
+ *
+ * Type: Synchronous
+ * Target: init
+ * Send Args: -
+ * Send Capability: RAM or frame capability
+ * Receive Args: Error value
+ * Receive Capability: -
+ */
+#define AOS_RPC_REVOKE_REMOTE 33
+
+/**
+ * Write a page to the swap partition on the SD card.
+ *
+ * Type: Synchronous
+ * Target: filesystem driver
+ * Send Args: memory descriptor of the page contents, swap slot or AOS_RPC_SWAP_NEW_SLOT
+ * Send Capability: -
+ * Receive Args: Error value, swap slot
+ * Receive Capability: -
+ */
+#define AOS_RPC_SWAP_OUT 34
+
+/**
+ * Read a page back from the swap partition and release its swap slot.
+ *
+ * Type: Synchronous
+ * Target: filesystem driver
+ * Send Args: memory descriptor for the page contents, swap slot
+ * Send Capability: -
+ * Receive Args: Error value
+ * Receive Buffer: Page contents
+ * Receive Capability: -
+ */
+#define AOS_RPC_SWAP_IN 35
+
+/// Ask AOS_RPC_SWAP_OUT for a new swap slot.
+#define AOS_RPC_SWAP_NEW_SLOT 0xFFFFFFFF
+
+/**
+ * Release a swap slot whose page isn't needed any more, e.g. because it was unmapped.
+ *
+ * Type: Synchronous
+ * Target: filesystem driver
+ * Send Args: swap slot
+ * Send Capability: -
+ * Receive Args: Error value
+ * Receive Capability: -
+ */
+#define AOS_RPC_SWAP_FREE 38
+
+/**
+ * Give memory from AOS_RPC_GET_RAM_CAP back to the RAM service.
+ * Only the domain which got it may give it back, as a whole, and only if it
+ * isn't shared: The sent capability may have no other copy than the sender's,
+ * which is deleted, and no descendants, so it must not be mapped any more.
+ *
+ * Type: Synchronous
+ * Target: RAM service
+ * Send Args: -
+ * Send Capability: RAM or frame capability
+ * Receive Args: Error value
+ * Receive Capability: -
+ */
+#define AOS_RPC_FREE_RAM_CAP 36
+
+/**
+ * Print the message handling statistics of a server to its debug output.
+ *
+ * Type: Synchronous
+ * Target: any server built on aos_support/server.h
+ * Send Args: -
+ * Send Capability: -
+ * Receive Args: Error value
+ * Receive Capability: -
+ */
+#define AOS_RPC_PRINT_SERVER_STATS 37
+
 /**
  * Get a RAM capability.
  *
@@ -127,7 +293,7 @@ enum aos_service {
  *
  * Type: Synchronous
  * Target: Serial driver
- * Send Args: Memory descriptor of shared buffer.
+ * Send Args: Memory descriptor of shared buffer (may be a bulk slot descriptor).
  * Send Capability: -
  * Receive Args: Error value
  * Receive Capability: -
@@ -137,7 +303,7 @@ enum aos_service {
 /**
  * Send a character to be printed by the UART driver.
  *
- * Type: Asynchronous // TODO: shall we wait for acknowledgement?
+ * Type: Asynchronous
  * Target: Serial driver
  * Send Args: a character
  * Send Capability: -
@@ -148,6 +314,7 @@ enum aos_service {
 
 /**
  * Request a single character from the UART driver.
+ * The reply is deferred until input arrives while the domain is in the foreground.
  *
  * Type: Synchronous
  * Target: Serial driver
@@ -286,7 +453,7 @@ enum aos_service {
  *
  * Type: Synchronous
  * Target: filesystem driver
- * Send Args: path to file
+ * Send Args: domain ID, path to file (string)
  * Send Capability: -
  * Receive Args: error value and file handle.
  * Receive Capability: -
@@ -322,7 +489,7 @@ enum aos_service {
  *
  * Type: Synchronous
  * Target: filesystem driver
- * Send Args: memory descriptor for result buffer, file descriptor, position, size
+ * Send Args: memory descriptor for result buffer (may be a bulk slot descriptor), file descriptor, position, size
  * Send Capability: -
  * Receive Args: Error value, number of characters read
  * Receive Buffer: File contents
@@ -346,9 +513,12 @@ enum aos_service {
 /**
  * Register an area of shared memory.
  *
+ * If the slot size is non-zero, the frame is treated as a ring of
+ * equally sized slots which can be addressed with AOS_RPC_BULK_DESCRIPTOR.
+ *
  * Type: Synchronous
  * Target: Any server.
- * Send Arguments: -
+ * Send Arguments: Slot size in bits (0 for a single buffer)
  * Send Capability: Frame to be shared
  * Receive Args: Error value, memory descriptor
  * Receive Capability: -
@@ -384,18 +554,103 @@ enum aos_service {
  *
  * Type: Synchronous
  * Target: Process manager (init)
- * Send Arguments: Memory descriptor, Core ID
- * Send Buffer: Process Name
+ * Send Arguments: Core ID, Process Name (string)
  * Send Capability: -
  * Receive Arguments: Error value, PID of process (if not remote).
  * Receive Capability: -
  */
 #define AOS_RPC_SPAWN_DOMAIN 27
 
+/**
+ * Send a short string to be printed by the UART driver.
+ * The characters are packed into the remaining message words.
+ *
+ * Type: Asynchronous
+ * Target: Serial driver
+ * Send Args: number of characters, up to AOS_RPC_SERIAL_INLINE_LENGTH characters
+ * Send Capability: -
+ * Receive Args: no reply
+ * Receive Capability: -
+ */
+#define AOS_RPC_SERIAL_WRITE 28
+
+/// Maximum number of characters in an AOS_RPC_SERIAL_WRITE message.
+#define AOS_RPC_SERIAL_INLINE_LENGTH (7 * 4)
+
+/**
+ * Memory descriptors may address a single slot within a registered frame.
+ * The lower half is the descriptor returned by AOS_RPC_REGISTER_MEMORY,
+ * the upper half is the slot index. Slot 0 of a frame without slots
+ * refers to the whole frame, so plain memory descriptors stay valid.
+ */
+#define AOS_RPC_BULK_DESCRIPTOR(memory_descriptor, slot) \
+    (((slot) << 16) | ((memory_descriptor) & 0xFFFF))
+#define AOS_RPC_BULK_MEMORY_DESCRIPTOR(descriptor) ((descriptor) & 0xFFFF)
+#define AOS_RPC_BULK_SLOT(descriptor) ((descriptor) >> 16)
+
+/// Maximum number of slots in a bulk ring (one bit per slot in the free mask).
+#define AOS_RPC_BULK_MAX_SLOTS 32
+
+/**
+ * A ring of equally sized slots in a frame which is shared once with the server.
+ * Payloads are produced and consumed in place, i.e. without any copies.
+ */
+struct aos_rpc_bulk {
+    uint32_t memory_descriptor;
+    void* base;
+    uint8_t slot_size_bits;
+    uint32_t slot_count;
+    uint32_t free_slots; // Bitmask of free slots.
+    uint32_t next_slot;  // Next slot to try, to hand out slots in ring order.
+    struct aos_rpc_request* requests; // Storage for asynchronous transfers, one per slot.
+};
+
+/// Maximum number of requests in flight on one channel.
+#define AOS_RPC_MAX_PENDING 8
+STATIC_ASSERT(LMP_RECV_SLOT_POOL_SIZE >= AOS_RPC_MAX_PENDING,
+              "every pending reply needs a receive slot from the pool");
+
+struct aos_rpc_request;
+
+/**
+ * Completion callback for asynchronous requests.
+ * Called from the event dispatch loop once the reply has arrived.
+ */
+typedef void (*aos_rpc_callback_t) (struct aos_rpc_request* request);
+
+/**
+ * An outstanding request on an aos_rpc channel.
+ * The storage has to stay valid until the request has completed.
+ */
+struct aos_rpc_request {
+    struct lmp_recv_msg message; // Request arguments, replaced by the reply.
+    struct capref cap;           // Capability to send, replaced by the received capability.
+    bool needs_receive_cap;      // Allocate a new receive slot after the reply.
+    bool is_barrier;             // Reply may be deferred by the server, see aos_rpc_submit.
+    bool done;
+    errval_t error;              // Transport error. The server result is in message.words [0].
+    uint16_t id;
+    aos_rpc_callback_t callback; // May be NULL.
+    void* arg;
+};
+
 struct aos_rpc {
     uint32_t memory_descriptor;
     void* shared_buffer;
     uint32_t shared_buffer_length;
+    struct aos_rpc_bulk bulk;
+
+    // Table of pending completions, indexed by request ID.
+    struct aos_rpc_request* pending [AOS_RPC_MAX_PENDING];
+    uint16_t next_request_id;
+    uint16_t pending_count;
+    bool barrier_pending;
+    bool receive_registered;
+
+    // Send blocking calls with LMP_FLAG_SYNC, such that the server runs
+    // on our timeslice and the kernel switches back on its reply.
+    bool donate_timeslice;
+
     struct lmp_chan channel;
 };
 
@@ -405,8 +660,8 @@ struct aos_rpc {
 struct aos_rpc* aos_rpc_get_init_channel (void);
 
 /// The channel to the serial driver.
-/// This channel is always available, except in init and serial_driver.
-/// NOTE: Initialization happens in libbarrelfish/init.c
+/// The connection is set up on first use. Returns NULL if this fails,
+/// which is always the case in init and serial_driver.
 struct aos_rpc* aos_rpc_get_serial_driver_channel (void);
 
 
@@ -434,6 +689,14 @@ errval_t aos_rpc_serial_getchar(struct aos_rpc *chan, char *retc);
  */
 errval_t aos_rpc_serial_putchar(struct aos_rpc *chan, char c);
 
+/**
+ * \brief send a buffer of characters to the serial port
+ *
+ * Short buffers are packed into AOS_RPC_SERIAL_WRITE messages, longer ones
+ * are sent asynchronously as strings through a bulk ring.
+ */
+errval_t aos_rpc_serial_write(struct aos_rpc *chan, const char *buf, size_t len);
+
 /**
  * \brief Request device memory capability from memory server.
  */
@@ -568,6 +831,28 @@ errval_t aos_find_service (uint32_t service, struct capref* endpoint);
  */
 errval_t aos_register_service (struct aos_rpc* rpc, uint32_t service);
 
+/**
+ * \brief Register a service of the current process under a name.
+ * \arg name The name of the service, at most AOS_NAME_LENGTH - 1 characters.
+ * \arg metadata A service-defined value published in the name directory.
+ * \arg service Result parameter for the service identifier. May be NULL.
+ */
+errval_t aos_register_name (struct aos_rpc* rpc, const char* name, uint32_t metadata, uint32_t* service);
+
+/**
+ * \brief Look up a service in the name directory of init.
+ * The directory is mapped on first use, later lookups don't need any IPC.
+ * \arg service Result parameter for the service identifier. May be NULL.
+ * \arg metadata Result parameter for the metadata of the service. May be NULL.
+ */
+errval_t aos_lookup_name (const char* name, uint32_t* service, uint32_t* metadata);
+
+/**
+ * \brief Get a channel to a service.
+ * The channel is set up on first use and cached afterwards.
+ */
+errval_t aos_rpc_get_service_channel (uint32_t service, struct aos_rpc** channel);
+
 /**
  * \brief Turn the LED on or off.
  */
@@ -594,9 +879,162 @@ void aos_rpc_exit (struct aos_rpc* rpc);
  */
 errval_t aos_rpc_wait_for_termination (struct aos_rpc* rpc, domainid_t domain);
 
+/**
+ * \brief Grant a ring of 2^slot_count_bits slots of 2^slot_size_bits bytes to the server.
+ * This has to be done once per channel before any of the bulk functions can be used.
+ */
+errval_t aos_rpc_bulk_init (struct aos_rpc* rpc, uint8_t slot_count_bits, uint8_t slot_size_bits);
+
+/**
+ * \brief Reserve a free slot of the bulk ring.
+ * \arg buffer The start of the slot in our address space.
+ * \arg size The size of the slot. May be NULL.
+ * \arg descriptor The slot descriptor to be passed to the server.
+ */
+errval_t aos_rpc_bulk_alloc (struct aos_rpc* rpc, void** buffer, size_t* size, uint32_t* descriptor);
+
+/**
+ * \brief Give back a slot reserved by aos_rpc_bulk_alloc.
+ */
+void aos_rpc_bulk_free (struct aos_rpc* rpc, uint32_t descriptor);
+
+/**
+ * \brief Send the null-terminated string which has been written in place into a bulk slot.
+ */
+errval_t aos_rpc_bulk_send_string (struct aos_rpc* rpc, uint32_t descriptor);
+
+/**
+ * \brief Read at most one slot of data from an open file directly into a bulk slot.
+ * \arg buflen the amount of bytes stored in the slot.
+ */
+errval_t aos_rpc_bulk_read (struct aos_rpc* rpc, int fd, size_t position, uint32_t descriptor, size_t* buflen);
+
+/**
+ * \brief Prepare a request for aos_rpc_submit.
+ * \arg callback Function to be called on completion. May be NULL.
+ */
+void aos_rpc_request_init (struct aos_rpc_request* request, aos_rpc_callback_t callback, void* arg);
+
+/**
+ * \brief Send a request without waiting for the reply.
+ *
+ * Up to AOS_RPC_MAX_PENDING requests can be in flight on one channel.
+ * Requests whose reply may be deferred by the server (service lookup,
+ * getchar, wait for termination) are never overlapped with other requests.
+ * If the channel is full, this function dispatches events until a slot is free.
+ * Messages without reply (see aos_rpc_expects_reply) are done once they are sent.
+ */
+errval_t aos_rpc_submit (struct aos_rpc* rpc, struct aos_rpc_request* request);
+
+/**
+ * \brief Check if the server replies to messages of this type.
+ * The types documented with "Receive Args: no reply" don't get one.
+ */
+bool aos_rpc_expects_reply (uint32_t type);
+
+/**
+ * \brief Dispatch events until the request has completed.
+ */
+errval_t aos_rpc_wait (struct aos_rpc* rpc, struct aos_rpc_request* request);
+
+/**
+ * \brief Declare 'thread' as the only thread dispatching events on the default waitset.
+ *
+ * Other threads waiting for a reply then block until the event thread has
+ * received it, instead of dispatching events themselves. Used by servers
+ * with worker threads.
+ */
+void aos_rpc_set_event_thread (struct thread* thread);
+
+/**
+ * \brief Enable or disable timeslice donation for blocking calls on 'rpc'.
+ *
+ * With donation, aos_send_receive switches to the server immediately and the
+ * kernel switches back when the server replies. Requests with a callback are
+ * always sent without donation. Enabled by default.
+ */
+void aos_rpc_set_donation (struct aos_rpc* rpc, bool donate);
+
+/**
+ * \brief Submit a RAM request. On completion, words [0] contains the error value,
+ * words [1] the actual size in bits and cap the RAM capability.
+ */
+errval_t aos_rpc_get_ram_cap_submit (struct aos_rpc* rpc, size_t request_bits, struct aos_rpc_request* request);
+
+/**
+ * \brief Submit a read into a bulk slot. On completion, words [0] contains
+ * the error value and words [1] the number of bytes read.
+ */
+errval_t aos_rpc_bulk_read_submit (struct aos_rpc* rpc, int fd, size_t position, uint32_t descriptor,
+                                   struct aos_rpc_request* request);
+
 /**
  * Ping a domain.
  */
 errval_t aos_ping (struct aos_rpc* channel, uint32_t value);
 
+/**
+ * Ping init on the second core through init.0.
+ * \arg ikc_cycles Result parameter for the cycles init.0 spent on the cross-core round trip. May be NULL.
+ */
+errval_t aos_rpc_ikc_ping (struct aos_rpc* rpc, uint32_t value, uint32_t* ikc_cycles);
+
+/**
+ * Memory statistics of one core, in bytes.
+ */
+struct aos_memory_stats {
+    size_t free;
+    size_t used;     // Includes the memory lent to the other core.
+    size_t borrowed; // Received from the other core.
+    size_t lent;     // Given to the other core.
+};
+
+/**
+ * Get the memory statistics of the memory server on 'core'.
+ */
+errval_t aos_rpc_get_memory_stats (struct aos_rpc* rpc, coreid_t core, struct aos_memory_stats* stats);
+
+/**
+ * Revoke a capability, including the copies init has handed to the other core.
+ * Fails with AOS_ERR_CROSS_CORE_CAP_NOT_OWNER if the memory belongs to the other core.
+ */
+errval_t aos_rpc_revoke_remote (struct aos_rpc* rpc, struct capref cap);
+
+/**
+ * Give a RAM or frame capability from aos_rpc_get_ram_cap back to the RAM service.
+ * On success, 'cap' is deleted and its slot is freed.
+ */
+errval_t aos_rpc_free_ram_cap (struct aos_rpc* rpc, struct capref cap);
+
+/**
+ * Make the server on the other end of 'rpc' print its message handling statistics.
+ */
+errval_t aos_rpc_print_server_stats (struct aos_rpc* rpc);
+
+/**
+ * Set up the page-sized buffer for swapping on a connection to the filesystem driver.
+ * The paging code calls this in advance, because swapping is needed when memory is scarce.
+ * Afterwards, the connection is only used by the swap calls below. They don't
+ * take the locks of the other calls and don't dispatch events, so they can be
+ * used in the page fault handler.
+ */
+errval_t aos_rpc_swap_init (struct aos_rpc* rpc);
+
+/**
+ * Write a page to the swap partition.
+ * \arg page The page contents, BASE_PAGE_SIZE bytes.
+ * \arg slot Result parameter for the swap slot holding the page.
+ */
+errval_t aos_rpc_swap_out (struct aos_rpc* rpc, const void* page, uint32_t* slot);
+
+/**
+ * Read a page from the swap partition. The swap slot is free afterwards.
+ */
+errval_t aos_rpc_swap_in (struct aos_rpc* rpc, uint32_t slot, void* page);
+
+/**
+ * Free a swap slot without reading it back.
+ */
+errval_t aos_rpc_swap_free (struct aos_rpc* rpc, uint32_t slot);
+
 #endif // _LIB_BARRELFISH_AOS_MESSAGES_H
@@ -37,6 +37,10 @@ struct lmp_bind_continuation {
     void *st;
 };
 
+/// Maximum number of receive slots a channel keeps allocated in advance.
+/// Must cover AOS_RPC_MAX_PENDING, so that every pending reply finds a slot.
+#define LMP_RECV_SLOT_POOL_SIZE 8
+
 /// A bidirectional LMP channel
 struct lmp_chan {
     struct waitset_chanstate send_waitset; ///< State belonging to waitset (for send)
@@ -56,6 +60,12 @@ struct lmp_chan {
     struct lmp_bind_continuation bind_continuation; ///< Continuation for bind
     iref_t iref;            ///< IREF
     size_t buflen_words;    ///< requested LMP buffer length, in words
+
+    /* Receive slots allocated in advance, see lmp_chan_alloc_recv_slot() */
+    struct capref recv_slot_pool[LMP_RECV_SLOT_POOL_SIZE];
+    size_t recv_slot_count;                    ///< Number of slots in the pool
+    size_t recv_slot_target;                   ///< Number of slots the pool is refilled to
+    struct waitset_chanstate recv_slot_refill; ///< Pending refill of the pool
 };
 
 void lmp_chan_init(struct lmp_chan *lc);
@@ -70,6 +80,8 @@ errval_t lmp_chan_register_send(struct lmp_chan *lc, struct waitset *ws,
 errval_t lmp_chan_deregister_send(struct lmp_chan *lc);
 void lmp_chan_migrate_send(struct lmp_chan *lc, struct waitset *ws);
 errval_t lmp_chan_alloc_recv_slot(struct lmp_chan *lc);
+bool lmp_chan_set_recv_slot_from_pool(struct lmp_chan *lc);
+void lmp_chan_set_recv_slot_pool(struct lmp_chan *lc, size_t count);
 void lmp_channels_retry_send_disabled(dispatcher_handle_t handle);
 void lmp_init(void);
 
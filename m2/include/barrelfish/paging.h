@@ -23,6 +23,7 @@
 typedef int paging_flags_t;
 
 #define VADDR_OFFSET ((lvaddr_t)1UL*1024*1024*1024) // 1GB
+#define VADDR_LIMIT ((lvaddr_t)2UL*1024*1024*1024) // 2GB, the kernel starts here
 
 #define SLAB_BUFSIZE 16
 
@@ -56,25 +57,72 @@ typedef int paging_flags_t;
 
 #define EXCEPTION_STACK_SIZE (16u*1024u)
 
-struct frame_list;
+// Upper limit for the number of frames of the page fault handler.
+#define PAGING_MAX_FRAMES ((VADDR_LIMIT - VADDR_OFFSET) / FRAME_SIZE)
+// Frames which paging_release can queue for paging_return_frames.
+#define PAGING_RETURN_FRAMES 16u
+
+// State of a page in the heap, which is mapped on demand.
+enum page_state {
+    PAGE_UNUSED = 0, // Never touched. A page fault maps a new, empty page.
+    PAGE_MAPPED,     // Mapped to a slot of a frame.
+    PAGE_INACTIVE,   // Still in its frame slot, but unmapped to detect the next access.
+    PAGE_SWAPPED,    // Paged out to the swap partition.
+};
+
+// Where a page is, packed into a single word.
+union page_entry {
+    struct {
+        uint32_t state : 2;       // An enum page_state.
+        uint32_t frame_slot : 8;  // Slot in the frame while the page is mapped or inactive.
+        uint32_t frame : 22;      // Index of the frame in paging_state.frames.
+    };
+    struct {
+        uint32_t : 2;
+        uint32_t swap_slot : 30;  // Location on the swap partition while paged out.
+    };
+};
 
-// We only need to store if the page has been mapped at some point.
-// (Not mapped + Pagefault) -> allocate new, empty frame.
-// (Mapped + Pagefault) -> Paged out. Allocate frame & retrieve from disk.
+// Keep the state of each page, to find out on a page fault if it has been paged out.
 struct ptable_lvl2 {
     struct capref lvl2_cap;
-    bool page_exists [ARM_L2_USER_ENTRIES];
-};
+    union page_entry pages [ARM_L2_USER_ENTRIES];
+
+    // The table is freed once it has no used pages, and no
+    // entries mapped with paging_map_fixed_attr, which don't show up in 'pages'.
+    uint16_t used_pages;
+    uint16_t mapped_entries;
 
+    // Fault-around: A fault at 'next_fault' continues a sequential
+    // access, and maps twice as many pages as the last fault.
+    lvaddr_t next_fault;
+    uint32_t run_pages;
+};
 
+// The page in a frame slot, packed into a single word.
+// Pages mapped by the same fault share one mapping. They
+// form a run of slots, and can only be unmapped together.
+struct frame_slot {
+    uint32_t page : 20;       // Virtual page number, 0 if the slot is free.
+    uint32_t run_offset : 6;  // Distance to the first slot of the run.
+    uint32_t run_length : 6;  // Only valid at the first slot of a run.
+};
 
 // For each frame, store frame cap & pages residing on this frame.
-// Need to call cap_revoke() when unmapping the frame, as copies are not stored.
-struct frame_list {
+// The whole frame is also mapped at 'window', such that
+// pages can be copied from and to the swap partition
+// while they're not mapped at their own address.
+// Each run is mapped with a copy of the frame cap, which is kept in
+// the slot of 'mappings' with the number of the run's first frame slot.
+struct paging_frame {
     struct capref frame;
-    uint32_t next_free_slot;
-    lvaddr_t pages [FRAME_SIZE / PAGE_SIZE]; // address is enough to identify a page.
-    struct frame_list* next;
+    struct capref mapping_cnode;
+    struct cnoderef mappings;
+    lvaddr_t window;
+    uint32_t index;                               // Index in paging_state.frames.
+    uint32_t free_count;
+    uint32_t free_slots [FRAME_SLOTS / 32];       // Bitmap, a set bit is a free slot.
+    struct frame_slot slots [FRAME_SLOTS];
 };
 
 /// Initialize a ptable struct
@@ -83,45 +131,82 @@ static inline void init_ptable_lvl2 (struct ptable_lvl2* ptable)
     memset (ptable, 0, sizeof(struct ptable_lvl2));
 }
 
-/// Initialize a frame list struct.
-static inline void init_frame_list (struct frame_list* node)
+/// Initialize a frame struct with all slots free.
+static inline void init_paging_frame (struct paging_frame* node)
 {
-    memset (node, 0, sizeof(struct frame_list));
+    memset (node, 0, sizeof(struct paging_frame));
+    memset (node -> free_slots, 0xff, sizeof (node -> free_slots));
+    node -> free_count = FRAME_SLOTS;
 }
 
+// A range of virtual addresses.
+// Free and reserved ranges are kept in two lists sorted by address.
+// Each reserved range keeps a list of the frames mapped into it.
+struct vspace_node {
+    lvaddr_t base;
+    size_t size;
+    struct vspace_node* next;
+    struct vspace_node* mappings; // Reserved ranges only.
+    struct capref frame;          // Mappings only: the mapped copy of the frame.
+    bool is_section;              // Mappings only: mapped in the first-level page table.
+};
+
+// Counters of the page fault handler.
+struct paging_stats {
+    uint32_t faults;
+    uint32_t pages_mapped_ahead; // Mapped by fault-around, i.e. faults avoided on sequential access.
+    uint32_t pages_deactivated;  // Unmapped by the clock algorithm.
+    uint32_t pages_swapped_out;
+    uint32_t pages_swapped_in;
+    uint32_t frames_returned;    // Given back to the RAM server by paging_release.
+};
+
 // struct to store the paging status of a process
 struct paging_state {
 
     // Virtual address space management:
 
-    // Keep track of reserved (valid) heap addresses.
-    // Valid addresses are in the range:
-    //      heap_begin <= x < heap_end
-    // NOTE: We don't support recycling of virtual addresses.
-    // Malloc usually doesn't return them anyway.
-    lvaddr_t heap_begin;
-    lvaddr_t heap_end;
+    // Addresses in reserved ranges are valid, and pages
+    // which are not mapped yet are mapped on a page fault.
+    // Unmapped ranges are merged with their free neighbours.
+    struct vspace_node* free_ranges;
+    struct vspace_node* reserved_ranges;
+    // Nodes for the lists above. A refill needs nodes itself,
+    // so it is done while there are still some in reserve.
+    struct slab_alloc vspace_mem;
+    bool vspace_refilling;
 
     // Page table management:
 
     // Keep track of allocated second-level page tables.
     // A first-level page table always has ARM_L1_USER_ENTRIES entries.
     struct ptable_lvl2* ptables [ARM_L1_USER_ENTRIES];
-    // ptable_mem is a simple memory manager for second-level page tables
+    // ptable_mem is a simple memory manager for second-level page tables.
+    // Like vspace_mem, it is refilled while there are some left in reserve.
     struct slab_alloc ptable_mem;
+    bool ptable_refilling;
     // Capability to level 1 page table.
     struct capref ptable_lvl1_cap;
 
     // Frame management:
 
-    // Allocated frames are stored in a singly linked list.
-    // That way pages can be unmapped in a FIFO way
-    // if physical memory gets scarce.
-    // NOTE: Remove from head, insert at end.
-    struct frame_list* flist_head;
-    struct frame_list* flist_tail;
-    // Simple memory manager for frame list.
+    // Allocated frames, in the order of allocation. When a frame
+    // is returned, the last one takes its place.
+    // If the RAM server runs out of memory, pages are
+    // paged out with the clock algorithm. The clock hand
+    // goes over all frame slots in this order.
+    struct paging_frame* frames [PAGING_MAX_FRAMES];
+    uint32_t frame_count;
+    // No frame before this index has free slots.
+    uint32_t first_free_frame;
+    uint32_t clock_frame;
+    uint32_t clock_slot;
+    // Simple memory manager for frame descriptors.
     struct slab_alloc frame_mem;
+    // Unmapped frames which wait for paging_return_frames.
+    struct capref returned_frames [PAGING_RETURN_FRAMES];
+    uint32_t returned_count;
+    struct paging_stats stats;
 
     // Exception stack management:
 
@@ -139,6 +224,10 @@ errval_t paging_init_state(struct paging_state *st, lvaddr_t start_vaddr,
 errval_t paging_init(void);
 /// setup paging on new thread (used for user-level threads)
 void paging_init_onthread(struct thread *t);
+/// never page out to the SD card, e.g. in domains the filesystem depends on
+void paging_disable_swap(void);
+/// get the counters of the page fault handler
+void paging_get_stats(struct paging_state *st, struct paging_stats *stats);
 
 struct paging_region {
     lvaddr_t base_addr;
@@ -160,7 +249,8 @@ errval_t paging_region_map(struct paging_region *pr, size_t req_size,
  * \brief free a bit of the paging region `pr`.
  * This function gets used in some of the code that is responsible
  * for allocating Frame (and other) capabilities.
- * We ignore unmap requests right now.
+ * Only frames mapped completely within the given range are unmapped,
+ * and the region doesn't hand out the addresses again.
  */
 errval_t paging_region_unmap(struct paging_region *pr, lvaddr_t base, size_t bytes);
 
@@ -170,6 +260,13 @@ errval_t paging_region_unmap(struct paging_region *pr, lvaddr_t base, size_t byt
  */
 errval_t paging_alloc(struct paging_state *st, void **buf, size_t bytes);
 
+/**
+ * \brief Allocate memory which is mapped right away and never paged out,
+ *        e.g. for thread stacks, which the swap path runs on.
+ *        Free it with paging_unmap.
+ */
+errval_t paging_alloc_pinned(struct paging_state *st, void **buf, size_t bytes);
+
 /**
  * Functions to map a user provided frame.
  */
@@ -182,12 +279,28 @@ errval_t paging_map_fixed_attr(struct paging_state *st, lvaddr_t vaddr,
                 struct capref frame, size_t bytes, int flags);
 
 /**
- * \brief unmap a user provided frame
- * NOTE: this function is currently here to make libbarrelfish compile. As
- * noted on paging_region_unmap we ignore unmap requests right now.
+ * \brief unmap everything in a range reserved with paging_alloc and free the range.
+ * `region` has to be the start address of the range. Unused second-level
+ * page tables are freed, and the addresses can be handed out again.
  */
 errval_t paging_unmap(struct paging_state *st, const void *region);
 
+/**
+ * \brief Release the pages between `base` and `base + bytes` which were
+ * mapped on a page fault, e.g. because malloc doesn't use them any more.
+ * Only whole pages are released, and explicit mappings are kept. The range
+ * stays reserved, and the next access maps a new, empty page. Frames which
+ * end up unused are returned to the RAM server, except for a spare one.
+ */
+errval_t paging_release(struct paging_state *st, void *base, size_t bytes);
+
+/**
+ * \brief Hand the frames which paging_release has unmapped to the RAM server.
+ * paging_release only queues them, as it runs with the malloc lock held,
+ * and returning a frame is an RPC which may need malloc itself.
+ */
+void paging_return_frames(struct paging_state *st);
+
 
 /// Map user provided frame while allocating VA space for it
 static inline errval_t paging_map_frame(struct paging_state *st, void **buf,
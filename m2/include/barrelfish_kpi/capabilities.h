@@ -187,6 +187,7 @@ enum kernel_cmd {
     KernelCmd_IPI_Register,
     KernelCmd_IPI_Delete,
     KernelCmd_DumpPTables,
+    KernelCmd_Cap_relations,      ///< Return ancestors, descendants and copies of a capability
     KernelCmd_Count
 };
 
@@ -215,7 +216,8 @@ enum frame_cmd {
  */
 enum irqtable_cmd {
     IRQTableCmd_Set,    ///< Set endpoint for IRQ# notifications
-    IRQTableCmd_Delete  ///< Remove notification endpoint for IRQ#
+    IRQTableCmd_Delete, ///< Remove notification endpoint for IRQ#
+    IRQTableCmd_Unmask  ///< Re-enable IRQ# after its notification was handled
 };
 
 /**
@@ -258,6 +260,11 @@ enum id_cmd {
 /**
  * Maximum command ordinal.
  */
+/// Result of KernelCmd_Cap_relations: Flags, and the number of other copies above them.
+#define CAP_RELATION_ANCESTORS      (1u << 0)
+#define CAP_RELATION_DESCENDANTS    (1u << 1)
+#define CAP_RELATION_COPIES_SHIFT   2
+
 #define CAP_MAX_CMD KernelCmd_Count
 
 /**
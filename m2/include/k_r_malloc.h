@@ -20,7 +20,8 @@ union header {			/* block header */
 typedef union header Header;
 
 Header  *morecore(unsigned nu);
-void lesscore(void);
+void lesscore(Header *freed, unsigned freed_units);
+void lesscore_unlocked(void);
 void __free_locked(void *ap);
 void __malloc_init(void*, void*);
 
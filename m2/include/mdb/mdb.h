@@ -26,6 +26,7 @@ void set_init_mapping(struct cte *dest_start, size_t num);
 bool has_descendants(struct cte *cte);
 bool has_ancestors(struct cte *cte);
 bool has_copies(struct cte *cte);
+size_t count_copies(struct cte *cte);
 void remove_mapping(struct cte *cte);
 errval_t mdb_get_copy(struct capability *cap, struct capability **ret);
 bool mdb_is_sane(void);
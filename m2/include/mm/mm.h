@@ -78,6 +78,7 @@ errval_t mm_realloc_range(struct mm *mm, uint8_t sizebits, genpaddr_t base,
                           struct capref *retcap);
 errval_t mm_free(struct mm *mm, struct capref cap, genpaddr_t base,
                  uint8_t sizebits);
+bool mm_is_allocated(struct mm *mm, genpaddr_t base, uint8_t sizebits);
 
 /// Structure to record all information about a given memory region
 struct mem_cap {
@@ -17,6 +17,33 @@
 
 #include <sys/cdefs.h>
 
+#define SPAWN_MAX_SEGMENTS 8
+
+/**
+ * \brief A loadable segment of an ELF image, page aligned.
+ */
+struct spawn_segment {
+    genvaddr_t base;
+    size_t size;
+    uint32_t flags;         ///< ELF segment flags
+    struct capref frame;    ///< Loaded segment, in the cspace of the spawning domain
+    lvaddr_t local_addr;    ///< Where frame is mapped in the spawning domain
+};
+
+/**
+ * \brief ELF image loaded once and kept to spawn more domains from it.
+ *
+ * Read-only segments are mapped directly into every domain spawned from
+ * the image. Writable segments are copied from the loaded image.
+ * A zeroed struct is filled in on the first spawn.
+ */
+struct spawn_image {
+    genvaddr_t entry;
+    void *got_base;
+    uint8_t segment_count;
+    struct spawn_segment segments[SPAWN_MAX_SEGMENTS];
+};
+
 //XXX: added alignment to workaround an arm-gcc bug
 //which generated (potentially) unaligned access code to those fields
 /**
@@ -39,6 +66,9 @@ struct spawninfo {
     // Slot (in segcn) from where elfload_allocate should allocate frames from
     cslot_t elfload_slot;
 
+    // Optional image shared between domains spawned from the same binary
+    struct spawn_image *image;
+
     // vspace of spawned domain
     struct paging_state *vspace;
 
@@ -20,7 +20,6 @@
 #include <exec.h>
 #include <exceptions.h>
 #include <misc.h>
-#include <cp15.h>   // for invalidating tlb and cache
 
 static arch_registers_state_t upcall_state;
 
@@ -32,10 +31,6 @@ void do_resume(uint32_t *regs)
     STATIC_ASSERT(R0_REG   ==  1, "");
     STATIC_ASSERT(PC_REG   == 16, "");
 
-    // Flush cashes and tlb
-    cp15_invalidate_tlb();
-    cp15_invalidate_i_and_d_caches();
-
     __asm volatile(
         // lr = r14, used as tmp register.
         // Load cpsr into lr and move regs to next entry (postindex op)
@@ -19,6 +19,7 @@
 #include <wakeup.h>
 #include <irq.h>
 #include <serial.h>
+#include <barrelfish_kpi/cpu_arch.h>
 
 /**
  * Prints register values
@@ -323,6 +324,15 @@ void handle_irq(arch_registers_state_t* save_area, uintptr_t fault_pc)
 #endif
     	dispatch(schedule());
     }
+#if defined(__ARM_ARCH_7A__)
+    // cross-core notification, see Notify_IPI. It may arrive before
+    // anyone registered for it, in which case we just drop it.
+    else if (irq == ARM_NOTIFY_IPI_IRQ) {
+        gic_ack_irq(irq);
+        send_user_interrupt(irq);
+        dispatch(schedule());
+    }
+#endif
     else {
         gic_ack_irq(irq);
         send_user_interrupt(irq);
@@ -60,6 +60,29 @@ void  __attribute__((noreturn)) gic_disable_all_irqs(void)
     /* } */
 }
 
+/**
+ * \brief Mask a shared peripheral interrupt at the distributor
+ *
+ * Used while a user-level driver services a level-sensitive device, so the
+ * still asserted line doesn't fire again before the driver could clear it.
+ */
+void gic_mask_interrupt(uint32_t int_id)
+{
+    assert(get_irq_type(int_id) == IrqType_SPI);
+    // Writing a one to the Clear-Enable register disables the interrupt,
+    // zeros have no effect.
+    pl130_gic_ICDICER_wr(&gic, int_id / 32, (1U << (int_id % 32)));
+}
+
+/**
+ * \brief Unmask a shared peripheral interrupt masked by gic_mask_interrupt
+ */
+void gic_unmask_interrupt(uint32_t int_id)
+{
+    assert(get_irq_type(int_id) == IrqType_SPI);
+    pl130_gic_ICDISER_wr(&gic, int_id / 32, (1U << (int_id % 32)));
+}
+
 /**
  * \brief Enable an interrupt
  *
@@ -81,8 +81,18 @@ errval_t irq_table_set(unsigned int nidt, capaddr_t endpoint)
         }
         err = caps_copy_to_cte(&irq_dispatch[nidt], recv, false, 0, 0);
 
-        gic_enable_interrupt(nidt, GIC_IRQ_CPU_TRG_ALL, 0,
-                GIC_IRQ_EDGE_TRIGGERED, GIC_IRQ_N_TO_N);
+        // Route the interrupt to this core only: the endpoint's
+        // dispatcher lives here, the other kernel has no handler for it.
+        // Software generated interrupts are always enabled and targeted
+        // by the sender, so there's nothing to configure for them.
+        // Device interrupts are level-sensitive: they stay masked from
+        // delivery until user space has serviced the device and unmasks
+        // them, see irq_table_unmask().
+        if (nidt >= 16) {
+            gic_enable_interrupt(nidt, 1 << my_core_id, 0,
+                    nidt >= 32 ? GIC_IRQ_LEVEL_SENSITIVE : GIC_IRQ_EDGE_TRIGGERED,
+                    GIC_IRQ_N_TO_N);
+        }
 #if 0
         if (err_is_ok(err)) {
             // Unmask interrupt if on PIC
@@ -97,6 +107,22 @@ errval_t irq_table_set(unsigned int nidt, capaddr_t endpoint)
     return SYS_ERR_IRQ_INVALID;
 }
 
+/**
+ * \brief Re-enable a device interrupt after the user-level handler serviced it.
+ *
+ * Shared peripheral interrupts are masked when they are delivered to user
+ * space, see send_user_interrupt().
+ */
+errval_t irq_table_unmask(unsigned int nidt)
+{
+    if (nidt >= 32 && nidt < NDISPATCH
+        && irq_dispatch[nidt].cap.type != ObjType_Null) {
+        gic_unmask_interrupt(nidt);
+        return SYS_ERR_OK;
+    }
+    return SYS_ERR_IRQ_INVALID;
+}
+
 errval_t irq_table_delete(unsigned int nidt)
 {
     if (nidt < NDISPATCH) {
@@ -130,6 +156,13 @@ void send_user_interrupt(int irq)
 
     // Otherwise, cap needs to be an endpoint
     assert(cap->type == ObjType_EndPoint);
+
+    // Device interrupts stay masked until the driver unmasks them again,
+    // otherwise a level-sensitive line would fire before the driver ran.
+    if (irq >= 32) {
+        gic_mask_interrupt(irq);
+    }
+
     errval_t err = lmp_deliver_notification(cap);
     if (err_is_fail(err)) {
         if (err_no(err) == SYS_ERR_LMP_BUF_OVERFLOW) {
@@ -12,6 +12,7 @@
 #include <barrelfish_kpi/lmp.h>
 #include <barrelfish_kpi/syscalls.h>
 #include <barrelfish_kpi/sys_debug.h>
+#include <barrelfish_kpi/cpu_arch.h>
 
 #include <arch/armv7/arm_hal.h>
 #include <arch/armv7/start_aps.h>
@@ -309,10 +310,10 @@ handle_unmap(
 
     /* Retrieve arguments */
     capaddr_t  mapping_cptr  = (capaddr_t)sa->arg2;
-    int mapping_bits         = (((int)sa->arg3) >> 20) & 0xff;
-    size_t pte_count         = (((size_t)sa->arg3) >> 10) & 0x3ff;
+    int mapping_bits         = (((int)sa->arg3) >> 24) & 0xff;
+    size_t pte_count         = (((size_t)sa->arg3) >> 12) & 0x3ff;
     pte_count               += 1;
-    size_t entry             = ((size_t)sa->arg3) & 0x3ff;
+    size_t entry             = ((size_t)sa->arg3) & 0xfff;
 
     errval_t err;
     struct cte *mapping = NULL;
@@ -394,6 +395,34 @@ monitor_remote_cap(
     return (struct sysret){ .error = SYS_ERR_OK, .value = has_desc };
 }
 
+static struct sysret
+monitor_cap_relations(
+	struct capability *kernel_cap,
+	arch_registers_state_t* context,
+	int argc)
+{
+	struct registers_arm_syscall_args* sa = &context->syscall_args;
+
+	struct capability *root = &dcb_current->cspace.cap;
+    capaddr_t cptr = sa->arg2;
+    int bits = sa->arg3;
+
+    struct cte *cte;
+    errval_t err = caps_lookup_slot(root, cptr, bits, &cte, CAPRIGHTS_READ);
+    if (err_is_fail(err)) {
+        return SYSRET(err_push(err, SYS_ERR_IDENTIFY_LOOKUP));
+    }
+
+    uintptr_t relations = count_copies(cte) << CAP_RELATION_COPIES_SHIFT;
+    if (has_ancestors(cte)) {
+        relations |= CAP_RELATION_ANCESTORS;
+    }
+    if (has_descendants(cte)) {
+        relations |= CAP_RELATION_DESCENDANTS;
+    }
+    return (struct sysret){ .error = SYS_ERR_OK, .value = relations };
+}
+
 static struct sysret
 monitor_create_cap(
     struct capability *kernel_cap,
@@ -484,6 +513,35 @@ static struct sysret handle_irq_table_delete( struct capability* to,
     return SYSRET(irq_table_delete(sa->arg2));
 }
 
+static struct sysret handle_irq_table_unmask( struct capability* to,
+        arch_registers_state_t* context,
+        int argc
+        )
+{
+    struct registers_arm_syscall_args* sa = &context->syscall_args;
+
+    return SYSRET(irq_table_unmask(sa->arg2));
+}
+
+/**
+ * \brief Raise the notification interrupt on the core named by a Notify_IPI cap.
+ */
+static struct sysret handle_notify_ipi_send( struct capability* to,
+        arch_registers_state_t* context,
+        int argc
+        )
+{
+    assert(to->type == ObjType_Notify_IPI);
+
+    coreid_t core = to->u.notify_ipi.coreid;
+    if (core >= 8) {
+        return SYSRET(SYS_ERR_CORE_NOT_FOUND);
+    }
+
+    gic_raise_softirq(1 << core, ARM_NOTIFY_IPI_IRQ);
+    return SYSRET(SYS_ERR_OK);
+}
+
 static struct sysret dispatcher_dump_ptables(
     struct capability* to,
     arch_registers_state_t* context,
@@ -537,7 +595,11 @@ static invocation_t invocations[ObjType_Num][CAP_MAX_CMD] = {
     [ObjType_IRQTable] = {
             [IRQTableCmd_Set] = handle_irq_table_set,
             [IRQTableCmd_Delete] = handle_irq_table_delete,
+            [IRQTableCmd_Unmask] = handle_irq_table_unmask,
         },
+    [ObjType_Notify_IPI] = {
+        [NotifyCmd_Send] = handle_notify_ipi_send,
+    },
     [ObjType_Kernel] = {
         [KernelCmd_Get_core_id]  = monitor_get_core_id,
         [KernelCmd_Get_arch_id]  = monitor_get_arch_id,
@@ -546,6 +608,7 @@ static invocation_t invocations[ObjType_Num][CAP_MAX_CMD] = {
         [KernelCmd_Remote_cap]   = monitor_remote_cap,
         [KernelCmd_Spawn_core]   = monitor_spawn_core,
         [KernelCmd_Identify_cap] = monitor_identify_cap,
+        [KernelCmd_Cap_relations] = monitor_cap_relations,
     }
 
 };
@@ -610,18 +673,31 @@ handle_invoke(arch_registers_state_t *context, int argc)
                 msg_words[8] = sa->arg11;
                 STATIC_ASSERT(LMP_MSG_LENGTH == 9, "Oops");
 
-                        struct dispatcher_shared_generic *current_disp1 =
-                            get_dispatcher_shared_generic(dcb_current->disp);
-                        struct dispatcher_shared_generic *listener_disp1 =
-                            get_dispatcher_shared_generic(listener->disp);
+#ifndef NDEBUG
+                struct dispatcher_shared_generic *current_disp1 =
+                    get_dispatcher_shared_generic(dcb_current->disp);
+                struct dispatcher_shared_generic *listener_disp1 =
+                    get_dispatcher_shared_generic(listener->disp);
                 debug(SUBSYS_SYSCALL, "LMP msg: from %.*s to %.*s\n",
                         DISP_NAME_LEN, current_disp1->name,
                         DISP_NAME_LEN, listener_disp1->name);
+#endif
 
                 // try to deliver message
                 r.error = lmp_deliver(to, dcb_current, msg_words,
                                       length_words, send_cptr, send_bits);
 
+                // A message to the dispatcher which donated its timeslice
+                // to us is the reply it is waiting for: Switch back directly,
+                // instead of letting it wait for its next turn in the schedule.
+                if (err_is_ok(r.error) && listener == dcb_current->donor) {
+                    dispatch_clear_donor(dcb_current);
+                    sync = true;
+                } else if (sync && err_is_ok(r.error) && listener != dcb_current) {
+                    // Remember the caller, so that the reply can return the timeslice.
+                    dispatch_set_donor(listener, dcb_current);
+                }
+
                 /* Switch to reciever upon successful delivery
                  * with sync flag, or (some cases of)
                  * unsuccessful delivery with yield flag */
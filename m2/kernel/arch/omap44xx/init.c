@@ -120,7 +120,7 @@ relocate_got_base(lvaddr_t offset)
 		    );
 }
 
-#ifndef __GEM5__
+#ifndef __gem5__
 static void enable_cycle_counter_user_access(void)
 {
     /* enable user-mode access to the performance counter*/
@@ -369,7 +369,6 @@ static void  __attribute__ ((noinline,noreturn)) text_init(void)
         start_aps_remap(aux_core_boot_section);
     }
 
-        cp15_disable_cache(); // TODO: Find a less drastic way to make spinlocks work.
     arm_kernel_startup();
 }
 
@@ -457,6 +456,12 @@ extern uint8_t core_id;
  */
 void arch_init(void *pointer)
 {
+    // The caches are still off. Get rid of whatever the data cache
+    // contains after reset, and join the SCU's coherency protocol
+    // before we turn it on in cp15_enable_mmu.
+    cp15_discard_d_cache();
+    cp15_enable_smp_coherency();
+
     serial_early_init(serial_console_port);
     
     if (hal_cpu_is_bsp()) {
@@ -475,16 +480,14 @@ void arch_init(void *pointer)
         glbl_core_data->multiboot_flags = mb->flags                         ;
 
 
-        // Allocate a free page-sized memory chunk for init to use.
-        uint32_t start_free_ram = ROUND_UP(max_addr, BASE_PAGE_SIZE);
+        // Allocate a free memory chunk for the cross core channels of init.
+        uint32_t start_free_ram = ROUND_UP(max_addr, 1UL << URPC_CHANNEL_SIZE_BITS);
 
         global -> urpc_channel_physical_address = start_free_ram;
-        global -> urpc_channel_size_bits = BASE_PAGE_BITS;
-
-        assert ((1<<BASE_PAGE_BITS) == BASE_PAGE_SIZE);
+        global -> urpc_channel_size_bits = URPC_CHANNEL_SIZE_BITS;
 
         // The allocated frame changes the region that can be used to map init and devices.
-        glbl_core_data->start_free_ram  = start_free_ram + BASE_PAGE_SIZE;
+        glbl_core_data->start_free_ram  = start_free_ram + (1UL << URPC_CHANNEL_SIZE_BITS);
 
 
         print_system_identification();
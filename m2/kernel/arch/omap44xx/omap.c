@@ -367,12 +367,19 @@ void scu_initialize(void)
 
 void scu_enable(void)
 {
+    // The duplicate tags are undefined after reset, see Cortex-A9 MPCore
+    // TRM 2.2.1. The write is ignored in non-secure state, where the
+    // boot loader has to do it for us.
+    a9scu_SCUInvalidateAll_wr(&scu, 0xffff);
+
     //enable SCU
     a9scu_SCUControl_t ctrl_reg = a9scu_SCUControl_rd(&scu);
     ctrl_reg |= 0x1;
     a9scu_SCUControl_wr(&scu, ctrl_reg);
 
-    //(should invalidate d-cache here)
+    // Lines this core allocated so far are unknown to the SCU, so write
+    // them back and start over.
+    cp15_clean_invalidate_d_cache();
 }
 
 int scu_get_core_count(void)
@@ -16,6 +16,7 @@
 #include <arm_hal.h>
 #include <cap_predicates.h>
 #include <dispatch.h>
+#include <mdb/mdb_tree.h>
 
 /**
  * Kernel L1 page table
@@ -85,8 +86,11 @@ void paging_map_kernel_section(uintptr_t ttbase, lvaddr_t va, lpaddr_t pa)
 
     l1.raw = 0;
     l1.section.type = L1_TYPE_SECTION_ENTRY;
+    // Write-back write-allocate and shareable, so it's coherent between the cores.
     l1.section.bufferable   = 1;
     l1.section.cacheable    = 1;
+    l1.section.tex          = 1;
+    l1.section.shareable    = 1;
     l1.section.ap10         = 1;    // RW/NA
     l1.section.ap2          = 0;
     l1.section.base_address = pa >> 20u;
@@ -274,6 +278,7 @@ void paging_set_l2_entry(uintptr_t* l2e, lpaddr_t addr, uintptr_t flags)
     e.raw = flags;
 
     e.small_page.type = L2_TYPE_SMALL_PAGE;
+    e.small_page.not_global = 1;    // Only used for init's pages.
     e.small_page.base_address = (addr >> 12);
 
     *l2e = e.raw;
@@ -284,23 +289,232 @@ void paging_context_switch(lpaddr_t ttbr)
 //    printf("paging context switch to %"PRIxLPADDR"\n", ttbr);
     lpaddr_t old_ttbr = cp15_read_ttbr0();
     if (ttbr != old_ttbr) {
+        cp15_write_asid(0);
         cp15_write_ttbr0(ttbr);
         cp15_invalidate_tlb();
-        cp15_invalidate_i_and_d_caches();
+    }
+}
+
+// ASID 0 is reserved, it is only active while switching between VSpaces.
+#define ASID_COUNT 256
+
+// ASIDs are handed out in generations. Once they are used up, the TLB
+// is flushed and a new generation starts. A dispatcher with an ASID of
+// an older generation gets a new one on its next context switch.
+// Starting with a full generation flushes the entries of startup.
+static uint32_t asid_generation = 0;
+static uint32_t next_asid = ASID_COUNT;
+
+static void paging_assign_asid(struct dcb *dcb)
+{
+    if (next_asid == ASID_COUNT) {
+        cp15_invalidate_tlb();
+        cp15_invalidate_branch_predictor();
+        asid_generation++;
+        next_asid = 1;
+    }
+    dcb->asid = next_asid++;
+    dcb->asid_generation = asid_generation;
+}
+
+void paging_dispatcher_switch(struct dcb *dcb)
+{
+    if (dcb->asid_generation != asid_generation) {
+        paging_assign_asid(dcb);
+    }
+
+    if (dcb->vspace != cp15_read_ttbr0() || dcb->asid != cp15_read_asid()) {
+        // Go through the reserved ASID, such that no walk of the new table
+        // is tagged with the old ASID, see ARMv7 ARM B3.10.4.
+        cp15_write_asid(0);
+        cp15_write_ttbr0(dcb->vspace);
+        __asm volatile("isb");
+        cp15_write_asid(dcb->asid);
     }
 }
 
 static void
 paging_set_flags(union arm_l2_entry *entry, uintptr_t kpi_paging_flags)
 {
+        bool cacheable = !(kpi_paging_flags & KPI_PAGING_FLAGS_NOCACHE);
+
+        // Normal memory is write-back write-allocate and shareable, such
+        // that the SCU keeps it coherent between the cores. Without the
+        // cacheable bit it's shared device memory (TEX = 0, C = 0, B = 1).
         entry->small_page.bufferable = 1;
-        entry->small_page.cacheable =
-            (kpi_paging_flags & KPI_PAGING_FLAGS_NOCACHE) ? 0 : 1;
+        entry->small_page.cacheable = cacheable ? 1 : 0;
+        entry->small_page.tex = cacheable ? 1 : 0;
+        entry->small_page.shareable = cacheable ? 1 : 0;
         entry->small_page.ap10  =
             (kpi_paging_flags & KPI_PAGING_FLAGS_READ)  ? 2 : 0;
         entry->small_page.ap10 |=
             (kpi_paging_flags & KPI_PAGING_FLAGS_WRITE) ? 3 : 0;
         entry->small_page.ap2 = 0;
+        entry->small_page.not_global = 1;
+}
+
+// Large pages have to be repeated in 16 consecutive L2 entries.
+#define L2_ENTRIES_PER_LARGE_PAGE (BYTES_PER_LARGE_PAGE / BYTES_PER_PAGE)
+
+// An "L2" table capability covers 4 hardware L2 tables, see caps_map_l1.
+#define ARM_L1_SCALE 4
+
+static void
+paging_set_large_page_flags(union arm_l2_entry *entry, uintptr_t kpi_paging_flags)
+{
+        // Same memory attributes as paging_set_flags.
+        bool cacheable = !(kpi_paging_flags & KPI_PAGING_FLAGS_NOCACHE);
+
+        entry->large_page.bufferable = 1;
+        entry->large_page.cacheable = cacheable ? 1 : 0;
+        entry->large_page.tex = cacheable ? 1 : 0;
+        entry->large_page.shareable = cacheable ? 1 : 0;
+        entry->large_page.ap10  =
+            (kpi_paging_flags & KPI_PAGING_FLAGS_READ)  ? 2 : 0;
+        entry->large_page.ap10 |=
+            (kpi_paging_flags & KPI_PAGING_FLAGS_WRITE) ? 3 : 0;
+        entry->large_page.ap2 = 0;
+        entry->large_page.not_global = 1;
+}
+
+static void
+paging_set_section_flags(union arm_l1_entry *entry, uintptr_t kpi_paging_flags)
+{
+        // Same memory attributes as paging_set_flags.
+        bool cacheable = !(kpi_paging_flags & KPI_PAGING_FLAGS_NOCACHE);
+
+        entry->section.bufferable = 1;
+        entry->section.cacheable = cacheable ? 1 : 0;
+        entry->section.tex = cacheable ? 1 : 0;
+        entry->section.shareable = cacheable ? 1 : 0;
+        entry->section.ap10  =
+            (kpi_paging_flags & KPI_PAGING_FLAGS_READ)  ? 2 : 0;
+        entry->section.ap10 |=
+            (kpi_paging_flags & KPI_PAGING_FLAGS_WRITE) ? 3 : 0;
+        entry->section.ap2 = 0;
+        entry->section.not_global = 1;
+}
+
+/**
+ * Turn the large page containing 'entry' back into 16 small pages
+ * with the same attributes, such that they can be changed one by one.
+ */
+static void
+paging_split_large_page(union arm_l2_entry *entry)
+{
+    union arm_l2_entry *first = (union arm_l2_entry *)
+        paging_round_down((uintptr_t)entry, L2_ENTRIES_PER_LARGE_PAGE * ARM_L2_BYTES_PER_ENTRY);
+    union arm_l2_entry large = *first;
+    assert(L2_TYPE(large.raw) == L2_TYPE_LARGE_PAGE);
+
+    for (int i = 0; i < L2_ENTRIES_PER_LARGE_PAGE; i++) {
+        union arm_l2_entry small;
+        small.raw = 0;
+        small.small_page.type = L2_TYPE_SMALL_PAGE;
+        small.small_page.bufferable = large.large_page.bufferable;
+        small.small_page.cacheable = large.large_page.cacheable;
+        small.small_page.tex = large.large_page.tex;
+        small.small_page.shareable = large.large_page.shareable;
+        small.small_page.ap10 = large.large_page.ap10;
+        small.small_page.ap2 = large.large_page.ap2;
+        small.small_page.not_global = large.large_page.not_global;
+        small.small_page.base_address =
+            (((lpaddr_t)large.large_page.base_address << 16) + i * BYTES_PER_PAGE) >> 12;
+        first[i] = small;
+    }
+}
+
+/**
+ * Make code written through the data cache visible to instruction fetches
+ * from an executable mapping. Caches aren't flushed on context switches,
+ * and the instruction cache may still hold old contents of the memory.
+ */
+static void
+paging_sync_caches(uintptr_t kpi_paging_flags)
+{
+    if (kpi_paging_flags & KPI_PAGING_FLAGS_EXECUTE) {
+        // Cleans the data cache, and invalidates the instruction cache.
+        cp15_invalidate_i_and_d_caches();
+        cp15_invalidate_branch_predictor();
+    }
+}
+
+/**
+ * Make new entries visible to the table walk. They replace invalid entries,
+ * and the TLB never holds translations which fault (ARMv7 ARM B3.10.1),
+ * so there are no TLB entries to invalidate.
+ */
+static void
+paging_sync_new_entries(void)
+{
+    __asm volatile("dsb");
+    cp15_invalidate_branch_predictor();
+    __asm volatile("dsb \n\t"
+                   "isb");
+}
+
+/**
+ * Map 'pte_count' sections of a frame directly into the L1 table.
+ *
+ * Unlike page tables, sections are addressed with the index of
+ * the hardware L1 entry, i.e. in units of 1MB.
+ */
+static errval_t
+caps_map_sections(struct capability* dest,
+                  cslot_t            slot,
+                  struct capability* src,
+                  uintptr_t          kpi_paging_flags,
+                  uintptr_t          offset,
+                  uintptr_t          pte_count)
+{
+    assert(0 == (kpi_paging_flags & ~KPI_PAGING_FLAGS_MASK));
+
+    if (pte_count == 0 || slot + pte_count > ARM_L1_OFFSET(MEMORY_OFFSET)) {
+        return SYS_ERR_VNODE_SLOT_RESERVED;
+    }
+
+    // check offset within frame
+    if (!aligned(offset, BYTES_PER_SECTION) ||
+        offset + pte_count * BYTES_PER_SECTION > get_size(src)) {
+        return SYS_ERR_FRAME_OFFSET_INVALID;
+    }
+
+    lpaddr_t src_lpaddr = gen_phys_to_local_phys(get_address(src) + offset);
+    if (!aligned(src_lpaddr, BYTES_PER_SECTION)) {
+        return SYS_ERR_FRAME_OFFSET_INVALID;
+    }
+
+    // Destination
+    lpaddr_t dest_lpaddr = gen_phys_to_local_phys(get_address(dest));
+    lvaddr_t dest_lvaddr = local_phys_to_mem(dest_lpaddr);
+
+    union arm_l1_entry* entry = (union arm_l1_entry*)dest_lvaddr + slot;
+
+    for (int i = 0; i < pte_count; i++) {
+        if (L1_TYPE(entry[i].raw) != L1_TYPE_INVALID_ENTRY) {
+            return SYS_ERR_VNODE_SLOT_INUSE;
+        }
+    }
+
+    struct cte *src_cte = cte_for_cap(src);
+    src_cte->mapping_info.pte_count = pte_count;
+    src_cte->mapping_info.pte = dest_lpaddr + slot * ARM_L1_BYTES_PER_ENTRY;
+    src_cte->mapping_info.offset = offset;
+
+    for (int i = 0; i < pte_count; i++, entry++) {
+        entry->raw = 0;
+        entry->section.type = L1_TYPE_SECTION_ENTRY;
+        paging_set_section_flags(entry, kpi_paging_flags);
+        entry->section.base_address = (src_lpaddr + i * BYTES_PER_SECTION) >> 20;
+
+        debug(SUBSYS_PAGING, "L1 section %"PRIuCSLOT" @%p = %08"PRIx32"\n",
+              slot + i, entry, entry->raw);
+    }
+
+    paging_sync_caches(kpi_paging_flags);
+    paging_sync_new_entries();
+
+    return SYS_ERR_OK;
 }
 
 static errval_t
@@ -321,7 +535,10 @@ caps_map_l1(struct capability* dest,
     //
     // See lib/barrelfish/arch/arm/pmap_arch.c for more discussion.
     //
-    const int ARM_L1_SCALE = 4;
+
+    if (src->type == ObjType_Frame || src->type == ObjType_DevFrame) {
+        return caps_map_sections(dest, slot, src, kpi_paging_flags, offset, pte_count);
+    }
 
     if (slot >= 1024) {
         printf("slot = %"PRIuCSLOT"\n",slot);
@@ -352,8 +569,10 @@ caps_map_l1(struct capability* dest,
 
     union arm_l1_entry* entry = (union arm_l1_entry*)dest_lvaddr + (slot * ARM_L1_SCALE);
 
+    // Some of the 1MB entries may already be mapped as sections.
+    // The corresponding part of the L2 table is never used then.
     for (int i = 0; i < 4; i++) {
-        if (entry[i].page_table.type != L1_TYPE_INVALID_ENTRY) {
+        if (L1_TYPE(entry[i].raw) == L1_TYPE_PAGE_TABLE_ENTRY) {
             panic("Remapping valid page table.");
         }
     }
@@ -368,11 +587,14 @@ caps_map_l1(struct capability* dest,
 
     struct cte *src_cte = cte_for_cap(src);
     src_cte->mapping_info.pte_count = pte_count;
-    src_cte->mapping_info.pte = dest_lpaddr + (slot * ARM_L1_SCALE);
+    src_cte->mapping_info.pte = dest_lpaddr + slot * ARM_L1_SCALE * ARM_L1_BYTES_PER_ENTRY;
     src_cte->mapping_info.offset = 0;
 
     for (int i = 0; i < 4; i++, entry++)
     {
+        if (L1_TYPE(entry->raw) == L1_TYPE_SECTION_ENTRY) {
+            continue;
+        }
         entry->raw = 0;
         entry->page_table.type   = L1_TYPE_PAGE_TABLE_ENTRY;
         entry->page_table.domain = 0;
@@ -382,7 +604,7 @@ caps_map_l1(struct capability* dest,
               slot * ARM_L1_SCALE + i, entry, entry->raw);
     }
 
-    cp15_invalidate_tlb();
+    paging_sync_new_entries();
 
     return SYS_ERR_OK;
 }
@@ -426,8 +648,10 @@ caps_map_l2(struct capability* dest,
     lvaddr_t dest_lvaddr = local_phys_to_mem(dest_lpaddr);
 
     union arm_l2_entry* entry = (union arm_l2_entry*)dest_lvaddr + slot;
-    if (entry->small_page.type != L2_TYPE_INVALID_PAGE) {
-        panic("Remapping valid page.");
+    for (int i = 0; i < pte_count; i++) {
+        if (L2_TYPE(entry[i].raw) != L2_TYPE_INVALID_PAGE) {
+            return SYS_ERR_VNODE_SLOT_INUSE;
+        }
     }
 
     lpaddr_t src_lpaddr = gen_phys_to_local_phys(get_address(src) + offset);
@@ -437,24 +661,42 @@ caps_map_l2(struct capability* dest,
 
     struct cte *src_cte = cte_for_cap(src);
     src_cte->mapping_info.pte_count = pte_count;
-    src_cte->mapping_info.pte = dest_lpaddr;
+    src_cte->mapping_info.pte = dest_lpaddr + slot * ARM_L2_BYTES_PER_ENTRY;
     src_cte->mapping_info.offset = offset;
 
-    for (int i = 0; i < pte_count; i++) {
-        entry->raw = 0;
+    for (int i = 0; i < pte_count; ) {
+        lpaddr_t page_lpaddr = src_lpaddr + i * BYTES_PER_PAGE;
+
+        // Use a 64K large page wherever the mapping covers one
+        // that is aligned both virtually and physically.
+        if (pte_count - i >= L2_ENTRIES_PER_LARGE_PAGE
+            && (slot + i) % L2_ENTRIES_PER_LARGE_PAGE == 0
+            && aligned(page_lpaddr, BYTES_PER_LARGE_PAGE))
+        {
+            for (int j = 0; j < L2_ENTRIES_PER_LARGE_PAGE; j++, entry++) {
+                entry->raw = 0;
+                entry->large_page.type = L2_TYPE_LARGE_PAGE;
+                paging_set_large_page_flags(entry, kpi_paging_flags);
+                entry->large_page.base_address = page_lpaddr >> 16;
+            }
+            i += L2_ENTRIES_PER_LARGE_PAGE;
+        } else {
+            entry->raw = 0;
 
-        entry->small_page.type = L2_TYPE_SMALL_PAGE;
-        paging_set_flags(entry, kpi_paging_flags);
-        entry->small_page.base_address = (src_lpaddr + i * BYTES_PER_PAGE) >> 12;
+            entry->small_page.type = L2_TYPE_SMALL_PAGE;
+            paging_set_flags(entry, kpi_paging_flags);
+            entry->small_page.base_address = page_lpaddr >> 12;
 
-        entry++;
+            entry++;
+            i++;
+        }
 
         debug(SUBSYS_PAGING, "L2 mapping %08"PRIxLVADDR"[%"PRIuCSLOT"] @%p = %08"PRIx32"\n",
                dest_lvaddr, slot, entry, entry->raw);
     }
 
-    // Flush TLB if remapping.
-    cp15_invalidate_tlb();
+    paging_sync_caches(kpi_paging_flags);
+    paging_sync_new_entries();
 
     return SYS_ERR_OK;
 }
@@ -471,6 +713,11 @@ errval_t caps_copy_to_vnode(struct cte *dest_vnode_cte, cslot_t dest_slot,
         return SYS_ERR_VM_ALREADY_MAPPED;
     }
 
+    // A capability without write rights can only be mapped read-only.
+    if (!(src_cap->rights & CAPRIGHTS_WRITE)) {
+        flags &= ~KPI_PAGING_FLAGS_WRITE;
+    }
+
     if (ObjType_VNode_ARM_l1 == dest_cap->type) {
         //printf("caps_map_l1: %zu\n", (size_t)pte_count);
         return caps_map_l1(dest_cap, dest_slot, src_cap,
@@ -542,10 +789,9 @@ errval_t page_mappings_unmap(struct capability *pgtable, struct cte *mapping, si
     lvaddr_t pt = local_phys_to_mem(gen_phys_to_local_phys(get_address(pgtable)));
 
     // get virtual address of first page
-    // TODO: error checking
     genvaddr_t vaddr;
     struct cte *leaf_pt = cte_for_cap(pgtable);
-    compile_vaddr(leaf_pt, slot, &vaddr);
+    errval_t vaddr_err = compile_vaddr(leaf_pt, slot, &vaddr);
     //genvaddr_t vend = vaddr + num_pages * BASE_PAGE_SIZE;
     // printf("vaddr = 0x%"PRIxGENVADDR"\n", vaddr);
     // printf("num_pages = %zu\n", num_pages);
@@ -568,11 +814,36 @@ errval_t page_mappings_unmap(struct capability *pgtable, struct cte *mapping, si
         return SYS_ERR_VM_MAP_SIZE;
     }
 
-    do_unmap(pt, slot, num_pages);
+    // The mapping has to start at the given slot of this table.
+    lpaddr_t pt_lpaddr = gen_phys_to_local_phys(get_address(pgtable));
+    bool is_l2_table = mapping->cap.type == ObjType_VNode_ARM_l2;
+    size_t first_entry = is_l2_table ? slot * ARM_L1_SCALE : slot;
+    if (mapping->mapping_info.pte != pt_lpaddr + first_entry * sizeof(uint32_t)) {
+        return SYS_ERR_VM_NOT_MAPPED;
+    }
 
-    // flush TLB for unmapped pages
-    // TODO: selective TLB flush
-    cp15_invalidate_tlb();
+    if (is_l2_table) {
+        // Leave sections in the same 4MB range alone.
+        union arm_l1_entry *entry = (union arm_l1_entry *)pt + first_entry;
+        for (int i = 0; i < ARM_L1_SCALE; i++, entry++) {
+            if (L1_TYPE(entry->raw) == L1_TYPE_PAGE_TABLE_ENTRY) {
+                entry->raw = 0;
+            }
+        }
+        // Pages which are still mapped in the table may be anywhere in its 4MB.
+        do_full_tlb_flush();
+    } else {
+        do_unmap(pt, slot, num_pages);
+
+        // flush TLB for unmapped pages
+        if (err_is_ok(vaddr_err)) {
+            bool is_section = pgtable->type == ObjType_VNode_ARM_l1;
+            do_tlb_flush_entries(vaddr, num_pages,
+                                 is_section ? BYTES_PER_SECTION : BYTES_PER_PAGE);
+        } else {
+            do_full_tlb_flush();
+        }
+    }
 
     // update mapping info
     memset(&mapping->mapping_info, 0, sizeof(struct mapping_info));
@@ -590,12 +861,56 @@ errval_t paging_modify_flags(struct capability *frame, uintptr_t offset,
     struct mapping_info *info = &mapping->mapping_info;
 
     /* Calculate location of page table entries we need to modify */
-    lvaddr_t base = info->pte + offset;
+    lvaddr_t base = local_phys_to_mem(info->pte);
 
-    for (int i = 0; i < pages; i++) {
-        union arm_l2_entry *entry =
-            (union arm_l2_entry *)base + i;
-        paging_set_flags(entry, kpi_paging_flags);
+    struct cte *pgtable;
+    errval_t err = mdb_find_cap_for_address(local_phys_to_gen_phys(info->pte), &pgtable);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    // Index of the first entry of the mapping in its table.
+    lpaddr_t table_lpaddr = gen_phys_to_local_phys(get_address(&pgtable->cap));
+    size_t slot = (info->pte - table_lpaddr) / PTABLE_ENTRY_SIZE;
+    genvaddr_t vaddr;
+
+    if (pgtable->cap.type == ObjType_VNode_ARM_l1) {
+        // Sections can only be changed as a whole.
+        size_t pages_per_section = BYTES_PER_SECTION / BYTES_PER_PAGE;
+        size_t first = offset / pages_per_section;
+        size_t last = (offset + pages - 1) / pages_per_section;
+        if (last >= info->pte_count) {
+            last = info->pte_count - 1;
+        }
+        for (size_t i = first; i <= last; i++) {
+            paging_set_section_flags((union arm_l1_entry *)base + i, kpi_paging_flags);
+        }
+
+        paging_sync_caches(kpi_paging_flags);
+        if (first <= last) {
+            if (err_is_ok(compile_vaddr(pgtable, slot + first, &vaddr))) {
+                do_tlb_flush_entries(vaddr, last - first + 1, BYTES_PER_SECTION);
+            } else {
+                do_full_tlb_flush();
+            }
+        }
+    } else {
+        for (int i = 0; i < pages; i++) {
+            union arm_l2_entry *entry =
+                (union arm_l2_entry *)base + offset + i;
+            if (L2_TYPE(entry->raw) == L2_TYPE_LARGE_PAGE) {
+                paging_split_large_page(entry);
+            }
+            paging_set_flags(entry, kpi_paging_flags);
+        }
+
+        // Invalidating any page of a split large page invalidates all of it.
+        paging_sync_caches(kpi_paging_flags);
+        if (err_is_ok(compile_vaddr(pgtable, slot + offset, &vaddr))) {
+            do_tlb_flush_entries(vaddr, pages, BYTES_PER_PAGE);
+        } else {
+            do_full_tlb_flush();
+        }
     }
 
     return SYS_ERR_OK;
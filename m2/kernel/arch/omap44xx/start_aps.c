@@ -83,6 +83,10 @@ int start_aps_arm_start(uint8_t core_id, lpaddr_t entry)
             *aux_core_boot_1 = entry;
         }
 
+        // The new core runs with its caches off until it has set up
+        // paging, so it has to find everything we wrote in memory.
+        cp15_clean_invalidate_d_cache ();
+
         // Send the interrrupt.
         send_event ();
 
@@ -269,6 +269,9 @@ load_init_image(
     	panic("ELF load of " BSP_INIT_MODULE_NAME " failed!\n");
     }
 
+    // The image was written through the data cache.
+    cp15_invalidate_i_and_d_caches();
+
     // TODO: Fix application linkage so that it's non-PIC.
     struct Elf32_Shdr* got_shdr =
         elf32_find_section_header_name((lvaddr_t)elf_base, elf_bytes, ".got");
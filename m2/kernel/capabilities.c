@@ -993,6 +993,9 @@ static void delete_cnode_or_dcb(struct capability *cap, bool from_monitor)
         // Remove from wakeup queue
         wakeup_remove(dcb);
 
+        // Nobody may switch to or back to it any more
+        dispatch_remove_donations(dcb);
+
         // Notify monitor
         if (monitor_ep.u.endpoint.listener == dcb) {
             printk(LOG_ERR, "monitor terminated; expect badness!\n");
@@ -96,7 +96,7 @@ static inline void context_switch(struct dcb *dcb)
     }
 #endif
 
-    paging_context_switch(dcb->vspace);
+    paging_dispatcher_switch(dcb);
     context_switch_counter++;
 
     if (!dcb->is_vm_guest) {
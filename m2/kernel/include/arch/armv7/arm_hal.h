@@ -49,6 +49,8 @@ void     gic_cpu_interface_disable(void);
 void     gic_enable_interrupt(uint32_t int_id, uint8_t cpu_targets, uint16_t prio,
                               bool edge_triggered, bool one_to_n);
 void     gic_disable_all_irqs(void);
+void     gic_mask_interrupt(uint32_t int_id);
+void     gic_unmask_interrupt(uint32_t int_id);
 uint32_t gic_get_active_irq(void);
 void     gic_ack_irq(uint32_t irq);
 void     gic_raise_softirq(uint8_t cpumask, uint8_t irq);
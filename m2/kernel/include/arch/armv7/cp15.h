@@ -50,30 +50,70 @@ static inline uint32_t cp15_read_far(void)
     return addr;
 }
 
+/*
+ * Attributes of translation table walks, in the low bits of TTBR0/1:
+ * Inner and outer write-back write-allocate, shareable (IRGN = 0b01,
+ * RGN = 0b01, S, NOS). The walks then go through the coherent data
+ * caches, so page table updates don't have to be cleaned to memory.
+ * See ARMv7 ARM B4.1.154 (with the Multiprocessing Extensions).
+ */
+#define TTBR_WALK_ATTRIBUTES    0x6a
+#define TTBR_ATTRIBUTES_MASK    0x7f
+
+/**
+ * \brief Read the physical address of the translation table in TTBR0.
+ */
 static inline lpaddr_t cp15_read_ttbr0(void)
 {
     lpaddr_t ttbr;
     __asm volatile(" mrc  p15, 0, %[ttbr], c2, c0, 0" : [ttbr] "=r" (ttbr));
-    return ttbr;
+    return ttbr & ~TTBR_ATTRIBUTES_MASK;
 }
 
+/**
+ * \brief Read the physical address of the translation table in TTBR1.
+ */
 static inline lpaddr_t cp15_read_ttbr1(void)
 {
     lpaddr_t ttbr;
     __asm volatile(" mrc  p15, 0, %[ttbr], c2, c0, 1" : [ttbr] "=r" (ttbr));
-    return ttbr;
+    return ttbr & ~TTBR_ATTRIBUTES_MASK;
 }
 
 static inline void cp15_write_ttbr0(lpaddr_t ttbr)
 {
+    ttbr |= TTBR_WALK_ATTRIBUTES;
     __asm volatile(" mcr  p15, 0, %[ttbr], c2, c0, 0" :: [ttbr] "r" (ttbr));
 }
 
 static inline void cp15_write_ttbr1(lpaddr_t ttbr)
 {
+    ttbr |= TTBR_WALK_ATTRIBUTES;
     __asm volatile(" mcr  p15, 0, %[ttbr], c2, c0, 1" :: [ttbr] "r" (ttbr));
 }
 
+#define CONTEXTIDR_ASID_MASK    0xff
+
+/**
+ * \brief Read the ASID which tags the non-global TLB entries.
+ */
+static inline uint8_t cp15_read_asid(void)
+{
+    uint32_t contextidr;
+    __asm volatile(" mrc  p15, 0, %[contextidr], c13, c0, 1" : [contextidr] "=r" (contextidr));
+    return contextidr & CONTEXTIDR_ASID_MASK;
+}
+
+/**
+ * \brief Set the ASID in CONTEXTIDR, effective for the following instructions.
+ */
+static inline void cp15_write_asid(uint8_t asid)
+{
+    uint32_t contextidr = asid;
+    __asm volatile(" mcr  p15, 0, %[contextidr], c13, c0, 1 \n\t"
+                   " isb" :: [contextidr] "r" (contextidr));
+}
+
 static inline uint32_t cp15_read_ttbcr(void)
 {
 	uint32_t ttbcr;
@@ -91,6 +131,8 @@ extern void cp15_invalidate_i_and_d_caches(void);
 extern void cp15_invalidate_i_and_d_caches_fast(void);
 extern void cp15_invalidate_tlb_fn(void);
 extern void cp15_enable_mmu(void);
+extern void cp15_discard_d_cache(void);
+extern void cp15_clean_invalidate_d_cache(void);
 
 static inline uint32_t cp15_read_cache_status(void){
     uint32_t cache;
@@ -99,19 +141,38 @@ static inline uint32_t cp15_read_cache_status(void){
 }
 
 
-static inline void cp15_disable_cache(void){
-
-    cp15_invalidate_i_and_d_caches_fast();
+#define ACTLR_FW    (1 << 0)    // Cache and TLB maintenance broadcast
+#define ACTLR_SMP   (1 << 6)    // Take part in SCU coherency
 
-    __asm volatile(
-                   //     "ldr r1, =0x3 \n\t"
-                   "mrc p15, 0, r1, c1, c0, 0 \n\t" //read
-                   "bic r1, #4 \n\t"
-                   "mcr p15, 0, r1, c1, c0, 0 \n\t"
-                   :::"r1");
+/**
+ * \brief Read the auxiliary control register.
+ */
+static inline uint32_t cp15_read_actlr(void)
+{
+    uint32_t actlr;
+    __asm volatile("mrc   p15, 0, %[actlr], c1, c0, 1" : [actlr] "=r" (actlr));
+    return actlr;
+}
 
-    printf("WARNING! Caching has been disabled, configuration is: %"PRIx32"\n", cp15_read_cache_status());
+static inline void cp15_write_actlr(uint32_t actlr)
+{
+    __asm volatile("mcr   p15, 0, %[actlr], c1, c0, 1 \n\t"
+                   "isb" :: [actlr] "r" (actlr));
+}
 
+/**
+ * \brief Let this core's data cache take part in the coherency protocol.
+ *
+ * This has to happen before the data cache is enabled, see Cortex-A9 MPCore
+ * TRM 2.2.3. The boot loader may already have set the bit, in which case we
+ * leave the register alone: it may not be writable from non-secure state.
+ */
+static inline void cp15_enable_smp_coherency(void)
+{
+    uint32_t actlr = cp15_read_actlr();
+    if ((actlr & ACTLR_SMP) == 0) {
+        cp15_write_actlr(actlr | ACTLR_SMP | ACTLR_FW);
+    }
 }
 
 static inline void cp15_invalidate_tlb(void)
@@ -119,6 +180,14 @@ static inline void cp15_invalidate_tlb(void)
     __asm volatile(" mcr  p15, 0, r0, c8, c7, 0");
 }
 
+/**
+ * \brief Invalidate all branch predictor entries (BPIALL).
+ */
+static inline void cp15_invalidate_branch_predictor(void)
+{
+    __asm volatile(" mcr  p15, 0, r0, c7, c5, 6");
+}
+
 static inline uint8_t cp15_get_cpu_id(void) {
 	uint8_t cpu_id;
 	__asm volatile(
@@ -34,13 +34,16 @@ struct global {
     // Used to propagate mutliboot info to second kernel.
     struct multiboot_info* mb_info;
 
-    // Info to page used for communication.
+    // Info to frame used for communication.
     uint32_t urpc_channel_physical_address;
     uint8_t urpc_channel_size_bits;
 
     genpaddr_t notify[MAX_COREID];
 };
 
+/// Size of the frame shared between the two inits, room for several channels.
+#define URPC_CHANNEL_SIZE_BITS 16
+
 extern struct global *global;
 
 #if defined(__gem5__)
@@ -16,6 +16,7 @@ struct idc_recv_msg;
 //struct sysret irq_table_delete(struct capability *to, struct idc_recv_msg *msg);
 errval_t irq_table_set(unsigned int nidt, capaddr_t endpoint);
 errval_t irq_table_delete(unsigned int nidt);
+errval_t irq_table_unmask(unsigned int nidt);
 void send_user_interrupt(int irq);
 
 #endif // KERNEL_ARCH_ARM_IRQ_H
@@ -57,8 +57,22 @@ void paging_map_user_pages_l1(lvaddr_t table_addr, lvaddr_t vaddr, lpaddr_t padd
 
 void paging_set_l2_entry(uintptr_t* l2entry, lpaddr_t paddr, uintptr_t flags);
 
+/**
+ * Switch to a user page table with the reserved ASID 0, and flush the TLB.
+ * Only used at startup, before the first dispatch.
+ */
 void paging_context_switch(lpaddr_t table_addr);
 
+struct dcb;
+/**
+ * Switch to the VSpace of 'dcb'.
+ *
+ * Every dispatcher gets its own ASID, such that its TLB entries survive
+ * switches to other dispatchers. User mappings are not global, and the
+ * Cortex-A9 caches are physically tagged, so they aren't flushed either.
+ */
+void paging_dispatcher_switch(struct dcb *dcb);
+
 void paging_arm_reset(lpaddr_t paddr, size_t bytes);
 
 
@@ -78,21 +92,47 @@ static inline size_t get_pte_size(void) {
 }
 #define PTABLE_ENTRY_SIZE get_pte_size()
 
-static inline void do_one_tlb_flush(genvaddr_t vaddr)
+// Invalidating more entries one by one is slower than flushing the TLB,
+// which only has 128 entries on the Cortex-A9.
+#define TLB_FLUSH_THRESHOLD 32
+
+static inline void do_full_tlb_flush(void)
 {
-    // TODO: figure out selective flushing for ARM
     cp15_invalidate_tlb();
 }
 
-static inline void do_selective_tlb_flush(genvaddr_t vaddr, genvaddr_t vend)
+/**
+ * Invalidate the TLB entries of 'count' pages or sections of 'bytes' each,
+ * starting at 'vaddr'. The entries are invalidated for all ASIDs (TLBIMVAA),
+ * as the page table may belong to any dispatcher.
+ */
+static inline void do_tlb_flush_entries(genvaddr_t vaddr, size_t count, size_t bytes)
 {
-    // TODO: figure out selective flushing for ARM
-    cp15_invalidate_tlb();
+    if (count > TLB_FLUSH_THRESHOLD) {
+        do_full_tlb_flush();
+        return;
+    }
+
+    // Wait for the page table writes before invalidating.
+    __asm volatile("dsb");
+    for (size_t i = 0; i < count; i++) {
+        uint32_t mva = (uint32_t)(vaddr + i * bytes) & ~BASE_PAGE_MASK;
+        __asm volatile(" mcr  p15, 0, %[mva], c8, c7, 3" :: [mva] "r" (mva));
+    }
+    cp15_invalidate_branch_predictor();
+    __asm volatile("dsb \n\t"
+                   "isb");
 }
 
-static inline void do_full_tlb_flush(void)
+static inline void do_one_tlb_flush(genvaddr_t vaddr)
 {
-    cp15_invalidate_tlb();
+    do_tlb_flush_entries(vaddr, 1, BASE_PAGE_SIZE);
+}
+
+static inline void do_selective_tlb_flush(genvaddr_t vaddr, genvaddr_t vend)
+{
+    do_tlb_flush_entries(vaddr, (vend - vaddr + BASE_PAGE_SIZE - 1) / BASE_PAGE_SIZE,
+                         BASE_PAGE_SIZE);
 }
 
 
@@ -41,6 +41,8 @@ struct dcb {
     bool                disabled;       ///< Was dispatcher disabled when last saved?
     struct cte          cspace;         ///< Cap slot for CSpace
     lpaddr_t            vspace;         ///< Address of VSpace root
+    uint8_t             asid;           ///< Tags the TLB entries of the VSpace
+    uint32_t            asid_generation;///< 'asid' is only valid in this generation
     struct cte          disp_cte;
     unsigned int        faults_taken;   ///< # of disabled faults or traps taken
     /// Indicates whether this domain shall be executed in VM guest mode
@@ -49,6 +51,10 @@ struct dcb {
     uint64_t            domain_id;      ///< ID of dispatcher's domain
     systime_t           wakeup_time;    ///< Time to wakeup this dispatcher
     struct dcb          *wakeup_prev, *wakeup_next; ///< Next/prev in timeout queue
+    /// Last dispatcher that donated its timeslice to us with a synchronous LMP send,
+    /// and the dispatcher we donated ours to. donor->donee == this and the other way
+    /// round, see dispatch_set_donor. Both are cleared when either side is deleted.
+    struct dcb          *donor, *donee;
 
 #if defined(CONFIG_SCHEDULER_RR)
     struct dcb          *prev, *next;   ///< Prev/Next DCBs in schedule
@@ -74,6 +80,35 @@ errval_t lmp_deliver(struct capability *ep, struct dcb *send,
                      uintptr_t *payload, size_t payload_len,
                      capaddr_t send_cptr, uint8_t send_bits);
 
+/// Forget the dispatcher that donated its timeslice to 'dcb'
+static inline void dispatch_clear_donor(struct dcb *dcb)
+{
+    if (dcb->donor != NULL) {
+        dcb->donor->donee = NULL;
+        dcb->donor = NULL;
+    }
+}
+
+/// Record that 'donor' donated its timeslice to 'dcb'
+static inline void dispatch_set_donor(struct dcb *dcb, struct dcb *donor)
+{
+    dispatch_clear_donor(dcb);
+    if (donor->donee != NULL) {
+        dispatch_clear_donor(donor->donee);
+    }
+    dcb->donor = donor;
+    donor->donee = dcb;
+}
+
+/// Drop all donation links of a dispatcher that is being deleted
+static inline void dispatch_remove_donations(struct dcb *dcb)
+{
+    dispatch_clear_donor(dcb);
+    if (dcb->donee != NULL) {
+        dispatch_clear_donor(dcb->donee);
+    }
+}
+
 /// Deliver an empty LMP as a notification
 static inline errval_t lmp_deliver_notification(struct capability *ep)
 {
@@ -49,6 +49,33 @@ static inline size_t get_offset(struct cte *old, struct cte *next)
     return (old->mapping_info.pte - get_address(&next->cap)) / get_pte_size();
 }
 
+#if defined(__arm__)
+/*
+ * An ARM "L2" table consists of four hardware tables, mapped by four
+ * consecutive L1 entries, and its 1024 entries map 4K pages. Entries of
+ * the L1 table itself are 1MB sections. L1 tables are 16K aligned, so the
+ * L1 index follows from the address of the entry alone.
+ */
+static errval_t compile_vaddr_arm(struct cte *ptable, size_t entry, genvaddr_t *retvaddr)
+{
+    if (ptable->cap.type == ObjType_VNode_ARM_l1) {
+        *retvaddr = (genvaddr_t)entry * ARM_L1_SECTION_BYTES;
+        return SYS_ERR_OK;
+    }
+
+    lpaddr_t l1_entry = ptable->mapping_info.pte;
+    if (!l1_entry) {
+        *retvaddr = 0;
+        return SYS_ERR_VNODE_NOT_INSTALLED;
+    }
+
+    size_t l1_index = (l1_entry & (ARM_L1_ALIGN - 1)) / ARM_L1_BYTES_PER_ENTRY;
+    *retvaddr = (genvaddr_t)l1_index * ARM_L1_SECTION_BYTES
+              + ((genvaddr_t)entry << BASE_PAGE_BITS);
+    return SYS_ERR_OK;
+}
+#endif
+
 /*
  * compile_vaddr returns the lowest address that is addressed by entry 'entry'
  * in page table 'ptable'
@@ -59,6 +86,10 @@ errval_t compile_vaddr(struct cte *ptable, size_t entry, genvaddr_t *retvaddr)
         return SYS_ERR_VNODE_TYPE;
     }
 
+#if defined(__arm__)
+    return compile_vaddr_arm(ptable, entry, retvaddr);
+#endif
+
     genvaddr_t vaddr = 0;
     // shift at least by BASE_PAGE_BITS for first vaddr part
     size_t shift = BASE_PAGE_BITS;
@@ -148,7 +179,8 @@ errval_t unmap_capability(struct cte *mem)
     if (err_is_ok(err)) {
         // only perform unmap when we successfully reconstructed the virtual address
         do_unmap(ptable_lv, slot, mem->mapping_info.pte_count);
-        if (mem->mapping_info.pte_count > 1) {
+        // A page table maps more than the address of its first entry.
+        if (mem->mapping_info.pte_count > 1 || type_is_vnode(mem->cap.type)) {
             do_full_tlb_flush();
         } else {
             do_one_tlb_flush(vaddr);
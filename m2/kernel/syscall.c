@@ -126,6 +126,9 @@ sys_dispatcher_setup(struct capability *to, capaddr_t cptr, int depth,
         default:
             return SYSRET(err_push(err, SYS_ERR_DISP_VSPACE_INVALID));
         }
+
+        // TLB entries tagged with the old ASID may belong to the old VSpace.
+        dcb->asid_generation = 0;
     }
 
     /* 3. set dispatcher frame pointer */
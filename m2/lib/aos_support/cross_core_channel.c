@@ -0,0 +1,291 @@
+#include <aos_support/cross_core_channel.h>
+#include <aos_support/cross_core_notify.h>
+#include <arch/arm/barrelfish_kpi/asm_inlines_arch.h>
+#include <string.h>
+
+#define HEADER_MORE 0x80
+#define HEADER_SIZE_MASK 0x7F
+#define HEADER_SEQUENCE_SHIFT 8
+#define HEADER_SEQUENCE_MASK 0xFFFFFF
+
+// Sequence numbers start at one, such that a cleared slot never matches.
+static inline uint32_t slot_header (uint32_t sequence, bool more, size_t size)
+{
+    return (((sequence + 1) & HEADER_SEQUENCE_MASK) << HEADER_SEQUENCE_SHIFT) | (more ? HEADER_MORE : 0) | size;
+}
+
+static inline bool slot_is_ready (uint32_t header, uint32_t sequence)
+{
+    return (header >> HEADER_SEQUENCE_SHIFT) == ((sequence + 1) & HEADER_SEQUENCE_MASK);
+}
+
+static inline struct cross_core_slot* get_slot (struct cross_core_ring* ring, struct cross_core_channel* channel, uint32_t sequence)
+{
+    return &ring -> slots [sequence & (channel -> slot_count - 1)];
+}
+
+static inline size_t ring_size (uint32_t slot_count)
+{
+    return sizeof (struct cross_core_ring) + slot_count * sizeof (struct cross_core_slot);
+}
+
+/// Spin for a while, then let other threads run.
+static inline void poll_wait (uint32_t* spins)
+{
+    (*spins)++;
+    if (*spins >= CROSS_CORE_POLL_SPINS) {
+        *spins = 0;
+        thread_yield ();
+    }
+}
+
+typedef bool (*ready_check_t) (struct cross_core_channel* channel);
+
+/**
+ * Like poll_wait, but block on a notification instead of yielding if the channel allows it.
+ * The flag tells the other side to notify us, and is cleared again once we return.
+ */
+static void poll_or_block (struct cross_core_channel* channel, uint32_t* spins, volatile uint32_t* waiting, ready_check_t is_ready)
+{
+    if (!channel -> blocking) {
+        poll_wait (spins);
+        return;
+    }
+
+    (*spins)++;
+    if (*spins >= CROSS_CORE_POLL_SPINS) {
+        *spins = 0;
+        uint32_t seen = cross_core_notify_count ();
+        *waiting = true;
+
+        // Either the other side sees our flag, or we see its update.
+        dmb ();
+        if (!is_ready (channel)) {
+            cross_core_notify_wait (seen);
+        }
+        *waiting = false;
+    }
+}
+
+/// Notify the other core if it's blocked on the given flag.
+static inline void notify_waiting (volatile uint32_t* waiting)
+{
+    if (cross_core_notify_enabled ()) {
+        // Pairs with the barrier in poll_or_block.
+        dmb ();
+        if (*waiting) {
+            cross_core_notify_peer ();
+        }
+    }
+}
+
+size_t cross_core_channel_size (uint32_t slot_count)
+{
+    return 2 * ring_size (slot_count);
+}
+
+void cross_core_channel_clear (void* buffer, uint32_t slot_count)
+{
+    memset (buffer, 0, cross_core_channel_size (slot_count));
+    dmb ();
+}
+
+errval_t cross_core_channel_init (struct cross_core_channel* channel, void* buffer, uint32_t slot_count, bool initiator)
+{
+    // The ring index is computed with a mask, and a message needs at least one slot.
+    if (slot_count < 2 || (slot_count & (slot_count - 1)) != 0
+        || ((uintptr_t) buffer % CROSS_CORE_LINE_SIZE) != 0)
+    {
+        return AOS_ERR_CROSS_CORE_INVALID_SIZE;
+    }
+
+    struct cross_core_ring* first = buffer;
+    struct cross_core_ring* second = buffer + ring_size (slot_count);
+
+    channel -> send_ring = initiator ? first : second;
+    channel -> receive_ring = initiator ? second : first;
+    channel -> slot_count = slot_count;
+    channel -> ack_batch = slot_count / 2;
+    channel -> send_sequence = 0;
+    channel -> send_limit = slot_count;
+    channel -> receive_sequence = 0;
+    channel -> receive_published = 0;
+    channel -> blocking = false;
+
+    // Up to ack_batch - 1 consumed slots may be unpublished,
+    // so a larger message could wait for credits forever.
+    channel -> max_message_size = (slot_count - channel -> ack_batch + 1) * CROSS_CORE_SLOT_PAYLOAD;
+    return SYS_ERR_OK;
+}
+
+errval_t cross_core_channel_enable_blocking (struct cross_core_channel* channel)
+{
+    if (!cross_core_notify_enabled ()) {
+        return AOS_ERR_CROSS_CORE_NO_NOTIFY;
+    }
+    channel -> blocking = true;
+    return SYS_ERR_OK;
+}
+
+size_t cross_core_max_message_size (struct cross_core_channel* channel)
+{
+    return channel -> max_message_size;
+}
+
+void cross_core_limit_message_size (struct cross_core_channel* channel, size_t size)
+{
+    if (size < channel -> max_message_size) {
+        channel -> max_message_size = size;
+    }
+}
+
+static inline uint32_t slots_needed (size_t size)
+{
+    return (size == 0) ? 1 : (size + CROSS_CORE_SLOT_PAYLOAD - 1) / CROSS_CORE_SLOT_PAYLOAD;
+}
+
+/// Check for credits, and only read the acknowledgement line if we've run out.
+static bool has_credits (struct cross_core_channel* channel, uint32_t slots)
+{
+    if ((int32_t) (channel -> send_limit - channel -> send_sequence) >= (int32_t) slots) {
+        return true;
+    }
+    channel -> send_limit = channel -> send_ring -> acknowledged + channel -> slot_count;
+    // Don't overwrite slots before the receiver is done with them.
+    dmb ();
+    return (int32_t) (channel -> send_limit - channel -> send_sequence) >= (int32_t) slots;
+}
+
+errval_t cross_core_try_send (struct cross_core_channel* channel, const void* message, size_t size)
+{
+    if (size > cross_core_max_message_size (channel)) {
+        return AOS_ERR_LMP_INVALID_ARGS;
+    }
+
+    uint32_t slots = slots_needed (size);
+    if (!has_credits (channel, slots)) {
+        return AOS_ERR_CROSS_CORE_FULL;
+    }
+
+    const uint8_t* data = message;
+    for (uint32_t i = 0; i < slots; i++) {
+        struct cross_core_slot* slot = get_slot (channel -> send_ring, channel, channel -> send_sequence);
+        size_t chunk = (size < CROSS_CORE_SLOT_PAYLOAD) ? size : CROSS_CORE_SLOT_PAYLOAD;
+        memcpy (slot -> payload, data, chunk);
+
+        // The payload has to be visible before the header.
+        dmb ();
+        slot -> header = slot_header (channel -> send_sequence, i + 1 < slots, chunk);
+
+        channel -> send_sequence++;
+        data += chunk;
+        size -= chunk;
+    }
+    notify_waiting (&channel -> send_ring -> receiver_waiting);
+    return SYS_ERR_OK;
+}
+
+/// The receiver has consumed slots since we last updated our credits.
+static bool has_new_credits (struct cross_core_channel* channel)
+{
+    return channel -> send_ring -> acknowledged + channel -> slot_count != channel -> send_limit;
+}
+
+errval_t cross_core_send (struct cross_core_channel* channel, const void* message, size_t size)
+{
+    errval_t error = cross_core_try_send (channel, message, size);
+    uint32_t spins = 0;
+
+    while (error == AOS_ERR_CROSS_CORE_FULL) {
+        poll_or_block (channel, &spins, &channel -> send_ring -> sender_waiting, has_new_credits);
+        error = cross_core_try_send (channel, message, size);
+    }
+    return error;
+}
+
+void cross_core_acknowledge (struct cross_core_channel* channel)
+{
+    if (channel -> receive_published != channel -> receive_sequence) {
+        // We must be done reading the slots before the sender may reuse them.
+        dmb ();
+        channel -> receive_ring -> acknowledged = channel -> receive_sequence;
+        channel -> receive_published = channel -> receive_sequence;
+        notify_waiting (&channel -> receive_ring -> sender_waiting);
+    }
+}
+
+/// Wait until the slot with the given sequence number has arrived and return its header.
+static uint32_t wait_for_slot (struct cross_core_slot* slot, uint32_t sequence)
+{
+    uint32_t spins = 0;
+    uint32_t header = slot -> header;
+
+    while (!slot_is_ready (header, sequence)) {
+        poll_wait (&spins);
+        header = slot -> header;
+    }
+    return header;
+}
+
+errval_t cross_core_try_receive (struct cross_core_channel* channel, void* buffer, size_t* size)
+{
+    struct cross_core_slot* slot = get_slot (channel -> receive_ring, channel, channel -> receive_sequence);
+    uint32_t header = slot -> header;
+
+    if (!slot_is_ready (header, channel -> receive_sequence)) {
+        // Nothing to do, so this is a good time to hand back credits.
+        cross_core_acknowledge (channel);
+        return AOS_ERR_CROSS_CORE_EMPTY;
+    }
+
+    // The rest of a message is already on its way, so just wait for it.
+    uint8_t* data = buffer;
+    size_t received = 0;
+    bool truncated = false;
+    while (true) {
+        // Don't read the payload before the header.
+        dmb ();
+        size_t chunk = header & HEADER_SIZE_MASK;
+        if (received + chunk > channel -> max_message_size) {
+            // Consume the rest of the message, but don't overflow the buffer.
+            chunk = channel -> max_message_size - received;
+            truncated = true;
+        }
+        memcpy (data + received, slot -> payload, chunk);
+        received += chunk;
+        channel -> receive_sequence++;
+
+        if ((header & HEADER_MORE) == 0) {
+            break;
+        }
+        slot = get_slot (channel -> receive_ring, channel, channel -> receive_sequence);
+        header = wait_for_slot (slot, channel -> receive_sequence);
+    }
+
+    if (channel -> receive_sequence - channel -> receive_published >= channel -> ack_batch) {
+        cross_core_acknowledge (channel);
+    }
+    if (size) {
+        *size = received;
+    }
+    return truncated ? AOS_ERR_CROSS_CORE_INVALID_SIZE : SYS_ERR_OK;
+}
+
+/// The next slot has arrived.
+static bool has_message (struct cross_core_channel* channel)
+{
+    struct cross_core_slot* slot = get_slot (channel -> receive_ring, channel, channel -> receive_sequence);
+    return slot_is_ready (slot -> header, channel -> receive_sequence);
+}
+
+errval_t cross_core_receive (struct cross_core_channel* channel, void* buffer, size_t* size)
+{
+    errval_t error = cross_core_try_receive (channel, buffer, size);
+    uint32_t spins = 0;
+
+    while (error == AOS_ERR_CROSS_CORE_EMPTY) {
+        poll_or_block (channel, &spins, &channel -> receive_ring -> receiver_waiting, has_message);
+        error = cross_core_try_receive (channel, buffer, size);
+    }
+    return error;
+}
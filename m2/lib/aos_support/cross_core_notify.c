@@ -0,0 +1,99 @@
+#include <aos_support/cross_core_notify.h>
+#include <barrelfish/waitset.h>
+#include <barrelfish/lmp_endpoints.h>
+#include <arch/arm/barrelfish_kpi/cpu_arch.h>
+
+static bool notify_enabled = false;
+static struct capref notify_peer_cap;
+
+static struct waitset notify_waitset;
+static struct lmp_endpoint* notify_endpoint;
+
+// Number of notifications received, protected by the mutex.
+static volatile uint32_t notify_count = 0;
+static struct thread_mutex notify_mutex = THREAD_MUTEX_INITIALIZER;
+static struct thread_cond notify_cond = THREAD_COND_INITIALIZER;
+
+static void notification_handler (void* arg)
+{
+    // Notifications are empty, and a few of them may have piled up.
+    struct lmp_recv_buf buffer = { .buflen = 0 };
+    while (err_is_ok (lmp_endpoint_recv (notify_endpoint, &buffer, NULL)));
+
+    thread_mutex_lock (&notify_mutex);
+    notify_count++;
+    thread_cond_broadcast (&notify_cond);
+    thread_mutex_unlock (&notify_mutex);
+
+    errval_t error = lmp_endpoint_register (notify_endpoint, &notify_waitset, MKCLOSURE (notification_handler, NULL));
+    if (err_is_fail (error)) {
+        debug_printf ("cross_core_notify: %s\n", err_getstring (error));
+    }
+}
+
+static int notification_thread (void* arg)
+{
+    while (true) {
+        errval_t error = event_dispatch (&notify_waitset);
+        if (err_is_fail (error)) {
+            debug_printf ("cross_core_notify: %s\n", err_getstring (error));
+        }
+    }
+    return 0;
+}
+
+errval_t cross_core_notify_init (struct capref peer, struct capref irq_table)
+{
+    struct capref endpoint_cap;
+    waitset_init (&notify_waitset);
+
+    // A minimum-sized endpoint is enough, an overflow only drops a redundant notification.
+    errval_t error = endpoint_create (LMP_RECV_LENGTH, &endpoint_cap, &notify_endpoint);
+
+    if (err_is_ok (error)) {
+        error = lmp_endpoint_register (notify_endpoint, &notify_waitset, MKCLOSURE (notification_handler, NULL));
+    }
+    if (err_is_ok (error)) {
+        error = invoke_irqtable_set (irq_table, ARM_NOTIFY_IPI_IRQ, endpoint_cap);
+    }
+    if (err_is_ok (error)) {
+        struct thread* thread = thread_create (notification_thread, NULL);
+        if (thread == NULL) {
+            error = LIB_ERR_THREAD_CREATE;
+        }
+    }
+    if (err_is_ok (error)) {
+        notify_peer_cap = peer;
+        notify_enabled = true;
+    }
+    return error;
+}
+
+bool cross_core_notify_enabled (void)
+{
+    return notify_enabled;
+}
+
+void cross_core_notify_peer (void)
+{
+    if (notify_enabled) {
+        errval_t error = invoke_ipi_notify_send (notify_peer_cap);
+        if (err_is_fail (error)) {
+            debug_printf ("cross_core_notify: %s\n", err_getstring (error));
+        }
+    }
+}
+
+uint32_t cross_core_notify_count (void)
+{
+    return notify_count;
+}
+
+void cross_core_notify_wait (uint32_t seen)
+{
+    thread_mutex_lock (&notify_mutex);
+    while (notify_enabled && notify_count == seen) {
+        thread_cond_wait (&notify_cond, &notify_mutex);
+    }
+    thread_mutex_unlock (&notify_mutex);
+}
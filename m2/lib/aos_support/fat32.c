@@ -1,6 +1,7 @@
 #include <aos_support/fat32.h>
 
 #include <barrelfish/aos_rpc.h>
+#include <barrelfish/threads.h>
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
@@ -279,12 +280,14 @@ struct fat32_config* descriptor_to_config [1024];
 static uint32_t descriptor_to_size [1024];
 static uint32_t descriptor_to_cluster [1024];
 static uint32_t descriptor_count = 0;
+// The descriptor tables are shared by the threads of the filesystem server.
+// Reading sectors doesn't need the lock, the read function has its own.
+static struct thread_mutex descriptor_mutex = THREAD_MUTEX_INITIALIZER;
 
 /// see header file
 errval_t fat32_open_file (struct fat32_config* config, char* path, uint32_t* file_descriptor)
 {
     assert (path != NULL && file_descriptor != NULL);
-    assert (descriptor_count < 1024); // TODO: A dynamic structure.
 
     uint32_t ret_cluster = 0;
     uint32_t ret_size = 0;
@@ -293,11 +296,14 @@ errval_t fat32_open_file (struct fat32_config* config, char* path, uint32_t* fil
     error = fat32_find_node (config, path, &ret_cluster, &ret_size);
 
     if (err_is_ok (error)) {
+        thread_mutex_lock (&descriptor_mutex);
+        assert (descriptor_count < 1024); // TODO: A dynamic structure.
         descriptor_to_config [descriptor_count] = config;
         descriptor_to_cluster [descriptor_count] = ret_cluster;
         descriptor_to_size [descriptor_count] = ret_size;
         *file_descriptor = descriptor_count;
         descriptor_count++;
+        thread_mutex_unlock (&descriptor_mutex);
     }
     return error;
 }
@@ -306,8 +312,10 @@ errval_t fat32_open_file (struct fat32_config* config, char* path, uint32_t* fil
 errval_t fat32_close_file (uint32_t file_descriptor)
 {
     // TODO: Recycle file descriptors.
+    thread_mutex_lock (&descriptor_mutex);
     descriptor_to_cluster [file_descriptor] = 0;
     descriptor_to_size [file_descriptor] = 0;
+    thread_mutex_unlock (&descriptor_mutex);
     return SYS_ERR_OK;
 }
 
@@ -320,11 +328,23 @@ static inline int min (int first, int second)
     }
 }
 
+static inline int max (int first, int second)
+{
+    if (first > second) {
+        return first;
+    } else {
+        return second;
+    }
+}
+
 /// see header file
 errval_t fat32_read_file (uint32_t file_descriptor, size_t position, size_t size, void* buf, size_t *buflen)
 {
+    thread_mutex_lock (&descriptor_mutex);
+    struct fat32_config* config = descriptor_to_config [file_descriptor];
     uint32_t cluster_index = descriptor_to_cluster [file_descriptor];
     uint32_t file_size = descriptor_to_size [file_descriptor];
+    thread_mutex_unlock (&descriptor_mutex);
     debug_printf_quiet ("FD: %u, size: %u, Cluster index: %u, file size: %u, position %u\n", file_descriptor, size, cluster_index, file_size, position);
 
     assert (*buflen >= size);
@@ -332,7 +352,7 @@ errval_t fat32_read_file (uint32_t file_descriptor, size_t position, size_t size
     errval_t error = SYS_ERR_OK;
     struct sector_stream stack_stream;
     struct sector_stream* stream = &stack_stream;
-    stream_init (stream, descriptor_to_config [file_descriptor], cluster_index);
+    stream_init (stream, config, cluster_index);
     uint32_t early_stop = false;
     char sector [512];
 
@@ -342,27 +362,35 @@ errval_t fat32_read_file (uint32_t file_descriptor, size_t position, size_t size
     *buflen = min (file_size - position, size);
 
     // Skip sectors which are not interesting.
-    while (!stream_is_finished (stream) && file_index + 512 < position && err_is_ok (error)) {
+    while (!stream_is_finished (stream) && file_index + 512 <= position && err_is_ok (error)) {
         error = stream_next (stream);
         file_index += 512;
     }
 
-    while (!stream_is_finished (stream) && chars_read != size && err_is_ok (error)) {
-        error = stream_load (stream, sector);
+    size_t end_position = min (position + size, file_size);
 
-        // TODO: Use memcpy
-        for (int i=0; i<512; i++) {
-            // Stop if we've read more than necessary, or if we're after the file boundary.
-            if ( (file_index + i) >= (position + size) || (file_index + i) >= file_size) {
-                early_stop = true;
-            // Copy characters while in range [position, position+size)
-            } else if (position <= (file_index + i) && (file_index + i) < (position + size)) {
-                buffer [chars_read] = sector [i];
-                chars_read++;
-            }
+    while (!stream_is_finished (stream) && chars_read != size && !early_stop && err_is_ok (error)) {
+
+        // Interesting range [first, last) within this sector.
+        size_t first = max (position, file_index);
+        size_t last = min (end_position, file_index + 512);
+
+        if (last <= first) {
+            // Stop if we're after the file boundary or have read enough.
+            early_stop = true;
+        } else if (first == file_index && last == file_index + 512) {
+            // Whole sector is requested: load it in place without a bounce copy.
+            error = stream_load (stream, buffer + chars_read);
+            chars_read += 512;
+        } else {
+            error = stream_load (stream, sector);
+            memcpy (buffer + chars_read, sector + (first - file_index), last - first);
+            chars_read += last - first;
         }
         file_index += 512;
-        error = stream_next (stream);
+        if (!early_stop) {
+            error = stream_next (stream);
+        }
     }
     debug_printf_quiet ("fat32_read_file: %s\n", err_getstring (error));
     return error;
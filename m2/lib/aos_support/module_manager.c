@@ -145,7 +145,7 @@ errval_t module_manager_load (char* domain_name, struct module_info** ret_module
 
             // Allocate a new module info struct.
             error = module_cache_resize ();
-            struct module_info* info = malloc (sizeof (struct module_info));
+            struct module_info* info = calloc (1, sizeof (struct module_info));
             char* copied_name = malloc (strlen (domain_name) + 1);
 
             if (err_is_ok (error) && info && copied_name) {
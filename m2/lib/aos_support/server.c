@@ -1,6 +1,7 @@
 #include <aos_support/server.h>
 #include <aos_support/shared_buffer.h>
 #include <barrelfish/aos_dbg.h>
+#include <arch/arm/barrelfish_kpi/asm_inlines_arch.h>
 
 // The user-defined, external handler.
 // NOTE: Maybe it might be better to not use a global variable.
@@ -16,6 +17,7 @@ void set_external_handler (handler_function_t handler)
 
 // Forward declaration of the shared handler function.
 static void default_handler (void* arg);
+static void server_channel_handler (void* arg);
 
 /**
  * Get the default handler.
@@ -25,17 +27,94 @@ dflt_handler_t get_default_handler (void)
     return default_handler;
 }
 
+/**
+ * A message waiting to be handled by a worker thread.
+ */
+struct work_item {
+    struct lmp_recv_msg message;
+    struct capref capability;
+    uint32_t type;
+    uint32_t arrival; // Cycle count when the message was received.
+    struct work_item* next;
+};
+
+/**
+ * A channel created by create_channel, together with its queue of
+ * messages which have not been handled yet.
+ * NOTE: The channel has to be the first member.
+ */
+struct server_channel {
+    struct lmp_chan channel;
+    handler_function_t forward; // Gets all messages except the connection setup, or NULL.
+
+    struct work_item* head;
+    struct work_item* tail;
+    struct work_item* current; // Message being handled, or whose reply was deferred.
+    bool busy;                 // No other message may be handled until current is done.
+    bool deferred;             // The handler of current will reply later.
+    bool ready;                // Enqueued in the ready list.
+    bool closed;               // Freed by destroy_channel once current is done.
+
+    // Queued in place of a message if there's no memory for a work item.
+    // The sender gets LIB_ERR_MALLOC_FAIL when it's this message's turn.
+    struct work_item spare;
+    bool spare_used;
+
+    struct server_channel* next_ready;
+    struct server_channel* next;
+};
+
+// All channels created by create_channel.
+static struct server_channel* server_channels;
+
+// Channels with pending messages that are not busy, in FIFO order.
+static struct server_channel* ready_head;
+static struct server_channel* ready_tail;
+
+static uint32_t worker_count = 0;
+
+// Protects the channel queues, the ready list and the statistics.
+static struct thread_mutex server_mutex = THREAD_MUTEX_INITIALIZER;
+static struct thread_cond work_available = THREAD_COND_INITIALIZER;
+
+static struct server_stats handler_stats [SERVER_MAX_MESSAGE_TYPE];
+
+// Told about each channel freed after destroy_channel, or NULL.
+static close_handler_t close_handler = NULL;
+
+static void record_latency (uint32_t type, uint32_t arrival)
+{
+    if (type < SERVER_MAX_MESSAGE_TYPE) {
+        uint32_t latency = get_cycle_count () - arrival;
+        handler_stats [type].count++;
+        handler_stats [type].total_cycles += latency;
+        if (latency > handler_stats [type].max_cycles) {
+            handler_stats [type].max_cycles = latency;
+        }
+    }
+}
+
+static struct server_channel* find_server_channel (struct lmp_chan* channel)
+{
+    struct server_channel* current = server_channels;
+    while (current && &current -> channel != channel) {
+        current = current -> next;
+    }
+    return current;
+}
 
 /// Creates a new LMP channel that is ready to accept messages.
-errval_t create_channel (struct lmp_chan** ret_channel)
+static errval_t create_server_channel (struct lmp_chan** ret_channel, handler_function_t forward)
 {
     errval_t error = SYS_ERR_OK;
     *ret_channel = NULL;
 
     // Create a new endpoint.
-    struct lmp_chan* channel = malloc (sizeof (struct lmp_chan));
+    struct server_channel* server_channel = calloc (1, sizeof (struct server_channel));
 
-    if (channel) {
+    if (server_channel) {
+        struct lmp_chan* channel = &server_channel -> channel;
+        server_channel -> forward = forward;
         lmp_chan_init (channel);
 
         // Initialize endpoint to receive messages.
@@ -43,7 +122,7 @@ errval_t create_channel (struct lmp_chan** ret_channel)
 
         // Register a receive handler.
         if (err_is_ok (error)) {
-            error = lmp_chan_register_recv (channel, get_default_waitset (), MKCLOSURE (default_handler, channel));
+            error = lmp_chan_register_recv (channel, get_default_waitset (), MKCLOSURE (server_channel_handler, server_channel));
         }
         // Allocate a slot for incoming capabilities.
         if (err_is_ok (error)) {
@@ -51,11 +130,16 @@ errval_t create_channel (struct lmp_chan** ret_channel)
         }
 
         if (err_is_ok (error)) {
+            thread_mutex_lock (&server_mutex);
+            server_channel -> next = server_channels;
+            server_channels = server_channel;
+            thread_mutex_unlock (&server_mutex);
+
             *ret_channel = channel;
         } else{
             // Clean up...
             lmp_chan_destroy (channel);
-            free (channel);
+            free (server_channel);
         }
     } else {
         error = LIB_ERR_MALLOC_FAIL;
@@ -63,112 +147,519 @@ errval_t create_channel (struct lmp_chan** ret_channel)
     return error;
 }
 
+errval_t create_channel (struct lmp_chan** ret_channel)
+{
+    return create_server_channel (ret_channel, NULL);
+}
+
+errval_t create_forwarding_channel (struct lmp_chan** ret_channel, handler_function_t forward)
+{
+    assert (forward);
+    return create_server_channel (ret_channel, forward);
+}
+
 /**
- * The shared handler function.
+ * Handle a single message.
  *
- * Handles AOS_PING, AOS_ROUTE_REQUEST_EP and AOS_RPC_CONNECTION_INIT and forwards
+ * Handles AOS_PING, AOS_ROUTE_REQUEST_EP, AOS_RPC_CONNECTION_INIT, AOS_RPC_REGISTER_MEMORY
+ * and AOS_RPC_PRINT_SERVER_STATS and forwards
  * all other message types to the external handler.
+ * On forwarding channels, everything except AOS_PING and AOS_RPC_CONNECTION_INIT
+ * goes to 'forward' instead.
+ */
+static void handle_message (struct lmp_chan* channel, struct lmp_recv_msg* message, struct capref capability, uint32_t type, handler_function_t forward)
+{
+    errval_t error = SYS_ERR_OK;
+
+    if (forward && type != AOS_PING && type != AOS_RPC_CONNECTION_INIT) {
+        forward (channel, message, capability, type);
+        return;
+    }
+
+    // Handle common server messages.
+    switch (type)
+    {
+        case AOS_PING:;
+
+            // Extract message parameters.
+            uint32_t ping_value = message -> words [1];
+            assert (!capref_is_null (capability));
+
+            // NOTE: Not printing by default, ipc_bench uses pings to measure round trips.
+            debug_printf_quiet ("Handling PING message with value %u\n", ping_value);
+
+            // Send a response to the ping request.
+            lmp_ep_send1 (capability, 0, NULL_CAP, ping_value);
+
+            // Destroy received capability and reuse slot.
+            cap_destroy (capability);
+            break;
+
+        case AOS_ROUTE_REQUEST_EP:;
+
+            debug_printf_quiet ("Got AOS_ROUTE_REQUEST_EP\n");
+
+            // Extract request ID
+            uint32_t id = message -> words [1];
+            assert (capref_is_null (capability));
+
+            // Create the new channel.
+            struct lmp_chan* new_channel;
+            errval_t ret_error = create_channel (&new_channel);
+
+            if (err_is_ok (ret_error)) {
+                // Send back the endpoint of the new channel.
+                lmp_chan_send3 (channel, 0, new_channel->local_cap, AOS_ROUTE_DELIVER_EP, ret_error, id);
+            } else {
+                // Channel creation failed. Send back error message.
+                lmp_chan_send3 (channel, 0, NULL_CAP, AOS_ROUTE_DELIVER_EP, ret_error, id);
+            }
+            break;
+        case AOS_RPC_CONNECTION_INIT:;
+
+            debug_printf_quiet ("Got AOS_RPC_CONNECTION_INIT\n");
+
+            // Check validity of message.
+            assert (!capref_is_null (capability));
+
+            // Set the remote capability in our channel.
+            channel->remote_cap = capability;
+
+            // Send back a reply.
+            lmp_chan_send1 (channel, 0, NULL_CAP, error);
+            break;
+
+        case AOS_RPC_PRINT_SERVER_STATS:;
+            debug_printf_quiet ("Got AOS_RPC_PRINT_SERVER_STATS\n");
+            server_print_stats ();
+            lmp_chan_send1 (channel, 0, NULL_CAP, error);
+            break;
+
+        case AOS_RPC_REGISTER_MEMORY:;
+            debug_printf_quiet ("Got AOS_RPC_REGISTER_MEMORY\n");
+            uint32_t descriptor = 0;
+            uint8_t slot_size_bits = message -> words [1];
+            if (!capref_is_null (capability)) {
+                error = map_shared_buffer (capability, slot_size_bits, &descriptor);
+            } else {
+                // TODO: Is there a more suitable error?
+                error = AOS_ERR_LMP_MSGTYPE_UNKNOWN;
+            }
+            lmp_chan_send2 (channel, 0, NULL_CAP, error, descriptor);
+            break;
+        default:
+            // This is a message that may be handled by the external handler.
+            debug_printf_quiet ("Message for external handler\n");
+            assert (external_handler);
+
+            external_handler (channel, message, capability, type);
+    }
+}
+
+/**
+ * Receive a message and reallocate the receive slot if needed.
+ */
+static errval_t receive_message (struct lmp_chan* channel, struct lmp_recv_msg* message, struct capref* capability)
+{
+    // Retrieve capability and arguments.
+    errval_t error = lmp_chan_recv(channel, message, capability);
+
+    // Reallocate a slot if we just received a capability.
+    if (err_is_ok (error) && !capref_is_null (*capability)) {
+        lmp_chan_alloc_recv_slot (channel);
+    }
+    return error;
+}
+
+/**
+ * The shared handler function for channels without a message queue.
+ * Messages are always handled on the current thread.
  *
  * \arg arg: The channel where the message was received from.
  */
 static void default_handler (void* arg)
 {
     debug_printf_quiet ("Handling LMP message...\n");
-    errval_t error = SYS_ERR_OK;
     struct lmp_chan* channel = (struct lmp_chan*) arg;
     struct lmp_recv_msg message = LMP_RECV_MSG_INIT;
     struct capref capability;
+    uint32_t arrival = get_cycle_count ();
 
-    // Retrieve capability and arguments.
-    error = lmp_chan_recv(channel, &message, &capability);
+    errval_t error = receive_message (channel, &message, &capability);
 
-    // Reallocate a slot if we just received a capability.
-    if (err_is_ok (error) && !capref_is_null (capability)) {
-        lmp_chan_alloc_recv_slot (channel);
+    // Now we're ready to handle the message.
+    if (err_is_ok (error)) {
+        uint32_t type = AOS_RPC_MESSAGE_TYPE (message.words [0]);
+        handle_message (channel, &message, capability, type, NULL);
+
+        thread_mutex_lock (&server_mutex);
+        record_latency (type, arrival);
+        thread_mutex_unlock (&server_mutex);
     }
 
-    // Now we're ready to handle the message.
+    // Re-register ourselves.
+    lmp_chan_register_recv (channel, get_default_waitset(), MKCLOSURE(default_handler, arg));
+}
+
+/// Allocate a work item, or take the spare one if memory is short. Needs server_mutex.
+static struct work_item* alloc_work_item (struct server_channel* server_channel)
+{
+    struct work_item* item = malloc (sizeof (struct work_item));
+    if (item == NULL && !server_channel -> spare_used) {
+        server_channel -> spare_used = true;
+        item = &server_channel -> spare;
+    }
+    return item;
+}
+
+/// Free a work item from alloc_work_item. Needs server_mutex.
+static void free_work_item (struct server_channel* server_channel, struct work_item* item)
+{
+    if (item == &server_channel -> spare) {
+        server_channel -> spare_used = false;
+    } else {
+        free (item);
+    }
+}
+
+/**
+ * Handle a queued message, or reply with an error if it couldn't be queued properly.
+ */
+static void handle_work_item (struct server_channel* server_channel, struct work_item* item)
+{
+    if (item == &server_channel -> spare) {
+        debug_printf ("Out of memory, rejecting message of type %u\n", item -> type);
+        if (!capref_is_null (item -> capability)) {
+            cap_destroy (item -> capability);
+        }
+        if (aos_rpc_expects_reply (item -> type)) {
+            lmp_chan_send1 (&server_channel -> channel, 0, NULL_CAP, LIB_ERR_MALLOC_FAIL);
+        }
+    } else {
+        handle_message (&server_channel -> channel, &item -> message, item -> capability, item -> type, server_channel -> forward);
+    }
+}
+
+/// Add a channel with pending messages to the ready list. Needs server_mutex.
+static void make_ready (struct server_channel* server_channel)
+{
+    if (!server_channel -> ready && !server_channel -> busy && !server_channel -> closed && server_channel -> head) {
+        server_channel -> ready = true;
+        server_channel -> next_ready = NULL;
+        if (ready_tail) {
+            ready_tail -> next_ready = server_channel;
+        } else {
+            ready_head = server_channel;
+        }
+        ready_tail = server_channel;
+        thread_cond_signal (&work_available);
+    }
+}
+
+/// Free a closed channel and drop its queued messages. Needs server_mutex.
+static void free_server_channel (struct server_channel* server_channel)
+{
+    assert (server_channel -> closed && !server_channel -> busy);
+
+    struct server_channel** link = &server_channels;
+    while (*link != server_channel) {
+        link = &((*link) -> next);
+    }
+    *link = server_channel -> next;
+
+    // A closed channel doesn't get ready again, but it may still be in the ready list.
+    struct server_channel* previous = NULL;
+    for (struct server_channel* current = ready_head; current; previous = current, current = current -> next_ready) {
+        if (current == server_channel) {
+            if (previous) {
+                previous -> next_ready = current -> next_ready;
+            } else {
+                ready_head = current -> next_ready;
+            }
+            if (ready_tail == current) {
+                ready_tail = previous;
+            }
+            break;
+        }
+    }
+
+    while (server_channel -> head) {
+        struct work_item* item = server_channel -> head;
+        server_channel -> head = item -> next;
+        if (!capref_is_null (item -> capability)) {
+            cap_destroy (item -> capability);
+        }
+        free_work_item (server_channel, item);
+    }
+
+    if (close_handler) {
+        close_handler (&server_channel -> channel);
+    }
+
+    lmp_chan_deregister_recv (&server_channel -> channel);
+    lmp_chan_destroy (&server_channel -> channel);
+    free (server_channel);
+}
+
+/// Free a closed channel once it is done with its current message. Needs server_mutex.
+static bool free_if_closed (struct server_channel* server_channel)
+{
+    if (server_channel -> closed && !server_channel -> busy) {
+        free_server_channel (server_channel);
+        return true;
+    }
+    return false;
+}
+
+void destroy_channel (struct lmp_chan* channel)
+{
+    thread_mutex_lock (&server_mutex);
+    struct server_channel* server_channel = find_server_channel (channel);
+    if (server_channel) {
+        server_channel -> closed = true;
+        free_if_closed (server_channel);
+    }
+    thread_mutex_unlock (&server_mutex);
+}
+
+void server_set_close_handler (close_handler_t handler)
+{
+    close_handler = handler;
+}
+
+bool server_client_alive (struct lmp_chan* channel)
+{
+    struct capref copy;
+    errval_t error = slot_alloc (&copy);
+
+    // Without a slot, we can't tell. Assume that the client is there.
+    if (err_is_fail (error)) {
+        return true;
+    }
+
+    // Copying fails if the endpoint of the client has been deleted.
+    error = cap_copy (copy, channel -> remote_cap);
     if (err_is_ok (error)) {
+        cap_delete (copy);
+    }
+    slot_free (copy);
+    return err_is_ok (error);
+}
+
+/// Finish the current message of a channel. Needs server_mutex.
+static void finish_current (struct server_channel* server_channel)
+{
+    struct work_item* item = server_channel -> current;
+    assert (item);
 
-        // Extract the type of message.
-        uint32_t type = message.words [0];
+    record_latency (item -> type, item -> arrival);
+    free_work_item (server_channel, item);
 
-        // Handle common server messages.
-        switch (type)
-        {
-            case AOS_PING:;
+    server_channel -> current = NULL;
+    server_channel -> busy = false;
+    server_channel -> deferred = false;
+    make_ready (server_channel);
+}
 
-                // Extract message parameters.
-                uint32_t ping_value = message.words [1];
-                assert (!capref_is_null (capability));
+/**
+ * Receive handler for channels created by create_channel.
+ * If there are worker threads, the message is queued for them.
+ *
+ * \arg arg: The struct server_channel where the message was received from.
+ */
+static void server_channel_handler (void* arg)
+{
+    struct server_channel* server_channel = arg;
+    struct lmp_chan* channel = &server_channel -> channel;
+    struct lmp_recv_msg message = LMP_RECV_MSG_INIT;
+    struct capref capability;
+    uint32_t arrival = get_cycle_count ();
 
-                // Print a message. NOTE: Here we're always printing, as this call is mostly for debugging.
-                debug_printf ("Handling PING message with value %u\n", ping_value);
+    errval_t error = receive_message (channel, &message, &capability);
 
-                // Send a response to the ping request.
-                lmp_ep_send1 (capability, 0, NULL_CAP, ping_value);
+    if (err_is_ok (error)) {
+        uint32_t type = AOS_RPC_MESSAGE_TYPE (message.words [0]);
+
+        thread_mutex_lock (&server_mutex);
+        bool idle = !server_channel -> busy && server_channel -> head == NULL;
+
+        struct work_item* item = alloc_work_item (server_channel);
+        if (item) {
+            item -> message = message;
+            item -> capability = capability;
+            item -> type = type;
+            item -> arrival = arrival;
+            item -> next = NULL;
+        }
 
-                // Destroy received capability and reuse slot.
+        if (server_channel -> closed || item == NULL) {
+            // Messages still arriving on a closed channel are dropped.
+            // Without any memory left, not even an error reply can be queued in order.
+            if (item == NULL) {
+                debug_printf ("Out of memory, dropping message of type %u\n", type);
+            }
+            if (!capref_is_null (capability)) {
                 cap_destroy (capability);
-                break;
-
-            case AOS_ROUTE_REQUEST_EP:;
-
-                debug_printf_quiet ("Got AOS_ROUTE_REQUEST_EP\n");
-
-                // Extract request ID
-                uint32_t id = message.words [1];
-                assert (capref_is_null (capability));
-
-                // Create the new channel.
-                struct lmp_chan* new_channel;
-                errval_t ret_error = create_channel (&new_channel);
-
-                if (err_is_ok (ret_error)) {
-                    // Send back the endpoint of the new channel.
-                    lmp_chan_send3 (channel, 0, new_channel->local_cap, AOS_ROUTE_DELIVER_EP, ret_error, id);
-                } else {
-                    // Channel creation failed. Send back error message.
-                    lmp_chan_send3 (channel, 0, NULL_CAP, AOS_ROUTE_DELIVER_EP, ret_error, id);
-                }
-                break;
-            case AOS_RPC_CONNECTION_INIT:;
-
-                debug_printf_quiet ("Got AOS_RPC_CONNECTION_INIT\n");
-
-                // Check validity of message.
-                assert (!capref_is_null (capability));
-
-                // Set the remote capability in our channel.
-                channel->remote_cap = capability;
-
-                // Send back a reply.
-                lmp_chan_send1 (channel, 0, NULL_CAP, error);
-                break;
-
-            case AOS_RPC_REGISTER_MEMORY:;
-                debug_printf_quiet ("Got AOS_RPC_REGISTER_MEMORY\n");
-                uint32_t descriptor = 0;
-                if (!capref_is_null (capability)) {
-                    error = map_shared_buffer (capability, &descriptor);
-                } else {
-                    // TODO: Is there a more suitable error?
-                    error = AOS_ERR_LMP_MSGTYPE_UNKNOWN;
-                }
-                lmp_chan_send2 (channel, 0, NULL_CAP, error, descriptor);
-                break;
-            default:
-                // This is a message that may be handled by the external handler.
-                debug_printf_quiet ("Message for external handler\n");
-                assert (external_handler);
-
-                external_handler (channel, &message, capability, type);
+            }
+            if (item) {
+                free_work_item (server_channel, item);
+            }
+        } else if (worker_count == 0 && idle) {
+            // Handle the message right here, but keep track of deferred replies.
+            server_channel -> current = item;
+            server_channel -> busy = true;
+            thread_mutex_unlock (&server_mutex);
+
+            handle_work_item (server_channel, item);
+
+            thread_mutex_lock (&server_mutex);
+            if (!server_channel -> deferred && server_channel -> current == item) {
+                finish_current (server_channel);
+            }
+        } else {
+            // Queue the message to preserve the order of messages on this channel.
+            if (server_channel -> tail) {
+                server_channel -> tail -> next = item;
+            } else {
+                server_channel -> head = item;
+            }
+            server_channel -> tail = item;
+            make_ready (server_channel);
         }
+        thread_mutex_unlock (&server_mutex);
+    }
+
+    // Re-register ourselves, unless the channel was closed meanwhile.
+    thread_mutex_lock (&server_mutex);
+    bool closed = server_channel -> closed;
+    free_if_closed (server_channel);
+    thread_mutex_unlock (&server_mutex);
 
+    if (!closed) {
+        lmp_chan_register_recv (channel, get_default_waitset(), MKCLOSURE(server_channel_handler, arg));
     }
+}
 
-    // Re-register ourselves.
-    lmp_chan_register_recv (channel, get_default_waitset(), MKCLOSURE(default_handler, arg));
+/**
+ * Handle the oldest message of the next ready channel.
+ * Returns false if there is no work, unless 'block' is set.
+ */
+static bool handle_next_message (bool block)
+{
+    thread_mutex_lock (&server_mutex);
+    while (block && ready_head == NULL) {
+        thread_cond_wait (&work_available, &server_mutex);
+    }
+
+    struct server_channel* server_channel = ready_head;
+    if (server_channel == NULL) {
+        thread_mutex_unlock (&server_mutex);
+        return false;
+    }
+
+    ready_head = server_channel -> next_ready;
+    if (ready_head == NULL) {
+        ready_tail = NULL;
+    }
+    server_channel -> ready = false;
+
+    struct work_item* item = server_channel -> head;
+    server_channel -> head = item -> next;
+    if (server_channel -> head == NULL) {
+        server_channel -> tail = NULL;
+    }
+    server_channel -> current = item;
+    server_channel -> busy = true;
+    thread_mutex_unlock (&server_mutex);
+
+    handle_work_item (server_channel, item);
+
+    thread_mutex_lock (&server_mutex);
+    if (!server_channel -> deferred && server_channel -> current == item) {
+        finish_current (server_channel);
+        free_if_closed (server_channel);
+    }
+    thread_mutex_unlock (&server_mutex);
+    return true;
+}
+
+/**
+ * Handle queued messages, one message per channel at a time.
+ */
+static int worker_thread (void* arg)
+{
+    while (true) {
+        handle_next_message (true);
+    }
+    return 0;
+}
+
+void server_defer_reply (struct lmp_chan* channel)
+{
+    thread_mutex_lock (&server_mutex);
+    struct server_channel* server_channel = find_server_channel (channel);
+    if (server_channel && server_channel -> busy) {
+        server_channel -> deferred = true;
+    }
+    thread_mutex_unlock (&server_mutex);
+}
+
+void server_complete_reply (struct lmp_chan* channel)
+{
+    thread_mutex_lock (&server_mutex);
+    struct server_channel* server_channel = find_server_channel (channel);
+    if (server_channel && server_channel -> deferred) {
+        finish_current (server_channel);
+        free_if_closed (server_channel);
+    }
+    thread_mutex_unlock (&server_mutex);
+
+    // Without workers, messages that queued up behind the deferred one are handled here.
+    if (worker_count == 0) {
+        while (handle_next_message (false));
+    }
+}
+
+void server_get_stats (uint32_t type, struct server_stats* stats)
+{
+    assert (type < SERVER_MAX_MESSAGE_TYPE && stats);
+    thread_mutex_lock (&server_mutex);
+    *stats = handler_stats [type];
+    thread_mutex_unlock (&server_mutex);
+}
+
+void server_print_stats (void)
+{
+    thread_mutex_lock (&server_mutex);
+    for (uint32_t type = 0; type < SERVER_MAX_MESSAGE_TYPE; type++) {
+        struct server_stats* stats = &handler_stats [type];
+        if (stats -> count > 0) {
+            debug_printf ("message type %3u: count %u, average %llu cycles, max %u cycles\n",
+                type, stats -> count, stats -> total_cycles / stats -> count, stats -> max_cycles);
+        }
+    }
+    thread_mutex_unlock (&server_mutex);
+}
+
+errval_t server_get_string (struct lmp_recv_msg* message, uint32_t first_word, char** string)
+{
+    errval_t error = SYS_ERR_OK;
+    assert (0 < first_word && first_word < LMP_MSG_LENGTH);
+
+    if (AOS_RPC_HAS_BULK_STRING (message -> words [0])) {
+        void* buffer = NULL;
+        uint32_t size = 0;
+        error = get_shared_buffer (message -> words [first_word], &buffer, &size);
+        if (err_is_ok (error)) {
+            ((char*) buffer) [size - 1] = '\0';
+            *string = buffer;
+        }
+    } else {
+        char* end = (char*) &message -> words [LMP_MSG_LENGTH];
+        end [-1] = '\0';
+        *string = (char*) &message -> words [first_word];
+    }
+    return error;
 }
 
 /**
@@ -190,6 +681,11 @@ void handle_unknown_message (struct lmp_chan* channel, struct capref capability)
  * \arg handler: A handler function for all messages handled by this server.
  */
 errval_t start_server (enum aos_service service, handler_function_t handler)
+{
+    return start_server_with_workers (service, handler, 0);
+}
+
+errval_t start_server_with_workers (enum aos_service service, handler_function_t handler, uint32_t workers)
 {
     // Set up the static external handler.
     external_handler = handler;
@@ -198,7 +694,22 @@ errval_t start_server (enum aos_service service, handler_function_t handler)
     struct aos_rpc* init_rpc = aos_rpc_get_init_channel ();
     struct lmp_chan* init_channel = &(init_rpc->channel);
 
-    error = aos_register_service (init_rpc, service);
+    // The current thread dispatches all events, workers block until their RPCs complete.
+    if (workers > 0) {
+        aos_rpc_set_event_thread (thread_self ());
+    }
+
+    for (uint32_t i = 0; i < workers && err_is_ok (error); i++) {
+        if (thread_create (worker_thread, NULL) == NULL) {
+            error = LIB_ERR_THREAD_CREATE;
+        } else {
+            worker_count++;
+        }
+    }
+
+    if (err_is_ok (error)) {
+        error = aos_register_service (init_rpc, service);
+    }
 
     if (err_is_ok (error)) {
         error = lmp_chan_register_recv (init_channel, get_default_waitset (), MKCLOSURE (default_handler, init_channel));
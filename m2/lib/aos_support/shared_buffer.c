@@ -8,20 +8,26 @@
 struct buffer_manager_entry {
     bool is_used;
     uint8_t frame_size_bits;
+    uint8_t slot_size_bits; // Zero if the buffer is not divided into slots.
     void* virtual_address;
     struct capref frame_capability;
 };
 
 static struct buffer_manager_entry buffer_manager [MAX_BUFFER_COUNT];
 
+// Servers may map buffers from several worker threads.
+static struct thread_mutex buffer_manager_mutex = THREAD_MUTEX_INITIALIZER;
+
 
 // Map a user-provided frame into our address space.
-errval_t map_shared_buffer (struct capref frame, uint32_t* memory_descriptor)
+errval_t map_shared_buffer (struct capref frame, uint8_t slot_size_bits, uint32_t* memory_descriptor)
 {
     uint32_t free_index = -1;
     uint8_t size_bits = 0;
     errval_t error = SYS_ERR_OK;
 
+    thread_mutex_lock (&buffer_manager_mutex);
+
     // Find a free slot in the buffer table.
     for (int i=0; i < MAX_BUFFER_COUNT && free_index == -1; i++) {
         if ( !buffer_manager[i].is_used ) {
@@ -38,6 +44,10 @@ errval_t map_shared_buffer (struct capref frame, uint32_t* memory_descriptor)
         struct frame_identity frame_size;
         error = invoke_frame_identify (frame, &frame_size);
         size_bits = frame_size.bits;
+
+        if (slot_size_bits > size_bits) {
+            error = AOS_ERR_LMP_INVALID_ARGS;
+        }
     }
 
     // Reserve some virtual space if needed.
@@ -57,34 +67,49 @@ errval_t map_shared_buffer (struct capref frame, uint32_t* memory_descriptor)
     if (err_is_ok (error)) {
         buffer_manager [free_index].is_used = true;
         buffer_manager [free_index].frame_size_bits = size_bits;
+        buffer_manager [free_index].slot_size_bits = slot_size_bits;
         buffer_manager [free_index].frame_capability = frame;
         if (memory_descriptor) {
             *memory_descriptor = free_index;
         }
     }
 
+    thread_mutex_unlock (&buffer_manager_mutex);
     return error;
 }
 
-// Return handle of the buffer.
-errval_t get_shared_buffer (uint32_t memory_descriptor, void** return_buffer, uint32_t* return_size)
+// Return handle of the buffer, or of a single slot within it.
+errval_t get_shared_buffer (uint32_t descriptor, void** return_buffer, uint32_t* return_size)
 {
     errval_t error = SYS_ERR_OK;
+    uint32_t memory_descriptor = AOS_RPC_BULK_MEMORY_DESCRIPTOR (descriptor);
+    uint32_t slot = AOS_RPC_BULK_SLOT (descriptor);
 
     if (0 <= memory_descriptor
         && memory_descriptor < MAX_BUFFER_COUNT
         && buffer_manager [memory_descriptor].is_used)
     {
-        if (return_buffer) {
-            *return_buffer = buffer_manager [memory_descriptor].virtual_address;
+        struct buffer_manager_entry* entry = &buffer_manager [memory_descriptor];
+
+        // A buffer without slots behaves like a single slot spanning the whole frame.
+        uint8_t slot_size_bits = entry -> slot_size_bits;
+        if (slot_size_bits == 0) {
+            slot_size_bits = entry -> frame_size_bits;
         }
-        if (return_size) {
-            uint8_t size_bits = buffer_manager [memory_descriptor].frame_size_bits;
-            *return_size = (1UL << size_bits);
+
+        if (slot < (1UL << (entry -> frame_size_bits - slot_size_bits))) {
+            if (return_buffer) {
+                *return_buffer = entry -> virtual_address + (slot << slot_size_bits);
+            }
+            if (return_size) {
+                *return_size = (1UL << slot_size_bits);
+            }
+        } else {
+            error = AOS_ERR_INVALID_MEMORY_DESCRIPTOR;
         }
     }
     else {
-        error = -1; // TODO: Find suitable error.
+        error = AOS_ERR_INVALID_MEMORY_DESCRIPTOR;
     }
     return error;
 }
@@ -93,20 +118,33 @@ errval_t get_shared_buffer (uint32_t memory_descriptor, void** return_buffer, ui
 // Unmap the shared buffer from our address space.
 errval_t unmap_shared_buffer (uint32_t memory_descriptor)
 {
-    errval_t error = -1; // TODO; Find suitable error.
-    return error; // TODO: Implement this function.
+    errval_t error = SYS_ERR_OK;
+
+    thread_mutex_lock (&buffer_manager_mutex);
 
     if (0 <= memory_descriptor
         && memory_descriptor < MAX_BUFFER_COUNT
         && buffer_manager [memory_descriptor].is_used)
     {
-        assert ( !capref_is_null (buffer_manager [memory_descriptor].frame_capability));
-        // TODO: We need to support unmap operations in the paging code...
-
-        buffer_manager [memory_descriptor].is_used = false;
-        buffer_manager [memory_descriptor].frame_size_bits = 0;
-        buffer_manager [memory_descriptor].frame_capability = NULL_CAP;
+        struct buffer_manager_entry* entry = &buffer_manager [memory_descriptor];
+        assert ( !capref_is_null (entry -> frame_capability));
+
+        // The next buffer in this entry may have a different size, so free the virtual range as well.
+        error = paging_unmap (get_current_paging_state(), entry -> virtual_address);
+
+        if (err_is_ok (error)) {
+            cap_destroy (entry -> frame_capability);
+            entry -> is_used = false;
+            entry -> frame_size_bits = 0;
+            entry -> slot_size_bits = 0;
+            entry -> virtual_address = NULL;
+            entry -> frame_capability = NULL_CAP;
+        }
+    } else {
+        error = AOS_ERR_INVALID_MEMORY_DESCRIPTOR;
     }
+
+    thread_mutex_unlock (&buffer_manager_mutex);
     return error;
 }
 
@@ -120,7 +158,7 @@ void test_shared_buffer (void)
     debug_printf ("First ram cap done: %s\n", err_getstring (error));
     assert (err_is_ok (error));
     uint32_t md;
-    error = map_shared_buffer (frame, &md);
+    error = map_shared_buffer (frame, 0, &md);
     assert (err_is_ok (error));
     debug_printf ("First mapping done\n");
     void* buffer;
@@ -130,20 +168,20 @@ void test_shared_buffer (void)
     assert (((char*) buffer) [0] == 'a');
 
     debug_printf ("Write worked\n");
-//     error = unmap_shared_buffer (md);
-//     debug_printf ("Unmap worked\n");
-//     assert (err_is_ok (error));
+    error = unmap_shared_buffer (md);
+    debug_printf ("Unmap worked\n");
+    assert (err_is_ok (error));
 
     struct capref frame_two;
     error = frame_alloc (&frame_two, 1024*1024, 0);
     debug_printf ("Second ram cap done\n");
     assert (err_is_ok (error));
-    error = map_shared_buffer (frame_two, &md);
+    error = map_shared_buffer (frame_two, 0, &md);
     assert (err_is_ok (error));
     debug_printf ("Second mapping done\n");
     void* new_buf;
     error = get_shared_buffer (md, &new_buf, NULL);
     assert (err_is_ok (error));
-//    error = unmap_shared_buffer (md);
-//     assert (err_is_ok (error));
+    error = unmap_shared_buffer (md);
+    assert (err_is_ok (error));
 }
@@ -13,11 +13,13 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
 
 #include <barrelfish/aos_rpc.h>
 #include <barrelfish/lmp_chan.h>
 
 #include <barrelfish/aos_dbg.h>
+#include <arch/arm/barrelfish_kpi/asm_inlines_arch.h>
 
 #define SHARED_BUFFER_DEFAULT_SIZE_BITS 20
 
@@ -46,9 +48,41 @@ struct aos_rpc* aos_rpc_get_init_channel (void)
 
 static struct aos_rpc serial_driver_channel;
 
+// Connected services, indexed by service identifier.
+static struct aos_rpc* service_channels [AOS_NAME_DIRECTORY_SIZE];
+static struct thread_mutex service_channels_mutex = THREAD_MUTEX_INITIALIZER;
+// The thread currently setting up a connection, or NULL. Protected by service_channels_mutex.
+// Other threads wait for connection_done, the connecting thread itself must not recurse.
+static struct thread* connecting_thread = NULL;
+static struct thread_cond connection_done = THREAD_COND_INITIALIZER;
+
+// The name directory of init, mapped read-only on first use.
+static struct aos_name_directory* name_directory = NULL;
+
 struct aos_rpc* aos_rpc_get_serial_driver_channel (void)
 {
-    return &serial_driver_channel;
+    struct aos_rpc* channel = NULL;
+    errval_t error = aos_rpc_get_service_channel (aos_service_serial, &channel);
+    if (err_is_fail (error)) {
+        channel = NULL;
+    }
+    return channel;
+}
+
+/**
+ * Remove 'rpc' from the connected services, such that the next lookup connects again.
+ * The structure isn't freed, because the callers may still hold on to it.
+ */
+static void aos_rpc_forget_service_channel (struct aos_rpc* rpc)
+{
+    thread_mutex_lock (&service_channels_mutex);
+    for (uint32_t service = 0; service < AOS_NAME_DIRECTORY_SIZE; service++) {
+        if (service_channels [service] == rpc) {
+            debug_printf_quiet ("Dropping the connection to service %u\n", service);
+            service_channels [service] = NULL;
+        }
+    }
+    thread_mutex_unlock (&service_channels_mutex);
 }
 
 /**
@@ -76,81 +110,390 @@ static void init_lmp_message_args (struct lmp_message_args* args, struct lmp_cha
     }
 }
 
+// The thread that dispatches events on the default waitset, or NULL if
+// every thread dispatches events itself while waiting for a reply.
+static struct thread* event_thread = NULL;
+
+// Protects the pending tables. Signalled whenever a request completes.
+static struct thread_mutex rpc_mutex = THREAD_MUTEX_INITIALIZER;
+static struct thread_cond rpc_completion = THREAD_COND_INITIALIZER;
+
+// Serializes the swap requests, see aos_rpc_swap_call.
+static struct thread_mutex swap_mutex = THREAD_MUTEX_INITIALIZER;
+
+void aos_rpc_set_event_thread (struct thread* thread)
+{
+    event_thread = thread;
+}
+
+void aos_rpc_set_donation (struct aos_rpc* rpc, bool donate)
+{
+    rpc -> donate_timeslice = donate;
+}
+
+/**
+ * Wait until something happened on the channels. Needs rpc_mutex.
+ * Either dispatch an event ourselves, or wait for the event thread to complete a request.
+ */
+static errval_t aos_rpc_block (void)
+{
+    errval_t error = SYS_ERR_OK;
+    if (event_thread == NULL || event_thread == thread_self ()) {
+        thread_mutex_unlock (&rpc_mutex);
+        error = event_dispatch (get_default_waitset());
+        thread_mutex_lock (&rpc_mutex);
+    } else {
+        thread_cond_wait (&rpc_completion, &rpc_mutex);
+    }
+    return error;
+}
+
+/// Get the aos_rpc structure which contains "channel".
+static inline struct aos_rpc* aos_rpc_from_channel (struct lmp_chan* channel)
+{
+    return (struct aos_rpc*) ((char*) channel - offsetof (struct aos_rpc, channel));
+}
+
+/**
+ * Marshaling information for the messages which need special treatment.
+ * Must match the description of the message types in aos_rpc.h.
+ */
+struct aos_rpc_message_info {
+    uint8_t string_word;  // First word of the string argument, or 0 if there is none.
+    bool reply_has_cap;   // A receive slot is needed for the reply.
+    bool is_barrier;      // The server may defer the reply, see aos_rpc_is_barrier.
+    bool no_reply;        // The server never replies, see aos_rpc_expects_reply.
+};
+
+static const struct aos_rpc_message_info message_table [] = {
+    [AOS_ROUTE_FIND_SERVICE]        = { .reply_has_cap = true, .is_barrier = true },
+    [AOS_ROUTE_REGISTER_NAME]       = { .string_word = 2 },
+    [AOS_RPC_GET_NAME_DIRECTORY]    = { .reply_has_cap = true },
+    [AOS_RPC_GET_RAM_CAP]           = { .reply_has_cap = true },
+    [AOS_RPC_GET_DEVICE_FRAME]      = { .reply_has_cap = true },
+    [AOS_RPC_SERIAL_PUTCHAR]        = { .no_reply = true },
+    [AOS_RPC_SERIAL_GETCHAR]        = { .is_barrier = true },
+    [AOS_RPC_SERIAL_WRITE]          = { .no_reply = true },
+    [AOS_RPC_WAIT_FOR_TERMINATION]  = { .is_barrier = true },
+    [AOS_RPC_OPEN_FILE]             = { .string_word = 2 },
+    [AOS_RPC_SPAWN_DOMAIN]          = { .string_word = 2 },
+    [AOS_RPC_REVOKE_REMOTE]         = { .is_barrier = true },
+};
+
+#define MESSAGE_TABLE_SIZE (sizeof (message_table) / sizeof (message_table [0]))
+
+/// Get the marshaling information of a message type.
+static inline const struct aos_rpc_message_info* aos_rpc_message_info (uint32_t type)
+{
+    static const struct aos_rpc_message_info plain = { 0 };
+    type = AOS_RPC_MESSAGE_TYPE (type);
+    return (type < MESSAGE_TABLE_SIZE) ? &message_table [type] : &plain;
+}
+
+/**
+ * Check if the server may defer the reply to a message of this type.
+ * Those requests act as a barrier, because a later request might overtake them.
+ */
+static bool aos_rpc_is_barrier (uint32_t type)
+{
+    return aos_rpc_message_info (type) -> is_barrier;
+}
+
+bool aos_rpc_expects_reply (uint32_t type)
+{
+    return !aos_rpc_message_info (type) -> no_reply;
+}
+
+void aos_rpc_request_init (struct aos_rpc_request* request, aos_rpc_callback_t callback, void* arg)
+{
+    struct lmp_recv_msg msg = LMP_RECV_MSG_INIT;
+    request -> message = msg;
+    for (int i=0; i < LMP_MSG_LENGTH; i++ ) {
+        request -> message.words [i] = 0;
+    }
+    request -> cap = NULL_CAP;
+    request -> needs_receive_cap = false;
+    request -> is_barrier = false;
+    request -> done = false;
+    request -> error = SYS_ERR_OK;
+    request -> id = 0;
+    request -> callback = callback;
+    request -> arg = arg;
+}
+
 /**
- * A generic response handler that just fills in a struct lmp_message_args.
+ * Receive handler for aos_rpc channels.
+ * Completes the oldest pending request with the received reply.
  *
- * \param arg: must be a valid struct lmp_message_args*
+ * \param arg: must be a valid struct aos_rpc*
  */
-static void aos_generic_response_handler (void* arg)
+static void aos_rpc_response_handler (void* arg)
 {
-    struct lmp_message_args* args = arg;
-    debug_printf_quiet ("aos_generic_response_handler, arg %p, channel %p...\n", arg, args->channel);
+    struct aos_rpc* rpc = arg;
+    struct lmp_chan* channel = &rpc -> channel;
+    debug_printf_quiet ("aos_rpc_response_handler, channel %p...\n", channel);
+
+    thread_mutex_lock (&rpc_mutex);
+    rpc -> receive_registered = false;
 
-    // Make sure we don't return stale values...
-    // NOTE: Once we're sure that everything works we can also uncomment this.
-    args -> cap = NULL_CAP;
     struct lmp_recv_msg msg = LMP_RECV_MSG_INIT;
-    args -> message = msg;
+    struct capref cap = NULL_CAP;
+    errval_t error = lmp_chan_recv (channel, &msg, &cap);
+
+    if (err_is_fail (error) && lmp_err_is_transient (error)) {
+        // Nothing received yet, try again later.
+        error = lmp_chan_register_recv (channel, get_default_waitset(), MKCLOSURE (aos_rpc_response_handler, rpc));
+        rpc -> receive_registered = err_is_ok (error);
+        thread_mutex_unlock (&rpc_mutex);
+        return;
+    }
+    print_error (error, "aos_rpc_response_handler: error code: %s\n", err_getstring (error));
+
+    if (rpc -> pending_count == 0) {
+        debug_printf ("aos_rpc_response_handler: dropping unexpected message on channel %p\n", channel);
+        thread_mutex_unlock (&rpc_mutex);
+        return;
+    }
+
+    // Replies arrive in request order.
+    uint16_t oldest_id = rpc -> next_request_id - rpc -> pending_count;
+    struct aos_rpc_request* request = rpc -> pending [oldest_id % AOS_RPC_MAX_PENDING];
+    rpc -> pending [oldest_id % AOS_RPC_MAX_PENDING] = NULL;
+    rpc -> pending_count--;
+    assert (request && request -> id == oldest_id);
+
+    if (request -> is_barrier) {
+        rpc -> barrier_pending = false;
+    }
+
+    request -> message = msg;
+    request -> cap = cap;
+    request -> error = error;
+
+    // Set a new slot for the next incoming capability.
+    // TODO: In case of error we may sometimes be able to reuse the existing slot.
+    bool needs_slot = err_is_ok (error) && request -> needs_receive_cap
+        && !lmp_chan_set_recv_slot_from_pool (channel);
+
+    // Keep listening as long as there are outstanding requests.
+    if (rpc -> pending_count > 0) {
+        error = lmp_chan_register_recv (channel, get_default_waitset(), MKCLOSURE (aos_rpc_response_handler, rpc));
+        rpc -> receive_registered = err_is_ok (error);
+        print_error (error, "aos_rpc_response_handler: re-register failed. %s\n", err_getstring (error));
+    }
+
+    if (needs_slot) {
+        // The pool is empty. Allocating a slot may need a RAM capability,
+        // i.e. another request on an aos_rpc channel, so it is done without rpc_mutex.
+        // Nobody else touches the request before it is done.
+        thread_mutex_unlock (&rpc_mutex);
+        request -> error = lmp_chan_alloc_recv_slot (channel);
+        print_error (request -> error, "aos_rpc_response_handler: reallocated. Error code: %s\n", err_getstring (request -> error));
+        thread_mutex_lock (&rpc_mutex);
+    }
+
+    request -> done = true;
+    aos_rpc_callback_t callback = request -> callback;
+    thread_cond_broadcast (&rpc_completion);
+    thread_mutex_unlock (&rpc_mutex);
 
-    // Read values from channel.
-    args -> error = lmp_chan_recv(args -> channel, &(args->message), &(args->cap));
-    print_error (args -> error, "aos_generic_response_handler: error code: %s\n", err_getstring (args -> error));
+    // NOTE: The request may be gone already if there's no callback.
+    if (callback) {
+        callback (request);
+    }
 }
 
 /**
- * Generic function to send a request and wait for a response.
- * Arguments can be given in the storage struct.
- * Any return value will be stored in the same struct.
+ * Send a message without reply. It doesn't take a slot in the pending table,
+ * and it doesn't wait for barriers, because there's no reply to match.
+ * The request is done as soon as the message is sent.
  */
-static errval_t aos_send_receive (struct lmp_message_args* storage, bool needs_receive_cap)
+static errval_t aos_rpc_send_without_reply (struct aos_rpc* rpc, struct aos_rpc_request* request)
 {
-    debug_printf_quiet ("aos_send_receive, storage %p, channel %p... \n", storage, storage -> channel);
+    errval_t error = SYS_ERR_OK;
+    uint32_t flags = LMP_FLAG_SYNC | LMP_FLAG_YIELD;
 
+    // Retry if the server didn't catch up yet.
+    do {
+        error = lmp_chan_send9 (
+            &rpc -> channel,
+            flags,
+            request -> cap,
+            AOS_RPC_TAGGED_TYPE (request -> message.words [0], 0),
+            request -> message.words [1],
+            request -> message.words [2],
+            request -> message.words [3],
+            request -> message.words [4],
+            request -> message.words [5],
+            request -> message.words [6],
+            request -> message.words [7],
+            request -> message.words [8]
+        );
+        if (err_is_fail (error) && lmp_err_is_transient (error)) {
+            thread_yield ();
+        }
+    } while (err_is_fail (error) && lmp_err_is_transient (error));
+
+    request -> error = error;
+    request -> done = true;
+    if (err_is_fail (error)) {
+        aos_rpc_forget_service_channel (rpc);
+    }
+    if (request -> callback) {
+        request -> callback (request);
+    }
+    return error;
+}
+
+errval_t aos_rpc_submit (struct aos_rpc* rpc, struct aos_rpc_request* request)
+{
+    debug_printf_quiet ("aos_rpc_submit, rpc %p, request %p...\n", rpc, request);
     errval_t error = SYS_ERR_OK;
+    struct lmp_chan* channel = &rpc -> channel;
+
+    if (!aos_rpc_expects_reply (request -> message.words [0])) {
+        return aos_rpc_send_without_reply (rpc, request);
+    }
+
+    request -> is_barrier = aos_rpc_is_barrier (request -> message.words [0]);
+    request -> needs_receive_cap |= aos_rpc_message_info (request -> message.words [0]) -> reply_has_cap;
+    request -> done = false;
+
+    // Only channels that get capabilities back keep receive slots for their pending replies.
+    if (request -> needs_receive_cap) {
+        lmp_chan_set_recv_slot_pool (channel, AOS_RPC_MAX_PENDING);
+    }
+
+    thread_mutex_lock (&rpc_mutex);
+
+    // Wait for a free slot in the pending table. A barrier request needs to be
+    // alone on the channel, and a pending barrier blocks everything else.
+    while (err_is_ok (error)
+        && (rpc -> pending_count == AOS_RPC_MAX_PENDING
+            || rpc -> barrier_pending
+            || (request -> is_barrier && rpc -> pending_count > 0)))
+    {
+        error = aos_rpc_block ();
+    }
 
     // Set up the receive handler.
-    error = lmp_chan_register_recv (storage->channel, get_default_waitset(), MKCLOSURE (aos_generic_response_handler, storage));
-    print_error (error, "aos_send_receive: message sent. Error code: %s, channel %p\n", err_getstring (error), storage -> channel);
+    if (err_is_ok (error) && !rpc -> receive_registered) {
+        error = lmp_chan_register_recv (channel, get_default_waitset(), MKCLOSURE (aos_rpc_response_handler, rpc));
+        rpc -> receive_registered = err_is_ok (error);
+        print_error (error, "aos_rpc_submit: register failed. Error code: %s, channel %p\n", err_getstring (error), channel);
+    }
 
     if (err_is_ok (error)) {
 
-        // Send the request.
-        error = lmp_chan_send9 (
-            storage -> channel, // Channel to send on.
-            0, // Don't give up processor (yet).
-            storage -> cap, // Capability to send.
-            storage -> message.words [0],
-            storage -> message.words [1],
-            storage -> message.words [2],
-            storage -> message.words [3],
-            storage -> message.words [4],
-            storage -> message.words [5],
-            storage -> message.words [6],
-            storage -> message.words [7],
-            storage -> message.words [8]
-        );
-        print_error (error, "aos_send_receive: message sent. Error code: %s, channel %p\n", err_getstring (error), storage -> channel);
-
-        if (err_is_ok (error)) {
+        // Enter the request into the pending table.
+        request -> id = rpc -> next_request_id;
+        rpc -> pending [request -> id % AOS_RPC_MAX_PENDING] = request;
+        rpc -> pending_count++;
+        rpc -> next_request_id++;
+        if (request -> is_barrier) {
+            rpc -> barrier_pending = true;
+        }
 
-            // Yield processor and wait for response.
-            error = event_dispatch (get_default_waitset());
-            print_error (error, "aos_send_receive: message received. Error code: %s, channel %p\n", err_getstring (error), storage -> channel);
+        // A caller that is going to wait for the reply anyway can hand its timeslice
+        // to the server. Callers with a callback keep the processor.
+        uint32_t flags = 0;
+        if (rpc -> donate_timeslice && request -> callback == NULL) {
+            flags = LMP_SEND_FLAGS_DEFAULT;
+        }
 
-            // Re-allocate a new slot for the next incoming message.
-            // TODO: It might be better to reserve them lazily.
-            // TODO: In case of error we may sometimes be able to reuse the existing slot.
-            if (needs_receive_cap) {
-                error = lmp_chan_alloc_recv_slot (storage -> channel);
-                print_error (error, "aos_send_receive: reallocated. Error code: %s\n", err_getstring (error));
+        // Send the request, waiting for buffer space if the server is lagging behind.
+        do {
+            error = lmp_chan_send9 (
+                channel, // Channel to send on.
+                flags,
+                request -> cap, // Capability to send.
+                AOS_RPC_TAGGED_TYPE (request -> message.words [0], request -> id),
+                request -> message.words [1],
+                request -> message.words [2],
+                request -> message.words [3],
+                request -> message.words [4],
+                request -> message.words [5],
+                request -> message.words [6],
+                request -> message.words [7],
+                request -> message.words [8]
+            );
+            if (err_is_fail (error) && lmp_err_is_transient (error)) {
+                thread_mutex_unlock (&rpc_mutex);
+                thread_yield ();
+                thread_mutex_lock (&rpc_mutex);
             }
-        }
+        } while (err_is_fail (error) && lmp_err_is_transient (error));
+        print_error (error, "aos_rpc_submit: message sent. Error code: %s, channel %p\n", err_getstring (error), channel);
 
         if (err_is_fail (error)) {
-            // Send or receive failed. Deregister event handler and return.
-            error = lmp_chan_deregister_recv (storage -> channel);
+            // Send failed. The request is the newest one, so we can just roll back.
+            rpc -> next_request_id--;
+            rpc -> pending_count--;
+            rpc -> pending [request -> id % AOS_RPC_MAX_PENDING] = NULL;
+            if (request -> is_barrier) {
+                rpc -> barrier_pending = false;
+            }
+            if (rpc -> pending_count == 0) {
+                lmp_chan_deregister_recv (channel);
+                rpc -> receive_registered = false;
+            }
         }
     }
+    thread_mutex_unlock (&rpc_mutex);
+
+    // The service may be gone. Don't hand out this connection any more.
+    if (err_is_fail (error) && !lmp_err_is_transient (error)) {
+        aos_rpc_forget_service_channel (rpc);
+    }
+    return error;
+}
+
+errval_t aos_rpc_wait (struct aos_rpc* rpc, struct aos_rpc_request* request)
+{
+    errval_t error = SYS_ERR_OK;
+
+    // Yield processor and wait for response.
+    thread_mutex_lock (&rpc_mutex);
+    while (!request -> done && err_is_ok (error)) {
+        error = aos_rpc_block ();
+    }
+    thread_mutex_unlock (&rpc_mutex);
+    print_error (error, "aos_rpc_wait: event dispatch failed. Error code: %s, rpc %p\n", err_getstring (error), rpc);
+
+    if (err_is_ok (error)) {
+        error = request -> error;
+    }
+    return error;
+}
+
+/**
+ * Generic function to send a request and wait for a response.
+ * Arguments can be given in the storage struct.
+ * Any return value will be stored in the same struct.
+ */
+static errval_t aos_send_receive (struct lmp_message_args* storage, bool needs_receive_cap)
+{
+    debug_printf_quiet ("aos_send_receive, storage %p, channel %p... \n", storage, storage -> channel);
+
+    struct aos_rpc* rpc = aos_rpc_from_channel (storage -> channel);
+
+    struct aos_rpc_request request;
+    aos_rpc_request_init (&request, NULL, NULL);
+    request.message = storage -> message;
+    request.cap = storage -> cap;
+    request.needs_receive_cap = needs_receive_cap;
+
+    errval_t error = aos_rpc_submit (rpc, &request);
+
+    if (err_is_ok (error)) {
+        error = aos_rpc_wait (rpc, &request);
+    }
+
+    if (request.done) {
+        storage -> message = request.message;
+        storage -> cap = request.cap;
+    }
+    storage -> error = error;
     return error;
 }
 
@@ -171,6 +514,138 @@ static errval_t aos_send_receive (struct lmp_message_args* storage, bool needs_r
 //     return finished;
 // }
 
+// Size of the bulk ring which is set up on demand, e.g. for long strings.
+#define DEFAULT_BULK_SLOT_COUNT_BITS 2
+#define DEFAULT_BULK_SLOT_SIZE_BITS BASE_PAGE_BITS
+
+// Serializes the lazy setup of bulk rings.
+static struct thread_mutex bulk_setup_mutex = THREAD_MUTEX_INITIALIZER;
+
+/**
+ * Make sure that 'rpc' has a bulk ring.
+ */
+static errval_t aos_rpc_bulk_setup (struct aos_rpc* rpc)
+{
+    errval_t error = SYS_ERR_OK;
+    thread_mutex_lock (&bulk_setup_mutex);
+    if (rpc -> bulk.base == NULL) {
+        error = aos_rpc_bulk_init (rpc, DEFAULT_BULK_SLOT_COUNT_BITS, DEFAULT_BULK_SLOT_SIZE_BITS);
+    }
+    thread_mutex_unlock (&bulk_setup_mutex);
+    return error;
+}
+
+/**
+ * Allocate a bulk slot, waiting for outstanding requests to release one if necessary.
+ */
+static errval_t aos_rpc_bulk_alloc_wait (struct aos_rpc* rpc, void** buffer, size_t* size, uint32_t* descriptor)
+{
+    errval_t error = aos_rpc_bulk_alloc (rpc, buffer, size, descriptor);
+    while (error == AOS_ERR_BULK_SLOTS_EXHAUSTED) {
+        thread_mutex_lock (&rpc_mutex);
+        if (rpc -> bulk.free_slots == 0) {
+            error = aos_rpc_block ();
+        }
+        thread_mutex_unlock (&rpc_mutex);
+
+        if (err_is_ok (error)) {
+            error = aos_rpc_bulk_alloc (rpc, buffer, size, descriptor);
+        }
+    }
+    return error;
+}
+
+/**
+ * Put a string argument into 'request', starting at word 'first_word'.
+ * Strings that don't fit into the message are copied into a bulk slot, which
+ * is returned in 'descriptor' and has to be freed after the reply arrived.
+ *
+ * \arg uses_bulk: Result parameter, set if a bulk slot was allocated.
+ */
+static errval_t aos_rpc_put_string (struct aos_rpc* rpc, struct aos_rpc_request* request, uint32_t first_word,
+                                    const char* string, bool* uses_bulk, uint32_t* descriptor)
+{
+    errval_t error = SYS_ERR_OK;
+    size_t length = strlen (string) + 1;
+    *uses_bulk = false;
+
+    // Fast path: The string fits into the message.
+    if (length <= (LMP_MSG_LENGTH - first_word) * sizeof (uintptr_t)) {
+        memcpy (&request -> message.words [first_word], string, length);
+        return SYS_ERR_OK;
+    }
+
+    error = aos_rpc_bulk_setup (rpc);
+
+    void* buffer = NULL;
+    size_t size = 0;
+    if (err_is_ok (error)) {
+        error = aos_rpc_bulk_alloc_wait (rpc, &buffer, &size, descriptor);
+    }
+
+    if (err_is_ok (error) && length > size) {
+        aos_rpc_bulk_free (rpc, *descriptor);
+        error = AOS_ERR_LMP_INVALID_ARGS;
+    }
+
+    if (err_is_ok (error)) {
+        memcpy (buffer, string, length);
+        request -> message.words [0] |= AOS_RPC_BULK_STRING;
+        request -> message.words [first_word] = *descriptor;
+        *uses_bulk = true;
+    }
+    return error;
+}
+
+/**
+ * Do a blocking call, marshaled according to the message table.
+ *
+ * \arg args: The words following the message type, up to the string argument.
+ * \arg string: The string argument, or NULL if the message has none.
+ * \arg results: Result parameter for the reply words following the error value. May be NULL.
+ */
+static errval_t aos_rpc_call (struct aos_rpc* rpc, uint32_t type, const uint32_t* args, uint32_t arg_count,
+                              const char* string, uint32_t* results, uint32_t result_count)
+{
+    const struct aos_rpc_message_info* info = aos_rpc_message_info (type);
+    assert (arg_count < LMP_MSG_LENGTH && result_count < LMP_MSG_LENGTH);
+    assert (string == NULL || info -> string_word == arg_count + 1);
+
+    struct aos_rpc_request request;
+    aos_rpc_request_init (&request, NULL, NULL);
+    request.message.words [0] = type;
+    for (uint32_t i = 0; i < arg_count; i++) {
+        request.message.words [i + 1] = args [i];
+    }
+
+    errval_t error = SYS_ERR_OK;
+    bool uses_bulk = false;
+    uint32_t descriptor = 0;
+    if (string) {
+        error = aos_rpc_put_string (rpc, &request, info -> string_word, string, &uses_bulk, &descriptor);
+    }
+
+    if (err_is_ok (error)) {
+        error = aos_rpc_submit (rpc, &request);
+    }
+    if (err_is_ok (error)) {
+        error = aos_rpc_wait (rpc, &request);
+    }
+    if (uses_bulk) {
+        aos_rpc_bulk_free (rpc, descriptor);
+    }
+
+    if (err_is_ok (error)) {
+        error = request.message.words [0];
+    }
+    if (err_is_ok (error) && results) {
+        for (uint32_t i = 0; i < result_count; i++) {
+            results [i] = request.message.words [i + 1];
+        }
+    }
+    return error;
+}
+
 errval_t aos_rpc_send_string(struct aos_rpc *chan, const char *string)
 {
     debug_printf_quiet ("aos_rpc_send_string. String to send (may be truncated): %s\n", string);
@@ -249,6 +724,15 @@ errval_t aos_rpc_get_ram_cap(struct aos_rpc *chan, size_t request_bits,
     return error;
 }
 
+errval_t aos_rpc_get_ram_cap_submit (struct aos_rpc* rpc, size_t request_bits, struct aos_rpc_request* request)
+{
+    request -> message.words [0] = AOS_RPC_GET_RAM_CAP;
+    request -> message.words [1] = request_bits;
+    request -> needs_receive_cap = true;
+
+    return aos_rpc_submit (rpc, request);
+}
+
 errval_t aos_rpc_get_dev_cap(struct aos_rpc *chan, lpaddr_t paddr,
                              size_t length, struct capref *retcap,
                              size_t *retlen)
@@ -330,57 +814,104 @@ errval_t aos_rpc_serial_getchar(struct aos_rpc *chan, char *retc)
 
 errval_t aos_rpc_serial_putchar(struct aos_rpc *chan, char c)
 {
-    // Send a character to the serial port.
-    // TODO: Shall we change the protocol to wait for acknowledgement?
-    struct lmp_chan* channel = &chan->channel;
+    // Send a character to the serial port. There's no reply.
+    struct aos_rpc_request request;
+    aos_rpc_request_init (&request, NULL, NULL);
+    request.message.words [0] = AOS_RPC_SERIAL_PUTCHAR;
+    request.message.words [1] = c;
 
-    uint32_t flags = LMP_FLAG_SYNC | LMP_FLAG_YIELD;
-    lmp_chan_send2 (channel, flags, NULL_CAP, AOS_RPC_SERIAL_PUTCHAR, c);
-    return SYS_ERR_OK;
+    return aos_rpc_submit (chan, &request);
 }
 
-errval_t aos_rpc_process_spawn (struct aos_rpc *chan, char *name, coreid_t core_id, domainid_t *newpid)
+/// Send at most AOS_RPC_SERIAL_INLINE_LENGTH characters in a single message.
+static errval_t aos_rpc_serial_write_inline (struct aos_rpc* chan, const char* buf, size_t len)
 {
-    // Spawn a new process on core 'core_id'.
-    errval_t error = SYS_ERR_OK;
+    assert (len <= AOS_RPC_SERIAL_INLINE_LENGTH);
+    struct aos_rpc_request request;
+    aos_rpc_request_init (&request, NULL, NULL);
+    request.message.words [0] = AOS_RPC_SERIAL_WRITE;
+    request.message.words [1] = len;
+    memcpy (&request.message.words [2], buf, len);
+
+    // There's no reply, aos_rpc_submit returns once the message is sent.
+    return aos_rpc_submit (chan, &request);
+}
 
-    if (chan && chan -> shared_buffer == NULL) {
-        error = aos_rpc_setup_shared_buffer (chan, SHARED_BUFFER_DEFAULT_SIZE_BITS);
-        debug_printf_quiet ("Initialized buffer: %s\n", err_getstring (error));
-    }
+/// Completion of an asynchronous string transfer: give back the bulk slot.
+static void aos_rpc_serial_write_done (struct aos_rpc_request* request)
+{
+    struct aos_rpc* chan = request -> arg;
+    uint32_t slot = request - chan -> bulk.requests;
 
-    assert (chan -> shared_buffer != NULL);
-    assert (chan -> shared_buffer_length != 0);
+    print_error (request -> message.words [0], "aos_rpc_serial_write: %s\n", err_getstring (request -> message.words [0]));
+    aos_rpc_bulk_free (chan, AOS_RPC_BULK_DESCRIPTOR (chan -> bulk.memory_descriptor, slot));
+}
 
-    if (chan && err_is_ok (error)) {
-        // TODO: Gracefully handle this assertion.
-        assert (strlen (name) <= chan->shared_buffer_length);
+// Writes which need more messages than this are sent through a bulk slot.
+#define SERIAL_BULK_THRESHOLD (4 * AOS_RPC_SERIAL_INLINE_LENGTH)
 
-        // Put the string into the shared buffer.
-        char* as_string_buffer = chan -> shared_buffer;
-        strncpy (as_string_buffer, name, chan -> shared_buffer_length);
+errval_t aos_rpc_serial_write (struct aos_rpc *chan, const char *buf, size_t len)
+{
+    errval_t error = SYS_ERR_OK;
 
-        struct lmp_message_args args;
-        init_lmp_message_args (&args, &(chan->channel));
+    if (len > SERIAL_BULK_THRESHOLD && chan -> bulk.base == NULL) {
+        error = aos_rpc_bulk_setup (chan);
+        print_error (error, "aos_rpc_serial_write: no bulk ring, falling back to messages. %s\n", err_getstring (error));
+    }
 
-        // Set up the send arguments.
-        args.message.words [0] = AOS_RPC_SPAWN_DOMAIN;
-        args.message.words [1] = chan -> memory_descriptor;
-        args.message.words [2] = core_id;
+    if (len <= SERIAL_BULK_THRESHOLD || chan -> bulk.base == NULL) {
+        // Pack the characters into messages.
+        for (size_t i = 0; i < len && err_is_ok (error); i += AOS_RPC_SERIAL_INLINE_LENGTH) {
+            size_t chunk = (len - i < AOS_RPC_SERIAL_INLINE_LENGTH ? len - i : AOS_RPC_SERIAL_INLINE_LENGTH);
+            error = aos_rpc_serial_write_inline (chan, buf + i, chunk);
+        }
+        return error;
+    }
 
-        // Do the IPC call.
-        error = aos_send_receive (&args, false);
-        print_error (error, "aos_rpc_send_string: communication failed. %s\n", err_getstring (error));
+    for (size_t i = 0; i < len && err_is_ok (error);) {
+        void* slot_buffer = NULL;
+        size_t slot_size = 0;
+        uint32_t descriptor = 0;
+
+        // Wait until one of the earlier transfers has finished.
+        error = aos_rpc_bulk_alloc_wait (chan, &slot_buffer, &slot_size, &descriptor);
 
-        // Get the result.
         if (err_is_ok (error)) {
-            error = args.message.words [0];
-            if (err_is_ok (error) && newpid) {
-                *newpid = args.message.words [1];
+            // Leave room for the terminating null character.
+            size_t chunk = (len - i < slot_size - 1 ? len - i : slot_size - 1);
+            memcpy (slot_buffer, buf + i, chunk);
+            ((char*) slot_buffer) [chunk] = '\0';
+            i += chunk;
+
+            // Don't wait for the reply, the slot is released on completion.
+            struct aos_rpc_request* request = &chan -> bulk.requests [AOS_RPC_BULK_SLOT (descriptor)];
+            aos_rpc_request_init (request, aos_rpc_serial_write_done, chan);
+            request -> message.words [0] = AOS_RPC_SEND_STRING;
+            request -> message.words [1] = descriptor;
+
+            error = aos_rpc_submit (chan, request);
+            if (err_is_fail (error)) {
+                aos_rpc_bulk_free (chan, descriptor);
             }
         }
-    } else {
-        error = SYS_ERR_INVARGS_SYSCALL;
+    }
+    return error;
+}
+
+errval_t aos_rpc_process_spawn (struct aos_rpc *chan, char *name, coreid_t core_id, domainid_t *newpid)
+{
+    // Spawn a new process on core 'core_id'.
+    errval_t error = SYS_ERR_INVARGS_SYSCALL;
+
+    if (chan && name) {
+        uint32_t args [1] = { core_id };
+        uint32_t results [1];
+        error = aos_rpc_call (chan, AOS_RPC_SPAWN_DOMAIN, args, 1, name, results, 1);
+        print_error (error, "aos_rpc_process_spawn: %s\n", err_getstring (error));
+
+        if (err_is_ok (error) && newpid) {
+            *newpid = results [0];
+        }
     }
     return error;
 }
@@ -465,8 +996,6 @@ errval_t aos_rpc_process_get_all_pids(struct aos_rpc *chan,
     return error;
 }
 
-#define MAX_PATH 7 * 4 - 1
-
 errval_t aos_rpc_open(struct aos_rpc *chan, char *path, int *fd)
 {
     // Open file from the removable storage
@@ -474,28 +1003,14 @@ errval_t aos_rpc_open(struct aos_rpc *chan, char *path, int *fd)
     errval_t error = -1;
 
     if ((chan != NULL) && (path != NULL) && (fd != NULL)) {
-        if (strlen(path) <= MAX_PATH) {
-            struct lmp_message_args  args   ;
-            struct lmp_chan        * channel = &chan->channel;
-    
-            init_lmp_message_args(&args, channel);
-
-            args.message.words[0] = AOS_RPC_OPEN_FILE   ;
-            args.message.words[1] = disp_get_domain_id();
+        // Long paths are moved to a bulk slot automatically.
+        uint32_t args [1] = { disp_get_domain_id () };
+        uint32_t results [1];
+        error = aos_rpc_call (chan, AOS_RPC_OPEN_FILE, args, 1, path, results, 1);
+        print_error (error, "aos_rpc_open: operation failed. %s\n", err_getstring (error));
 
-            strcpy((char*)(&args.message.words[2]), path);
-
-            error = aos_send_receive (&args, false);
-            print_error (error, "aos_rpc_open: communication failed. %s\n", err_getstring (error));
-
-            if (err_is_ok (error)) {
-                error = args.message.words[0];
-                print_error (error, "aos_rpc_open: operation failed. %s\n", err_getstring (error));
-
-                if (err_is_ok (error)) {
-                    *fd = args.message.words[1];
-                }
-            }
+        if (err_is_ok (error)) {
+            *fd = results [0];
         }
     }
 
@@ -715,7 +1230,7 @@ errval_t aos_find_service (uint32_t service, struct capref* endpoint)
     *endpoint = NULL_CAP;
 
     // Check arguments.
-    if (service < 0 || service >= aos_service_guard) {
+    if (service < 0 || service >= AOS_NAME_DIRECTORY_SIZE) {
         error = SYS_ERR_INVARGS_SYSCALL; // TODO: is there a better error type?
 
     } else {
@@ -735,8 +1250,8 @@ errval_t aos_find_service (uint32_t service, struct capref* endpoint)
         if (err_is_ok (error)) {
             error = my_args.message.words [0];
             if (err_is_ok (error)) {
+                // The response handler has already set up a new receive slot.
                 *endpoint = my_args.cap;
-                error = lmp_chan_alloc_recv_slot (my_args.channel);
             }
         }
     }
@@ -776,6 +1291,166 @@ errval_t aos_register_service (struct aos_rpc* rpc, uint32_t service)
     return error;
 }
 
+errval_t aos_register_name (struct aos_rpc* rpc, const char* name, uint32_t metadata, uint32_t* service)
+{
+    debug_printf_quiet ("aos_register_name %s...\n", name);
+    errval_t error = SYS_ERR_OK;
+
+    // Check arguments.
+    if (name == NULL || name [0] == '\0' || strlen (name) >= AOS_NAME_LENGTH) {
+        error = AOS_ERR_LMP_INVALID_ARGS;
+
+    } else {
+        uint32_t args [1] = { metadata };
+        uint32_t results [1];
+        error = aos_rpc_call (rpc, AOS_ROUTE_REGISTER_NAME, args, 1, name, results, 1);
+
+        if (err_is_ok (error) && service) {
+            *service = results [0];
+        }
+    }
+    print_error (error, "aos_register_name:%s\n", err_getstring (error));
+    return error;
+}
+
+/**
+ * Map the name directory of init, unless this already happened.
+ */
+static errval_t map_name_directory (void)
+{
+    if (name_directory != NULL) {
+        return SYS_ERR_OK;
+    }
+
+    // Provide a new set of message arguments.
+    struct lmp_message_args my_args;
+    init_lmp_message_args (&my_args, &(aos_rpc_get_init_channel()->channel));
+    my_args.message.words [0] = AOS_RPC_GET_NAME_DIRECTORY;
+
+    errval_t error = aos_send_receive (&my_args, true);
+
+    if (err_is_ok (error)) {
+        error = my_args.message.words [0];
+    }
+
+    void* buffer = NULL;
+    if (err_is_ok (error)) {
+        error = paging_map_frame_attr (get_current_paging_state (), &buffer, BASE_PAGE_SIZE, my_args.cap, VREGION_FLAGS_READ, NULL, NULL);
+    }
+
+    if (err_is_ok (error)) {
+        name_directory = buffer;
+    }
+    print_error (error, "map_name_directory:%s\n", err_getstring (error));
+    return error;
+}
+
+errval_t aos_lookup_name (const char* name, uint32_t* service, uint32_t* metadata)
+{
+    errval_t error = map_name_directory ();
+
+    if (err_is_ok (error)) {
+        uint32_t version;
+        uint32_t found_service;
+        uint32_t found_metadata;
+        bool found;
+
+        // Retry if init updated the directory while we were reading it.
+        // The barriers order the entries between the two reads of the version.
+        do {
+            version = name_directory -> version;
+            dmb ();
+            found = false;
+            for (uint32_t i = 0; i < AOS_NAME_DIRECTORY_SIZE && !found && version % 2 == 0; i++) {
+                struct aos_name_entry* entry = &name_directory -> entries [i];
+                if (entry -> is_registered && strncmp (entry -> name, name, AOS_NAME_LENGTH) == 0) {
+                    found = true;
+                    found_service = i;
+                    found_metadata = entry -> metadata;
+                }
+            }
+            dmb ();
+        } while (version % 2 == 1 || version != name_directory -> version);
+
+        if (!found) {
+            error = AOS_ERR_SERVICE_NOT_FOUND;
+        }
+        if (found && service) {
+            *service = found_service;
+        }
+        if (found && metadata) {
+            *metadata = found_metadata;
+        }
+    }
+    return error;
+}
+
+errval_t aos_rpc_get_service_channel (uint32_t service, struct aos_rpc** channel)
+{
+    errval_t error = SYS_ERR_OK;
+
+    if (service >= AOS_NAME_DIRECTORY_SIZE) {
+        return AOS_ERR_LMP_INVALID_ARGS;
+    }
+
+    thread_mutex_lock (&service_channels_mutex);
+
+    // Setting up a connection may print an error, which
+    // in turn may want to connect to the serial driver.
+    if (connecting_thread == thread_self ()) {
+        thread_mutex_unlock (&service_channels_mutex);
+        return AOS_ERR_SERVICE_NOT_FOUND;
+    }
+
+    // Connect one service at a time. Someone else might have been faster.
+    while (connecting_thread != NULL) {
+        thread_cond_wait (&connection_done, &service_channels_mutex);
+    }
+    struct aos_rpc* rpc = service_channels [service];
+
+    if (rpc == NULL) {
+        // The mutex is released while connecting, because the RPCs
+        // may fail and drop a connection, see aos_rpc_forget_service_channel.
+        connecting_thread = thread_self ();
+        thread_mutex_unlock (&service_channels_mutex);
+
+        struct capref endpoint;
+        error = aos_find_service (service, &endpoint);
+
+        if (err_is_ok (error)) {
+            // The serial driver channel is needed before malloc works.
+            if (service == aos_service_serial) {
+                rpc = &serial_driver_channel;
+            } else {
+                rpc = malloc (sizeof (struct aos_rpc));
+                if (rpc == NULL) {
+                    error = LIB_ERR_MALLOC_FAIL;
+                }
+            }
+        }
+
+        if (err_is_ok (error)) {
+            error = aos_rpc_init (rpc, endpoint);
+            if (err_is_fail (error) && rpc != &serial_driver_channel) {
+                free (rpc);
+            }
+        }
+
+        thread_mutex_lock (&service_channels_mutex);
+        if (err_is_ok (error)) {
+            service_channels [service] = rpc;
+        } else {
+            rpc = NULL;
+        }
+        connecting_thread = NULL;
+        thread_cond_broadcast (&connection_done);
+    }
+    *channel = rpc;
+
+    thread_mutex_unlock (&service_channels_mutex);
+    return error;
+}
+
 errval_t aos_ping (struct aos_rpc* chan, uint32_t value)
 {
     debug_printf_quiet ("aos_ping, channel %p...\n", chan);
@@ -799,6 +1474,201 @@ errval_t aos_ping (struct aos_rpc* chan, uint32_t value)
     return error;
 }
 
+errval_t aos_rpc_ikc_ping (struct aos_rpc* rpc, uint32_t value, uint32_t* ikc_cycles)
+{
+    debug_printf_quiet ("aos_rpc_ikc_ping...\n");
+
+    uint32_t results [2];
+    errval_t error = aos_rpc_call (rpc, AOS_RPC_IKC_PING, &value, 1, NULL, results, 2);
+
+    if (err_is_ok (error) && results [0] != value) {
+        error = AOS_ERR_LMP_INVALID_ARGS;
+    }
+    if (err_is_ok (error) && ikc_cycles) {
+        *ikc_cycles = results [1];
+    }
+    print_error (error, "aos_rpc_ikc_ping: %s\n", err_getstring (error));
+    return error;
+}
+
+errval_t aos_rpc_get_memory_stats (struct aos_rpc* rpc, coreid_t core, struct aos_memory_stats* stats)
+{
+    debug_printf_quiet ("aos_rpc_get_memory_stats...\n");
+
+    uint32_t argument = core;
+    uint32_t results [4];
+    errval_t error = aos_rpc_call (rpc, AOS_RPC_GET_MEMORY_STATS, &argument, 1, NULL, results, 4);
+
+    if (err_is_ok (error)) {
+        stats -> free = results [0];
+        stats -> used = results [1];
+        stats -> borrowed = results [2];
+        stats -> lent = results [3];
+    }
+    print_error (error, "aos_rpc_get_memory_stats: %s\n", err_getstring (error));
+    return error;
+}
+
+errval_t aos_rpc_revoke_remote (struct aos_rpc* rpc, struct capref cap)
+{
+    debug_printf_quiet ("aos_rpc_revoke_remote...\n");
+
+    struct lmp_message_args args;
+    init_lmp_message_args (&args, &rpc -> channel);
+
+    args.cap = cap;
+    args.message.words [0] = AOS_RPC_REVOKE_REMOTE;
+
+    errval_t error = aos_send_receive (&args, false);
+
+    if (err_is_ok (error)) {
+        error = args.message.words [0];
+    }
+    // The other core has dropped its copies, now do the same on this core.
+    if (err_is_ok (error)) {
+        error = cap_revoke (cap);
+    }
+    print_error (error, "aos_rpc_revoke_remote: %s\n", err_getstring (error));
+    return error;
+}
+
+errval_t aos_rpc_free_ram_cap (struct aos_rpc* rpc, struct capref cap)
+{
+    debug_printf_quiet ("aos_rpc_free_ram_cap...\n");
+
+    struct lmp_message_args args;
+    init_lmp_message_args (&args, &rpc -> channel);
+
+    args.cap = cap;
+    args.message.words [0] = AOS_RPC_FREE_RAM_CAP;
+
+    errval_t error = aos_send_receive (&args, false);
+
+    if (err_is_ok (error)) {
+        error = args.message.words [0];
+    }
+    // The RAM service has revoked our copy already.
+    if (err_is_ok (error)) {
+        error = slot_free (cap);
+    }
+    print_error (error, "aos_rpc_free_ram_cap: %s\n", err_getstring (error));
+    return error;
+}
+
+
+errval_t aos_rpc_print_server_stats (struct aos_rpc* rpc)
+{
+    debug_printf_quiet ("aos_rpc_print_server_stats...\n");
+
+    errval_t error = aos_rpc_call (rpc, AOS_RPC_PRINT_SERVER_STATS, NULL, 0, NULL, NULL, 0);
+    print_error (error, "aos_rpc_print_server_stats: %s\n", err_getstring (error));
+    return error;
+}
+
+errval_t aos_rpc_swap_init (struct aos_rpc* rpc)
+{
+    debug_printf_quiet ("aos_rpc_swap_init...\n");
+
+    errval_t error = SYS_ERR_OK;
+    if (rpc -> shared_buffer == NULL) {
+        error = aos_rpc_setup_shared_buffer (rpc, BASE_PAGE_BITS);
+    } else if (rpc -> shared_buffer_length < BASE_PAGE_SIZE) {
+        error = AOS_ERR_LMP_INVALID_ARGS;
+    }
+    print_error (error, "aos_rpc_swap_init: %s\n", err_getstring (error));
+    return error;
+}
+
+/**
+ * Send a swap request and poll the endpoint for the reply.
+ *
+ * Swapping is done by the page fault handler, which may interrupt a thread
+ * holding rpc_mutex, or run while nobody dispatches the waitset. So the swap
+ * calls don't go through the pending table and the receive handler, and the
+ * channel must not be used for anything else once it is set up.
+ * swap_mutex keeps the requests of different threads apart.
+ */
+static errval_t aos_rpc_swap_call (struct aos_rpc* rpc, uint32_t type, uint32_t first, uint32_t second, uint32_t* result)
+{
+    struct lmp_chan* channel = &rpc -> channel;
+    errval_t error = SYS_ERR_OK;
+
+    thread_mutex_lock (&swap_mutex);
+
+    // Retry if the server didn't catch up yet.
+    do {
+        error = lmp_chan_send3 (channel, LMP_FLAG_SYNC | LMP_FLAG_YIELD, NULL_CAP, AOS_RPC_TAGGED_TYPE (type, 0), first, second);
+        if (err_is_fail (error) && lmp_err_is_transient (error)) {
+            thread_yield ();
+        }
+    } while (err_is_fail (error) && lmp_err_is_transient (error));
+
+    // Wait for the reply, giving the processor to the server in the meantime.
+    struct lmp_recv_msg msg = LMP_RECV_MSG_INIT;
+    if (err_is_ok (error)) {
+        do {
+            error = lmp_chan_recv (channel, &msg, NULL);
+            if (err_no (error) == LIB_ERR_NO_LMP_MSG) {
+                thread_yield ();
+            }
+        } while (err_no (error) == LIB_ERR_NO_LMP_MSG);
+    }
+
+    if (err_is_ok (error)) {
+        error = msg.words [0];
+    }
+    if (err_is_ok (error) && result) {
+        *result = msg.words [1];
+    }
+    thread_mutex_unlock (&swap_mutex);
+    return error;
+}
+
+errval_t aos_rpc_swap_out (struct aos_rpc* rpc, const void* page, uint32_t* slot)
+{
+    debug_printf_quiet ("aos_rpc_swap_out...\n");
+
+    // The buffer is set up by aos_rpc_swap_init, there's no way to do it here.
+    errval_t error = SYS_ERR_OK;
+    if (rpc -> shared_buffer == NULL || rpc -> shared_buffer_length < BASE_PAGE_SIZE) {
+        error = AOS_ERR_LMP_INVALID_ARGS;
+    }
+
+    if (err_is_ok (error)) {
+        memcpy (rpc -> shared_buffer, page, BASE_PAGE_SIZE);
+        error = aos_rpc_swap_call (rpc, AOS_RPC_SWAP_OUT, rpc -> memory_descriptor, AOS_RPC_SWAP_NEW_SLOT, slot);
+    }
+    print_error (error, "aos_rpc_swap_out: %s\n", err_getstring (error));
+    return error;
+}
+
+errval_t aos_rpc_swap_in (struct aos_rpc* rpc, uint32_t slot, void* page)
+{
+    debug_printf_quiet ("aos_rpc_swap_in...\n");
+
+    errval_t error = SYS_ERR_OK;
+    if (rpc -> shared_buffer == NULL || rpc -> shared_buffer_length < BASE_PAGE_SIZE) {
+        error = AOS_ERR_LMP_INVALID_ARGS;
+    }
+
+    if (err_is_ok (error)) {
+        error = aos_rpc_swap_call (rpc, AOS_RPC_SWAP_IN, rpc -> memory_descriptor, slot, NULL);
+    }
+    if (err_is_ok (error)) {
+        memcpy (page, rpc -> shared_buffer, BASE_PAGE_SIZE);
+    }
+    print_error (error, "aos_rpc_swap_in: %s\n", err_getstring (error));
+    return error;
+}
+
+errval_t aos_rpc_swap_free (struct aos_rpc* rpc, uint32_t slot)
+{
+    debug_printf_quiet ("aos_rpc_swap_free...\n");
+
+    errval_t error = aos_rpc_swap_call (rpc, AOS_RPC_SWAP_FREE, slot, 0, NULL);
+    print_error (error, "aos_rpc_swap_free: %s\n", err_getstring (error));
+    return error;
+}
 
 errval_t aos_rpc_set_led (struct aos_rpc* rpc, bool new_state)
 {
@@ -917,11 +1787,13 @@ errval_t aos_rpc_wait_for_termination (struct aos_rpc* rpc, domainid_t domain)
 }
 
 /**
- * Set up a shared frame within channel "rpc".
+ * Allocate a frame, map it and register it with the server on channel "rpc".
+ *
+ * \param slot_size_bits: Size of the slots in the frame, or 0 for a single buffer.
  */
-static errval_t aos_rpc_setup_shared_buffer (struct aos_rpc* rpc, uint8_t size_bits)
+static errval_t aos_rpc_share_frame (struct aos_rpc* rpc, uint8_t size_bits, uint8_t slot_size_bits,
+                                     void** ret_buffer, uint32_t* ret_descriptor)
 {
-    debug_printf_quiet ("aos_rpc_setup_shared_buffer...\n");
     errval_t error = SYS_ERR_OK;
     void* buffer = NULL;
 
@@ -943,6 +1815,7 @@ static errval_t aos_rpc_setup_shared_buffer (struct aos_rpc* rpc, uint8_t size_b
         // Set up the arguments according to the convention.
         args.cap = frame;
         args.message.words [0] = AOS_RPC_REGISTER_MEMORY;
+        args.message.words [1] = slot_size_bits;
 
         // Do the actual IPC call.
         error = aos_send_receive (&args, false);
@@ -951,9 +1824,8 @@ static errval_t aos_rpc_setup_shared_buffer (struct aos_rpc* rpc, uint8_t size_b
         if (err_is_ok (error)) {
             error = args.message.words [0];
             if (err_is_ok (error)) {
-                rpc -> memory_descriptor = args.message.words [1];
-                rpc -> shared_buffer = buffer;
-                rpc -> shared_buffer_length = (1ul << size_bits);
+                *ret_descriptor = args.message.words [1];
+                *ret_buffer = buffer;
             }
         }
     }
@@ -966,6 +1838,171 @@ static errval_t aos_rpc_setup_shared_buffer (struct aos_rpc* rpc, uint8_t size_b
     return error;
 }
 
+/**
+ * Set up a shared frame within channel "rpc".
+ */
+static errval_t aos_rpc_setup_shared_buffer (struct aos_rpc* rpc, uint8_t size_bits)
+{
+    debug_printf_quiet ("aos_rpc_setup_shared_buffer...\n");
+    void* buffer = NULL;
+    uint32_t descriptor = 0;
+
+    errval_t error = aos_rpc_share_frame (rpc, size_bits, 0, &buffer, &descriptor);
+
+    if (err_is_ok (error)) {
+        rpc -> memory_descriptor = descriptor;
+        rpc -> shared_buffer = buffer;
+        rpc -> shared_buffer_length = (1ul << size_bits);
+    }
+    return error;
+}
+
+errval_t aos_rpc_bulk_init (struct aos_rpc* rpc, uint8_t slot_count_bits, uint8_t slot_size_bits)
+{
+    debug_printf_quiet ("aos_rpc_bulk_init...\n");
+    errval_t error = SYS_ERR_OK;
+
+    // Check the bit counts before shifting, shifts by the word size or more are undefined.
+    if (rpc == NULL
+        || slot_count_bits >= sizeof (size_t) * 8
+        || slot_size_bits >= sizeof (size_t) * 8 - slot_count_bits
+        || (1ul << slot_count_bits) > AOS_RPC_BULK_MAX_SLOTS
+        || slot_size_bits < BASE_PAGE_BITS)
+    {
+        error = AOS_ERR_LMP_INVALID_ARGS;
+    }
+
+    void* buffer = NULL;
+    uint32_t descriptor = 0;
+
+    struct aos_rpc_request* requests = NULL;
+    if (err_is_ok (error)) {
+        requests = malloc ((1ul << slot_count_bits) * sizeof (struct aos_rpc_request));
+        if (requests == NULL) {
+            error = LIB_ERR_MALLOC_FAIL;
+        }
+    }
+
+    if (err_is_ok (error)) {
+        error = aos_rpc_share_frame (rpc, slot_count_bits + slot_size_bits, slot_size_bits, &buffer, &descriptor);
+    }
+
+    if (err_is_fail (error)) {
+        free (requests);
+    } else {
+        struct aos_rpc_bulk* bulk = &rpc -> bulk;
+        bulk -> requests = requests;
+        bulk -> memory_descriptor = descriptor;
+        bulk -> base = buffer;
+        bulk -> slot_size_bits = slot_size_bits;
+        bulk -> slot_count = (1ul << slot_count_bits);
+        bulk -> free_slots = (bulk -> slot_count == 32) ? 0xFFFFFFFF : ((1ul << bulk -> slot_count) - 1);
+        bulk -> next_slot = 0;
+    }
+    return error;
+}
+
+errval_t aos_rpc_bulk_alloc (struct aos_rpc* rpc, void** buffer, size_t* size, uint32_t* descriptor)
+{
+    assert (rpc && buffer && descriptor);
+    struct aos_rpc_bulk* bulk = &rpc -> bulk;
+
+    if (bulk -> base == NULL) {
+        return AOS_ERR_LMP_INVALID_ARGS;
+    }
+
+    errval_t error = AOS_ERR_BULK_SLOTS_EXHAUSTED;
+    thread_mutex_lock (&rpc_mutex);
+
+    // Search the ring, starting after the slot handed out last.
+    for (uint32_t i = 0; i < bulk -> slot_count && err_is_fail (error); i++) {
+        uint32_t slot = (bulk -> next_slot + i) % bulk -> slot_count;
+
+        if (bulk -> free_slots & (1u << slot)) {
+            bulk -> free_slots &= ~(1u << slot);
+            bulk -> next_slot = (slot + 1) % bulk -> slot_count;
+
+            *buffer = bulk -> base + (slot << bulk -> slot_size_bits);
+            *descriptor = AOS_RPC_BULK_DESCRIPTOR (bulk -> memory_descriptor, slot);
+            if (size) {
+                *size = (1ul << bulk -> slot_size_bits);
+            }
+            error = SYS_ERR_OK;
+        }
+    }
+    thread_mutex_unlock (&rpc_mutex);
+    return error;
+}
+
+void aos_rpc_bulk_free (struct aos_rpc* rpc, uint32_t descriptor)
+{
+    struct aos_rpc_bulk* bulk = &rpc -> bulk;
+    uint32_t slot = AOS_RPC_BULK_SLOT (descriptor);
+
+    assert (AOS_RPC_BULK_MEMORY_DESCRIPTOR (descriptor) == bulk -> memory_descriptor);
+    assert (slot < bulk -> slot_count);
+    assert ((bulk -> free_slots & (1u << slot)) == 0);
+
+    // Wake up threads waiting for a free slot.
+    thread_mutex_lock (&rpc_mutex);
+    bulk -> free_slots |= (1u << slot);
+    thread_cond_broadcast (&rpc_completion);
+    thread_mutex_unlock (&rpc_mutex);
+}
+
+errval_t aos_rpc_bulk_send_string (struct aos_rpc* rpc, uint32_t descriptor)
+{
+    struct lmp_message_args args;
+    init_lmp_message_args (&args, &(rpc->channel));
+
+    // The string is already in place, just tell the server where it is.
+    args.message.words [0] = AOS_RPC_SEND_STRING;
+    args.message.words [1] = descriptor;
+
+    errval_t error = aos_send_receive (&args, false);
+    print_error (error, "aos_rpc_bulk_send_string: communication failed. %s\n", err_getstring (error));
+
+    if (err_is_ok (error)) {
+        error = args.message.words [0];
+    }
+    return error;
+}
+
+errval_t aos_rpc_bulk_read_submit (struct aos_rpc* rpc, int fd, size_t position, uint32_t descriptor,
+                                   struct aos_rpc_request* request)
+{
+    // The server writes the file contents directly into the slot.
+    request -> message.words [0] = AOS_RPC_READ_FILE;
+    request -> message.words [1] = descriptor;
+    request -> message.words [2] = fd;
+    request -> message.words [3] = position;
+    request -> message.words [4] = (1ul << rpc -> bulk.slot_size_bits);
+
+    return aos_rpc_submit (rpc, request);
+}
+
+errval_t aos_rpc_bulk_read (struct aos_rpc* rpc, int fd, size_t position, uint32_t descriptor, size_t* buflen)
+{
+    assert (buflen);
+    struct aos_rpc_request request;
+    aos_rpc_request_init (&request, NULL, NULL);
+
+    errval_t error = aos_rpc_bulk_read_submit (rpc, fd, position, descriptor, &request);
+
+    if (err_is_ok (error)) {
+        error = aos_rpc_wait (rpc, &request);
+    }
+    print_error (error, "aos_rpc_bulk_read: communication failed. %s\n", err_getstring (error));
+
+    if (err_is_ok (error)) {
+        error = request.message.words [0];
+        if (err_is_ok (error)) {
+            *buflen = request.message.words [1];
+        }
+    }
+    return error;
+}
+
 errval_t aos_rpc_init(struct aos_rpc *rpc, struct capref receiver)
 {
     // Initialize channel to receiver.
@@ -979,6 +2016,16 @@ errval_t aos_rpc_init(struct aos_rpc *rpc, struct capref receiver)
     rpc -> memory_descriptor = 0;
     rpc -> shared_buffer_length = 0;
     rpc -> shared_buffer = NULL;
+    memset (&rpc -> bulk, 0, sizeof (struct aos_rpc_bulk));
+
+    for (int i = 0; i < AOS_RPC_MAX_PENDING; i++) {
+        rpc -> pending [i] = NULL;
+    }
+    rpc -> next_request_id = 0;
+    rpc -> pending_count = 0;
+    rpc -> donate_timeslice = true;
+    rpc -> barrier_pending = false;
+    rpc -> receive_registered = false;
 
     // Provide a new set of message arguments.
     struct lmp_message_args args;
@@ -95,23 +95,36 @@ static size_t dummy_terminal_read(char *buf, size_t len)
 
 
 /// Write function for the serial driver.
+/// NOTE: stdout is line buffered (see barrelfish_libc_glue_init), so libc calls
+/// this on a newline, when the buffer is full, or on fflush.
+/// The connection to the serial driver is set up on the first write.
 static size_t aos_rpc_terminal_write(const char *buf, size_t len)
 {
-    for (int i=0; i<len; i++) {
-        aos_rpc_serial_putchar (aos_rpc_get_serial_driver_channel (), buf[i]);
+    struct aos_rpc* serial = aos_rpc_get_serial_driver_channel ();
+    if (serial == NULL) {
+        return syscall_terminal_write (buf, len);
     }
-    return 0;
+    errval_t error = aos_rpc_serial_write (serial, buf, len);
+    if (err_is_fail (error)) {
+        return 0;
+    }
+    return len;
 }
 
 /// Read function for the serial driver.
 static size_t aos_rpc_terminal_read (char *buf, size_t len)
 {
+    struct aos_rpc* serial = aos_rpc_get_serial_driver_channel ();
+    if (serial == NULL) {
+        return 0;
+    }
+
     // probably scanf always only wants to read one character anyway...
     int i = 0;
     char c;
     do {
         //TODO: error handling.
-        aos_rpc_serial_getchar (aos_rpc_get_serial_driver_channel (), &c);
+        aos_rpc_serial_getchar (serial, &c);
         buf [i] = c;
         i++;
     } while (c != '\n' && c != '\r' && i+1 < len);
@@ -157,6 +170,11 @@ static errval_t ram_alloc_ipc (struct capref *ret, uint8_t size_bits, uint64_t m
     return error;
 }
 
+static errval_t ram_free_ipc (struct capref cap)
+{
+    return aos_rpc_free_ram_cap (ram_server_connection, cap);
+}
+
 /** \brief Initialise libbarrelfish.
  *
  * This runs on a thread in every domain, after the dispatcher is setup but
@@ -236,6 +254,9 @@ errval_t barrelfish_init_onthread(struct spawn_domain_params *params)
 
     // Change ram allocation to use the IPC mechanism.
     error = ram_alloc_set (ram_alloc_ipc);
+    if (err_is_ok (error)) {
+        error = ram_free_set (ram_free_ipc);
+    }
 
     // Initialize printf and scanf:
 
@@ -246,26 +267,13 @@ errval_t barrelfish_init_onthread(struct spawn_domain_params *params)
         return SYS_ERR_OK;
     }
 
-    // Find the serial driver.
-    struct capref serial_ep;
-    error = aos_find_service (aos_service_serial, &serial_ep);
-
-    // Register ourselves with the serial driver.
-    if (err_is_ok (error)) {
-        aos_rpc_init (aos_rpc_get_serial_driver_channel (), serial_ep);
-    }
-
     // Tell libc to use the IPC mechanism to print characters.
-    if (err_is_ok (error)) {
-        _libc_terminal_read_func = aos_rpc_terminal_read;
-        _libc_terminal_write_func = aos_rpc_terminal_write;
-    } else {
-        debug_printf ("Error: Could not establish connection to serial driver.\n Error code: %s\n Using sys_print system call instead.\n", err_getstring (error));
-    }
-
+    // The serial driver is looked up lazily on the first read or write,
+    // so domains which never print don't pay for the connection.
+    _libc_terminal_read_func = aos_rpc_terminal_read;
+    _libc_terminal_write_func = aos_rpc_terminal_write;
 
-    // right now we don't have the nameservice & don't need the terminal
-    // and domain spanning, so we return here
+    // right now we don't need domain spanning, so we return here
     return SYS_ERR_OK;
 }
 
@@ -31,6 +31,9 @@ void lmp_chan_init(struct lmp_chan *lc)
     assert(lc != NULL);
     lc->connstate = LMP_DISCONNECTED;
     waitset_chanstate_init(&lc->send_waitset, CHANTYPE_LMP_OUT);
+    waitset_chanstate_init(&lc->recv_slot_refill, CHANTYPE_OTHER);
+    lc->recv_slot_count = 0;
+    lc->recv_slot_target = 0;
     lc->endpoint = NULL;
 #ifndef NDEBUG
     lc->prev = lc->next = NULL;
@@ -183,6 +186,13 @@ void lmp_chan_destroy(struct lmp_chan *lc)
     lc->connstate = LMP_DISCONNECTED;
     cap_destroy(lc->local_cap);
 
+    // cancel a pending refill and release the unused receive slots
+    waitset_chan_deregister(&lc->recv_slot_refill);
+    while (lc->recv_slot_count > 0) {
+        lc->recv_slot_count--;
+        slot_free(lc->recv_slot_pool[lc->recv_slot_count]);
+    }
+
     if (lc->endpoint != NULL) {
         lmp_endpoint_free(lc->endpoint);
     }
@@ -408,28 +418,140 @@ void lmp_chan_migrate_send(struct lmp_chan *lc, struct waitset *ws)
     waitset_chan_migrate(&lc->send_waitset, ws);
 }
 
+/**
+ * \brief Top up the pool of receive slots of an LMP channel
+ *
+ * Runs as an event on the default waitset, so that slot allocation (and
+ * possibly growing a CNode) happens outside of the message handlers.
+ * The pool is filled up to the size set by #lmp_chan_set_recv_slot_pool.
+ *
+ * \param arg LMP channel
+ */
+static void lmp_chan_refill_recv_slots(void *arg)
+{
+    struct lmp_chan *lc = arg;
+
+    while (lc->recv_slot_count < lc->recv_slot_target) {
+        struct capref slot;
+        errval_t err = slot_alloc(&slot);
+        if (err_is_fail(err)) {
+            // try again on the next allocation
+            return;
+        }
+
+        bool added = false;
+        dispatcher_handle_t handle = disp_disable();
+        if (lc->recv_slot_count < lc->recv_slot_target) {
+            lc->recv_slot_pool[lc->recv_slot_count++] = slot;
+            added = true;
+        }
+        disp_enable(handle);
+
+        if (!added) {
+            slot_free(slot);
+        }
+    }
+}
+
 /**
  * \brief Allocate a new receive capability slot for an LMP channel
  *
- * This utility function allocates a new receive slot (using #slot_alloc)
- * and sets it on the channel (using #lmp_chan_set_recv_slot).
+ * This utility function takes a receive slot from the channel's pool, or
+ * allocates a new one (using #slot_alloc) if the pool is empty, and sets it
+ * on the channel (using #lmp_chan_set_recv_slot). The pool is refilled
+ * later from the default waitset.
  *
  * \param lc LMP channel
  */
 errval_t lmp_chan_alloc_recv_slot(struct lmp_chan *lc)
 {
     struct capref slot;
+    bool from_pool = false;
 
-    errval_t err = slot_alloc(&slot);
-    if (err_is_fail(err)) {
-        return err_push(err, LIB_ERR_SLOT_ALLOC);
+    assert(lc != NULL);
+
+    dispatcher_handle_t handle = disp_disable();
+    if (lc->recv_slot_count > 0) {
+        slot = lc->recv_slot_pool[--lc->recv_slot_count];
+        from_pool = true;
+    }
+    disp_enable(handle);
+
+    if (!from_pool) {
+        errval_t err = slot_alloc(&slot);
+        if (err_is_fail(err)) {
+            return err_push(err, LIB_ERR_SLOT_ALLOC);
+        }
     }
 
-    assert(lc != NULL);
     lmp_chan_set_recv_slot(lc, slot);
+
+    // schedule a refill, unless one is pending already
+    if (lc->recv_slot_count < lc->recv_slot_target) {
+        waitset_chan_trigger_closure(get_default_waitset(), &lc->recv_slot_refill,
+                                     MKCLOSURE(lmp_chan_refill_recv_slots, lc));
+    }
     return SYS_ERR_OK;
 }
 
+/**
+ * \brief Set a receive slot from the channel's pool, without allocating one
+ *
+ * Unlike #lmp_chan_alloc_recv_slot, this never calls #slot_alloc, so it can
+ * be used while holding locks which slot allocation may need.
+ *
+ * \param lc LMP channel
+ *
+ * \return false if the pool is empty, and no slot was set.
+ */
+bool lmp_chan_set_recv_slot_from_pool(struct lmp_chan *lc)
+{
+    struct capref slot;
+    bool from_pool = false;
+
+    assert(lc != NULL);
+
+    dispatcher_handle_t handle = disp_disable();
+    if (lc->recv_slot_count > 0) {
+        slot = lc->recv_slot_pool[--lc->recv_slot_count];
+        from_pool = true;
+    }
+    disp_enable(handle);
+
+    if (from_pool) {
+        lmp_chan_set_recv_slot(lc, slot);
+        waitset_chan_trigger_closure(get_default_waitset(), &lc->recv_slot_refill,
+                                     MKCLOSURE(lmp_chan_refill_recv_slots, lc));
+    }
+    return from_pool;
+}
+
+/**
+ * rief Set the number of receive slots an LMP channel keeps in advance
+ *
+ * Channels start without a pool, and allocate a slot whenever they received
+ * a capability. Channels which expect many capabilities in a row, e.g. in
+ * pipelined replies, can ask for up to #LMP_RECV_SLOT_POOL_SIZE slots.
+ * The pool is filled later from the default waitset, not right here.
+ *
+ * \param lc LMP channel
+ * \param count Number of slots to keep
+ */
+void lmp_chan_set_recv_slot_pool(struct lmp_chan *lc, size_t count)
+{
+    assert(lc != NULL);
+
+    if (count > LMP_RECV_SLOT_POOL_SIZE) {
+        count = LMP_RECV_SLOT_POOL_SIZE;
+    }
+    if (lc->recv_slot_target >= count) {
+        return;
+    }
+    lc->recv_slot_target = count;
+    waitset_chan_trigger_closure(get_default_waitset(), &lc->recv_slot_refill,
+                                 MKCLOSURE(lmp_chan_refill_recv_slots, lc));
+}
+
 /**
  * \brief Trigger send events for all LMP channels that are registered
  *
@@ -24,6 +24,9 @@ extern morecore_alloc_func_t sys_morecore_alloc;
 typedef void (*morecore_free_func_t)(void *base, size_t bytes);
 extern morecore_free_func_t sys_morecore_free;
 
+typedef void (*morecore_flush_func_t)(void);
+extern morecore_flush_func_t sys_morecore_flush;
+
 // this define makes morecore use an implementation that just has a static
 // 16MB heap.
 //#define USE_STATIC_HEAP
@@ -120,15 +123,33 @@ static void *morecore_alloc (size_t bytes, size_t *retbytes)
     return result;
 }
 
+/**
+ * \brief Give the whole pages of a free heap area back to the system
+ *
+ * The area stays reserved for the heap, and malloc may use it again.
+ * Touching it then maps new, zeroed pages.
+ */
 static void morecore_free(void *base, size_t bytes)
 {
-    USER_PANIC("NYI");
+    errval_t err = paging_release (get_current_paging_state (), base, bytes);
+    if (err_is_fail (err)) {
+        debug_printf ("morecore_free: %s\n", err_getstring (err));
+    }
+}
+
+/**
+ * \brief Return the frames released by morecore_free, once malloc isn't locked anymore
+ */
+static void morecore_flush(void)
+{
+    paging_return_frames (get_current_paging_state ());
 }
 
 errval_t morecore_init(void)
 {
     sys_morecore_alloc = morecore_alloc;
     sys_morecore_free = morecore_free;
+    sys_morecore_flush = morecore_flush;
     return SYS_ERR_OK;
 }
 
@@ -16,6 +16,7 @@
 #include <barrelfish/paging.h>
 #include <barrelfish/except.h>
 #include <barrelfish/slab.h>
+#include <barrelfish/aos_rpc.h>
 #include "threads_priv.h"
 
 #include <stdio.h>
@@ -28,27 +29,68 @@
 // Flags for newly mapped pages.
 #define FLAGS (KPI_PAGING_FLAGS_READ | KPI_PAGING_FLAGS_WRITE)
 
-// Default page count for refill requests by slab data structures.
-#define SLAB_REFILL_PAGE_COUNT 64u
+// Number of blocks added by a refill of the slab allocators.
+// Small domains only need a few page tables and frames.
+#define SLAB_REFILL_BLOCK_COUNT 4u
 
 // Predefined paging region for slot allocator.
 // This is defined by us as a workaround to a bug.
 // TODO Which size?? Experiments show that it needs about 32 pages for an 48MB array.
 #define SLOT_REGION_SIZE FRAME_SIZE
 
+// Connect to the filesystem driver for swapping once the heap has this many frames.
+#define SWAP_CONNECT_FRAMES 4u
+
+// Frames without used slots which paging_release keeps for new pages, instead of returning them.
+#define SPARE_FRAMES 1u
+
+// Upper limit for the pages mapped by a single page fault.
+#define FAULT_AROUND_MAX_PAGES 32u
+
+// Mappings which the kernel can do with fewer, larger entries.
+#define SECTION_SIZE (1024u*1024u)
+#define LARGE_PAGE_SIZE (64u*1024u)
+#define SECTIONS_PER_L2 (ARM_L2_USER_ENTRIES * PAGE_SIZE / SECTION_SIZE)
+
+// Nodes for the virtual address space lists which are kept in reserve for a refill.
+#define VSPACE_NODE_RESERVE 16u
+#define VSPACE_REFILL_PAGE_COUNT 4u
+// Page table descriptors which are kept in reserve for a refill. A refill maps at most
+// a few pages, which need no more than two new second-level page tables.
+#define PTABLE_RESERVE 3u
+
 // A global paging state instance.
 static struct paging_state current;
 
+// The first nodes of the global paging state, as there's no other state to refill from yet.
+static char vspace_bootstrap_nodes [SLAB_STATIC_SIZE (2 * VSPACE_NODE_RESERVE, sizeof (struct vspace_node))];
+
+// The same for the second-level page table descriptors.
+static char ptable_bootstrap_descriptors [SLAB_STATIC_SIZE (PTABLE_RESERVE, sizeof (struct ptable_lvl2))];
+
+// Connection to the filesystem driver, which stores paged out memory on the SD card.
+// Nothing the swap path uses may be paged out itself: The channel is static, its
+// endpoint lives in the dispatcher, its shared buffer and the thread stacks are
+// mapped eagerly (see paging_alloc_pinned), and none of them is in the frame slots.
+// Once connected, the channel only carries the aos_rpc_swap_* calls, which neither
+// take rpc_mutex nor dispatch events, so a fault in the middle of an RPC can page.
+static struct aos_rpc swap_channel;
+static bool swap_connected = false;
+static bool swap_disabled = false;
+
 // The exception stack for the first user-level thread.
 static char e_stack[EXCEPTION_STACK_SIZE];
 static char* e_stack_top = e_stack + EXCEPTION_STACK_SIZE;
 
 // Forward declarations.
-static errval_t paging_handle_pagefault (struct paging_state* state, lvaddr_t addr);
+static errval_t paging_handle_pagefault (struct paging_state* state, struct vspace_node* range, lvaddr_t addr);
 static errval_t paging_allocate_ptable (struct paging_state* state, uint32_t l2_index);
 static errval_t arml2_alloc(struct capref *ret);
 static errval_t paging_map_eagerly (struct paging_state* state, lvaddr_t base_addr, uint32_t page_count);
 static errval_t memory_refill (struct slab_alloc* allocator);
+static errval_t memory_refill_pages (struct slab_alloc* allocator, size_t pages);
+static struct vspace_node* paging_find_range (struct vspace_node* list, lvaddr_t addr);
+static errval_t paging_unmap_mappings (struct paging_state* state, struct vspace_node* range, lvaddr_t start, lvaddr_t end);
 
 /**
  * \brief Helper function that allocates a slot and
@@ -82,13 +124,13 @@ static void my_exception_handler (enum exception_type type, int subtype,
 //     debug_printf ("Exception type %u, subtype %u, addr %X\n", type, subtype, addr);
 
     lvaddr_t vaddr = (lvaddr_t) addr;
+    struct vspace_node* range = paging_find_range (current.reserved_ranges, vaddr);
 
     if (type == EXCEPT_PAGEFAULT 
         && subtype == PAGEFLT_NULL
-        && current.heap_begin <= vaddr 
-        && vaddr < current.heap_end )
+        && range != NULL)
     {
-        errval_t err = paging_handle_pagefault (&current, (lvaddr_t) addr);
+        errval_t err = paging_handle_pagefault (&current, range, vaddr);
         if (err_is_ok (err)) {
             debug_print_short ("!");
         } else {
@@ -100,113 +142,505 @@ static void my_exception_handler (enum exception_type type, int subtype,
     }
 }
 
+static inline uint32_t min (uint32_t first, uint32_t second)
+{
+    return first < second ? first : second;
+}
+
+/// Get the state of the page at 'addr'. The second-level page table must exist.
+static inline union page_entry* paging_get_entry (struct paging_state* state, lvaddr_t addr)
+{
+    return &(state -> ptables [ARM_L1_USER_OFFSET (addr)] -> pages [ARM_L2_USER_OFFSET (addr)]);
+}
+
 /**
- * \brief Handle the page fault at address `addr'.
- *
- * \param state: The current paging state.
- * \param addr: The address at which the page fault occured.
+ * Allocate a zeroed node for the virtual address space lists.
+ * A refill reserves and maps memory, which needs nodes itself.
+ * Therefore it is done in advance, while some nodes are left.
  */
-static errval_t paging_handle_pagefault (struct paging_state* state, lvaddr_t addr)
+static struct vspace_node* paging_node_alloc (struct paging_state* state)
 {
-    int l1_index = ARM_L1_USER_OFFSET(addr);
-    int l2_index = ARM_L2_USER_OFFSET(addr);
-    errval_t error = 0;
+    if (slab_freecount (&state -> vspace_mem) < VSPACE_NODE_RESERVE && ! state -> vspace_refilling) {
+        state -> vspace_refilling = true;
+        errval_t error = memory_refill_pages (&state -> vspace_mem, VSPACE_REFILL_PAGE_COUNT);
+        state -> vspace_refilling = false;
 
-    // Allocate a second-level page table if necessary.
-    if ( ! state -> ptables [l1_index] ) {
-        error = paging_allocate_ptable (state, l1_index);
+        if (err_is_fail (error)) {
+            debug_printf ("paging_node_alloc: %s\n", err_getstring (error));
+        }
+    }
+
+    struct vspace_node* node = slab_alloc (&state -> vspace_mem);
+    if (node) {
+        memset (node, 0, sizeof (struct vspace_node));
+    }
+    return node;
+}
+
+/// Find the range in a sorted list which contains 'addr', or NULL.
+static struct vspace_node* paging_find_range (struct vspace_node* list, lvaddr_t addr)
+{
+    for (struct vspace_node* range = list; range && range -> base <= addr; range = range -> next) {
+        if (addr < range -> base + range -> size) {
+            return range;
+        }
+    }
+    return NULL;
+}
+
+/// Insert a range into the free list and merge it with adjacent free ranges.
+static void paging_free_range (struct paging_state* state, struct vspace_node* range)
+{
+    struct vspace_node* previous = NULL;
+    struct vspace_node* next = state -> free_ranges;
+
+    while (next && next -> base < range -> base) {
+        previous = next;
+        next = next -> next;
+    }
+
+    range -> mappings = NULL;
+    range -> next = next;
+    if (previous) {
+        previous -> next = range;
+    } else {
+        state -> free_ranges = range;
+    }
+
+    if (next && range -> base + range -> size == next -> base) {
+        range -> size += next -> size;
+        range -> next = next -> next;
+        slab_free (&state -> vspace_mem, next);
+    }
+    if (previous && previous -> base + previous -> size == range -> base) {
+        previous -> size += range -> size;
+        previous -> next = range -> next;
+        slab_free (&state -> vspace_mem, range);
+    }
+}
+
+/// Get the address at which the contents of a frame slot are always accessible.
+static inline void* paging_slot_window (struct paging_frame* node, uint32_t slot)
+{
+    return (void*) (node -> window + slot * PAGE_SIZE);
+}
+
+/// Get the copy of the frame capability which maps the run starting at 'start'.
+static inline struct capref paging_run_mapping (struct paging_frame* node, uint32_t start)
+{
+    return (struct capref) { .cnode = node -> mappings, .slot = start };
+}
+
+/// Get the state of the page in a frame slot.
+static inline union page_entry* paging_slot_entry (struct paging_state* state, struct paging_frame* node, uint32_t slot)
+{
+    return paging_get_entry (state, node -> slots [slot].page * PAGE_SIZE);
+}
+
+/**
+ * Connect to the filesystem driver for paging out.
+ * This is done in advance, as it needs some memory itself.
+ * It fails silently if the filesystem driver isn't running yet.
+ */
+static void paging_swap_connect (void)
+{
+    if (swap_connected || swap_disabled) {
+        return;
     }
 
+    struct capref endpoint;
+    errval_t error = aos_find_service (aos_service_filesystem, &endpoint);
+
     if (err_is_ok (error)) {
+        error = aos_rpc_init (&swap_channel, endpoint);
 
-        // Check if we need to allocate a new frame.
-        if (state->flist_tail == NULL // => No frame available yet.
-                || state->flist_tail->next_free_slot >= FRAME_SLOTS) // => Frame is full.
-        {
-            debug_print_short ("..+..");
+        if (err_is_ok (error)) {
+            error = aos_rpc_swap_init (&swap_channel);
+        }
+        // Don't retry if the driver is there but can't handle us.
+        swap_connected = err_is_ok (error);
+        swap_disabled = err_is_fail (error);
+    }
+}
 
-            // Unfortunately we need to allocate a frame.
-            // Get a new frame of default size FRAME_SIZE.
+/**
+ * Get a new frame of default size FRAME_SIZE from the RAM server
+ * and add it to the frames of the page fault handler.
+ */
+static errval_t paging_add_frame (struct paging_state* state)
+{
+    debug_print_short ("..+..");
 
-            struct capref new_frame;
-            error = frame_alloc (&new_frame, FRAME_SIZE, NULL);
+    struct capref new_frame;
+    struct capref mapping_cnode;
+    struct cnoderef mappings;
+    void* window = NULL;
 
-            if (err_is_ok (error)) {
+    if (state -> frame_count >= PAGING_MAX_FRAMES) {
+        return LIB_ERR_FRAME_ALLOC;
+    }
 
-                // Grab some dynamic memory for the list.
-                struct frame_list* node = slab_alloc ( &(state->frame_mem));
-
-                // The allocation should succeed as the allocator has a refill function.
-                assert (node);
-
-                // Initialize the node.
-                init_frame_list (node);
-                node -> frame = new_frame;
-
-                // Add our newly allocated node to the frame list.
-                if (state->flist_tail && state->flist_head) {
-                    // Extend the list.
-                    state->flist_tail -> next = node;
-                    state->flist_tail = node;
-                    state->flist_head = node;
-                } else {
-                    // We're the first node.
-                    assert (state->flist_tail == NULL && state->flist_head == NULL);
-                    state->flist_head = node;
-                    state->flist_tail = node;
-                }
-                debug_printf_quiet ("Allocated a new frame of size 0x%X\n", FRAME_SIZE);
-            } else {
-                // Allocation was not successful.
-                cap_destroy (new_frame);
-            }
+    errval_t error = frame_alloc (&new_frame, FRAME_SIZE, NULL);
+
+    // Map the whole frame once more, to access pages which are not mapped themselves.
+    if (err_is_ok (error)) {
+        error = paging_map_frame_attr (state, &window, FRAME_SIZE, new_frame, FLAGS, NULL, NULL);
+    }
+
+    // A CNode for the mappings of the runs, with a slot for each frame slot.
+    if (err_is_ok (error)) {
+        error = cnode_create (&mapping_cnode, &mappings, FRAME_SLOTS, NULL);
+        if (err_is_fail (error)) {
+            paging_unmap (state, window);
         }
+    }
 
-        if (err_is_ok (error)) {
-            // We have a guarantee now that there's a frame and a
-            // second-level page table with some free capacity.
-            struct capref base_frame = state -> flist_tail -> frame;
-            struct capref cap_l2 = state -> ptables [l1_index] -> lvl2_cap;
+    if (err_is_ok (error)) {
+
+        // Grab some dynamic memory for the descriptor.
+        struct paging_frame* node = slab_alloc ( &(state->frame_mem));
+
+        // The allocation should succeed as the allocator has a refill function.
+        assert (node);
 
-            // Due to semantics we need to create a copy of the frame capability.
-            struct capref copied_frame;
-            slot_alloc (&copied_frame);
-            error = cap_copy (copied_frame, base_frame);
+        // Initialize the node.
+        init_paging_frame (node);
+        node -> frame = new_frame;
+        node -> mapping_cnode = mapping_cnode;
+        node -> mappings = mappings;
+        node -> window = (lvaddr_t) window;
+        node -> index = state -> frame_count;
 
-            // Get the slot number.
-            int slot = state -> flist_tail -> next_free_slot;
+        state -> frames [state -> frame_count] = node;
+        state -> frame_count++;
+        debug_printf_quiet ("Allocated a new frame of size 0x%X\n", FRAME_SIZE);
+
+        // Big domains may need to page out later on.
+        if (state -> frame_count >= SWAP_CONNECT_FRAMES) {
+            paging_swap_connect ();
+        }
+    } else {
+        // Allocation was not successful.
+        // NOTE: If the window couldn't be mapped, its virtual address range is lost.
+        cap_destroy (new_frame);
+    }
+    return error;
+}
 
+/// Mark 'count' slots starting at 'slot' as used.
+static void paging_claim_slots (struct paging_frame* node, uint32_t slot, uint32_t count)
+{
+    for (uint32_t i = slot; i < slot + count; i++) {
+        node -> free_slots [i / 32] &= ~(1u << (i % 32));
+    }
+    node -> free_count -= count;
+}
+
+/// Mark 'count' slots starting at 'slot' as free. The slots must be zeroed.
+static void paging_release_slots (struct paging_state* state, struct paging_frame* node, uint32_t slot, uint32_t count)
+{
+    for (uint32_t i = slot; i < slot + count; i++) {
+        node -> free_slots [i / 32] |= 1u << (i % 32);
+        node -> slots [i].page = 0;
+    }
+    node -> free_count += count;
+    state -> first_free_frame = min (state -> first_free_frame, node -> index);
+}
+
+/**
+ * Unmap a page but keep its contents in the frame slot.
+ * The other pages mapped by the same fault are unmapped as well.
+ */
+static errval_t paging_deactivate_page (struct paging_state* state, struct paging_frame* node, uint32_t slot)
+{
+    uint32_t start = slot - node -> slots [slot].run_offset;
+    uint32_t length = node -> slots [start].run_length;
+    lvaddr_t addr = node -> slots [start].page * PAGE_SIZE;
+    struct capref cap_l2 = state -> ptables [ARM_L1_USER_OFFSET (addr)] -> lvl2_cap;
+
+    struct capref mapping = paging_run_mapping (node, start);
+
+    errval_t error = vnode_unmap (cap_l2, mapping, ARM_L2_USER_OFFSET (addr), length);
+
+    if (err_is_ok (error)) {
+        cap_delete (mapping);
+        for (uint32_t i = start; i < start + length; i++) {
+            paging_slot_entry (state, node, i) -> state = PAGE_INACTIVE;
+        }
+        state -> stats.pages_deactivated += length;
+    }
+    return error;
+}
+
+/**
+ * Write an inactive page to the swap partition. Its frame slot stays claimed for the caller.
+ */
+static errval_t paging_swap_out_page (struct paging_state* state, struct paging_frame* node, uint32_t slot)
+{
+    debug_print_short ("..>..");
+    union page_entry* entry = paging_slot_entry (state, node, slot);
+    assert (entry -> state == PAGE_INACTIVE);
+
+    void* contents = paging_slot_window (node, slot);
+    uint32_t swap_slot = 0;
+    errval_t error = aos_rpc_swap_out (&swap_channel, contents, &swap_slot);
+
+    if (err_is_ok (error)) {
+        entry -> state = PAGE_SWAPPED;
+        entry -> swap_slot = swap_slot;
+        node -> slots [slot].page = 0;
+
+        // The next page in this slot expects zeroed memory.
+        memset (contents, 0, PAGE_SIZE);
+        state -> stats.pages_swapped_out++;
+    }
+    return error;
+}
+
+/**
+ * Free a frame slot with the clock algorithm.
+ *
+ * A mapped page under the clock hand gets a second chance: it is only unmapped.
+ * If it is accessed again, the page fault maps it back cheaply. Otherwise
+ * it is still inactive when the hand comes back, and gets paged out.
+ */
+static errval_t paging_evict_page (struct paging_state* state, struct paging_frame** ret_node, uint32_t* ret_slot)
+{
+    errval_t error = SYS_ERR_OK;
+
+    // After one full round all pages are inactive.
+    uint32_t max_steps = 2 * state -> frame_count * FRAME_SLOTS + 1;
+
+    for (uint32_t step = 0; step < max_steps && err_is_ok (error); step++) {
+        struct paging_frame* node = state -> frames [state -> clock_frame];
+        uint32_t slot = state -> clock_slot;
+
+        // Advance the clock hand.
+        state -> clock_slot++;
+        if (state -> clock_slot >= FRAME_SLOTS) {
+            state -> clock_slot = 0;
+            state -> clock_frame = (state -> clock_frame + 1) % state -> frame_count;
+        }
+
+        if (node -> slots [slot].page == 0) {
+            // Free or claimed by someone else.
+            continue;
+        }
+
+        union page_entry* entry = paging_slot_entry (state, node, slot);
+
+        if (entry -> state == PAGE_MAPPED) {
+            error = paging_deactivate_page (state, node, slot);
+        } else {
+            error = paging_swap_out_page (state, node, slot);
             if (err_is_ok (error)) {
-                // Map the page to the free frame slot.
-                error = vnode_map(cap_l2, copied_frame, l2_index, FLAGS, slot*PAGE_SIZE, 1);
+                *ret_node = node;
+                *ret_slot = slot;
+                return SYS_ERR_OK;
             }
+        }
+    }
+    return err_is_fail (error) ? error : LIB_ERR_FRAME_ALLOC;
+}
 
+/**
+ * Claim up to 'count' consecutive free frame slots for new pages.
+ * Use the free slots of our frames, allocate a new frame, or page out.
+ * When paging out, only a single slot is freed.
+ *
+ * \param count: The number of slots wanted. Set to the number of slots found.
+ */
+static errval_t paging_get_free_slots (struct paging_state* state, struct paging_frame** ret_node, uint32_t* ret_slot, uint32_t* count)
+{
+    errval_t error = SYS_ERR_OK;
 
-            if (err_is_ok (error)) {
+    // Skip the frames which are full.
+    while (state -> first_free_frame < state -> frame_count
+           && state -> frames [state -> first_free_frame] -> free_count == 0)
+    {
+        state -> first_free_frame++;
+    }
 
-                // Now we need to do some additional bookkeeping.
-                state -> flist_tail -> next_free_slot = slot + 1;
-                state -> flist_tail -> pages [slot] = (addr & (PAGE_SIZE-1)); // page aligned address.
+    if (state -> first_free_frame == state -> frame_count) {
+        error = paging_add_frame (state);
 
-                // At this point we would also have to check if the page
-                // is currently paged out to disk.
+        // The RAM server refused. Make room in our own frames instead.
+        if (err_is_fail (error) && swap_connected && state -> frame_count > 0) {
+            debug_printf_quiet ("Out of memory, paging out: %s\n", err_getstring (error));
+            *count = 1;
+            return paging_evict_page (state, ret_node, ret_slot);
+        }
+    }
 
-                if (state -> ptables [l1_index] -> page_exists [l2_index]) {
-                    // Uh-oh, paging in from disk not implemented yet.
-                    USER_PANIC ("Paging in from persistent memory not implemented\n");
-                } else {
-                    state -> ptables [l1_index] -> page_exists [l2_index] = true;
-                }
+    if (err_is_ok (error)) {
+        struct paging_frame* node = state -> frames [state -> first_free_frame];
+
+        // Find the first free slot, and take as many of the following ones as are free.
+        uint32_t word = 0;
+        while (node -> free_slots [word] == 0) {
+            word++;
+        }
+        uint32_t slot = word * 32 + __builtin_ctz (node -> free_slots [word]);
+
+        uint32_t found = 1;
+        while (found < *count && slot + found < FRAME_SLOTS
+               && (node -> free_slots [(slot + found) / 32] & (1u << ((slot + found) % 32))))
+        {
+            found++;
+        }
+
+        paging_claim_slots (node, slot, found);
+        *count = found;
+        *ret_node = node;
+        *ret_slot = slot;
+    }
+    return error;
+}
+
+/**
+ * Map 'count' pages starting at 'addr' to consecutive frame slots with a single invocation.
+ * The pages must be in the same second-level page table.
+ */
+static errval_t paging_map_pages (struct paging_state* state, lvaddr_t addr, struct paging_frame* node, uint32_t slot, uint32_t count)
+{
+    struct ptable_lvl2* table = state -> ptables [ARM_L1_USER_OFFSET (addr)];
+    lvaddr_t page = addr & ~(PAGE_SIZE-1);
+    assert (ARM_L2_USER_OFFSET (page) + count <= ARM_L2_USER_ENTRIES);
+    assert (slot + count <= FRAME_SLOTS);
+
+    // Due to semantics we need to create a copy of the frame capability.
+    struct capref copied_frame = paging_run_mapping (node, slot);
+    errval_t error = cap_copy (copied_frame, node -> frame);
+    bool copied = err_is_ok (error);
 
-            } else {
-                // Copy or mapping failed. Clean up any leftovers.
-                cap_destroy (copied_frame);
+    if (err_is_ok (error)) {
+        // Map the pages to the free frame slots.
+        error = vnode_map(table -> lvl2_cap, copied_frame, ARM_L2_USER_OFFSET (page), FLAGS, slot*PAGE_SIZE, count);
+    }
+
+    if (err_is_ok (error)) {
+
+        // Now we need to do some additional bookkeeping.
+        for (uint32_t i = 0; i < count; i++) {
+            union page_entry* entry = paging_get_entry (state, page + i * PAGE_SIZE);
+            if (entry -> state == PAGE_UNUSED) {
+                table -> used_pages++;
             }
+            entry -> state = PAGE_MAPPED;
+            entry -> frame = node -> index;
+            entry -> frame_slot = slot + i;
+            node -> slots [slot + i].page = page / PAGE_SIZE + i;
+            node -> slots [slot + i].run_offset = i;
+        }
+        node -> slots [slot].run_length = count;
+
+    } else if (copied) {
+        // Mapping failed. Clean up the copy.
+        cap_delete (copied_frame);
+    }
+    return error;
+}
+
+/**
+ * Decide how many pages to map for a fault on a page which is not used yet.
+ *
+ * A fault right after the pages mapped by the last fault is part of a
+ * sequential access. Then twice as many pages are mapped as last time,
+ * otherwise only one. The run ends at the next page which is in use, at
+ * 'end' of the reserved range, or at the end of the second-level page table.
+ */
+static uint32_t paging_fault_around_pages (struct paging_state* state, lvaddr_t page, lvaddr_t end)
+{
+    uint32_t wanted = 1;
+
+    // The previous page may be in the page table before.
+    struct ptable_lvl2* previous = state -> ptables [ARM_L1_USER_OFFSET (page - PAGE_SIZE)];
+    if (previous && previous -> next_fault == page) {
+        wanted = min (2 * previous -> run_pages, FAULT_AROUND_MAX_PAGES);
+    }
+
+    // Remember the decision for the next fault, even if we map fewer pages.
+    struct ptable_lvl2* table = state -> ptables [ARM_L1_USER_OFFSET (page)];
+    table -> run_pages = wanted;
+
+    wanted = min (wanted, ARM_L2_USER_ENTRIES - ARM_L2_USER_OFFSET (page));
+    wanted = min (wanted, (end - page) / PAGE_SIZE);
+
+    uint32_t count = 1;
+    while (count < wanted && table -> pages [ARM_L2_USER_OFFSET (page) + count].state == PAGE_UNUSED) {
+        count++;
+    }
+    return count;
+}
+
+/**
+ * \brief Handle the page fault at address `addr'.
+ *
+ * \param state: The current paging state.
+ * \param range: The reserved range containing `addr'.
+ * \param addr: The address at which the page fault occured.
+ */
+static errval_t paging_handle_pagefault (struct paging_state* state, struct vspace_node* range, lvaddr_t addr)
+{
+    int l1_index = ARM_L1_USER_OFFSET(addr);
+    lvaddr_t page = addr & ~(PAGE_SIZE-1);
+    errval_t error = 0;
+    state -> stats.faults++;
+
+    // Allocate a second-level page table if necessary.
+    if ( ! state -> ptables [l1_index] ) {
+        error = paging_allocate_ptable (state, l1_index);
+    }
+
+    if (err_is_ok (error)) {
+        union page_entry* entry = paging_get_entry (state, addr);
+        struct paging_frame* node = NULL;
+        uint32_t slot = 0;
+        uint32_t count = 1;
+
+        switch (entry -> state) {
+            case PAGE_MAPPED:
+                // Another thread was faster.
+                break;
+            case PAGE_INACTIVE:
+                // The page got a second chance and is still in memory.
+                error = paging_map_pages (state, addr, state -> frames [entry -> frame], entry -> frame_slot, 1);
+                break;
+            case PAGE_SWAPPED:
+                debug_print_short ("..<..");
+                error = paging_get_free_slots (state, &node, &slot, &count);
+                if (err_is_ok (error)) {
+                    error = aos_rpc_swap_in (&swap_channel, entry -> swap_slot, paging_slot_window (node, slot));
+                    if (err_is_ok (error)) {
+                        state -> stats.pages_swapped_in++;
+                        error = paging_map_pages (state, addr, node, slot, 1);
+                    }
+                    if (err_is_fail (error)) {
+                        memset (paging_slot_window (node, slot), 0, PAGE_SIZE);
+                        paging_release_slots (state, node, slot, 1);
+                    }
+                }
+                break;
+            default:
+                // Never touched before. The frame slots are zeroed already.
+                count = paging_fault_around_pages (state, page, range -> base + range -> size);
+                error = paging_get_free_slots (state, &node, &slot, &count);
+                if (err_is_ok (error)) {
+                    error = paging_map_pages (state, page, node, slot, count);
+                    if (err_is_fail (error)) {
+                        paging_release_slots (state, node, slot, count);
+                    }
+                }
+                if (err_is_ok (error)) {
+                    state -> ptables [l1_index] -> next_fault = page + count * PAGE_SIZE;
+                    state -> stats.pages_mapped_ahead += count - 1;
+                }
+                break;
         }
     }
 
     if (err_is_fail(error)) {
-        debug_printf ("Error while handling pagefault!\n");
+        debug_printf ("Error while handling pagefault: %s\n", err_getstring (error));
     }
     return error;
 }
@@ -215,7 +649,8 @@ static errval_t paging_handle_pagefault (struct paging_state* state, lvaddr_t ad
  * \brief Allocate a second-level page table at the specified index.
  * This function only works if the page table to be allocated doesn't exist yet.
  *
- * NOTE: This function might be called recursively in slab allocators.
+ * NOTE: This function is called recursively while it refills the descriptors.
+ * The descriptor comes from the reserve, not from the exception stack, which is too small.
  *
  * \param state: The current paging state.
  * \param l1_index: The index at which the second-level page table is located.
@@ -228,18 +663,40 @@ static errval_t paging_allocate_ptable (struct paging_state* state, uint32_t l1_
 
     errval_t error = SYS_ERR_OK;
 
+    // A refill maps memory, which may need new page tables itself.
+    // Therefore it is done in advance, while some descriptors are left.
+    if (slab_freecount (&state -> ptable_mem) < PTABLE_RESERVE && ! state -> ptable_refilling) {
+        state -> ptable_refilling = true;
+        error = memory_refill (&state -> ptable_mem);
+        state -> ptable_refilling = false;
+
+        if (err_is_fail (error)) {
+            debug_printf ("paging_allocate_ptable: %s\n", err_getstring (error));
+            error = SYS_ERR_OK;
+        }
+
+        // The refill may have needed this very table.
+        if (state -> ptables [l1_index] != NULL) {
+            PRINT_EXIT (error);
+            return error;
+        }
+    }
+
+    struct ptable_lvl2* new_ptable = slab_alloc (&state -> ptable_mem);
+    if (new_ptable == NULL) {
+        error = LIB_ERR_SLAB_ALLOC_FAIL;
+    }
+
     // Ask for a new page second-level table.
     struct capref l2_cap;
-    error = arml2_alloc(&l2_cap);
+    if (err_is_ok (error)) {
+        error = arml2_alloc(&l2_cap);
+    }
 
     if (err_is_ok (error)) {
 
         // Get the predefined capability for the first-level page table.
         struct capref l1_cap = state -> ptable_lvl1_cap;
-        /*struct capref l1_cap = (struct capref) {
-            .cnode = cnode_page,
-            .slot = 0,
-        };*/
 
         // Now map the page table.
         error = vnode_map(l1_cap, l2_cap, l1_index, FLAGS, 0, 1);
@@ -248,38 +705,17 @@ static errval_t paging_allocate_ptable (struct paging_state* state, uint32_t l1_
             // Mapping failed!
             // Free resources and return.
             cap_destroy (l2_cap);
-
-        } else {
-            // If everything succeeded we can add the table to our paging state.
-
-            // Now it's getting messy... We need to allocate some dynamic memory
-            // for the new page table descriptor. If the slab allocator runs
-            // out of space however it will call memory_refill(), which again
-            // might call paging_allocate_ptable!
-
-            // Therefore we initialize the structure on the stack first and only copy
-            // it to dynamic memory when initialization succeeds.
-
-            struct ptable_lvl2 stack_allocated_descriptor;
-            init_ptable_lvl2 (&stack_allocated_descriptor);
-
-            stack_allocated_descriptor.lvl2_cap = l2_cap;
-            state -> ptables [l1_index] = &stack_allocated_descriptor;
-
-            // Let's do the allocation.
-            struct ptable_lvl2* new_ptable = NULL;
-            new_ptable = (struct ptable_lvl2*) slab_alloc ( &(state->ptable_mem) );
-
-            // As we have a refill function for the allocator it should not run out of space.
-            assert (new_ptable != NULL);
-
-            // Copy over our stack-allocated descriptor.
-            memcpy (new_ptable, &stack_allocated_descriptor, sizeof (struct ptable_lvl2));
-
-            // Finally, we need to update the pointer.
-            state -> ptables [l1_index] = new_ptable;
         }
     }
+
+    if (err_is_ok (error)) {
+        // If everything succeeded we can add the table to our paging state.
+        init_ptable_lvl2 (new_ptable);
+        new_ptable -> lvl2_cap = l2_cap;
+        state -> ptables [l1_index] = new_ptable;
+    } else if (new_ptable) {
+        slab_free (&state -> ptable_mem, new_ptable);
+    }
     PRINT_EXIT (error);
     return error;
 }
@@ -309,26 +745,31 @@ static errval_t paging_map_eagerly (struct paging_state* state, lvaddr_t base_ad
         error = paging_map_fixed_attr (state, base_addr, new_frame, requested_size, FLAGS);
     }
 
-    if (err_is_fail (error)) {
-        // Mapping or allocation failed!
-        // Return frame cap and report error.
-        cap_destroy (new_frame);
-    }
+    // The mapping keeps a copy of the frame, which frees the memory when unmapped.
+    // If mapping or allocation failed, this returns the frame.
+    cap_destroy (new_frame);
     PRINT_EXIT (error);
     return error;
 }
 
 /**
  * Refill memory for slab allocators.
- * By default always refills with SLAB_REFILL_PAGE_COUNT pages.
+ * By default always refills with enough pages for SLAB_REFILL_BLOCK_COUNT blocks.
  */
 static errval_t memory_refill (struct slab_alloc* allocator)
+{
+    size_t bytes = SLAB_STATIC_SIZE (SLAB_REFILL_BLOCK_COUNT, allocator -> blocksize);
+    return memory_refill_pages (allocator, (bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+}
+
+/**
+ * Refill a slab allocator with 'pages' pages of eagerly mapped memory.
+ */
+static errval_t memory_refill_pages (struct slab_alloc* allocator, size_t pages)
 {
     PRINT_ENTRY;
     debug_printf_quiet ("memory_refill on state %p\n", get_current_paging_state());
 
-    // Initialize constants.
-    size_t pages = SLAB_REFILL_PAGE_COUNT;
     size_t bytes = pages * PAGE_SIZE;
 
     // Need to reserve virtual space.
@@ -362,20 +803,35 @@ errval_t paging_init_state (struct paging_state *st, lvaddr_t start_vaddr, struc
     // Make sure we have zeroed out memory.
     memset (st, 0, sizeof (struct paging_state));
 
-    // Initialize virtual address space.
-    st -> heap_begin = start_vaddr;
-    st -> heap_end = start_vaddr;
-
     // Initialize ptable struct.
     st -> ptable_lvl1_cap = pdir;
 
     // Initialize dynamic memory for management.
-    slab_init (&(st->ptable_mem), sizeof (struct ptable_lvl2), memory_refill);
-    slab_init (&(st->frame_mem), sizeof (struct frame_list), memory_refill);
+    // The page table descriptors are refilled by paging_allocate_ptable.
+    slab_init (&(st->ptable_mem), sizeof (struct ptable_lvl2), NULL);
+    slab_init (&(st->frame_mem), sizeof (struct paging_frame), memory_refill);
 
     slab_init (&(st->exception_stack_mem), EXCEPTION_STACK_SIZE, memory_refill);
 
+    // The vspace nodes are refilled by paging_node_alloc.
+    slab_init (&(st->vspace_mem), sizeof (struct vspace_node), NULL);
+    if (st == &current) {
+        slab_grow (&(st->vspace_mem), vspace_bootstrap_nodes, sizeof (vspace_bootstrap_nodes));
+        slab_grow (&(st->ptable_mem), ptable_bootstrap_descriptors, sizeof (ptable_bootstrap_descriptors));
+    }
+
+    // Initialize virtual address space.
     errval_t error = SYS_ERR_OK;
+    struct vspace_node* range = paging_node_alloc (st);
+
+    if (range) {
+        range -> base = start_vaddr;
+        range -> size = VADDR_LIMIT - start_vaddr;
+        st -> free_ranges = range;
+    } else {
+        error = LIB_ERR_SLAB_ALLOC_FAIL;
+    }
+
     PRINT_EXIT (error);
     return error;
 }
@@ -412,6 +868,16 @@ errval_t paging_init(void)
 }
 
 
+void paging_disable_swap(void)
+{
+    swap_disabled = true;
+}
+
+void paging_get_stats(struct paging_state *st, struct paging_stats *stats)
+{
+    *stats = st -> stats;
+}
+
 /**
  * \brief Set up exception handler and exception stack for thread t.
  */
@@ -523,9 +989,90 @@ errval_t paging_region_map(struct paging_region *pr, size_t req_size,
  */
 errval_t paging_region_unmap(struct paging_region *pr, lvaddr_t base, size_t bytes)
 {
-    // XXX: should free up some space in paging region, however need to track
-    //      holes for non-trivial case
-    return SYS_ERR_OK;
+    // NOTE: The region itself is a simple bump allocator, so the addresses are not
+    // handed out again. The range stays reserved, such that an access is still valid.
+    struct paging_state* st = get_current_paging_state();
+    struct vspace_node* range = paging_find_range (st -> reserved_ranges, pr -> base_addr);
+
+    if (range == NULL) {
+        return LIB_ERR_VSPACE_VREGION_NOT_FOUND;
+    }
+    return paging_unmap_mappings (st, range, base, base + bytes);
+}
+
+/**
+ * Reserve `bytes' of virtual address space at an `alignment' boundary.
+ * Takes the first free range which is large enough.
+ */
+static errval_t paging_alloc_range (struct paging_state* st, void** buf, size_t bytes, lvaddr_t alignment)
+{
+    debug_printf_quiet ("paging_alloc: state %p, bytes %X...\n", st, bytes);
+    assert ((bytes & (PAGE_SIZE-1)) == 0);
+
+    // Get the nodes first, as a refill changes the lists.
+    struct vspace_node* reserved = paging_node_alloc (st);
+    struct vspace_node* padding = paging_node_alloc (st);
+    errval_t error = (reserved && padding) ? SYS_ERR_OK : LIB_ERR_SLAB_ALLOC_FAIL;
+
+    struct vspace_node** link = &st -> free_ranges;
+    lvaddr_t base = 0;
+
+    while (err_is_ok (error) && *link) {
+        lvaddr_t end = (*link) -> base + (*link) -> size;
+        base = ((*link) -> base + alignment - 1) & ~(alignment - 1);
+        if (base < end && end - base >= bytes) {
+            break;
+        }
+        link = &((*link) -> next);
+    }
+
+    if (err_is_ok (error) && *link == NULL) {
+        error = LIB_ERR_VSPACE_NO_SPACE;
+    }
+
+    if (err_is_ok (error)) {
+        struct vspace_node* range = *link;
+
+        // Keep the addresses skipped for alignment as a separate free range.
+        if (base > range -> base) {
+            padding -> base = range -> base;
+            padding -> size = base - range -> base;
+            padding -> next = range;
+            *link = padding;
+            link = &(padding -> next);
+            padding = NULL;
+        }
+
+        // The rest of the range stays free.
+        range -> size = range -> base + range -> size - (base + bytes);
+        range -> base = base + bytes;
+        if (range -> size == 0) {
+            *link = range -> next;
+            slab_free (&st -> vspace_mem, range);
+        }
+
+        // Insert the new range into the sorted list of reserved ranges.
+        reserved -> base = base;
+        reserved -> size = bytes;
+        link = &st -> reserved_ranges;
+        while (*link && (*link) -> base < base) {
+            link = &((*link) -> next);
+        }
+        reserved -> next = *link;
+        *link = reserved;
+        reserved = NULL;
+
+        *buf = (void*) base;
+        debug_printf_quiet ("paging_alloc: state %p, bytes %X, start %p.\n", st, bytes, *buf);
+    }
+
+    if (reserved) {
+        slab_free (&st -> vspace_mem, reserved);
+    }
+    if (padding) {
+        slab_free (&st -> vspace_mem, padding);
+    }
+    return error;
 }
 
 /**
@@ -534,14 +1081,38 @@ errval_t paging_region_unmap(struct paging_region *pr, lvaddr_t base, size_t byt
  */
 errval_t paging_alloc(struct paging_state *st, void **buf, size_t bytes)
 {
-    debug_printf_quiet ("paging_alloc: state %p, bytes %X...\n", st, bytes);
- //   assert (st == &current);
-    assert ((bytes & (PAGE_SIZE-1)) == 0);
+    return paging_alloc_range (st, buf, bytes, PAGE_SIZE);
+}
 
-    *buf = (void*)  st -> heap_end;
-    st -> heap_end += bytes;
-    debug_printf_quiet ("paging_alloc: state %p, bytes %X, start %p.\n", st, bytes, *buf);
-    return SYS_ERR_OK;
+/**
+ * Reserve virtual address space aligned to the largest mapping size
+ * which 'bytes' can make use of. Frames from the RAM server are naturally
+ * aligned, so the kernel can then map them with sections or large pages.
+ */
+static errval_t paging_alloc_aligned (struct paging_state* st, void** buf, size_t bytes)
+{
+    lvaddr_t alignment = PAGE_SIZE;
+    if (bytes >= SECTION_SIZE) {
+        alignment = SECTION_SIZE;
+    } else if (bytes >= LARGE_PAGE_SIZE) {
+        alignment = LARGE_PAGE_SIZE;
+    }
+    return paging_alloc_range (st, buf, bytes, alignment);
+}
+
+errval_t paging_alloc_pinned(struct paging_state *st, void **buf, size_t bytes)
+{
+    bytes = ROUND_UP (bytes, PAGE_SIZE);
+    errval_t error = paging_alloc_aligned (st, buf, bytes);
+
+    // Eager mappings are not in the frame slots, so the clock never evicts them.
+    if (err_is_ok (error)) {
+        error = paging_map_eagerly (st, (lvaddr_t) *buf, bytes / PAGE_SIZE);
+        if (err_is_fail (error)) {
+            paging_unmap (st, *buf);
+        }
+    }
+    return error;
 }
 
 /**
@@ -554,7 +1125,7 @@ errval_t paging_map_frame_attr(struct paging_state *st, void **buf,
 {
     PRINT_ENTRY;
     debug_printf_quiet ("paging_map_frame_attr: state %p\n", st);
-    errval_t err = paging_alloc(st, buf, bytes);
+    errval_t err = paging_alloc_aligned(st, buf, bytes);
     if (err_is_fail(err)) {
         return err;
     }
@@ -565,8 +1136,63 @@ errval_t paging_map_frame_attr(struct paging_state *st, void **buf,
 }
 
 
+/**
+ * Map 'count' entries of a copy of 'frame' at 'vaddr', as a capability
+ * can only be mapped once. Sections are mapped into the first-level page
+ * table, where the kernel addresses them by the 1MB index of 'vaddr'.
+ * Otherwise the second-level page table must exist.
+ *
+ * If 'range' is not NULL, the mapping is recorded there with the
+ * node 'mapping' for paging_unmap. The node is freed on failure.
+ */
+static errval_t paging_map_copy (struct paging_state* state, struct vspace_node* range, struct vspace_node* mapping,
+                                 lvaddr_t vaddr, bool is_section, struct capref frame,
+                                 uint32_t frame_offset, uint32_t count, int flags)
+{
+    struct capref copied_frame;
+    errval_t error = slot_alloc (&copied_frame);
+
+    if (err_is_ok (error)) {
+        error = cap_copy (copied_frame, frame);
+    }
+    if (err_is_ok (error)) {
+        if (is_section) {
+            error = vnode_map (state -> ptable_lvl1_cap, copied_frame, vaddr / SECTION_SIZE, flags, frame_offset, count);
+        } else {
+            struct ptable_lvl2* table = state -> ptables [ARM_L1_USER_OFFSET (vaddr)];
+            error = vnode_map (table -> lvl2_cap, copied_frame, ARM_L2_USER_OFFSET (vaddr), flags, frame_offset, count);
+            if (err_is_ok (error)) {
+                table -> mapped_entries += count;
+            }
+        }
+    }
+
+    if (err_is_ok (error)) {
+        if (range) {
+            mapping -> base = vaddr;
+            mapping -> size = count * (is_section ? SECTION_SIZE : PAGE_SIZE);
+            mapping -> frame = copied_frame;
+            mapping -> is_section = is_section;
+            mapping -> next = range -> mappings;
+            range -> mappings = mapping;
+        }
+    } else {
+        cap_destroy (copied_frame);
+        if (mapping) {
+            slab_free (&state -> vspace_mem, mapping);
+        }
+    }
+    return error;
+}
+
 /**
  * \brief map a user provided frame at user provided VA.
+ *
+ * Uses 1MB sections where the addresses are aligned and no
+ * second-level page table exists yet. Otherwise the kernel uses
+ * 64KB large pages for all aligned parts of the mapping.
+ *
+ * Only mappings in ranges reserved with paging_alloc can be unmapped again.
  */
 errval_t paging_map_fixed_attr(struct paging_state *state, lvaddr_t vaddr,
         struct capref frame, size_t bytes, int flags)
@@ -575,7 +1201,7 @@ errval_t paging_map_fixed_attr(struct paging_state *state, lvaddr_t vaddr,
     // keep this in mind when designing your self-paging system.
 
     PRINT_ENTRY;
-    debug_printf_quiet ("paging_map_fixed_attr: state %p (%p -> %p), addr %X\n", state, state->heap_begin, state->heap_end, vaddr);
+    debug_printf_quiet ("paging_map_fixed_attr: state %p, addr %X\n", state, vaddr);
 
     // Enforce page alignment restriction.
     assert ((vaddr & (PAGE_SIZE-1)) == 0);
@@ -591,50 +1217,71 @@ errval_t paging_map_fixed_attr(struct paging_state *state, lvaddr_t vaddr,
     uint32_t remaining_pages = page_count;
     lvaddr_t mapped_addr = vaddr;
 
+    // The physical address decides whether sections can be used.
+    struct frame_identity identity;
+    bool use_sections = err_is_ok (invoke_frame_identify (frame, &identity));
+
+    struct vspace_node* range = paging_find_range (state -> reserved_ranges, vaddr);
+
     while (remaining_pages > 0 && err_is_ok (error)) {
 
         // Now map all pages to the correct second-level page table.
         int l1_index = ARM_L1_USER_OFFSET (mapped_addr);
         int l2_index = ARM_L2_USER_OFFSET (mapped_addr);
 
+        // Offset at which a frame should be mapped. Usually zero, but
+        // when multiple page tables are needed it may be different.
+        uint32_t frame_offset = (page_count - remaining_pages) * PAGE_SIZE;
+
+        // Get the node to record the mapping first. A refill may
+        // allocate the second-level page table for this address.
+        struct vspace_node* mapping = NULL;
+        if (range) {
+            mapping = paging_node_alloc (state);
+            if (mapping == NULL) {
+                error = LIB_ERR_SLAB_ALLOC_FAIL;
+                break;
+            }
+        }
+
+        if (use_sections
+            && ! state->ptables [l1_index]
+            && remaining_pages * PAGE_SIZE >= SECTION_SIZE
+            && (mapped_addr & (SECTION_SIZE-1)) == 0
+            && ((identity.base + frame_offset) & (SECTION_SIZE-1)) == 0)
+        {
+            // Map as many sections as fit until the next second-level page table.
+            uint32_t sections = min (remaining_pages * PAGE_SIZE / SECTION_SIZE,
+                                     SECTIONS_PER_L2 - l2_index * PAGE_SIZE / SECTION_SIZE);
+
+            error = paging_map_copy (state, range, mapping, mapped_addr, true, frame, frame_offset, sections, flags);
+
+            if (err_is_ok (error)) {
+                remaining_pages -= sections * SECTION_SIZE / PAGE_SIZE;
+                mapped_addr += sections * SECTION_SIZE;
+            }
+            continue;
+        }
+
         // Allocate a second-level page table if necessary.
         if ( ! state->ptables [l1_index] ) {
             error = paging_allocate_ptable (state, l1_index);
         }
 
-        // Offset at which a frame should be mapped. Usually zero, but
-        // when multiple page tables are needed it may be different.
-        uint32_t frame_offset = (page_count - remaining_pages) * PAGE_SIZE;
-
         if (err_is_ok (error)) {
 
-            // Get the capability for the second-level page table.
-            struct capref cap_l2 = state -> ptables [l1_index] -> lvl2_cap;
-
-            // Figure out how many page table entries are still free.
-            uint32_t free_slots = ARM_L2_USER_ENTRIES - l2_index;
+            // The region may span over multiple page tables.
+            // Map as much as fits into the current one.
+            uint32_t count = min (remaining_pages, ARM_L2_USER_ENTRIES - l2_index);
 
-            if (free_slots <= remaining_pages) {
-                debug_printf_quiet ("paging_map_fixed_attr: page region spans over multiple ptables\n");
-                // ouch, need to allocate another page table...
-                // Map at least part of it.
-                struct capref copied_frame;
-                slot_alloc (&copied_frame);
-                error = cap_copy (copied_frame, frame);
+            error = paging_map_copy (state, range, mapping, mapped_addr, false, frame, frame_offset, count, flags);
 
-                if (err_is_ok (error)) {
-                    error = vnode_map (cap_l2, copied_frame, l2_index, flags, frame_offset, free_slots);
-                    remaining_pages -= free_slots;
-                    mapped_addr += free_slots * PAGE_SIZE;
-                } else {
-                    cap_destroy (copied_frame);
-                }
-            } else {
-                // Everything fits into the current page table.
-                // Map it to the specified addresses.
-                error = vnode_map (cap_l2, frame, l2_index, flags, frame_offset, remaining_pages);
-                remaining_pages = 0;
+            if (err_is_ok (error)) {
+                remaining_pages -= count;
+                mapped_addr += count * PAGE_SIZE;
             }
+        } else if (mapping) {
+            slab_free (&state -> vspace_mem, mapping);
         }
     }
     PRINT_EXIT (error);
@@ -642,12 +1289,262 @@ errval_t paging_map_fixed_attr(struct paging_state *state, lvaddr_t vaddr,
 }
 
 /**
- * \brief unmap a user provided frame, and return the VA of the mapped
- *        frame in `buf`.
- * NOTE: this function is currently here to make libbarrelfish compile. As
- * noted on paging_region_unmap we ignore unmap requests right now.
+ * Unmap the frames which were mapped into 'range' between 'start' and 'end'.
+ * Mappings which are only partially within the bounds are kept.
+ */
+static errval_t paging_unmap_mappings (struct paging_state* state, struct vspace_node* range, lvaddr_t start, lvaddr_t end)
+{
+    errval_t error = SYS_ERR_OK;
+    struct vspace_node** link = &range -> mappings;
+
+    while (*link && err_is_ok (error)) {
+        struct vspace_node* mapping = *link;
+
+        if (mapping -> base < start || end < mapping -> base + mapping -> size) {
+            link = &(mapping -> next);
+            continue;
+        }
+
+        if (mapping -> is_section) {
+            error = vnode_unmap (state -> ptable_lvl1_cap, mapping -> frame,
+                                 mapping -> base / SECTION_SIZE, mapping -> size / SECTION_SIZE);
+        } else {
+            struct ptable_lvl2* table = state -> ptables [ARM_L1_USER_OFFSET (mapping -> base)];
+            error = vnode_unmap (table -> lvl2_cap, mapping -> frame,
+                                 ARM_L2_USER_OFFSET (mapping -> base), mapping -> size / PAGE_SIZE);
+            if (err_is_ok (error)) {
+                table -> mapped_entries -= mapping -> size / PAGE_SIZE;
+            }
+        }
+
+        if (err_is_ok (error)) {
+            cap_destroy (mapping -> frame);
+            *link = mapping -> next;
+            slab_free (&state -> vspace_mem, mapping);
+        }
+    }
+    return error;
+}
+
+/**
+ * Forget the pages between 'start' and 'end' which were mapped on a page fault.
+ * Their frame slots are zeroed and can be used for other pages.
+ * The fault handler never maps pages across the end of a reserved range,
+ * so unmapping them doesn't affect any pages outside.
+ */
+static errval_t paging_release_pages (struct paging_state* state, lvaddr_t start, lvaddr_t end)
+{
+    errval_t error = SYS_ERR_OK;
+
+    for (lvaddr_t page = start; page < end && err_is_ok (error); page += PAGE_SIZE) {
+
+        if ( ! state -> ptables [ARM_L1_USER_OFFSET (page)]) {
+            // Skip to the next second-level page table.
+            page = (page | (ARM_L2_USER_ENTRIES * PAGE_SIZE - 1)) + 1 - PAGE_SIZE;
+            continue;
+        }
+
+        struct ptable_lvl2* table = state -> ptables [ARM_L1_USER_OFFSET (page)];
+        union page_entry* entry = paging_get_entry (state, page);
+
+        if (entry -> state == PAGE_MAPPED) {
+            error = paging_deactivate_page (state, state -> frames [entry -> frame], entry -> frame_slot);
+        }
+
+        if (err_is_ok (error) && entry -> state == PAGE_INACTIVE) {
+            struct paging_frame* node = state -> frames [entry -> frame];
+            memset (paging_slot_window (node, entry -> frame_slot), 0, PAGE_SIZE);
+            paging_release_slots (state, node, entry -> frame_slot, 1);
+        }
+
+        // If the driver doesn't take the swap slot back, it is lost until we exit.
+        if (entry -> state == PAGE_SWAPPED && swap_connected) {
+            aos_rpc_swap_free (&swap_channel, entry -> swap_slot);
+        }
+
+        if (err_is_ok (error) && entry -> state != PAGE_UNUSED) {
+            memset (entry, 0, sizeof (union page_entry));
+            table -> used_pages--;
+        }
+    }
+    return error;
+}
+
+/**
+ * Free the second-level page tables between 'start' and 'end' which are not used any more.
+ */
+static void paging_free_ptables (struct paging_state* state, lvaddr_t start, lvaddr_t end)
+{
+    for (uint32_t l1_index = ARM_L1_USER_OFFSET (start); l1_index <= ARM_L1_USER_OFFSET (end - 1); l1_index++) {
+        struct ptable_lvl2* table = state -> ptables [l1_index];
+        bool is_used = table == NULL || table -> mapped_entries > 0 || table -> used_pages > 0;
+
+        if ( ! is_used && err_is_ok (vnode_unmap (state -> ptable_lvl1_cap, table -> lvl2_cap, l1_index, 1))) {
+            cap_destroy (table -> lvl2_cap);
+            state -> ptables [l1_index] = NULL;
+            slab_free (&state -> ptable_mem, table);
+        }
+    }
+}
+
+/**
+ * \brief unmap everything in a range reserved with paging_alloc and free the range.
  */
 errval_t paging_unmap(struct paging_state *st, const void *region)
 {
+    PRINT_ENTRY;
+    lvaddr_t base = (lvaddr_t) region;
+
+    struct vspace_node** link = &st -> reserved_ranges;
+    while (*link && (*link) -> base != base) {
+        link = &((*link) -> next);
+    }
+
+    if (*link == NULL) {
+        return LIB_ERR_VSPACE_VREGION_NOT_FOUND;
+    }
+
+    struct vspace_node* range = *link;
+    lvaddr_t end = range -> base + range -> size;
+
+    errval_t error = paging_unmap_mappings (st, range, base, end);
+
+    if (err_is_ok (error)) {
+        error = paging_release_pages (st, base, end);
+    }
+
+    if (err_is_ok (error)) {
+        *link = range -> next;
+        paging_free_ptables (st, base, end);
+        paging_free_range (st, range);
+    }
+
+    PRINT_EXIT (error);
+    return error;
+}
+
+/**
+ * Unmap an unused frame and queue it for paging_return_frames. The last
+ * frame takes its index, so the entries of the pages in that frame are updated.
+ */
+static errval_t paging_remove_frame (struct paging_state* state, struct paging_frame* node)
+{
+    assert (node -> free_count == FRAME_SLOTS);
+    assert (state -> returned_count < PAGING_RETURN_FRAMES);
+    debug_print_short ("..-..");
+
+    // Page faults while unmapping must not use the frame.
+    paging_claim_slots (node, 0, FRAME_SLOTS);
+
+    errval_t error = paging_unmap (state, (void*) node -> window);
+    if (err_is_fail (error)) {
+        paging_release_slots (state, node, 0, FRAME_SLOTS);
+        return error;
+    }
+
+    state -> returned_frames [state -> returned_count] = node -> frame;
+    state -> returned_count++;
+
+    // The runs are all unmapped, so the CNode is empty.
+    cap_destroy (node -> mapping_cnode);
+
+    uint32_t index = node -> index;
+    uint32_t last = state -> frame_count - 1;
+    struct paging_frame* moved = state -> frames [last];
+
+    if (moved != node) {
+        moved -> index = index;
+        state -> frames [index] = moved;
+
+        for (uint32_t slot = 0; slot < FRAME_SLOTS; slot++) {
+            if (moved -> slots [slot].page != 0) {
+                paging_slot_entry (state, moved, slot) -> frame = index;
+            }
+        }
+    }
+    if (state -> clock_frame == last) {
+        state -> clock_frame = index;
+    }
+    state -> frames [last] = NULL;
+    state -> frame_count--;
+
+    if (state -> clock_frame >= state -> frame_count) {
+        state -> clock_frame = 0;
+        state -> clock_slot = 0;
+    }
+    state -> first_free_frame = min (state -> first_free_frame, index);
+    slab_free (&state -> frame_mem, node);
     return SYS_ERR_OK;
 }
+
+/**
+ * Queue the frames without used slots for the RAM server, except for SPARE_FRAMES.
+ * Going backwards, a frame which moves into the place of a removed one has been checked already.
+ * Frames which don't fit into the queue stay until the next release.
+ */
+static errval_t paging_trim_frames (struct paging_state* state)
+{
+    errval_t error = SYS_ERR_OK;
+    uint32_t spare = 0;
+
+    for (uint32_t index = state -> frame_count; index > 0 && err_is_ok (error) && state -> returned_count < PAGING_RETURN_FRAMES; index--) {
+        struct paging_frame* node = state -> frames [index - 1];
+
+        if (node -> free_count < FRAME_SLOTS) {
+            continue;
+        } else if (spare < SPARE_FRAMES) {
+            spare++;
+        } else {
+            error = paging_remove_frame (state, node);
+        }
+    }
+    return error;
+}
+
+/**
+ * \brief Give the pages between `base` and `base + bytes` back which were mapped on demand.
+ */
+errval_t paging_release(struct paging_state *st, void *base, size_t bytes)
+{
+    PRINT_ENTRY;
+    lvaddr_t start = ROUND_UP ((lvaddr_t) base, PAGE_SIZE);
+    lvaddr_t end = ROUND_DOWN ((lvaddr_t) base + bytes, PAGE_SIZE);
+    errval_t error = SYS_ERR_OK;
+
+    // The area may span several adjacent ranges.
+    for (struct vspace_node* range = st -> reserved_ranges; range && range -> base < end && err_is_ok (error); range = range -> next) {
+        lvaddr_t first = range -> base < start ? start : range -> base;
+        lvaddr_t last = min (end, range -> base + range -> size);
+
+        if (first < last) {
+            error = paging_release_pages (st, first, last);
+            if (err_is_ok (error)) {
+                paging_free_ptables (st, first, last);
+            }
+        }
+    }
+
+    if (err_is_ok (error)) {
+        error = paging_trim_frames (st);
+    }
+
+    PRINT_EXIT (error);
+    return error;
+}
+
+void paging_return_frames(struct paging_state *st)
+{
+    while (st -> returned_count > 0) {
+        st -> returned_count--;
+        struct capref frame = st -> returned_frames [st -> returned_count];
+
+        // Without its window the frame is useless, even if the RAM server doesn't take it back.
+        errval_t error = ram_free (frame);
+        if (err_is_ok (error)) {
+            st -> stats.frames_returned++;
+        } else {
+            debug_printf_quiet ("paging_return_frames: %s\n", err_getstring (error));
+            cap_destroy (frame);
+        }
+    }
+}
@@ -201,6 +201,7 @@ void ram_alloc_init(void)
     ram_alloc_state->mem_connect_err  = 0;
     thread_mutex_init(&ram_alloc_state->ram_alloc_lock);
     ram_alloc_state->ram_alloc_func   = NULL;
+    ram_alloc_state->ram_free_func    = NULL;
     ram_alloc_state->default_minbase  = 0;
     ram_alloc_state->default_maxlimit = 0;
     ram_alloc_state->base_capnum      = 0;
@@ -227,3 +228,30 @@ errval_t ram_alloc_set(ram_alloc_func_t local_allocator)
     ram_alloc_state->ram_alloc_func = ram_alloc_remote;
     return SYS_ERR_OK;
 }
+
+/**
+ * \brief Give memory back to the RAM allocator
+ *
+ * \param cap RAM or frame capability handed out by ram_alloc, or a part of it.
+ *            All copies of it are deleted, and the memory must not be mapped.
+ *
+ * Fails if no free function is set, in which case the caller keeps the cap.
+ */
+errval_t ram_free(struct capref cap)
+{
+    struct ram_alloc_state *ram_alloc_state = get_ram_alloc_state();
+    if (ram_alloc_state->ram_free_func == NULL) {
+        return LIB_ERR_NOT_IMPLEMENTED;
+    }
+    return ram_alloc_state->ram_free_func(cap);
+}
+
+/**
+ * \brief Set the function which gives memory back to the RAM allocator
+ */
+errval_t ram_free_set(ram_free_func_t free_func)
+{
+    struct ram_alloc_state *ram_alloc_state = get_ram_alloc_state();
+    ram_alloc_state->ram_free_func = free_func;
+    return SYS_ERR_OK;
+}
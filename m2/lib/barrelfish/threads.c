@@ -347,7 +347,7 @@ static void free_thread(struct thread *thread)
     ldt_free_segment(thread->thread_seg_selector);
 #endif
 
-    free(thread->stack);
+    paging_unmap(get_current_paging_state(), thread->stack);
     if (thread->tls_dtv != NULL) {
         free(thread->tls_dtv);
     }
@@ -371,10 +371,13 @@ static void free_thread(struct thread *thread)
 struct thread *thread_create_unrunnable(thread_func_t start_func, void *arg,
                                         size_t stacksize)
 {
-    // allocate stack
+    // allocate stack outside the heap, so that it is never paged out:
+    // a page fault which pages in may run on any thread
     assert((stacksize % sizeof(uintptr_t)) == 0);
-    void *stack = malloc(stacksize);
-    if (stack == NULL) {
+    void *stack = NULL;
+    errval_t err = paging_alloc_pinned(get_current_paging_state(), &stack,
+                                       stacksize);
+    if (err_is_fail(err)) {
         return NULL;
     }
 
@@ -386,7 +389,7 @@ struct thread *thread_create_unrunnable(thread_func_t start_func, void *arg,
     release_spinlock(&thread_slabs_spinlock);
     // thread_mutex_unlock(&thread_slabs_mutex);
     if (space == NULL) {
-        free(stack);
+        paging_unmap(get_current_paging_state(), stack);
         return NULL;
     }
 
@@ -134,6 +134,24 @@ bool has_copies(struct cte *cte)
     return false;
 }
 
+/// Count the other copies of #cte
+size_t count_copies(struct cte *cte)
+{
+    assert(cte != NULL);
+
+    // Copies are adjacent in the ordering.
+    size_t count = 0;
+    for (struct cte *next = mdb_successor(cte);
+         next && is_copy(&next->cap, &cte->cap); next = mdb_successor(next)) {
+        count++;
+    }
+    for (struct cte *prev = mdb_predecessor(cte);
+         prev && is_copy(&prev->cap, &cte->cap); prev = mdb_predecessor(prev)) {
+        count++;
+    }
+    return count;
+}
+
 /**
  * \brief Returns a copy of the #cap
  */
@@ -769,6 +769,27 @@ errval_t mm_free(struct mm *mm, struct capref cap, genpaddr_t base,
     return SYS_ERR_OK;
 }
 
+/**
+ * \brief Check if a region is allocated, such that mm_free() would accept it
+ *
+ * \param mm Memory manager instance
+ * \param base Physical base address of region
+ * \param sizebits Size of region
+ */
+bool mm_is_allocated(struct mm *mm, genpaddr_t base, uint8_t sizebits)
+{
+    genpaddr_t nodebase;
+    uint8_t nodesizebits;
+    struct mmnode *node = NULL;
+
+    errval_t err = find_node(mm, true, sizebits, base, base + UNBITS_GENPA(sizebits),
+                             mm->root, mm->base, mm->sizebits, &nodebase,
+                             &nodesizebits, &node);
+
+    return err_is_ok(err) && node != NULL && node->type == NodeType_Allocated
+           && nodesizebits >= sizebits && nodebase <= base;
+}
+
 /**
  * \brief Fills an array with metadata for all free regions
  *
@@ -16,6 +16,9 @@ morecore_alloc_func_t sys_morecore_alloc;
 typedef void (*morecore_free_func_t)(void *base, size_t bytes);
 morecore_free_func_t sys_morecore_free;
 
+typedef void (*morecore_flush_func_t)(void);
+morecore_flush_func_t sys_morecore_flush;
+
 int system(const char *cmd)
 {
 	return -1;
@@ -173,10 +173,14 @@ void free(void *ap)
     assert((lvaddr_t)ap >= base && (lvaddr_t)ap < limit);
 #endif
 
+    Header *freed = (Header *)ap - 1;
+
     MALLOC_LOCK;
+    unsigned freed_units = freed->s.size;
     __free_locked(ap);
-    lesscore();
+    lesscore(freed, freed_units);
     MALLOC_UNLOCK;
+    lesscore_unlocked();
 }
 
 #ifdef CONFIG_MALLOC_DEBUG_INTERNAL
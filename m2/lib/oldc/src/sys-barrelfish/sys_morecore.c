@@ -22,9 +22,57 @@ Header *get_malloc_freep(void);
 
 typedef void *(*morecore_alloc_func_t)(size_t bytes, size_t *retbytes);
 typedef void (*morecore_free_func_t)(void *base, size_t bytes);
+typedef void (*morecore_flush_func_t)(void);
 
 morecore_alloc_func_t sys_morecore_alloc;
 morecore_free_func_t sys_morecore_free;
+morecore_flush_func_t sys_morecore_flush;
+
+#if defined(__arm__)
+/*
+ * Hysteresis for giving memory back: A free block is only trimmed once it
+ * has grown to MORECORE_TRIM_THRESHOLD bytes, and its last MORECORE_TRIM_PAD
+ * bytes stay mapped. malloc() allocates from the end of a block, so small
+ * allocations after a trim don't fault in the pages one by one.
+ *
+ * A large free block has been trimmed already, and only a freed chunk
+ * merged into it brings mapped pages along. So only the chunk is trimmed,
+ * together with the pad of a large lower neighbour and the header of an
+ * upper one. A small neighbour was never trimmed and is trimmed as a whole.
+ */
+#ifndef MORECORE_TRIM_THRESHOLD
+#define MORECORE_TRIM_THRESHOLD (1024 * 1024)
+#endif
+#ifndef MORECORE_TRIM_PAD
+#define MORECORE_TRIM_PAD (128 * 1024)
+#endif
+
+/// Give the pages of the free block 'p' back which 'freed' brought along, keeping its header.
+static void trim_block(Header *p, Header *freed, unsigned freed_units)
+{
+    size_t bytes = p->s.size * sizeof(Header);
+    if (freed < p || freed >= p + p->s.size
+        || bytes < MORECORE_TRIM_THRESHOLD || bytes <= MORECORE_TRIM_PAD + sizeof(Header)) {
+        return;
+    }
+
+    char *start = (char *)(p + 1);
+    char *end = (char *)p + bytes - MORECORE_TRIM_PAD;
+
+    size_t lower = (char *)freed - (char *)p;
+    if (lower >= MORECORE_TRIM_THRESHOLD && lower > MORECORE_TRIM_PAD + sizeof(Header)) {
+        start = (char *)freed - MORECORE_TRIM_PAD;
+    }
+    size_t upper = (char *)(p + p->s.size) - (char *)(freed + freed_units);
+    if (upper >= MORECORE_TRIM_THRESHOLD && upper > MORECORE_TRIM_PAD + sizeof(Header)) {
+        end = (char *)(freed + freed_units + 1);
+    }
+
+    if (start < end) {
+        sys_morecore_free(start, end - start);
+    }
+}
+#endif
 
 /**
  * \brief sbrk() equivalent.
@@ -64,12 +112,25 @@ Header *morecore(unsigned nu)
  *
  * Tries to free up pages at the end of the segment, so to shorten the
  * segment and return memory to the operating system.
+ *
+ * On ARM, the heap is made of separate regions, and the pages of any large
+ * free block are given back, while the block stays in the free list.
+ * 'freed' is the chunk which free() has just put into the free list.
  */
-void lesscore(void)
+void lesscore(Header *freed, unsigned freed_units)
 {
 #if defined(__arm__)
-    // Not implemented
+    struct morecore_state *state = get_morecore_state();
+
+    assert(sys_morecore_free);
 
+    // free() leaves header_freep at the freed block if it was merged
+    // with its lower neighbour, and right before it otherwise.
+    Header *p = state->header_freep;
+    trim_block(p, freed, freed_units);
+    if (p->s.ptr != p) {
+        trim_block(p->s.ptr, freed, freed_units);
+    }
 #else
     struct morecore_state *state = get_morecore_state();
     genvaddr_t gvaddr =
@@ -97,3 +158,16 @@ void lesscore(void)
     }
 #endif
 }
+
+/**
+ * \brief Finishes the work of lesscore() after free() has released the malloc lock.
+ *
+ * Giving memory back to the operating system may involve messages which
+ * need malloc themselves, so sys_morecore_free only queues it.
+ */
+void lesscore_unlocked(void)
+{
+    if (sys_morecore_flush) {
+        sys_morecore_flush();
+    }
+}
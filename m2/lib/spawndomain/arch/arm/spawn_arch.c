@@ -179,6 +179,131 @@ static errval_t elf_allocate(void *state, genvaddr_t base, size_t size,
     return SYS_ERR_OK;
 } // end function: elf_allocate
 
+/**
+ * \brief Allocate a segment of a shared image
+ *
+ * The segment is only mapped into our own vspace, spawn_image_map
+ * maps it into each new domain once the whole image is loaded.
+ */
+static errval_t elf_allocate_image(void *state, genvaddr_t base, size_t size,
+                                   uint32_t flags, void **retbase)
+{
+    errval_t err;
+    struct spawn_image *image = state;
+
+    if (image->segment_count == SPAWN_MAX_SEGMENTS) {
+        return SPAWN_ERR_LOAD;
+    }
+
+    size_t base_offset = BASE_PAGE_OFFSET(base);
+    struct spawn_segment *segment = &image->segments[image->segment_count];
+    segment->base = base - base_offset;
+    segment->size = ROUND_UP(size + base_offset, BASE_PAGE_SIZE);
+    segment->flags = flags;
+
+    err = frame_alloc(&segment->frame, segment->size, NULL);
+    if (err_is_fail(err)) {
+        return err_push(err, LIB_ERR_FRAME_ALLOC);
+    }
+
+    void *local;
+    err = paging_map_frame(get_current_paging_state(), &local, segment->size,
+                           segment->frame, NULL, NULL);
+    if (err_is_fail(err)) {
+        cap_destroy(segment->frame);
+        return err;
+    }
+
+    segment->local_addr = (lvaddr_t)local;
+    image->segment_count++;
+
+    *retbase = local + base_offset;
+    return SYS_ERR_OK;
+}
+
+/**
+ * \brief Load the segments of a shared image
+ */
+static errval_t spawn_image_load(struct spawn_image *image,
+                                 lvaddr_t binary, size_t binary_size)
+{
+    errval_t err;
+
+    err = elf_load(EM_HOST, elf_allocate_image, image, binary, binary_size,
+                   &image->entry);
+
+    if (err_is_ok(err)) {
+        struct Elf32_Shdr* got_shdr =
+            elf32_find_section_header_name(binary, binary_size, ".got");
+        if (got_shdr) {
+            image->got_base = (void*)got_shdr->sh_addr;
+        } else {
+            err = SPAWN_ERR_LOAD;
+        }
+    }
+
+    // Leave an empty image behind, such that the next spawn tries again
+    if (err_is_fail(err)) {
+        for (int i = 0; i < image->segment_count; i++) {
+            paging_unmap(get_current_paging_state(),
+                         (void*)image->segments[i].local_addr);
+            cap_destroy(image->segments[i].frame);
+        }
+        image->segment_count = 0;
+    }
+    return err;
+}
+
+/**
+ * \brief Map a shared image into a new domain
+ *
+ * Read-only segments map the frames of the image, shared by all domains
+ * spawned from it. Writable segments get private frames with a copy of
+ * the image, which still saves loading the binary again.
+ */
+static errval_t spawn_image_map(struct spawninfo *si, struct spawn_image *image)
+{
+    errval_t err;
+
+    for (int i = 0; i < image->segment_count; i++) {
+        struct spawn_segment *segment = &image->segments[i];
+
+        if (segment->flags & PF_W) {
+            void *copy;
+            err = elf_allocate(si, segment->base, segment->size,
+                               segment->flags, &copy);
+            if (err_is_fail(err)) {
+                return err;
+            }
+            memcpy(copy, (void*)segment->local_addr, segment->size);
+
+            // The child keeps its own mapping of the frames
+            err = paging_unmap(get_current_paging_state(), copy);
+            if (err_is_fail(err)) {
+                return err;
+            }
+        } else {
+            struct capref frame = {
+                .cnode = si->segcn,
+                .slot  = si->elfload_slot++,
+            };
+            err = cap_copy(frame, segment->frame);
+            if (err_is_fail(err)) {
+                return err_push(err, LIB_ERR_CAP_COPY);
+            }
+
+            err = paging_map_fixed_attr(si->vspace, segment->base, frame,
+                                        segment->size,
+                                        elf_to_vregion_flags(segment->flags));
+            if (err_is_fail(err)) {
+                debug_printf("spawn_image_map: paging_map_fixed_attr failed\n");
+                return err;
+            }
+        }
+    }
+    return SYS_ERR_OK;
+}
+
 /**
  * \brief Load the elf image
  */
@@ -203,6 +328,19 @@ errval_t spawn_arch_load(struct spawninfo *si,
     si->tls_init_base = 0;
     si->tls_init_len = si->tls_total_len = 0;
 
+    // Domains spawned from a shared image skip the ELF loader
+    if (si->image != NULL) {
+        if (si->image->segment_count == 0) {
+            err = spawn_image_load(si->image, binary, binary_size);
+            if (err_is_fail(err)) {
+                return err;
+            }
+        }
+        *entry = si->image->entry;
+        *arch_info = si->image->got_base;
+        return spawn_image_map(si, si->image);
+    }
+
     //DBG: Uncomment if you really need it ==> debug_printf("spawn_arch_load: about to load elf %p\n", elf_allocate);
     // Load the binary
     err = elf_load(EM_HOST, elf_allocate, si, binary, binary_size, entry);
@@ -0,0 +1,49 @@
+##########################################################################
+# Copyright (c) 2015, ETH Zurich.
+# All rights reserved.
+#
+# This file is distributed under the terms in the attached LICENSE file.
+# If you do not find this file, copies can be found by writing to:
+# ETH Zurich D-INFK, Haldeneggsteig 4, CH-8092 Zurich. Attn: Systems Group.
+##########################################################################
+
+import re
+import tests
+from common import TestCommon
+from results import RowResults
+
+RESULT = re.compile(r'ipc_bench: (\w+) samples (\d+) min (\d+) median (\d+) p99 (\d+)')
+SKIPPED = re.compile(r'ipc_bench: (\w+) skipped')
+
+@tests.add_test
+class IpcBenchmark(TestCommon):
+    '''IPC microbenchmarks: LMP, aos_rpc, cap transfer, lookup and IKC (cycles)'''
+    name = "ipc_bench"
+
+    def get_modules(self, build, machine):
+        modules = super(IpcBenchmark, self).get_modules(build, machine)
+        # init starts the benchmark in place of the shell.
+        modules.reset_module("init", ["shell=ipc_bench"])
+        modules.add_module("test_domain")
+        modules.add_module("ipc_bench")
+        return modules
+
+    def get_finish_string(self):
+        return "IPC benchmark finished"
+
+    def process_data(self, testdir, rawiter):
+        results = RowResults(['benchmark', 'samples', 'min', 'median', 'p99'])
+        finished = False
+        for line in rawiter:
+            m = RESULT.search(line)
+            if m:
+                results.add_row([m.group(1)] + [int(m.group(i)) for i in range(2, 6)])
+                continue
+            if SKIPPED.search(line):
+                continue
+            if line.startswith(self.get_finish_string()):
+                finished = True
+
+        if not finished:
+            results.mark_failed()
+        return results
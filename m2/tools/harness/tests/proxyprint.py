@@ -0,0 +1,52 @@
+##########################################################################
+# Copyright (c) 2015, ETH Zurich.
+# All rights reserved.
+#
+# This file is distributed under the terms in the attached LICENSE file.
+# If you do not find this file, copies can be found by writing to:
+# ETH Zurich D-INFK, Haldeneggsteig 4, CH-8092 Zurich. Attn: Systems Group.
+##########################################################################
+
+import re
+import tests
+from common import TestCommon
+from results import PassFailResult
+
+# Must match PRINT_LINES in usr/proxy_print/main.c, 4 * AOS_RPC_MAX_PENDING.
+PRINT_LINES = 32
+LINE = re.compile(r'proxy_print: line (\d+)')
+PUTCHAR = re.compile(r'proxy_print: putchar')
+
+@tests.add_test
+class ProxyPrintTest(TestCommon):
+    '''Print more messages from core 1 than the proxy can have requests in flight'''
+    name = "proxy_print"
+
+    def get_modules(self, build, machine):
+        modules = super(ProxyPrintTest, self).get_modules(build, machine)
+        # init starts the test in place of the shell.
+        modules.reset_module("init", ["shell=proxy_print"])
+        modules.add_module("serial_driver")
+        modules.add_module("mmchs")
+        modules.add_module("test_domain")
+        modules.add_module("proxy_print")
+        return modules
+
+    def get_finish_string(self):
+        return "proxy_print: done"
+
+    def process_data(self, testdir, rawiter):
+        lines = set()
+        putchars = 0
+        finished = False
+        for line in rawiter:
+            m = LINE.search(line)
+            if m:
+                lines.add(int(m.group(1)))
+            if PUTCHAR.search(line):
+                putchars += 1
+            if line.startswith(self.get_finish_string()):
+                finished = True
+
+        passed = finished and lines == set(range(PRINT_LINES)) and putchars == PRINT_LINES
+        return PassFailResult(passed)
@@ -23,6 +23,36 @@ static inline void print_error (errval_t error, char* fmt, ...)
     }
 }
 
+// Reads which start at a sector boundary must return the same bytes as a read from the start.
+#define OFFSET_TEST_POSITION 512
+#define OFFSET_TEST_LENGTH   512
+
+static errval_t test_offset_read(const int file)
+{
+    char   * whole      = NULL;
+    size_t   whole_len  = OFFSET_TEST_POSITION + OFFSET_TEST_LENGTH;
+    char   * part       = NULL;
+    size_t   part_len   = OFFSET_TEST_LENGTH;
+
+    errval_t error = aos_rpc_read(filesystem_channel, file, 0, whole_len, (void**)&whole, &whole_len);
+    if (err_is_ok(error)) {
+        error = aos_rpc_read(filesystem_channel, file, OFFSET_TEST_POSITION, part_len, (void**)&part, &part_len);
+    }
+
+    if (err_is_ok(error)) {
+        size_t expected = whole_len > OFFSET_TEST_POSITION ? whole_len - OFFSET_TEST_POSITION : 0;
+        bool   passed   = part_len == expected
+                          && memcmp(whole + OFFSET_TEST_POSITION, part, part_len) == 0;
+
+        printf ("Read at offset %u: %s (%zu bytes, expected %zu)\n", OFFSET_TEST_POSITION,
+                passed ? "OK" : "FAILED", part_len, expected);
+    }
+    free(part);
+    free(whole);
+
+    return error;
+}
+
 static errval_t evaluate_fs(const int file)
 {
     char    * chunk     =       NULL;
@@ -88,6 +118,9 @@ int main(int argc, char *argv[])
                         error = aos_rpc_open(filesystem_channel, argv[1], &file);
                         print_error (error, "fsbench: aos_rpc_open failed. %s\n", err_getstring (error));
                         if (err_is_ok(error)) {
+                            error = test_offset_read(file);
+                            print_error (error, "fsbench: test_offset_read failed. %s\n", err_getstring (error));
+
                             error = evaluate_fs(file);
                         
                             aos_rpc_close(filesystem_channel, file);
@@ -0,0 +1,585 @@
+/**
+ * Capabilities shared between the cores.
+ *
+ * A capability is sent to the other core as its kernel representation,
+ * which init recreates there with the kernel capability. This works for
+ * RAM, frames and device frames, which are fully described by their
+ * physical address range.
+ *
+ * Both inits keep track of what they share. The core owning the memory
+ * records every range it exported. The other core keeps the first
+ * capability it recreated for a range as the root of all copies it hands
+ * out, and marks it as remote in the kernel.
+ *
+ * Revocation is done by the owner: It asks the other core to revoke and
+ * delete its root capability, which removes all copies on that core, and
+ * waits for the acknowledgement. Only then may the memory be reused.
+ *
+ * Once no copy of an import is left, the other core deletes its root and
+ * tells the owner, which then forgets the export. Both sides count how
+ * often a range was sent, so a range which is on its way again stays exported.
+ *
+ * Chunks which the other core lent to our memory server are imports as
+ * well, but the memory counts as ours: It is exported with this core as
+ * the owner, and may be freed once it is not shared.
+ */
+
+#include "init.h"
+#include <string.h>
+#include <barrelfish/aos_dbg.h>
+#include <barrelfish/waitset_chan.h>
+#include <aos_support/cross_core_channel.h>
+
+// Initial number of entries in each table. Full tables are doubled.
+#define CROSS_CORE_INITIAL_CAPS 16
+
+enum cap_message_kind {
+    cap_revoke_request, // Revoke all copies overlapping the range of 'cap'.
+    cap_revoke_done,    // The revocation has finished with 'error'.
+    cap_release,        // The other core dropped 'cap', which it received 'count' times.
+};
+
+struct cap_message {
+    uint32_t kind;
+    struct cross_core_cap cap;
+    errval_t error;
+    uint32_t count;
+};
+
+/// A range owned by this core with copies on the other core.
+struct cap_export {
+    bool used;
+    struct cross_core_cap cap;
+    uint32_t count; // Number of times it was sent.
+};
+
+/// A range owned by the other core, with the root of our copies.
+struct cap_import {
+    bool used;
+    struct cross_core_cap cap;
+    struct capref root;
+    uint32_t count; // Number of times it was received.
+    bool lent;      // Lent to our memory server, see cross_core_cap_borrow.
+};
+
+static struct cap_export* exports;
+static uint32_t export_capacity;
+static struct cap_import* imports;
+static uint32_t import_capacity;
+
+// The tables are used by the event loop, the proxy thread and caps_thread.
+// Nothing is sent to the other core while holding caps_mutex, as its
+// caps_thread might wait for its own caps_mutex meanwhile.
+static struct thread_mutex caps_mutex = THREAD_MUTEX_INITIALIZER;
+
+// The channel has a single sender side.
+static struct thread_mutex send_mutex = THREAD_MUTEX_INITIALIZER;
+
+static struct thread* caps_thread;
+
+// Only one revocation of ours is in flight at a time.
+static bool revoke_pending;
+static errval_t revoke_result;
+
+static struct cap_message received_request;
+static struct cap_message received_done;
+static struct waitset_chanstate request_event;
+static struct waitset_chanstate done_event;
+
+/// Check if the ranges of two capabilities have any address in common.
+static inline bool cap_overlap (struct cross_core_cap* first, struct cross_core_cap* second)
+{
+    uint64_t first_end = (uint64_t) first -> base + (1ULL << first -> bits);
+    uint64_t second_end = (uint64_t) second -> base + (1ULL << second -> bits);
+    return first -> base < second_end && second -> base < first_end;
+}
+
+static inline bool cap_equal (struct cross_core_cap* first, struct cross_core_cap* second)
+{
+    return first -> type == second -> type && first -> base == second -> base && first -> bits == second -> bits;
+}
+
+/// Get the kernel representation of a capability.
+static errval_t cap_describe (struct capref cap, struct cross_core_cap* ret)
+{
+    struct capability capability;
+    errval_t error = invoke_kernel_identify_cap (cap_kernel, cap, &capability);
+
+    if (err_is_ok (error)) {
+        switch (capability.type) {
+            case ObjType_RAM:
+                ret -> base = capability.u.ram.base;
+                ret -> bits = capability.u.ram.bits;
+                break;
+            case ObjType_Frame:
+                ret -> base = capability.u.frame.base;
+                ret -> bits = capability.u.frame.bits;
+                break;
+            case ObjType_DevFrame:
+                ret -> base = capability.u.devframe.base;
+                ret -> bits = capability.u.devframe.bits;
+                break;
+            default:
+                error = AOS_ERR_CROSS_CORE_CAP_TYPE;
+        }
+    }
+    if (err_is_ok (error)) {
+        ret -> type = capability.type;
+        ret -> rights = capability.rights;
+        ret -> owner = get_core_id ();
+    }
+    return error;
+}
+
+/**
+ * Double the capacity of a table. The new entries are zeroed, so they are unused.
+ * Returns the new table, or NULL if there's no memory left. Needs caps_mutex.
+ */
+static void* grow_table (void* table, uint32_t* capacity, size_t entry_size)
+{
+    uint32_t new_capacity = (*capacity > 0) ? 2 * *capacity : CROSS_CORE_INITIAL_CAPS;
+    char* grown = realloc (table, new_capacity * entry_size);
+
+    if (grown) {
+        memset (grown + *capacity * entry_size, 0, (new_capacity - *capacity) * entry_size);
+        *capacity = new_capacity;
+    }
+    return grown;
+}
+
+static void send_message (struct cap_message* message)
+{
+    thread_mutex_lock (&send_mutex);
+    errval_t error = cross_core_send (ikc_get_channel (ikc_channel_caps), message, sizeof (*message));
+    thread_mutex_unlock (&send_mutex);
+    if (err_is_fail (error)) {
+        debug_printf ("cross_core_caps: %s\n", err_getstring (error));
+    }
+}
+
+/// Find an import of memory owned by the other core which has any address in common with a range. Needs caps_mutex.
+static struct cap_import* find_import (struct cross_core_cap* cap)
+{
+    for (uint32_t i = 0; i < import_capacity; i++) {
+        if (imports [i].used && !imports [i].lent && cap_overlap (&imports [i].cap, cap)) {
+            return &imports [i];
+        }
+    }
+    return NULL;
+}
+
+/// Find the import of exactly this capability, unless it was lent. Needs caps_mutex.
+static struct cap_import* find_equal_import (struct cross_core_cap* cap)
+{
+    for (uint32_t i = 0; i < import_capacity; i++) {
+        if (imports [i].used && !imports [i].lent && cap_equal (&imports [i].cap, cap)) {
+            return &imports [i];
+        }
+    }
+    return NULL;
+}
+
+/// Record that we sent a range we own. Needs caps_mutex.
+static errval_t add_export (struct cross_core_cap* cap)
+{
+    struct cap_export* free_entry = NULL;
+
+    for (uint32_t i = 0; i < export_capacity; i++) {
+        if (exports [i].used && cap_equal (&exports [i].cap, cap)) {
+            exports [i].count++;
+            return SYS_ERR_OK;
+        }
+        if (!exports [i].used && free_entry == NULL) {
+            free_entry = &exports [i];
+        }
+    }
+    if (free_entry == NULL) {
+        uint32_t first_new = export_capacity;
+        struct cap_export* grown = grow_table (exports, &export_capacity, sizeof (struct cap_export));
+        if (grown == NULL) {
+            return AOS_ERR_CROSS_CORE_CAPS_FULL;
+        }
+        exports = grown;
+        free_entry = &exports [first_new];
+    }
+    free_entry -> used = true;
+    free_entry -> cap = *cap;
+    free_entry -> count = 1;
+    return SYS_ERR_OK;
+}
+
+/// The other core dropped a range 'count' times. Forget it once it has no copies left there.
+static void release_export (struct cross_core_cap* cap, uint32_t count)
+{
+    thread_mutex_lock (&caps_mutex);
+    for (uint32_t i = 0; i < export_capacity; i++) {
+        struct cap_export* export = &exports [i];
+        if (export -> used && cap_equal (&export -> cap, cap)) {
+            export -> count -= (count < export -> count) ? count : export -> count;
+            export -> used = (export -> count > 0);
+        }
+    }
+    thread_mutex_unlock (&caps_mutex);
+}
+
+/**
+ * Delete the roots of imports of which no copy is left on this core,
+ * and tell the owners. Domains may still use memory retyped from a root.
+ */
+static void release_unused_imports (void)
+{
+    bool done = false;
+    for (uint32_t i = 0; !done; i++) {
+        struct cap_message message = { .kind = cap_release };
+        bool released = false;
+
+        thread_mutex_lock (&caps_mutex);
+        done = (i >= import_capacity);
+        if (!done && imports [i].used && !imports [i].lent) {
+            uintptr_t relations = 0;
+            errval_t error = invoke_kernel_cap_relations (cap_kernel, imports [i].root, &relations);
+
+            if (err_is_ok (error)
+                && (relations >> CAP_RELATION_COPIES_SHIFT) == 0
+                && (relations & CAP_RELATION_DESCENDANTS) == 0)
+            {
+                error = cap_destroy (imports [i].root);
+                if (err_is_ok (error)) {
+                    message.cap = imports [i].cap;
+                    message.count = imports [i].count;
+                    imports [i].used = false;
+                    released = true;
+                }
+            }
+        }
+        thread_mutex_unlock (&caps_mutex);
+
+        if (released) {
+            send_message (&message);
+        }
+    }
+}
+
+/**
+ * Serialize a capability for the other core.
+ * The caller keeps its capability.
+ */
+errval_t cross_core_cap_export (struct capref cap, struct cross_core_cap* ret)
+{
+    memset (ret, 0, sizeof (*ret));
+    ret -> type = ObjType_Null;
+    if (capref_is_null (cap)) {
+        return SYS_ERR_OK;
+    }
+
+    struct cross_core_cap description;
+    errval_t error = cap_describe (cap, &description);
+
+    if (err_is_ok (error)) {
+        thread_mutex_lock (&caps_mutex);
+        struct cap_import* import = find_import (&description);
+        if (import) {
+            // It goes back to its owner, which doesn't need to track it.
+            description.owner = import -> cap.owner;
+        } else if (description.type != ObjType_DevFrame) {
+            // Device frames aren't memory anyone could reuse.
+            error = add_export (&description);
+        }
+        thread_mutex_unlock (&caps_mutex);
+    }
+    if (err_is_ok (error)) {
+        *ret = description;
+    }
+    return error;
+}
+
+/**
+ * Check if any part of the memory of a capability is shared with the other core.
+ */
+bool cross_core_cap_is_shared (struct capref cap)
+{
+    struct cross_core_cap description;
+    if (err_is_fail (cap_describe (cap, &description))) {
+        return false;
+    }
+
+    bool shared = false;
+    thread_mutex_lock (&caps_mutex);
+    for (uint32_t i = 0; i < export_capacity && !shared; i++) {
+        shared = exports [i].used && cap_overlap (&exports [i].cap, &description);
+    }
+    shared = shared || find_import (&description) != NULL;
+    thread_mutex_unlock (&caps_mutex);
+    return shared;
+}
+
+/// Create a capability from its kernel representation.
+static errval_t cap_create (struct cross_core_cap* cap, struct capref* ret)
+{
+    struct capability capability;
+    memset (&capability, 0, sizeof (capability));
+    capability.type = cap -> type;
+    capability.rights = cap -> rights;
+
+    switch (cap -> type) {
+        case ObjType_RAM:
+            capability.u.ram.base = cap -> base;
+            capability.u.ram.bits = cap -> bits;
+            break;
+        case ObjType_Frame:
+            capability.u.frame.base = cap -> base;
+            capability.u.frame.bits = cap -> bits;
+            break;
+        case ObjType_DevFrame:
+            capability.u.devframe.base = cap -> base;
+            capability.u.devframe.bits = cap -> bits;
+            break;
+        default:
+            return AOS_ERR_CROSS_CORE_CAP_TYPE;
+    }
+
+    errval_t error = slot_alloc (ret);
+    if (err_is_ok (error)) {
+        error = invoke_kernel_create_cap (cap_kernel, &capability, *ret);
+        if (err_is_fail (error)) {
+            slot_free (*ret);
+            *ret = NULL_CAP;
+        }
+    }
+    return error;
+}
+
+/// Get the root capability of a range owned by the other core. Needs caps_mutex.
+static errval_t get_import_root (struct cross_core_cap* cap, bool lent, struct capref* root)
+{
+    struct cap_import* import = lent ? NULL : find_equal_import (cap);
+    if (import) {
+        import -> count++;
+        *root = import -> root;
+        return SYS_ERR_OK;
+    }
+
+    for (uint32_t i = 0; i < import_capacity && import == NULL; i++) {
+        if (!imports [i].used) {
+            import = &imports [i];
+        }
+    }
+    if (import == NULL) {
+        uint32_t first_new = import_capacity;
+        struct cap_import* grown = grow_table (imports, &import_capacity, sizeof (struct cap_import));
+        if (grown == NULL) {
+            return AOS_ERR_CROSS_CORE_CAPS_FULL;
+        }
+        imports = grown;
+        import = &imports [first_new];
+    }
+
+    errval_t error = cap_create (cap, root);
+    if (err_is_ok (error)) {
+        // Tell the kernel that this capability has copies on another core.
+        error = invoke_kernel_remote_cap (cap_kernel, *root, true, NULL);
+        if (err_is_fail (error)) {
+            cap_destroy (*root);
+        }
+    }
+    if (err_is_ok (error)) {
+        import -> used = true;
+        import -> cap = *cap;
+        import -> root = *root;
+        import -> count = 1;
+        import -> lent = lent;
+    }
+    return error;
+}
+
+/// Get a copy of the root capability of a range owned by the other core.
+static errval_t copy_import_root (struct cross_core_cap* cap, bool lent, struct capref* ret)
+{
+    thread_mutex_lock (&caps_mutex);
+    struct capref root;
+    errval_t error = get_import_root (cap, lent, &root);
+    if (err_is_ok (error)) {
+        error = slot_alloc (ret);
+    }
+    if (err_is_ok (error)) {
+        error = cap_copy (*ret, root);
+        if (err_is_fail (error)) {
+            slot_free (*ret);
+            *ret = NULL_CAP;
+        }
+    }
+    thread_mutex_unlock (&caps_mutex);
+    return error;
+}
+
+/**
+ * Recreate a capability from the other core in a new slot.
+ * The caller owns the new capability.
+ */
+errval_t cross_core_cap_import (struct cross_core_cap* cap, struct capref* ret)
+{
+    *ret = NULL_CAP;
+    if (cap -> type == ObjType_Null) {
+        return SYS_ERR_OK;
+    }
+    if (cap -> owner == get_core_id () || cap -> type == ObjType_DevFrame) {
+        // Nothing to keep track of, it's our own memory or a device.
+        return cap_create (cap, ret);
+    }
+
+    // A new range takes an entry, so make room from ranges which are not used any more.
+    thread_mutex_lock (&caps_mutex);
+    bool known = (find_equal_import (cap) != NULL);
+    thread_mutex_unlock (&caps_mutex);
+    if (!known) {
+        release_unused_imports ();
+    }
+
+    return copy_import_root (cap, false, ret);
+}
+
+/**
+ * Recreate a chunk of RAM which the other core lent to our memory server.
+ * The caller owns the new capability, and the memory counts as ours.
+ */
+errval_t cross_core_cap_borrow (struct cross_core_cap* cap, struct capref* ret)
+{
+    *ret = NULL_CAP;
+    if (cap -> type != ObjType_RAM || cap -> owner == get_core_id ()) {
+        return AOS_ERR_CROSS_CORE_CAP_TYPE;
+    }
+    return copy_import_root (cap, true, ret);
+}
+
+/// Revoke our copies of everything the other core shared overlapping a range.
+static void handle_revoke_request (void* arg)
+{
+    struct cap_message reply = { .kind = cap_revoke_done, .cap = received_request.cap, .error = SYS_ERR_OK };
+
+    thread_mutex_lock (&caps_mutex);
+    for (uint32_t i = 0; i < import_capacity; i++) {
+        struct cap_import* import = &imports [i];
+        if (import -> used && !import -> lent && import -> cap.owner == reply.cap.owner
+            && cap_overlap (&import -> cap, &reply.cap))
+        {
+            errval_t error = cap_revoke (import -> root);
+            if (err_is_ok (error)) {
+                error = cap_destroy (import -> root);
+            }
+            if (err_is_ok (error)) {
+                import -> used = false;
+            } else {
+                reply.error = error;
+            }
+        }
+    }
+    thread_mutex_unlock (&caps_mutex);
+    send_message (&reply);
+}
+
+static void handle_revoke_done (void* arg)
+{
+    revoke_result = received_done.error;
+    revoke_pending = false;
+}
+
+/**
+ * Revoke the copies the other core has of memory within the range of 'cap'.
+ * This only works on the core which owns the memory.
+ * Revoking the copies on this core is up to the caller.
+ * Has to be called on the event loop.
+ */
+errval_t cross_core_cap_revoke (struct capref cap)
+{
+    struct cross_core_cap range;
+    errval_t error = cap_describe (cap, &range);
+
+    thread_mutex_lock (&caps_mutex);
+    bool shared = false;
+    if (err_is_ok (error) && find_import (&range) != NULL) {
+        error = AOS_ERR_CROSS_CORE_CAP_NOT_OWNER;
+    }
+    for (uint32_t i = 0; i < export_capacity && err_is_ok (error); i++) {
+        shared = shared || (exports [i].used && cap_overlap (&exports [i].cap, &range));
+    }
+    thread_mutex_unlock (&caps_mutex);
+
+    // Only ranges in our exports table have copies on the other core.
+    if (err_is_fail (error) || !shared) {
+        return error;
+    }
+    // The acknowledgement is received by caps_thread.
+    error = cross_core_caps_init ();
+    if (err_is_fail (error)) {
+        return error;
+    }
+
+    // Another revocation might still be on its way.
+    while (revoke_pending) {
+        event_dispatch (get_default_waitset ());
+    }
+    revoke_pending = true;
+    struct cap_message request = { .kind = cap_revoke_request, .cap = range };
+    send_message (&request);
+
+    while (revoke_pending) {
+        event_dispatch (get_default_waitset ());
+    }
+    error = revoke_result;
+
+    if (err_is_ok (error)) {
+        thread_mutex_lock (&caps_mutex);
+        for (uint32_t i = 0; i < export_capacity; i++) {
+            if (exports [i].used && cap_overlap (&exports [i].cap, &range)) {
+                exports [i].used = false;
+            }
+        }
+        thread_mutex_unlock (&caps_mutex);
+    }
+    return error;
+}
+
+/// Receive messages from the other core and pass them to the event loop.
+static int caps_thread_func (void* arg)
+{
+    struct cross_core_channel* channel = ikc_get_channel (ikc_channel_caps);
+
+    while (true) {
+        struct cap_message message;
+        size_t size = 0;
+        errval_t error = cross_core_receive (channel, &message, &size);
+        if (err_is_fail (error) || size != sizeof (message)) {
+            debug_printf ("cross_core_caps: invalid message\n");
+            continue;
+        }
+
+        if (message.kind == cap_release) {
+            release_export (&message.cap, message.count);
+        } else if (message.kind == cap_revoke_request) {
+            received_request = message;
+            error = waitset_chan_trigger_closure (get_default_waitset (), &request_event, MKCLOSURE (handle_revoke_request, NULL));
+        } else {
+            received_done = message;
+            error = waitset_chan_trigger_closure (get_default_waitset (), &done_event, MKCLOSURE (handle_revoke_done, NULL));
+        }
+        if (err_is_fail (error)) {
+            DEBUG_ERR (error, "cross_core_caps: waitset_chan_trigger_closure");
+        }
+    }
+    return 0;
+}
+
+/**
+ * Start handling revocations of the other core. Call once both cores are up.
+ */
+errval_t cross_core_caps_init (void)
+{
+    if (caps_thread != NULL) {
+        return SYS_ERR_OK;
+    }
+    waitset_chanstate_init (&request_event, CHANTYPE_OTHER);
+    waitset_chanstate_init (&done_event, CHANTYPE_OTHER);
+
+    caps_thread = thread_create (caps_thread_func, NULL);
+    return caps_thread ? SYS_ERR_OK : LIB_ERR_THREAD_CREATE;
+}
@@ -1,122 +1,128 @@
 #include "init.h"
-
-static const uintptr_t CHUNK_SIZE    = 64U                          ; // 2 cache lines
-static const uintptr_t IKC_LAST_WORD = 64U / sizeof(uintptr_t) -  1U; // index of last word in ikc message
-
-static uintptr_t ikc_read_ptr  = 0;
-static uintptr_t ikc_write_ptr = 0;
-
-static bool free_prev_message = false;
-
-static char* ikc_get_in_channel_base(void)
+#include <barrelfish/aos_dbg.h>
+#include <aos_support/cross_core_channel.h>
+#include <aos_support/cross_core_notify.h>
+
+/**
+ * The cross core channels between init.0 and init.1, laid out one after
+ * another in the shared frame. Both inits use the same table, so they
+ * agree on the layout.
+ */
+static const uint32_t ikc_slot_counts [ikc_channel_count] = {
+    [ikc_channel_control] = 16,
+    [ikc_channel_proxy] = 64,
+    [ikc_channel_memory] = 4,
+    [ikc_channel_caps] = 4,
+};
+
+static struct cross_core_channel ikc_channels [ikc_channel_count];
+
+// Only one request can be outstanding on the control channel.
+static struct thread_mutex ikc_call_mutex = THREAD_MUTEX_INITIALIZER;
+
+/**
+ * Set up the cross core channels in the shared buffer.
+ * init.0 clears the buffer, which has to happen before init.1 is started.
+ */
+errval_t ikc_init_channels (void)
 {
-    char* channel_base;
-
-    if (get_core_id () == 0) {
-        channel_base = (char*)(((uintptr_t)get_cross_core_buffer()) + (BASE_PAGE_SIZE / 2));
-    } else {
-        channel_base = (char*)             get_cross_core_buffer()                         ;
+    errval_t error = SYS_ERR_OK;
+    void* buffer = get_cross_core_buffer ();
+    void* end = buffer + get_cross_core_buffer_size ();
+
+    for (int i = 0; i < ikc_channel_count && err_is_ok (error); i++) {
+        size_t size = cross_core_channel_size (ikc_slot_counts [i]);
+
+        if (buffer + size > end) {
+            error = AOS_ERR_CROSS_CORE_INVALID_SIZE;
+        } else {
+            if (get_core_id () == 0) {
+                cross_core_channel_clear (buffer, ikc_slot_counts [i]);
+            }
+            error = cross_core_channel_init (&ikc_channels [i], buffer, ikc_slot_counts [i], get_core_id () == 0);
+            buffer += size;
+        }
     }
 
-    return channel_base;
-}
-
-static char* ikc_get_out_channel_base(void)
-{
-    char* channel_base;
-
-    if (get_core_id () == 0) {
-        channel_base = (char*)             get_cross_core_buffer()                         ;
-    } else {
-        channel_base = (char*)(((uintptr_t)get_cross_core_buffer()) + (BASE_PAGE_SIZE / 2));
+    if (err_is_ok (error)) {
+        // Requests and replies on the control channel use buffers of IKC_MAX_MESSAGE_SIZE bytes.
+        cross_core_limit_message_size (&ikc_channels [ikc_channel_control], IKC_MAX_MESSAGE_SIZE);
     }
-
-    return channel_base;
+    return error;
 }
 
-static inline uintptr_t ikc_index_to_offset(const uintptr_t idx)
+/**
+ * Let threads waiting on the cross core channels block until the other
+ * init notifies them with an inter-processor interrupt, instead of spinning.
+ * init.0 has to do this before it starts init.1, otherwise it would miss
+ * the first notifications.
+ */
+errval_t ikc_enable_notifications (void)
 {
-    return (idx % (BASE_PAGE_SIZE / (2 * CHUNK_SIZE))) * CHUNK_SIZE;
-}
-
-static void ikc_cleanup(char* channel_base)
-{
-    if (free_prev_message != false) {
-        ((uintptr_t*)&channel_base[ikc_index_to_offset(ikc_read_ptr - 1)])[IKC_LAST_WORD] = 0;
-
-        free_prev_message = false;
+    struct capref notify_cap;
+    struct capability notify = {
+        .type = ObjType_Notify_IPI,
+        .rights = CAPRIGHTS_ALLRIGHTS,
+        .u.notify_ipi = {
+            .coreid = (get_core_id () == 0) ? 1 : 0,
+            .chanid = 0,
+        },
+    };
+
+    errval_t error = slot_alloc (&notify_cap);
+    if (err_is_ok (error)) {
+        error = invoke_kernel_create_cap (cap_kernel, &notify, notify_cap);
     }
-}
-
-static void* peek_ikc_message(void)
-{
-    char* channel_base = ikc_get_in_channel_base();
-    char* message_slot;
-
-    ikc_cleanup(channel_base);
-
-    message_slot = &channel_base[ikc_index_to_offset(ikc_read_ptr)];
-    if(((uintptr_t*)message_slot)[IKC_LAST_WORD] == 0) {
-        message_slot = NULL;
-    } else {
-        ikc_read_ptr++;
+    if (err_is_ok (error)) {
+        error = cross_core_notify_init (notify_cap, cap_irq);
     }
-
-    return message_slot;
+    for (int i = 0; i < ikc_channel_count && err_is_ok (error); i++) {
+        error = cross_core_channel_enable_blocking (&ikc_channels [i]);
+    }
+    return error;
 }
 
-static void* pop_ikc_message(void)
+/**
+ * Get one of the cross core channels.
+ */
+struct cross_core_channel* ikc_get_channel (enum ikc_channel channel)
 {
-    debug_printf ("pop_ikc_message +\n");
-    char* channel_base = ikc_get_in_channel_base();
-    char* message_slot;
-
-    ikc_cleanup(channel_base);
-
-    message_slot = &channel_base[ikc_index_to_offset(ikc_read_ptr)];
-
-    for (; ((volatile uintptr_t*)message_slot)[IKC_LAST_WORD] == 0 ;);
-    ikc_read_ptr++;
-
-    debug_printf ("pop_ikc_message -\n");
-    return message_slot;
+    return &ikc_channels [channel];
 }
 
-static void push_ikc_message(void* message, int size)
+/**
+ * Send a request on the control channel and wait for the reply.
+ *
+ * \param reply: Buffer for the reply, of at least IKC_MAX_MESSAGE_SIZE bytes.
+ */
+errval_t ikc_rpc_call (void* message, size_t size, void* reply, size_t* reply_size)
 {
-    debug_printf ("push_ikc_message +\n");
-    char* channel_base = ikc_get_out_channel_base();
-    char* message_slot;
+    struct cross_core_channel* channel = &ikc_channels [ikc_channel_control];
 
-    assert(size <= CHUNK_SIZE - sizeof(uintptr_t));
-
-    message_slot = &channel_base[ikc_index_to_offset(ikc_write_ptr)];
-
-    for (; ((volatile uintptr_t*)message_slot)[IKC_LAST_WORD] != 0 ;);
-    memcpy(message_slot, message, size);
-    ((uintptr_t*)message_slot)[IKC_LAST_WORD] = 1;
-    ikc_write_ptr++;
-    debug_printf ("push_ikc_message -\n");
-}
-
-void* ikc_rpc_call(void* message, int size)
-{
-    push_ikc_message(message, size);
-    return pop_ikc_message();
+    thread_mutex_lock (&ikc_call_mutex);
+    errval_t error = cross_core_send (channel, message, size);
+    if (err_is_ok (error)) {
+        error = cross_core_receive (channel, reply, reply_size);
+    }
+    thread_mutex_unlock (&ikc_call_mutex);
+    return error;
 }
 
 int ikc_server(void* data)
 {
+    struct cross_core_channel* channel = &ikc_channels [ikc_channel_control];
+    uintptr_t message [IKC_MAX_MESSAGE_SIZE / sizeof (uintptr_t)];
+
     while (true) {
         errval_t  err    ;
-        void    * message;
 
-        message = peek_ikc_message();
-        if (message == NULL) {
-            message = pop_ikc_message();
+        err = cross_core_receive (channel, message, NULL);
+        if (err_is_fail (err)) {
+            debug_printf ("ikc_server: %s\n", err_getstring (err));
+            continue;
         }
 
-        switch(*((uintptr_t*)message))
+        switch(message[0])
         {
         case IKC_MSG_REMOTE_SPAWN:;
             err = SYS_ERR_OK;
@@ -140,12 +146,18 @@ int ikc_server(void* data)
 
             err = spawn (name, NULL);
 
-            push_ikc_message(&err, sizeof(err));
+            cross_core_send (channel, &err, sizeof(err));
+            break;
+        case IKC_MSG_PING:;
+            // Echo the value.
+            uintptr_t value = message[1];
+
+            cross_core_send (channel, &value, sizeof(value));
             break;
         default:;
             uintptr_t reply = -1;
 
-            push_ikc_message(&reply, sizeof(reply));
+            cross_core_send (channel, &reply, sizeof(reply));
             break;
         }
     }
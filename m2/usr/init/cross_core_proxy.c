@@ -0,0 +1,656 @@
+/**
+ * Transparent access to the services of core 0 from core 1.
+ *
+ * A domain on core 1 looks up a service through init.1 like any other
+ * service. If it isn't registered on core 1, init.1 asks init.0 to open a
+ * connection to the service and hands out the endpoint of a forwarding
+ * channel. Every request on that channel is relayed to init.0, which submits
+ * it on its own aos_rpc connection to the service and relays the reply back.
+ * Replies are matched in order on both sides, so init.0 relays them in
+ * request order, including the errors of requests which failed early.
+ * Messages without reply, e.g. terminal output, are only passed on.
+ *
+ * Messages are collected in batches, which are sent once the event loop
+ * has handled all pending events, or when they are full. Busy clients thus
+ * share the cache line transfers of the cross core channel.
+ *
+ * Capabilities are sent as their kernel representation and recreated on the
+ * other core, see cross_core_caps.c.
+ *
+ * When a client on core 1 is killed, init.1 asks init.0 to close the
+ * connection. init.0 waits for the outstanding requests, closes its aos_rpc
+ * connection and confirms, after which init.1 closes the forwarding channel
+ * and reuses the slot.
+ */
+
+#include "init.h"
+#include <string.h>
+#include <barrelfish/aos_dbg.h>
+#include <barrelfish/waitset_chan.h>
+#include <aos_support/server.h>
+#include <aos_support/cross_core_channel.h>
+
+#define PROXY_MAX_CONNECTIONS 64
+#define PROXY_BATCH_SIZE 8
+
+enum proxy_message_kind {
+    proxy_msg_connect,   // init.1 -> init.0: Open a connection, words [0] is the service.
+    proxy_msg_connected, // init.0 -> init.1: words [0] is the error code.
+    proxy_msg_request,   // init.1 -> init.0: Client request.
+    proxy_msg_reply,     // init.0 -> init.1: Server reply.
+    proxy_msg_close,     // init.1 -> init.0: The client is gone.
+    proxy_msg_closed,    // init.0 -> init.1: All replies are sent, the slot is free.
+};
+
+struct proxy_message {
+    uint32_t kind;
+    uint32_t connection;
+    errval_t error; // Requests: Failed on init.1 already, only relay this error back.
+    struct cross_core_cap cap;
+    uint32_t words [LMP_MSG_LENGTH];
+};
+
+struct proxy_batch {
+    uint32_t count;
+    struct proxy_message messages [PROXY_BATCH_SIZE];
+};
+
+/**
+ * A connection of a client on core 1, as seen by init.1.
+ */
+struct proxy_client {
+    bool used;
+    bool closing;             // Waiting for proxy_msg_closed.
+    struct lmp_chan* client;  // Waiting for the endpoint, until connected.
+    struct lmp_chan* channel; // Forwarding channel, once connected.
+    struct waitset_chanstate close_event;
+};
+
+/**
+ * A connection to a service on core 0, as seen by init.0.
+ */
+struct proxy_server {
+    uint32_t connection;
+    uint32_t service;
+    struct aos_rpc rpc;
+    // Relayed requests. The client has at most AOS_RPC_MAX_PENDING requests in flight.
+    struct aos_rpc_request requests [AOS_RPC_MAX_PENDING];
+    bool completed [AOS_RPC_MAX_PENDING];
+    uint32_t next_request;
+    uint32_t next_reply; // The oldest request whose reply isn't sent yet.
+    bool closing;
+    struct waitset_chanstate connect_event;
+};
+
+static struct proxy_client clients [PROXY_MAX_CONNECTIONS];
+static struct proxy_server* servers [PROXY_MAX_CONNECTIONS];
+static struct thread_mutex connection_mutex = THREAD_MUTEX_INITIALIZER;
+
+// Protects the request bookkeeping of the servers on init.0.
+static struct thread_mutex reply_mutex = THREAD_MUTEX_INITIALIZER;
+
+// The batch which is currently filled.
+static struct proxy_batch outgoing;
+static bool flush_pending;
+static struct waitset_chanstate flush_event;
+static struct thread_mutex outgoing_mutex = THREAD_MUTEX_INITIALIZER;
+
+static struct proxy_batch incoming;
+
+static struct thread* proxy_thread;
+
+/// Size of a batch with 'count' messages, such that we don't send unused slots.
+static inline size_t batch_size (uint32_t count)
+{
+    return offsetof (struct proxy_batch, messages) + count * sizeof (struct proxy_message);
+}
+
+/// Send the outgoing batch. Needs outgoing_mutex.
+static void flush_batch (void)
+{
+    if (outgoing.count > 0) {
+        errval_t error = cross_core_send (ikc_get_channel (ikc_channel_proxy), &outgoing, batch_size (outgoing.count));
+        if (err_is_fail (error)) {
+            debug_printf ("proxy: failed to send batch: %s\n", err_getstring (error));
+        }
+        outgoing.count = 0;
+    }
+}
+
+/// Runs on the event loop after all events that were pending when the first message was queued.
+static void flush_handler (void* arg)
+{
+    thread_mutex_lock (&outgoing_mutex);
+    flush_pending = false;
+    flush_batch ();
+    thread_mutex_unlock (&outgoing_mutex);
+}
+
+/**
+ * Queue a message for the other core.
+ */
+static void proxy_send (struct proxy_message* message)
+{
+    thread_mutex_lock (&outgoing_mutex);
+    if (outgoing.count == PROXY_BATCH_SIZE) {
+        flush_batch ();
+    }
+    outgoing.messages [outgoing.count] = *message;
+    outgoing.count++;
+
+    if (!flush_pending) {
+        errval_t error = waitset_chan_trigger_closure (get_default_waitset (), &flush_event, MKCLOSURE (flush_handler, NULL));
+        if (err_is_ok (error)) {
+            flush_pending = true;
+        } else {
+            flush_batch ();
+        }
+    }
+    thread_mutex_unlock (&outgoing_mutex);
+}
+
+/**
+ * Send a reply to a client, waiting if its buffer is full.
+ */
+static errval_t reply_to_client (struct lmp_chan* channel, struct capref cap, uint32_t* words)
+{
+    errval_t error = SYS_ERR_OK;
+    do {
+        error = lmp_chan_send9 (channel, 0, cap, words [0], words [1], words [2],
+            words [3], words [4], words [5], words [6], words [7], words [8]);
+        if (err_is_fail (error) && lmp_err_is_transient (error)) {
+            thread_yield ();
+        }
+    } while (err_is_fail (error) && lmp_err_is_transient (error));
+    return error;
+}
+
+/**
+ * Handler of the forwarding channels on init.1. Relays a client request to init.0.
+ */
+static void forward_request (struct lmp_chan* channel, struct lmp_recv_msg* message, struct capref capability, uint32_t type)
+{
+    struct proxy_message request = { .kind = proxy_msg_request, .connection = PROXY_MAX_CONNECTIONS };
+    bool closing = false;
+
+    thread_mutex_lock (&connection_mutex);
+    for (uint32_t i = 0; i < PROXY_MAX_CONNECTIONS; i++) {
+        if (clients [i].used && clients [i].channel == channel) {
+            request.connection = i;
+            closing = clients [i].closing;
+        }
+    }
+    thread_mutex_unlock (&connection_mutex);
+    assert (request.connection < PROXY_MAX_CONNECTIONS);
+
+    if (closing) {
+        // Nobody is left to receive the reply.
+        if (!capref_is_null (capability)) {
+            cap_destroy (capability);
+        }
+        return;
+    }
+
+    request.error = cross_core_cap_export (capability, &request.cap);
+    if (!capref_is_null (capability)) {
+        // init.0 creates its own copy.
+        cap_destroy (capability);
+    }
+
+    // Failed requests go to init.0 as well, such that their error reply
+    // doesn't overtake the replies of earlier requests.
+    if (err_is_fail (request.error)) {
+        request.cap.type = ObjType_Null;
+    }
+    memcpy (request.words, message -> words, sizeof (request.words));
+    proxy_send (&request);
+}
+
+/// init.1: Close the forwarding channel of a closed connection and free its slot. Runs on the event loop.
+static void close_handler (void* arg)
+{
+    struct proxy_client* client = arg;
+
+    thread_mutex_lock (&connection_mutex);
+    struct lmp_chan* channel = client -> channel;
+    thread_mutex_unlock (&connection_mutex);
+
+    destroy_channel (channel);
+
+    thread_mutex_lock (&connection_mutex);
+    client -> channel = NULL;
+    client -> closing = false;
+    client -> used = false;
+    thread_mutex_unlock (&connection_mutex);
+}
+
+/**
+ * init.1: Close the connections of clients whose endpoint is gone,
+ * e.g. after killing a domain. Has to be called on the event loop.
+ */
+void proxy_close_dead_connections (void)
+{
+    for (uint32_t i = 0; i < PROXY_MAX_CONNECTIONS; i++) {
+        thread_mutex_lock (&connection_mutex);
+        struct proxy_client* client = &clients [i];
+        bool dead = false;
+
+        if (client -> used && !client -> closing && client -> channel && !capref_is_null (client -> channel -> remote_cap)) {
+            // The endpoint of the client was deleted along with its dispatcher.
+            struct capability cap;
+            errval_t error = invoke_kernel_identify_cap (cap_kernel, client -> channel -> remote_cap, &cap);
+            dead = err_is_fail (error) || cap.type == ObjType_Null;
+        }
+        if (dead) {
+            client -> closing = true;
+        }
+        thread_mutex_unlock (&connection_mutex);
+
+        if (dead) {
+            struct proxy_message request = { .kind = proxy_msg_close, .connection = i };
+            proxy_send (&request);
+        }
+    }
+}
+
+errval_t proxy_connect (struct lmp_chan* client, uint32_t service)
+{
+    struct proxy_message request = { .kind = proxy_msg_connect, .connection = PROXY_MAX_CONNECTIONS };
+    request.words [0] = service;
+
+    thread_mutex_lock (&connection_mutex);
+    for (uint32_t i = 0; i < PROXY_MAX_CONNECTIONS && request.connection == PROXY_MAX_CONNECTIONS; i++) {
+        if (!clients [i].used) {
+            clients [i].used = true;
+            clients [i].client = client;
+            clients [i].channel = NULL;
+            request.connection = i;
+        }
+    }
+    thread_mutex_unlock (&connection_mutex);
+
+    if (request.connection == PROXY_MAX_CONNECTIONS) {
+        return AOS_ERR_PROXY_CONNECTIONS_EXHAUSTED;
+    }
+    proxy_send (&request);
+    return SYS_ERR_OK;
+}
+
+/**
+ * init.1: init.0 has opened the connection, or failed to do so.
+ * Hand out the forwarding channel to the client which asked for the service.
+ */
+static void handle_connected (struct proxy_message* message)
+{
+    struct proxy_client* client = &clients [message -> connection];
+    errval_t error = message -> words [0];
+
+    struct lmp_chan* channel = NULL;
+    if (err_is_ok (error)) {
+        error = create_forwarding_channel (&channel, forward_request);
+    }
+
+    uint32_t reply [LMP_MSG_LENGTH] = { error };
+    reply_to_client (client -> client, channel ? channel -> local_cap : NULL_CAP, reply);
+
+    thread_mutex_lock (&connection_mutex);
+    client -> client = NULL;
+    client -> channel = channel;
+    client -> used = (channel != NULL);
+    thread_mutex_unlock (&connection_mutex);
+}
+
+/**
+ * init.1: Pass a reply on to the client.
+ */
+static void handle_reply (struct proxy_message* message)
+{
+    thread_mutex_lock (&connection_mutex);
+    struct lmp_chan* channel = clients [message -> connection].channel;
+    bool closing = clients [message -> connection].closing;
+    thread_mutex_unlock (&connection_mutex);
+
+    if (channel == NULL) {
+        debug_printf ("proxy: dropping reply for unknown connection %u\n", message -> connection);
+        return;
+    }
+
+    struct capref cap = NULL_CAP;
+    errval_t error = cross_core_cap_import (&message -> cap, &cap);
+    if (closing) {
+        // The client is gone, but the imported capability still has to be released.
+    } else if (err_is_fail (error)) {
+        uint32_t reply [LMP_MSG_LENGTH] = { error };
+        reply_to_client (channel, NULL_CAP, reply);
+    } else {
+        reply_to_client (channel, cap, message -> words);
+    }
+
+    if (!capref_is_null (cap)) {
+        cap_destroy (cap);
+    }
+}
+
+/**
+ * init.1: init.0 has sent all replies of a closed connection.
+ * The forwarding channel is closed on the event loop.
+ */
+static void handle_closed (struct proxy_message* message)
+{
+    struct proxy_client* client = &clients [message -> connection];
+    waitset_chanstate_init (&client -> close_event, CHANTYPE_OTHER);
+
+    errval_t error = waitset_chan_trigger_closure (get_default_waitset (), &client -> close_event, MKCLOSURE (close_handler, client));
+    if (err_is_fail (error)) {
+        debug_printf ("proxy: failed to close connection %u: %s\n", message -> connection, err_getstring (error));
+    }
+}
+
+/// init.0: Close the aos_rpc connection to the service and confirm. Needs reply_mutex.
+static void finish_close (struct proxy_server* server)
+{
+    struct proxy_message reply = { .kind = proxy_msg_closed, .connection = server -> connection };
+
+    thread_mutex_lock (&connection_mutex);
+    servers [server -> connection] = NULL;
+    thread_mutex_unlock (&connection_mutex);
+
+    // Nothing is outstanding, so the channel isn't registered anymore.
+    lmp_chan_deregister_recv (&server -> rpc.channel);
+    lmp_chan_destroy (&server -> rpc.channel);
+    free (server);
+
+    proxy_send (&reply);
+}
+
+/**
+ * init.0: Send the replies of completed requests, in request order.
+ * Closes the connection once it is closing and nothing is outstanding. Needs reply_mutex.
+ */
+static void send_replies (struct proxy_server* server)
+{
+    while (server -> next_reply != server -> next_request && server -> completed [server -> next_reply % AOS_RPC_MAX_PENDING]) {
+        struct aos_rpc_request* request = &server -> requests [server -> next_reply % AOS_RPC_MAX_PENDING];
+        struct proxy_message reply = { .kind = proxy_msg_reply, .connection = server -> connection };
+
+        errval_t error = request -> error;
+        if (err_is_ok (error)) {
+            error = cross_core_cap_export (request -> cap, &reply.cap);
+        }
+        if (!capref_is_null (request -> cap)) {
+            cap_destroy (request -> cap);
+        }
+
+        if (err_is_ok (error)) {
+            memcpy (reply.words, request -> message.words, sizeof (reply.words));
+        } else {
+            reply.cap.type = ObjType_Null;
+            reply.words [0] = error;
+        }
+        proxy_send (&reply);
+        server -> next_reply++;
+    }
+
+    if (server -> closing && server -> next_reply == server -> next_request) {
+        finish_close (server);
+    }
+}
+
+/// init.0: A request has completed, either by the service or with an early error.
+static void complete_request (struct proxy_server* server, struct aos_rpc_request* request)
+{
+    thread_mutex_lock (&reply_mutex);
+    server -> completed [request - server -> requests] = true;
+    send_replies (server);
+    thread_mutex_unlock (&reply_mutex);
+}
+
+/**
+ * init.0: A relayed request has completed. Send the reply back.
+ * Runs on the event loop.
+ */
+static void request_done (struct aos_rpc_request* request)
+{
+    complete_request (request -> arg, request);
+}
+
+/// init.0: Reply to a proxy_msg_connect. Frees the connection on failure.
+static void send_connected (struct proxy_server* server, errval_t error)
+{
+    struct proxy_message reply = { .kind = proxy_msg_connected, .connection = server -> connection };
+    reply.words [0] = error;
+
+    if (err_is_fail (error)) {
+        thread_mutex_lock (&connection_mutex);
+        servers [server -> connection] = NULL;
+        thread_mutex_unlock (&connection_mutex);
+        free (server);
+    }
+    proxy_send (&reply);
+}
+
+/// init.0: The server has sent an endpoint for a new connection.
+static void endpoint_delivered (void* arg, errval_t error, struct capref endpoint)
+{
+    struct proxy_server* server = arg;
+
+    if (err_is_ok (error)) {
+        error = aos_rpc_init (&server -> rpc, endpoint);
+    } else if (!capref_is_null (endpoint)) {
+        cap_destroy (endpoint);
+    }
+    send_connected (server, error);
+}
+
+/// init.0: Ask the server for an endpoint. Runs on the event loop, as it uses the service table.
+static void connect_handler (void* arg)
+{
+    struct proxy_server* server = arg;
+    errval_t error = request_service_endpoint (server -> service, endpoint_delivered, server);
+    if (err_is_fail (error)) {
+        send_connected (server, error);
+    }
+}
+
+/**
+ * init.0: Open a connection to a service for a client on core 1.
+ */
+static void handle_connect (struct proxy_message* message)
+{
+    errval_t error = SYS_ERR_OK;
+    struct proxy_server* server = calloc (1, sizeof (struct proxy_server));
+
+    if (server) {
+        server -> connection = message -> connection;
+        server -> service = message -> words [0];
+        waitset_chanstate_init (&server -> connect_event, CHANTYPE_OTHER);
+
+        thread_mutex_lock (&connection_mutex);
+        servers [server -> connection] = server;
+        thread_mutex_unlock (&connection_mutex);
+
+        error = waitset_chan_trigger_closure (get_default_waitset (), &server -> connect_event, MKCLOSURE (connect_handler, server));
+        if (err_is_fail (error)) {
+            send_connected (server, error);
+        }
+    } else {
+        struct proxy_message reply = { .kind = proxy_msg_connected, .connection = message -> connection };
+        reply.words [0] = LIB_ERR_MALLOC_FAIL;
+        proxy_send (&reply);
+    }
+}
+
+/**
+ * init.0: Pass on a client message that gets no reply.
+ * It doesn't take a slot in the request table, so nothing waits for it.
+ */
+static void forward_without_reply (struct proxy_server* server, struct proxy_message* message)
+{
+    struct aos_rpc_request request;
+    aos_rpc_request_init (&request, NULL, NULL);
+    memcpy (request.message.words, message -> words, sizeof (request.message.words));
+
+    struct capref cap = NULL_CAP;
+    errval_t error = message -> error;
+    if (err_is_ok (error)) {
+        error = cross_core_cap_import (&message -> cap, &cap);
+    }
+    if (err_is_ok (error)) {
+        // Returns as soon as the message is sent.
+        request.cap = cap;
+        error = aos_rpc_submit (&server -> rpc, &request);
+    }
+    if (!capref_is_null (cap)) {
+        cap_destroy (cap);
+    }
+
+    if (err_is_fail (error)) {
+        debug_printf ("proxy: dropping message of type %u: %s\n", AOS_RPC_MESSAGE_TYPE (message -> words [0]), err_getstring (error));
+    }
+}
+
+/**
+ * init.0: Submit a client request to the service.
+ */
+static void handle_request (struct proxy_message* message)
+{
+    thread_mutex_lock (&connection_mutex);
+    struct proxy_server* server = servers [message -> connection];
+    thread_mutex_unlock (&connection_mutex);
+
+    if (server == NULL) {
+        debug_printf ("proxy: dropping request for unknown connection %u\n", message -> connection);
+        return;
+    }
+
+    if (!aos_rpc_expects_reply (message -> words [0])) {
+        forward_without_reply (server, message);
+        return;
+    }
+
+    thread_mutex_lock (&reply_mutex);
+    uint32_t index = server -> next_request % AOS_RPC_MAX_PENDING;
+    struct aos_rpc_request* request = &server -> requests [index];
+    server -> completed [index] = false;
+    server -> next_request++;
+    thread_mutex_unlock (&reply_mutex);
+
+    aos_rpc_request_init (request, request_done, server);
+    memcpy (request -> message.words, message -> words, sizeof (request -> message.words));
+
+    struct capref cap = NULL_CAP;
+    errval_t error = message -> error;
+    if (err_is_ok (error)) {
+        error = cross_core_cap_import (&message -> cap, &cap);
+    }
+
+    if (err_is_ok (error)) {
+        // The request ID of the client is replaced by ours.
+        request -> cap = cap;
+        error = aos_rpc_submit (&server -> rpc, request);
+    }
+    if (!capref_is_null (cap)) {
+        // The server has its own copy now.
+        cap_destroy (cap);
+    }
+
+    if (err_is_fail (error)) {
+        // Reply once the requests before this one have been answered.
+        request -> cap = NULL_CAP;
+        request -> error = error;
+        complete_request (server, request);
+    }
+}
+
+/**
+ * init.0: The client on core 1 is gone. Close the connection once
+ * the outstanding requests are answered.
+ */
+static void handle_close (struct proxy_message* message)
+{
+    thread_mutex_lock (&connection_mutex);
+    struct proxy_server* server = servers [message -> connection];
+    thread_mutex_unlock (&connection_mutex);
+
+    if (server == NULL) {
+        // The connection failed to open, so there is nothing to close.
+        struct proxy_message reply = { .kind = proxy_msg_closed, .connection = message -> connection };
+        proxy_send (&reply);
+        return;
+    }
+
+    thread_mutex_lock (&reply_mutex);
+    server -> closing = true;
+    send_replies (server);
+    thread_mutex_unlock (&reply_mutex);
+}
+
+/**
+ * Receive batches from the other core and handle their messages.
+ */
+static int proxy_server_thread (void* arg)
+{
+    struct cross_core_channel* channel = ikc_get_channel (ikc_channel_proxy);
+
+    while (true) {
+        size_t size = 0;
+        errval_t error = cross_core_receive (channel, &incoming, &size);
+
+        if (err_is_fail (error) || size != batch_size (incoming.count)) {
+            debug_printf ("proxy: invalid batch: %s\n", err_getstring (error));
+            continue;
+        }
+
+        for (uint32_t i = 0; i < incoming.count; i++) {
+            struct proxy_message* message = &incoming.messages [i];
+
+            if (message -> connection >= PROXY_MAX_CONNECTIONS) {
+                debug_printf ("proxy: invalid connection %u\n", message -> connection);
+                continue;
+            }
+
+            switch (message -> kind) {
+                case proxy_msg_connect:
+                    handle_connect (message);
+                    break;
+                case proxy_msg_connected:
+                    handle_connected (message);
+                    break;
+                case proxy_msg_request:
+                    handle_request (message);
+                    break;
+                case proxy_msg_reply:
+                    handle_reply (message);
+                    break;
+                case proxy_msg_close:
+                    handle_close (message);
+                    break;
+                case proxy_msg_closed:
+                    handle_closed (message);
+                    break;
+                default:
+                    debug_printf ("proxy: unknown message kind %u\n", message -> kind);
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Start the proxy. Has to be called on the thread which runs the event loop.
+ */
+errval_t proxy_init (void)
+{
+    if (proxy_thread) {
+        return SYS_ERR_OK;
+    }
+    assert (sizeof (struct proxy_batch) <= cross_core_max_message_size (ikc_get_channel (ikc_channel_proxy)));
+
+    waitset_chanstate_init (&flush_event, CHANTYPE_OTHER);
+
+    // The proxy thread submits requests, but only the event loop may dispatch events.
+    aos_rpc_set_event_thread (thread_self ());
+
+    proxy_thread = thread_create (proxy_server_thread, NULL);
+    return proxy_thread ? SYS_ERR_OK : LIB_ERR_THREAD_CREATE;
+}
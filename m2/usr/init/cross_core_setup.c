@@ -7,8 +7,9 @@
 #include <aos_support/module_manager.h>
 
 
-/// Virtual address of the shared buffer.
+/// Virtual address and size of the shared buffer.
 static void* cross_core_buffer = NULL;
+static size_t cross_core_buffer_size = 0;
 
 /**
  * Get the shared cross core buffer.
@@ -18,6 +19,14 @@ void* get_cross_core_buffer (void)
     return cross_core_buffer;
 }
 
+/**
+ * Get the size of the shared cross core buffer.
+ */
+size_t get_cross_core_buffer_size (void)
+{
+    return cross_core_buffer_size;
+}
+
 /**
  * Initialize the kernel-allocated cross core buffer.
  */
@@ -29,14 +38,21 @@ errval_t init_cross_core_buffer (void)
     struct capref shared_frame = cap_initep;
     shared_frame.slot = TASKCN_SLOT_MON_URPC;
 
-    // Map it into our address space.
-    error =  paging_map_frame_attr (
-            get_current_paging_state(),
-            &cross_core_buffer,
-            BASE_PAGE_SIZE,
-            shared_frame,
-            VREGION_FLAGS_READ_WRITE_NOCACHE,
-            NULL, NULL);
+    struct frame_identity identity;
+    error = invoke_frame_identify (shared_frame, &identity);
+
+    // Map it into our address space. The channels take care of ordering
+    // with barriers, so the buffer can be cached.
+    if (err_is_ok (error)) {
+        cross_core_buffer_size = 1UL << identity.bits;
+        error =  paging_map_frame_attr (
+                get_current_paging_state(),
+                &cross_core_buffer,
+                cross_core_buffer_size,
+                shared_frame,
+                VREGION_FLAGS_READ_WRITE,
+                NULL, NULL);
+    }
 
     return error;
 }
@@ -21,6 +21,9 @@
 #include <aos_support/server.h>
 #include <aos_support/shared_buffer.h>
 #include <aos_support/module_manager.h>
+#include <spawndomain/spawndomain.h>
+#include <arch/arm/barrelfish_kpi/asm_inlines_arch.h>
+#include <bench/bench.h>
 
 // Forward declaration
 static errval_t enable_elf_loading (struct lmp_chan* fs_chan);
@@ -37,12 +40,36 @@ coreid_t get_core_id (void)
     return my_core_id;
 }
 
-//Keeps track of registered services.
-struct lmp_chan* services [aos_service_guard];
+//Keeps track of registered services, indexed by service identifier.
+struct lmp_chan* services [AOS_NAME_DIRECTORY_SIZE];
+
+// The name directory, which is shared read-only with all domains.
+static struct capref name_directory_frame;
+static struct capref name_directory_readonly; // Handed out to clients.
+static struct aos_name_directory* name_directory;
+
+// Names of the predefined services.
+static const char* predefined_names [aos_service_guard] = {
+    [aos_service_ram] = "ram",
+    [aos_service_serial] = "serial",
+    [aos_service_led] = "led",
+    [aos_service_init] = "init",
+    [aos_service_domain] = "domain",
+    [aos_service_filesystem] = "filesystem",
+    [aos_service_test] = "test",
+};
 
 // Keeps track of FIND_SERVICE requests.
+// Unused entries form a free list, so allocation doesn't need to search.
 #define MAX_FIND_REQUESTS 100
-static struct lmp_chan* find_request [MAX_FIND_REQUESTS];
+struct find_request {
+    struct lmp_chan* channel;      // Client waiting for the endpoint, or NULL.
+    endpoint_callback_t callback;  // Used instead of channel for requests by init itself.
+    void* arg;
+    struct find_request* next_free;
+};
+static struct find_request find_requests [MAX_FIND_REQUESTS];
+static struct find_request* free_find_requests;
 
 /**
  * Initialize some data structures.
@@ -74,14 +101,94 @@ static void init_data_structures (char *argv[])
     }
 
     // Make sure other data structures are correctly initialized.
-    for (int i=0; i < aos_service_guard; i++) {
+    for (int i=0; i < AOS_NAME_DIRECTORY_SIZE; i++) {
         services [i] = NULL;
     }
-    for (int i=0; i < MAX_FIND_REQUESTS; i++) {
-        find_request [i] = NULL;
+    free_find_requests = NULL;
+    for (int i = MAX_FIND_REQUESTS - 1; i >= 0; i--) {
+        find_requests [i].channel = NULL;
+        find_requests [i].callback = NULL;
+        find_requests [i].next_free = free_find_requests;
+        free_find_requests = &find_requests [i];
+    }
+
+    // Set up the name directory.
+    void* buffer = NULL;
+    error = frame_alloc (&name_directory_frame, BASE_PAGE_SIZE, NULL);
+    if (err_is_ok (error)) {
+        error = paging_map_frame (get_current_paging_state (), &buffer, BASE_PAGE_SIZE, name_directory_frame, NULL, NULL);
+    }
+
+    // Clients get a copy without write rights, which the kernel only maps read-only.
+    struct capability readonly;
+    if (err_is_ok (error)) {
+        error = invoke_kernel_identify_cap (cap_kernel, name_directory_frame, &readonly);
+    }
+    if (err_is_ok (error)) {
+        error = slot_alloc (&name_directory_readonly);
+    }
+    if (err_is_ok (error)) {
+        readonly.rights = CAPRIGHTS_READ;
+        error = invoke_kernel_create_cap (cap_kernel, &readonly, name_directory_readonly);
+    }
+    if (err_is_fail (error)) {
+        debug_printf ("Failed to set up the name directory: %s\n", err_getstring (error));
+        abort();
+    }
+    name_directory = buffer;
+    memset (name_directory, 0, sizeof (struct aos_name_directory));
+    for (int i=0; i < aos_service_guard; i++) {
+        strncpy (name_directory -> entries [i].name, predefined_names [i], AOS_NAME_LENGTH);
     }
 }
 
+/**
+ * Publish a registered service in the name directory.
+ * Readers retry while the version is odd or has changed. The barriers keep
+ * other cores from seeing the entry change outside the odd version.
+ */
+static void publish_name (uint32_t service, const char* name, uint32_t metadata)
+{
+    name_directory -> version++;
+    dmb ();
+    struct aos_name_entry* entry = &name_directory -> entries [service];
+    if (name) {
+        strncpy (entry -> name, name, AOS_NAME_LENGTH);
+        entry -> name [AOS_NAME_LENGTH - 1] = '\0';
+    }
+    entry -> metadata = metadata;
+    entry -> is_registered = true;
+    dmb ();
+    name_directory -> version++;
+}
+
+/**
+ * Register a channel under a new name. Returns the service identifier.
+ */
+static errval_t register_name (struct lmp_chan* channel, const char* name, uint32_t metadata, uint32_t* service)
+{
+    uint32_t free_entry = AOS_NAME_DIRECTORY_SIZE;
+
+    for (uint32_t i = 0; i < AOS_NAME_DIRECTORY_SIZE; i++) {
+        struct aos_name_entry* entry = &name_directory -> entries [i];
+        if (strncmp (entry -> name, name, AOS_NAME_LENGTH) == 0) {
+            return AOS_ERR_NAME_EXISTS;
+        }
+        if (i >= aos_service_guard && entry -> name [0] == '\0' && free_entry == AOS_NAME_DIRECTORY_SIZE) {
+            free_entry = i;
+        }
+    }
+
+    if (free_entry == AOS_NAME_DIRECTORY_SIZE) {
+        return AOS_ERR_NAME_DIRECTORY_FULL;
+    }
+
+    services [free_entry] = channel;
+    publish_name (free_entry, name, metadata);
+    *service = free_entry;
+    return SYS_ERR_OK;
+}
+
 /*static bool str_to_args(const char* string, uint32_t* args, size_t args_length, int* indx, bool finished)
 {
     finished = false;
@@ -99,49 +206,133 @@ static void init_data_structures (char *argv[])
     return finished;
 }*/
 
+/**
+ * Send an AOS_ROUTE_REQUEST_EP to the server of 'service'. The endpoint
+ * is delivered either to 'channel' or to 'callback'.
+ */
+static errval_t send_endpoint_request (uint32_t service, struct lmp_chan* channel, endpoint_callback_t callback, void* arg)
+{
+    if (service >= AOS_NAME_DIRECTORY_SIZE) {
+        // Invalid service identifier.
+        return AOS_ERR_LMP_INVALID_ARGS;
+    }
+
+    struct lmp_chan* serv = services [service];
+
+    if (serv == NULL) {
+        // Service is not registered.
+        return AOS_ERR_SERVICE_NOT_FOUND;
+    }
+    if (free_find_requests == NULL) {
+        // No free space to allocate a find request ID.
+        // This is very rare...
+        return AOS_ERR_FIND_REQUESTS_EXHAUSTED;
+    }
+
+    // Store the receiver at a new ID.
+    struct find_request* request = free_find_requests;
+    free_find_requests = request -> next_free;
+    request -> channel = channel;
+    request -> callback = callback;
+    request -> arg = arg;
+    // generate AOS_ROUTE_REQUEST_EP request with ID.
+    return lmp_chan_send2 (serv, 0, NULL_CAP, AOS_ROUTE_REQUEST_EP, request - find_requests);
+}
+
+errval_t request_service_endpoint (uint32_t service, endpoint_callback_t callback, void* arg)
+{
+    assert (callback);
+    return send_endpoint_request (service, NULL, callback, arg);
+}
+
 static bool is_spawned = false;
 struct remote_spawn_message {
     uintptr_t message_id                              ;
     char      name      [64U - 2U * sizeof(uintptr_t)];
 };
 
-// Spawn on the second core.
-static errval_t spawn_remotely (char* domain_name, coreid_t core_id)
+struct remote_ping_message {
+    uintptr_t message_id;
+    uintptr_t value;
+};
+
+// Boot the second core, unless it's already running.
+static errval_t start_remote_core (coreid_t core_id)
 {
     errval_t error = SYS_ERR_OK;
     // Currently this function is only supported on init.0
     assert (get_core_id () == 0);
 
-    if (core_id == 1) {
-
-        // We may need to spawn the second kernel first.
-        if (get_core_id () == 0 && !is_spawned) {
-            is_spawned = true;
-            // Zero out the shared memory.
-            memset (get_cross_core_buffer(), 0, BASE_PAGE_SIZE);
-            // Spawn the core.
-            error = spawn_core (core_id);
-            debug_printf ("spawn_core: %s\n", err_getstring (error));
-            // For some reason we have to wait, otherwise the message gets lost.
-            for (volatile int wait = 0; wait < 5000000; wait++);
-            debug_printf_quiet ("After wait\n");
+    if (core_id != 1) {
+        // Invalid remote core ID.
+        return SYS_ERR_CORE_NOT_FOUND;
+    }
+
+    if (!is_spawned) {
+        is_spawned = true;
+        // Spawn the core. The channels have been cleared by ikc_init_channels.
+        error = spawn_core (core_id);
+        debug_printf ("spawn_core: %s\n", err_getstring (error));
+
+        // Relay requests of domains on the new core to our services.
+        if (err_is_ok (error)) {
+            error = cross_core_caps_init ();
         }
+        if (err_is_ok (error)) {
+            error = proxy_init ();
+        }
+        if (err_is_ok (error)) {
+            error = mem_serv_enable_stealing ();
+        }
+        // For some reason we have to wait, otherwise the message gets lost.
+        for (volatile int wait = 0; wait < 5000000; wait++);
+        debug_printf_quiet ("After wait\n");
+    }
+    return error;
+}
 
+// Spawn on the second core.
+static errval_t spawn_remotely (char* domain_name, coreid_t core_id)
+{
+    errval_t error = start_remote_core (core_id);
+
+    if (err_is_ok (error)) {
         struct remote_spawn_message rsm = { .message_id = IKC_MSG_REMOTE_SPAWN };
 
+        if (strlen (domain_name) >= sizeof (rsm.name)) {
+            return AOS_ERR_LMP_INVALID_ARGS;
+        }
         strcpy(rsm.name, domain_name);
 
-        void* reply_error = ikc_rpc_call(&rsm, sizeof(rsm));
-        error = *(errval_t*) reply_error;
-    } else {
-        // Invalid remote core ID.
-        error = SYS_ERR_CORE_NOT_FOUND;
+        errval_t reply [IKC_MAX_MESSAGE_SIZE / sizeof (errval_t)];
+        error = ikc_rpc_call (&rsm, sizeof (rsm), reply, NULL);
+        if (err_is_ok (error)) {
+            error = reply [0];
+        }
     }
 
     return error;
 }
 
+// Do an IKC round trip to the second core and measure it in cycles.
+static errval_t ping_remotely (uint32_t value, uint32_t* cycles)
+{
+    errval_t error = start_remote_core (1);
+
+    if (err_is_ok (error)) {
+        struct remote_ping_message rpm = { .message_id = IKC_MSG_PING, .value = value };
 
+        uintptr_t reply [IKC_MAX_MESSAGE_SIZE / sizeof (uintptr_t)];
+        uint32_t start = bench_cycle_count ();
+        error = ikc_rpc_call (&rpm, sizeof (rpm), reply, NULL);
+        *cycles = bench_cycle_count () - start;
+
+        if (err_is_ok (error) && reply [0] != value) {
+            error = AOS_ERR_LMP_INVALID_ARGS;
+        }
+    }
+    return error;
+}
 
 /**
  * The main receive handler for init.
@@ -160,6 +351,10 @@ static void my_handler (struct lmp_chan* channel, struct lmp_recv_msg* message,
             size_t bits = message -> words [1];
             struct capref ram;
             error = ram_alloc (&ram, bits);
+            if (err_is_ok (error)) {
+                // Only this domain may give it back.
+                mem_serv_grant (channel, ram);
+            }
 
             lmp_chan_send2 (channel, 0, ram, error, bits);
 
@@ -169,8 +364,80 @@ static void my_handler (struct lmp_chan* channel, struct lmp_recv_msg* message,
         case AOS_ROUTE_REGISTER_SERVICE:;
             debug_printf_quiet ("Got AOS_ROUTE_REGISTER_SERVICE 0x%x\n", message -> words [1]);
             assert (capref_is_null (cap));
-            services [message -> words [1]] = channel;
-            lmp_chan_send1 (channel, 0, NULL_CAP, SYS_ERR_OK);
+            uint32_t registered_service = message -> words [1];
+            if (registered_service < aos_service_guard) {
+                services [registered_service] = channel;
+                publish_name (registered_service, NULL, 0);
+            } else {
+                error = AOS_ERR_LMP_INVALID_ARGS;
+            }
+            lmp_chan_send1 (channel, 0, NULL_CAP, error);
+            break;
+        case AOS_ROUTE_REGISTER_NAME:;
+            uint32_t metadata = message -> words [1];
+            char* service_name = NULL;
+            uint32_t named_service = 0;
+            error = server_get_string (message, 2, &service_name);
+
+            if (err_is_ok (error) && strlen (service_name) >= AOS_NAME_LENGTH) {
+                error = AOS_ERR_LMP_INVALID_ARGS;
+            }
+            if (err_is_ok (error)) {
+                debug_printf_quiet ("Got AOS_ROUTE_REGISTER_NAME %s\n", service_name);
+                error = register_name (channel, service_name, metadata, &named_service);
+            }
+            lmp_chan_send2 (channel, 0, NULL_CAP, error, named_service);
+            break;
+        case AOS_RPC_GET_NAME_DIRECTORY:;
+            // The client can only map the frame read-only.
+            lmp_chan_send1 (channel, 0, name_directory_readonly, SYS_ERR_OK);
+            break;
+        case AOS_RPC_IKC_PING:;
+            uint32_t ping_value = message -> words [1];
+            uint32_t ping_cycles = 0;
+            if (get_core_id () == 0) {
+                error = ping_remotely (ping_value, &ping_cycles);
+            } else {
+                error = SYS_ERR_CORE_NOT_FOUND;
+            }
+            lmp_chan_send3 (channel, 0, NULL_CAP, error, ping_value, ping_cycles);
+            break;
+        case AOS_RPC_GET_MEMORY_STATS:;
+            coreid_t stats_core = message -> words [1];
+            struct aos_memory_stats stats = { 0 };
+            if (stats_core == get_core_id ()) {
+                mem_serv_get_stats (&stats);
+            } else if (stats_core == 0 || stats_core == 1) {
+                // Asked on either core, the other memory server answers over the memory channel.
+                error = mem_serv_get_remote_stats (&stats);
+            } else {
+                error = SYS_ERR_CORE_NOT_FOUND;
+            }
+            lmp_chan_send5 (channel, 0, NULL_CAP, error, stats.free, stats.used, stats.borrowed, stats.lent);
+            break;
+        case AOS_RPC_REVOKE_REMOTE:;
+            // The domain revokes its own copies once the other core is done.
+            if (capref_is_null (cap)) {
+                error = AOS_ERR_LMP_INVALID_ARGS;
+            } else {
+                error = cross_core_cap_revoke (cap);
+                cap_destroy (cap);
+            }
+            lmp_chan_send1 (channel, 0, NULL_CAP, error);
+            debug_printf_quiet ("Handled AOS_RPC_REVOKE_REMOTE: %s\n", err_getstring (error));
+            break;
+        case AOS_RPC_FREE_RAM_CAP:;
+            // On success, the memory server keeps the slot.
+            if (capref_is_null (cap)) {
+                error = AOS_ERR_LMP_INVALID_ARGS;
+            } else {
+                error = mem_serv_free_granted (channel, cap);
+                if (err_is_fail (error)) {
+                    cap_destroy (cap);
+                }
+            }
+            lmp_chan_send1 (channel, 0, NULL_CAP, error);
+            debug_printf_quiet ("Handled AOS_RPC_FREE_RAM_CAP: %s\n", err_getstring (error));
             break;
         case AOS_RPC_GET_DEVICE_FRAME:;
             uint32_t device_addr = message -> words [1];
@@ -188,34 +455,16 @@ static void my_handler (struct lmp_chan* channel, struct lmp_recv_msg* message,
 
             // find correct server channel
             uint32_t requested_service = message -> words [1];
-            if (0 <= requested_service && requested_service < aos_service_guard) {
-                struct lmp_chan* serv = services [requested_service];
-
-                if (serv != NULL) {
-                    // generate new ID
-                    bool found = false;
-                    for (int i = 0; i < MAX_FIND_REQUESTS && !found; i++) {
-
-                        if (find_request [i] == NULL) {
-                            found = true;
-                            // store current channel at ID
-                            find_request [i] = channel;
-                            // generate AOS_ROUTE_REQUEST_EP request with ID.
-                            lmp_chan_send2 (serv, 0, NULL_CAP, AOS_ROUTE_REQUEST_EP, i);
-                        }
-                    }
-                    if (!found) {
-                        // No free space to allocate a find request ID.
-                        // This is very rare...
-                        lmp_chan_send1 (channel, 0, NULL_CAP, -1); // TODO: Proper error value
-                    }
-                } else {
-                    // Service is not registered.
-                    lmp_chan_send1 (channel, 0, NULL_CAP, -1); // TODO: proper error value
-                }
+            if (get_core_id () != 0 && requested_service < AOS_NAME_DIRECTORY_SIZE
+                && services [requested_service] == NULL)
+            {
+                // Maybe the service runs on core 0. The proxy replies once it knows.
+                error = proxy_connect (channel, requested_service);
             } else {
-                // Invalid service identifier.
-                lmp_chan_send1 (channel, 0, NULL_CAP, AOS_ERR_LMP_INVALID_ARGS);
+                error = send_endpoint_request (requested_service, channel, NULL, NULL);
+            }
+            if (err_is_fail (error)) {
+                lmp_chan_send1 (channel, 0, NULL_CAP, error);
             }
             break;
         case AOS_ROUTE_DELIVER_EP:;
@@ -223,22 +472,41 @@ static void my_handler (struct lmp_chan* channel, struct lmp_recv_msg* message,
             // get error value and ID from message
             errval_t error_ret = message -> words [1];
             uint32_t req_id = message -> words [2];
-            // lookup receiver channel at ID
-            struct lmp_chan* recv = find_request [req_id];
-            find_request [req_id] = NULL;
-            // generate response with cap and error value
-            lmp_chan_send1 (recv, 0, cap, error_ret);
-            // Delete capability and reuse slot.
-            error = cap_destroy (cap);
+            // lookup receiver at ID
+            struct find_request* request = NULL;
+            if (req_id < MAX_FIND_REQUESTS
+                && (find_requests [req_id].channel != NULL || find_requests [req_id].callback != NULL))
+            {
+                request = &find_requests [req_id];
+            }
+            if (request && request -> callback) {
+                // Init wants the endpoint for itself.
+                endpoint_callback_t callback = request -> callback;
+                void* callback_arg = request -> arg;
+                request -> callback = NULL;
+                request -> next_free = free_find_requests;
+                free_find_requests = request;
+                callback (callback_arg, error_ret, cap);
+            } else {
+                if (request) {
+                    struct lmp_chan* recv = request -> channel;
+                    request -> channel = NULL;
+                    request -> next_free = free_find_requests;
+                    free_find_requests = request;
+                    // generate response with cap and error value
+                    lmp_chan_send1 (recv, 0, cap, error_ret);
+                }
+                // Delete capability and reuse slot.
+                error = cap_destroy (cap);
+            }
             break;
         case AOS_RPC_SPAWN_DOMAIN:;
-            uint32_t mem_desc = message -> words [1];
-            coreid_t core_id = message -> words [2];
+            coreid_t core_id = message -> words [1];
             debug_printf_quiet ("AOS_RPC_SPAWN_DOMAIN on core %u\n", core_id);
             domainid_t new_domain_id = -1;
 
-            void* domain_name = NULL;
-            error = get_shared_buffer (mem_desc, &domain_name, NULL);
+            char* domain_name = NULL;
+            error = server_get_string (message, 2, &domain_name);
 
             if (err_is_ok (error)) {
                 if (core_id == get_core_id()) {
@@ -313,6 +581,10 @@ static void my_handler (struct lmp_chan* channel, struct lmp_recv_msg* message,
                     error = cap_destroy (domain -> root_cnode_capability);
                 }
 
+                // Its endpoints are gone now, so close its connections to core 0.
+                proxy_close_dead_connections ();
+                mem_serv_forget (domain -> channel);
+
                 // Send back an acknowledgement if it's not a self-kill.
                 if (channel != domain -> channel) {
                     lmp_chan_send1 (channel, 0, NULL_CAP, SYS_ERR_OK);
@@ -409,10 +681,37 @@ static errval_t initep_setup (void)
 __attribute__((unused))
 static struct thread* ikcsrv;
 
+/**
+ * Get the name of the domain to start once the core services are up.
+ * It defaults to the shell and can be changed with the "shell=<name>"
+ * option of init in menu.lst, e.g. to run a benchmark unattended.
+ */
+static void get_shell_name (char* shell, size_t length)
+{
+    strncpy (shell, "memeater", length);
+
+    struct mem_region* region = multiboot_find_module (bi, BINARY_PREFIX "init");
+    const char* options = region ? multiboot_module_rawstring (region) : NULL;
+    const char* option = options ? strstr (options, " shell=") : NULL;
+
+    if (option) {
+        option += strlen (" shell=");
+        size_t option_length = strcspn (option, " ");
+        if (option_length < length) {
+            strncpy (shell, option, option_length);
+            shell [option_length] = '\0';
+        }
+    }
+    shell [length - 1] = '\0';
+}
+
 int main(int argc, char *argv[])
 {
     errval_t err = SYS_ERR_OK;
 
+    // Swapping needs init to find the filesystem driver.
+    paging_disable_swap ();
+
     // Initialize some core data structures.
     init_data_structures (argv);
 
@@ -469,6 +768,14 @@ int main(int argc, char *argv[])
     // Map the shared cross core buffer into our address space.
     err = init_cross_core_buffer ();
     assert (err_is_ok (err));
+    err = ikc_init_channels ();
+    assert (err_is_ok (err));
+
+    // NOTE: Without notifications the channels still work by polling.
+    errval_t notify_err = ikc_enable_notifications ();
+    if (err_is_fail (notify_err)) {
+        debug_printf ("Failed to enable cross core notifications: %s\n", err_getstring (notify_err));
+    }
 
     if (get_core_id () != 0) {
         // NOTE: This is a workaround for a bug.
@@ -478,6 +785,21 @@ int main(int argc, char *argv[])
         // We're the second init and need to create a listener thread.
         ikcsrv = thread_create(ikc_server, NULL);
 
+        // Give our domains access to the services on core 0.
+        // NOTE: Failures are not fatal, init.1 can still spawn domains.
+        errval_t setup_err = cross_core_caps_init ();
+        if (err_is_fail (setup_err)) {
+            debug_printf ("Failed to start sharing capabilities: %s\n", err_getstring (setup_err));
+        }
+        setup_err = proxy_init ();
+        if (err_is_fail (setup_err)) {
+            debug_printf ("Failed to start the service proxy: %s\n", err_getstring (setup_err));
+        }
+        setup_err = mem_serv_enable_stealing ();
+        if (err_is_fail (setup_err)) {
+            debug_printf ("Failed to enable memory stealing: %s\n", err_getstring (setup_err));
+        }
+
     } else {
         // Initialize the serial driver.
         err = spawn ("serial_driver", NULL);
@@ -502,7 +824,9 @@ int main(int argc, char *argv[])
         debug_printf_quiet ("initialized core services\n");
 
         // Spawn the shell.
-        err = spawn ("memeater", NULL);
+        char shell [MAX_PROCESS_NAME_LENGTH + 1];
+        get_shell_name (shell, sizeof (shell));
+        err = spawn (shell, NULL);
     }
 
     // Go into messaging main loop.
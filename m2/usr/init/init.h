@@ -26,6 +26,13 @@ coreid_t get_core_id (void);
 // Physical memory server functions.
 errval_t initialize_ram_alloc(void);
 errval_t initialize_mem_serv(void);
+errval_t mem_serv_enable_stealing(void);
+errval_t mem_serv_free(struct capref cap);
+void mem_serv_grant(void *owner, struct capref cap);
+errval_t mem_serv_free_granted(void *owner, struct capref cap);
+void mem_serv_forget(void *owner);
+void mem_serv_get_stats(struct aos_memory_stats *stats);
+errval_t mem_serv_get_remote_stats(struct aos_memory_stats *stats);
 
 // Device frame server functions.
 errval_t initialize_device_frame_server (struct capref io_space_cap);
@@ -60,16 +67,58 @@ uint32_t max_domain_id (void);
 struct domain_info* get_domain_info (domainid_t id);
 errval_t spawn (char* name, domainid_t* ret_id);
 
+// Service lookup on behalf of init. The callback owns the endpoint.
+typedef void (*endpoint_callback_t) (void* arg, errval_t error, struct capref endpoint);
+errval_t request_service_endpoint (uint32_t service, endpoint_callback_t callback, void* arg);
+
 // Cross core setup:
 errval_t init_cross_core_buffer (void);
 void* get_cross_core_buffer (void);
+size_t get_cross_core_buffer_size (void);
 errval_t spawn_core (coreid_t core_identifier);
 
 // Cross core communication:
 #define IKC_MSG_REMOTE_SPAWN 0x0FFFFFFFU
-void* ikc_rpc_call(void* message, int size);
+#define IKC_MSG_PING         0x0FFFFFFEU
+#define IKC_MAX_MESSAGE_SIZE 128 // Limit of the control channel.
+
+// Independent channels between init.0 and init.1.
+enum ikc_channel {
+    ikc_channel_control, // Requests from init.0, handled by ikc_server.
+    ikc_channel_proxy,   // Batches of service requests and replies, see cross_core_proxy.c.
+    ikc_channel_memory,  // Memory stealing and statistics between the memory servers, see mem_serv.c.
+    ikc_channel_caps,    // Revocation of shared capabilities, see cross_core_caps.c.
+    ikc_channel_count
+};
+
+struct cross_core_channel;
+errval_t ikc_init_channels (void);
+errval_t ikc_enable_notifications (void);
+struct cross_core_channel* ikc_get_channel (enum ikc_channel channel);
+errval_t ikc_rpc_call (void* message, size_t size, void* reply, size_t* reply_size);
 int ikc_server(void* data);
 
+// Capabilities shared with the other core:
+struct cross_core_cap {
+    uint8_t type;   // ObjType_Null for no capability.
+    uint8_t bits;
+    uint8_t rights;
+    uint8_t owner;  // Core whose memory it is.
+    uint32_t base;
+};
+
+errval_t cross_core_caps_init (void);
+errval_t cross_core_cap_export (struct capref cap, struct cross_core_cap* ret);
+errval_t cross_core_cap_import (struct cross_core_cap* cap, struct capref* ret);
+errval_t cross_core_cap_borrow (struct cross_core_cap* cap, struct capref* ret);
+errval_t cross_core_cap_revoke (struct capref cap);
+bool cross_core_cap_is_shared (struct capref cap);
+
+// Cross core service proxy:
+errval_t proxy_init (void);
+errval_t proxy_connect (struct lmp_chan* client, uint32_t service);
+void proxy_close_dead_connections (void);
+
 // LED controls:
 errval_t led_init (void);
 void led_set_state (bool new_state);
@@ -15,6 +15,7 @@
 #include <string.h>
 #include "init.h"
 #include <mm/mm.h>
+#include <aos_support/cross_core_channel.h>
 
 size_t mem_total = 0, mem_avail = 0;
 
@@ -43,8 +44,62 @@ static struct slot_prealloc ram_slot_alloc;
 
 static bool refilling = false;
 
-static errval_t memserv_alloc(struct capref *ret, uint8_t bits, genpaddr_t minbase,
-                              genpaddr_t maxlimit)
+/*
+ * Memory stealing: The kernel gives each core half of the RAM. If the
+ * memory server of one core runs low, it asks the other core for a chunk
+ * of MEM_STEAL_BITS over the memory channel. The other side only gives it
+ * away if it stays above the low watermark itself. The chunk is sent like
+ * any shared capability, and the receiver keeps track of it as borrowed,
+ * see cross_core_cap_borrow.
+ *
+ * Requests and grants are handled by steal_thread. Allocations may happen
+ * on any thread, so the allocator and the grants are protected by
+ * mem_mutex. An allocation which runs out of memory waits on grant_cond
+ * until steal_thread has added the chunk.
+ *
+ * Lock order: mem_mutex is never held while calling into cross_core_caps.c,
+ * as allocating slots there can end up in memserv_alloc.
+ *
+ * The memory statistics of the other core are queried over the same
+ * channel, one query at a time, see mem_serv_get_remote_stats.
+ */
+#define MEM_STEAL_BITS 24
+#define MEM_LOW_WATERMARK (2UL << MEM_STEAL_BITS)
+
+enum mem_steal_kind { mem_steal_request, mem_steal_grant, mem_stats_request, mem_stats_reply };
+
+struct mem_steal_message {
+    uint32_t kind;
+    uint32_t bits;
+    struct cross_core_cap chunk;
+    errval_t error;
+    struct aos_memory_stats stats; // mem_stats_reply only.
+};
+
+/// Free memory, counting allocations through memserv_alloc only.
+static size_t mem_free = 0;
+static size_t mem_borrowed = 0;
+static size_t mem_lent = 0;
+
+static bool stealing_enabled = false;
+static bool steal_pending = false; // We have asked the other core and wait for the grant.
+
+// Nested, as refilling the allocator allocates memory itself.
+static struct thread_mutex mem_mutex = THREAD_MUTEX_INITIALIZER;
+static struct thread_cond grant_cond = THREAD_COND_INITIALIZER;
+static uint32_t alloc_depth = 0;
+
+static struct thread* steal_thread;
+
+// The outstanding statistics query to the other core.
+static struct thread_mutex stats_mutex = THREAD_MUTEX_INITIALIZER;
+static struct thread_cond stats_cond = THREAD_COND_INITIALIZER;
+static bool stats_busy = false;
+static bool stats_done = false;
+static struct aos_memory_stats remote_stats;
+
+static errval_t memserv_alloc_local(struct capref *ret, uint8_t bits, genpaddr_t minbase,
+                                    genpaddr_t maxlimit)
 {
     errval_t err;
 
@@ -89,8 +144,482 @@ static errval_t memserv_alloc(struct capref *ret, uint8_t bits, genpaddr_t minba
         debug_printf("in mem_serv:mymm_alloc(bits=%"PRIu8", minbase=%"PRIxGENPADDR
                      ", maxlimit=%"PRIxGENPADDR")\n", bits, minbase, maxlimit);
         DEBUG_ERR(err, "mem_serv:mymm_alloc");
+    } else {
+        mem_free -= ((size_t)1) << bits;
+    }
+
+    return err;
+}
+
+/// Ask the other core for a chunk, unless we're already waiting for one. Needs mem_mutex.
+static void request_chunk(void)
+{
+    if (stealing_enabled && !steal_pending) {
+        struct mem_steal_message request = { .kind = mem_steal_request, .bits = MEM_STEAL_BITS };
+        errval_t err = cross_core_send(ikc_get_channel(ikc_channel_memory), &request, sizeof(request));
+        steal_pending = err_is_ok(err);
+    }
+}
+
+static errval_t memserv_alloc(struct capref *ret, uint8_t bits, genpaddr_t minbase,
+                              genpaddr_t maxlimit)
+{
+    thread_mutex_lock_nested(&mem_mutex);
+    alloc_depth++;
+
+    errval_t err = memserv_alloc_local(ret, bits, minbase, maxlimit);
+
+    // Out of memory: Wait for a chunk from the other core and try again.
+    // The other core only has memory in its own range, so this doesn't help for ranged requests.
+    // Nested allocations can't wait, as mem_mutex would stay locked. Neither can
+    // steal_thread, which is the one adding the chunk.
+    if (err_is_fail(err) && maxlimit == 0 && bits < MEM_STEAL_BITS
+        && alloc_depth == 1 && thread_self() != steal_thread) {
+        request_chunk();
+        while (steal_pending) {
+            thread_cond_wait(&grant_cond, &mem_mutex);
+        }
+        err = memserv_alloc_local(ret, bits, minbase, maxlimit);
+    }
+
+    // Refill early, such that domains don't have to wait.
+    if (mem_free < MEM_LOW_WATERMARK) {
+        request_chunk();
+    }
+
+    alloc_depth--;
+    thread_mutex_unlock(&mem_mutex);
+    return err;
+}
+
+/// Give a chunk to the other core, if we can spare it.
+static void handle_steal_request(struct mem_steal_message *request)
+{
+    struct mem_steal_message grant = { .kind = mem_steal_grant, .bits = request->bits };
+    size_t size = ((size_t)1) << grant.bits;
+    struct capref chunk;
+
+    thread_mutex_lock_nested(&mem_mutex);
+    if (grant.bits > MEM_STEAL_BITS || mem_free < size + MEM_LOW_WATERMARK) {
+        grant.error = AOS_ERR_MEMORY_LOW;
+    } else {
+        grant.error = memserv_alloc_local(&chunk, grant.bits, 0, 0);
+    }
+    thread_mutex_unlock(&mem_mutex);
+
+    if (err_is_ok(grant.error)) {
+        // The chunk stays allocated here, the other core creates its own capability.
+        grant.error = cross_core_cap_export(chunk, &grant.chunk);
+        cap_destroy(chunk);
+    }
+
+    thread_mutex_lock_nested(&mem_mutex);
+    if (err_is_ok(grant.error)) {
+        mem_lent += size;
+    }
+    errval_t err = cross_core_send(ikc_get_channel(ikc_channel_memory), &grant, sizeof(grant));
+    thread_mutex_unlock(&mem_mutex);
+    if (err_is_fail(err)) {
+        DEBUG_ERR(err, "mem_serv: sending chunk");
+    }
+}
+
+/// Add a chunk from the other core to our allocator, and wake up the allocations waiting for it.
+static void handle_steal_grant(struct mem_steal_message *grant)
+{
+    errval_t err = grant->error;
+    struct capref chunk;
+    if (err_is_ok(err)) {
+        err = cross_core_cap_borrow(&grant->chunk, &chunk);
+    }
+
+    thread_mutex_lock_nested(&mem_mutex);
+    if (err_is_ok(err)) {
+        err = mm_add(&mm_ram, chunk, grant->chunk.bits, grant->chunk.base);
+    }
+    if (err_is_ok(err)) {
+        size_t size = ((size_t)1) << grant->chunk.bits;
+        mem_avail += size;
+        mem_free += size;
+        mem_borrowed += size;
+    }
+    steal_pending = false;
+    thread_cond_broadcast(&grant_cond);
+    thread_mutex_unlock(&mem_mutex);
+
+    if (err_is_fail(err)) {
+        debug_printf("mem_serv: no chunk from the other core: %s\n", err_getstring(err));
+    }
+}
+
+/// Send our statistics to the other core.
+static void handle_stats_request(void)
+{
+    struct mem_steal_message reply = { .kind = mem_stats_reply };
+    mem_serv_get_stats(&reply.stats);
+
+    thread_mutex_lock_nested(&mem_mutex);
+    errval_t err = cross_core_send(ikc_get_channel(ikc_channel_memory), &reply, sizeof(reply));
+    thread_mutex_unlock(&mem_mutex);
+    if (err_is_fail(err)) {
+        DEBUG_ERR(err, "mem_serv: sending statistics");
     }
+}
+
+/// Pass the statistics of the other core on to mem_serv_get_remote_stats.
+static void handle_stats_reply(struct mem_steal_message *reply)
+{
+    thread_mutex_lock(&stats_mutex);
+    remote_stats = reply->stats;
+    stats_done = true;
+    thread_cond_broadcast(&stats_cond);
+    thread_mutex_unlock(&stats_mutex);
+}
 
+/// Handle requests and grants from the other core.
+static int steal_thread_func(void *arg)
+{
+    struct cross_core_channel *channel = ikc_get_channel(ikc_channel_memory);
+
+    while (true) {
+        struct mem_steal_message message;
+        size_t size = 0;
+        errval_t err = cross_core_receive(channel, &message, &size);
+        if (err_is_fail(err) || size != sizeof(message)) {
+            debug_printf("mem_serv: invalid steal message\n");
+            continue;
+        }
+
+        switch (message.kind) {
+        case mem_steal_request:
+            handle_steal_request(&message);
+            break;
+        case mem_steal_grant:
+            handle_steal_grant(&message);
+            break;
+        case mem_stats_request:
+            handle_stats_request();
+            break;
+        case mem_stats_reply:
+            handle_stats_reply(&message);
+            break;
+        default:
+            debug_printf("mem_serv: unknown message kind %u\n", message.kind);
+        }
+    }
+    return 0;
+}
+
+/**
+ * \brief Exchange memory with the memory server on the other core.
+ * Call once both cores are up.
+ */
+errval_t mem_serv_enable_stealing(void)
+{
+    if (steal_thread != NULL) {
+        return SYS_ERR_OK;
+    }
+
+    steal_thread = thread_create(steal_thread_func, NULL);
+    if (steal_thread == NULL) {
+        return LIB_ERR_THREAD_CREATE;
+    }
+
+    thread_mutex_lock_nested(&mem_mutex);
+    stealing_enabled = true;
+
+    // We might be low already.
+    if (mem_free < MEM_LOW_WATERMARK) {
+        request_chunk();
+    }
+    thread_mutex_unlock(&mem_mutex);
+    return SYS_ERR_OK;
+}
+
+/// Memory handed out to a domain, which only that domain may give back.
+struct mem_grant {
+    void *owner;
+    genpaddr_t base;
+    uint8_t bits;
+};
+
+static struct mem_grant *grants = NULL;
+static size_t grant_count = 0;
+static size_t grant_capacity = 0;
+
+/// Get the physical range of a RAM or frame capability.
+static errval_t identify_memory(struct capref cap, genpaddr_t *base, uint8_t *bits)
+{
+    struct capability capability;
+    errval_t err = invoke_kernel_identify_cap(cap_kernel, cap, &capability);
+
+    if (err_is_ok(err)) {
+        if (capability.type == ObjType_RAM) {
+            *base = capability.u.ram.base;
+            *bits = capability.u.ram.bits;
+        } else if (capability.type == ObjType_Frame) {
+            *base = capability.u.frame.base;
+            *bits = capability.u.frame.bits;
+        } else {
+            err = AOS_ERR_LMP_INVALID_ARGS;
+        }
+    }
+    return err;
+}
+
+/// Find the grant of exactly this range to 'owner', or any grant overlapping it if 'owner' is NULL.
+static struct mem_grant *find_grant(void *owner, genpaddr_t base, uint8_t bits)
+{
+    genpaddr_t end = base + (((genpaddr_t)1) << bits);
+
+    for (size_t i = 0; i < grant_count; i++) {
+        struct mem_grant *grant = &grants[i];
+        genpaddr_t grant_end = grant->base + (((genpaddr_t)1) << grant->bits);
+
+        if (owner == NULL) {
+            if (grant->base < end && base < grant_end) {
+                return grant;
+            }
+        } else if (grant->owner == owner && grant->base == base && grant->bits == bits) {
+            return grant;
+        }
+    }
+    return NULL;
+}
+
+static void remove_grant(struct mem_grant *grant)
+{
+    grant_count--;
+    *grant = grants[grant_count];
+}
+
+/**
+ * \brief Record that 'cap' was handed out to 'owner', e.g. the channel of a domain.
+ * Only the owner may give it back with mem_serv_free_granted.
+ */
+void mem_serv_grant(void *owner, struct capref cap)
+{
+    genpaddr_t base = 0;
+    uint8_t bits = 0;
+    errval_t err = identify_memory(cap, &base, &bits);
+
+    thread_mutex_lock_nested(&mem_mutex);
+    if (err_is_ok(err) && grant_count == grant_capacity) {
+        size_t capacity = grant_capacity ? 2 * grant_capacity : 64;
+        struct mem_grant *resized = realloc(grants, capacity * sizeof(struct mem_grant));
+        if (resized) {
+            grants = resized;
+            grant_capacity = capacity;
+        } else {
+            err = LIB_ERR_MALLOC_FAIL;
+        }
+    }
+    if (err_is_ok(err)) {
+        grants[grant_count] = (struct mem_grant) { .owner = owner, .base = base, .bits = bits };
+        grant_count++;
+    }
+    thread_mutex_unlock(&mem_mutex);
+
+    if (err_is_fail(err)) {
+        // The owner just can't give it back.
+        DEBUG_ERR(err, "mem_serv: tracking a grant");
+    }
+}
+
+/**
+ * \brief Forget the grants of an owner which is gone.
+ */
+void mem_serv_forget(void *owner)
+{
+    thread_mutex_lock_nested(&mem_mutex);
+    for (size_t i = grant_count; i > 0; i--) {
+        if (grants[i - 1].owner == owner) {
+            remove_grant(&grants[i - 1]);
+        }
+    }
+    thread_mutex_unlock(&mem_mutex);
+}
+
+/**
+ * Give memory back to the allocator, if nobody else can still use it:
+ * The range has to be allocated in mm, and 'cap' may have one other copy
+ * at most, i.e. the one of the domain which gave it back. The caller checks
+ * that it isn't shared with the other core. The remaining copy is deleted,
+ * and the allocator gets a new RAM capability for the range in the same slot.
+ * Needs mem_mutex.
+ */
+static errval_t free_memory(struct capref cap, genpaddr_t base, uint8_t bits)
+{
+    // Fails if the range is not ours, e.g. memory of a multiboot module.
+    if (!mm_is_allocated(&mm_ram, base, bits)) {
+        return MM_ERR_NOT_FOUND;
+    }
+
+    uintptr_t relations = 0;
+    errval_t err = invoke_kernel_cap_relations(cap_kernel, cap, &relations);
+    if (err_is_ok(err)) {
+        bool related = (relations & (CAP_RELATION_ANCESTORS | CAP_RELATION_DESCENDANTS)) != 0;
+        if (related || (relations >> CAP_RELATION_COPIES_SHIFT) > 1) {
+            err = AOS_ERR_MEMORY_SHARED;
+        }
+    }
+
+    if (err_is_ok(err)) {
+        err = cap_revoke(cap);
+    }
+    if (err_is_ok(err)) {
+        err = cap_delete(cap);
+    }
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    struct capability capability;
+    memset(&capability, 0, sizeof(capability));
+    capability.type = ObjType_RAM;
+    capability.rights = CAPRIGHTS_ALLRIGHTS;
+    capability.u.ram.base = base;
+    capability.u.ram.bits = bits;
+
+    err = invoke_kernel_create_cap(cap_kernel, &capability, cap);
+    if (err_is_ok(err)) {
+        err = mm_free(&mm_ram, cap, base, bits);
+    }
+    if (err_is_ok(err)) {
+        mem_free += ((size_t)1) << bits;
+    }
+    return err;
+}
+
+/**
+ * \brief Give memory of init itself back to the allocator.
+ *
+ * 'cap' is a RAM or frame capability handed out by memserv_alloc to init,
+ * i.e. not to a domain. On failure, the slot stays with the caller.
+ */
+errval_t mem_serv_free(struct capref cap)
+{
+    genpaddr_t base = 0;
+    uint8_t bits = 0;
+    errval_t err = identify_memory(cap, &base, &bits);
+
+    if (err_is_ok(err) && cross_core_cap_is_shared(cap)) {
+        err = AOS_ERR_MEMORY_SHARED;
+    }
+
+    thread_mutex_lock_nested(&mem_mutex);
+    if (err_is_ok(err) && find_grant(NULL, base, bits) != NULL) {
+        err = AOS_ERR_MEMORY_NOT_OWNED;
+    }
+    if (err_is_ok(err)) {
+        err = free_memory(cap, base, bits);
+    }
+    thread_mutex_unlock(&mem_mutex);
+    return err;
+}
+
+/**
+ * \brief Give memory back which was handed out to 'owner' with mem_serv_grant.
+ *
+ * 'cap' has to cover the whole grant, and the owner may not have shared it.
+ * On failure, the slot stays with the caller.
+ */
+errval_t mem_serv_free_granted(void *owner, struct capref cap)
+{
+    genpaddr_t base = 0;
+    uint8_t bits = 0;
+    errval_t err = identify_memory(cap, &base, &bits);
+
+    if (err_is_ok(err) && cross_core_cap_is_shared(cap)) {
+        err = AOS_ERR_MEMORY_SHARED;
+    }
+
+    thread_mutex_lock_nested(&mem_mutex);
+    struct mem_grant *grant = NULL;
+    if (err_is_ok(err)) {
+        grant = find_grant(owner, base, bits);
+        if (grant == NULL) {
+            err = AOS_ERR_MEMORY_NOT_OWNED;
+        }
+    }
+    if (err_is_ok(err)) {
+        err = free_memory(cap, base, bits);
+    }
+    if (err_is_ok(err)) {
+        remove_grant(grant);
+    }
+    thread_mutex_unlock(&mem_mutex);
+    return err;
+}
+
+/// Count the free memory below 'node', which has a size of 2^bits.
+static size_t count_free(struct mmnode *node, uint8_t bits)
+{
+    if (node == NULL || node->type == NodeType_Allocated) {
+        return 0;
+    } else if (node->type == NodeType_Free) {
+        return ((size_t)1) << bits;
+    }
+
+    size_t free = 0;
+    for (size_t i = 0; i < (1UL << node->childbits); i++) {
+        free += count_free(node->children[i], bits - node->childbits);
+    }
+    return free;
+}
+
+/**
+ * \brief Get the memory statistics of this core.
+ *
+ * Memory lent to the other core counts as used.
+ * May be called on any thread.
+ */
+void mem_serv_get_stats(struct aos_memory_stats *stats)
+{
+    thread_mutex_lock_nested(&mem_mutex);
+    stats->free = count_free(mm_ram.root, mm_ram.sizebits);
+    stats->used = mem_avail - stats->free;
+    stats->borrowed = mem_borrowed;
+    stats->lent = mem_lent;
+    thread_mutex_unlock(&mem_mutex);
+}
+
+/**
+ * \brief Get the memory statistics of the other core from its memory server.
+ *
+ * Blocks until the reply has arrived. Fails with SYS_ERR_CORE_NOT_FOUND
+ * if the other core isn't up yet.
+ */
+errval_t mem_serv_get_remote_stats(struct aos_memory_stats *stats)
+{
+    if (!stealing_enabled) {
+        return SYS_ERR_CORE_NOT_FOUND;
+    }
+
+    thread_mutex_lock(&stats_mutex);
+    while (stats_busy) {
+        thread_cond_wait(&stats_cond, &stats_mutex);
+    }
+    stats_busy = true;
+    stats_done = false;
+    thread_mutex_unlock(&stats_mutex);
+
+    // Messages on the memory channel are sent with mem_mutex held.
+    struct mem_steal_message request = { .kind = mem_stats_request };
+    thread_mutex_lock_nested(&mem_mutex);
+    errval_t err = cross_core_send(ikc_get_channel(ikc_channel_memory), &request, sizeof(request));
+    thread_mutex_unlock(&mem_mutex);
+
+    thread_mutex_lock(&stats_mutex);
+    while (err_is_ok(err) && !stats_done) {
+        thread_cond_wait(&stats_cond, &stats_mutex);
+    }
+    if (err_is_ok(err)) {
+        *stats = remote_stats;
+    }
+    stats_busy = false;
+    thread_cond_broadcast(&stats_cond);
+    thread_mutex_unlock(&stats_mutex);
     return err;
 }
 
@@ -159,6 +688,7 @@ errval_t initialize_mem_serv(void)
                          bi->regions[i].mr_base);
             if (err_is_ok(err)) {
                 mem_avail += ((size_t)1) << bi->regions[i].mr_bits;
+                mem_free += ((size_t)1) << bi->regions[i].mr_bits;
             } else {
                 DEBUG_ERR(err, "Warning: adding RAM region %d (%p/%d) FAILED",
                           i, bi->regions[i].mr_base, bi->regions[i].mr_bits);
@@ -203,6 +733,7 @@ errval_t initialize_mem_serv(void)
 
     // switch over ram alloc to proper ram allocator
     ram_alloc_set(memserv_alloc);
+    ram_free_set(mem_serv_free);
 
     return SYS_ERR_OK;
 }
@@ -94,6 +94,19 @@ static errval_t copy_capability (struct capref* destination, struct capref sourc
     return error;
 }
 
+/// Domains which are allowed to register interrupt handlers.
+static const char* irq_domains [] = { "serial_driver" };
+
+static bool needs_irq_capability (char* domain_name)
+{
+    for (int i = 0; i < sizeof (irq_domains) / sizeof (irq_domains [0]); i++) {
+        if (strcmp (domain_name, irq_domains [i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /**
  * Spawn a new domain with an initial channel to init.
  *
@@ -134,6 +147,7 @@ static errval_t spawn_with_channel (char* command_string, uint32_t domain_id)
     struct spawninfo new_domain;
     memset (&new_domain, 0, sizeof (struct spawninfo));
     new_domain.domain_id = domain_id;
+    new_domain.image = &(info->image);
 
 
     if (err_is_ok (error)) {
@@ -184,6 +198,15 @@ static errval_t spawn_with_channel (char* command_string, uint32_t domain_id)
         domain_data -> channel = initial_channel;
     }
 
+    // Device drivers which handle interrupts get access to the IRQ table.
+    if (err_is_ok (error) && needs_irq_capability (domain_name)) {
+        struct capref irq_remote_cap;
+        irq_remote_cap.cnode = new_domain.taskcn;
+        irq_remote_cap.slot  = TASKCN_SLOT_IRQ;
+
+        error = cap_copy (irq_remote_cap, cap_irq);
+    }
+
     // Make the domain runnable
     if (err_is_ok (error)) {
         error = spawn_run(&new_domain);
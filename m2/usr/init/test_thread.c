@@ -5,7 +5,7 @@
 #include "init.h"
 #include <barrelfish/aos_rpc.h>
 
-extern struct lmp_chan* services [aos_service_guard];
+extern struct lmp_chan* services [AOS_NAME_DIRECTORY_SIZE];
 
 static void test_thread_handler (void *arg)
 {
@@ -21,7 +21,7 @@ static void test_thread_handler (void *arg)
         // reregister
         lmp_chan_register_recv (lc, get_default_waitset(), MKCLOSURE(test_thread_handler, arg));
     }
-    uint32_t type = msg.words [0];
+    uint32_t type = AOS_RPC_MESSAGE_TYPE (msg.words [0]);
     switch (type)
     {
         case AOS_PING:
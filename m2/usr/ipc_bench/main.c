@@ -0,0 +1,314 @@
+/**
+ * \file
+ * \brief Benchmarks for the AOS IPC layer.
+ *
+ * Every benchmark records the cost of single operations with the cycle
+ * counter (on gem5, the CPU private timer) and reports the minimum, median
+ * and 99th percentile. The results are printed as one line per benchmark,
+ * which is parsed by the ipc_bench test of the harness:
+ *
+ *   ipc_bench: <name> samples <n> min <cycles> median <cycles> p99 <cycles>
+ *
+ * To run it unattended, start init with the option "shell=ipc_bench".
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <barrelfish/aos_rpc.h>
+#include <barrelfish/barrelfish.h>
+#include <bench/bench.h>
+
+#define LOG_SIZE 4096
+#define LOG_REPETITIONS 4
+
+#define PING_REPETITIONS 1000
+
+#define MAX_SAMPLES 1000
+#define SEND_SAMPLES 1000
+#define STRING_SAMPLES 100
+#define RAM_SAMPLES 200
+#define LOOKUP_SAMPLES 200
+#define IKC_SAMPLES 200
+
+/// Sizes for aos_rpc_send_string, ending with a carriage return.
+static const size_t string_sizes [] = { 8, 28, 128, 1024, 4000 };
+#define STRING_SIZE_COUNT (sizeof (string_sizes) / sizeof (string_sizes [0]))
+
+static char log_buffer [LOG_SIZE];
+
+static uint32_t samples [MAX_SAMPLES];
+
+static int compare_cycles (const void* a, const void* b)
+{
+    uint32_t first = *(const uint32_t*) a;
+    uint32_t second = *(const uint32_t*) b;
+    return (first > second) - (first < second);
+}
+
+/// Sort the samples and print min, median and p99.
+static void report (const char* name, int count)
+{
+    if (count == 0) {
+        printf ("ipc_bench: %s skipped\n", name);
+        return;
+    }
+    qsort (samples, count, sizeof (uint32_t), compare_cycles);
+
+    printf ("ipc_bench: %s samples %d min %u median %u p99 %u\n", name, count,
+            samples [0], samples [count / 2], samples [(count * 99) / 100]);
+}
+
+/// Null LMP send: A message without arguments to our own endpoint.
+static void null_send_benchmark (void)
+{
+    struct lmp_chan channel;
+    errval_t error = lmp_chan_accept (&channel, DEFAULT_LMP_BUF_WORDS, NULL_CAP);
+    channel.remote_cap = channel.local_cap;
+
+    int count = 0;
+    while (err_is_ok (error) && count < SEND_SAMPLES) {
+        uint32_t start = bench_cycle_count ();
+        error = lmp_chan_send0 (&channel, 0, NULL_CAP);
+        samples [count] = bench_cycle_count () - start;
+
+        // Drain the endpoint, such that the buffer never runs full.
+        struct lmp_recv_msg message = LMP_RECV_MSG_INIT;
+        if (err_is_ok (error)) {
+            error = lmp_chan_recv (&channel, &message, NULL);
+            count++;
+        }
+    }
+    if (err_is_fail (error)) {
+        debug_printf ("null_send_benchmark: %s\n", err_getstring (error));
+    }
+    report ("null_lmp_send", count);
+    lmp_chan_destroy (&channel);
+}
+
+/// Round trip of aos_ping to init.
+static void ping_benchmark (const char* name, bool donate)
+{
+    struct aos_rpc* init = aos_rpc_get_init_channel ();
+    aos_rpc_set_donation (init, donate);
+
+    errval_t error = SYS_ERR_OK;
+    int count = 0;
+    while (err_is_ok (error) && count < PING_REPETITIONS) {
+        uint32_t start = bench_cycle_count ();
+        error = aos_ping (init, count);
+        samples [count] = bench_cycle_count () - start;
+        if (err_is_ok (error)) {
+            count++;
+        }
+    }
+    aos_rpc_set_donation (init, true);
+    report (name, count);
+}
+
+/// aos_rpc_send_string to the serial driver. Prints lines of spaces.
+static void send_string_benchmark (size_t size)
+{
+    char name [32];
+    snprintf (name, sizeof (name), "send_string_%zu", size);
+
+    struct aos_rpc* serial = aos_rpc_get_serial_driver_channel ();
+    char* string = malloc (size + 1);
+    if (serial == NULL || string == NULL) {
+        free (string);
+        report (name, 0);
+        return;
+    }
+    memset (string, ' ', size - 1);
+    string [size - 1] = '\r';
+    string [size] = '\0';
+
+    errval_t error = SYS_ERR_OK;
+    int count = 0;
+    while (err_is_ok (error) && count < STRING_SAMPLES) {
+        uint32_t start = bench_cycle_count ();
+        error = aos_rpc_send_string (serial, string);
+        samples [count] = bench_cycle_count () - start;
+        if (err_is_ok (error)) {
+            count++;
+        }
+    }
+    free (string);
+    report (name, count);
+}
+
+/// Get a RAM capability from init. Deleting it again is not measured.
+static void ram_cap_benchmark (void)
+{
+    struct aos_rpc* init = aos_rpc_get_init_channel ();
+
+    errval_t error = SYS_ERR_OK;
+    int count = 0;
+    while (err_is_ok (error) && count < RAM_SAMPLES) {
+        struct capref ram;
+        size_t bits = 0;
+
+        uint32_t start = bench_cycle_count ();
+        error = aos_rpc_get_ram_cap (init, BASE_PAGE_BITS, &ram, &bits);
+        samples [count] = bench_cycle_count () - start;
+
+        if (err_is_ok (error)) {
+            error = cap_destroy (ram);
+            count++;
+        }
+    }
+    if (err_is_fail (error)) {
+        debug_printf ("ram_cap_benchmark: %s\n", err_getstring (error));
+    }
+    report ("ram_cap_transfer", count);
+}
+
+/// Endpoint lookup, through the name directory and through init.
+static void lookup_benchmark (void)
+{
+    errval_t error = SYS_ERR_OK;
+    int count = 0;
+    while (err_is_ok (error) && count < LOOKUP_SAMPLES) {
+        uint32_t service = 0;
+
+        uint32_t start = bench_cycle_count ();
+        error = aos_lookup_name ("init", &service, NULL);
+        samples [count] = bench_cycle_count () - start;
+        if (err_is_ok (error)) {
+            count++;
+        }
+    }
+    report ("lookup_name", count);
+
+    count = 0;
+    while (err_is_ok (error) && count < LOOKUP_SAMPLES) {
+        struct capref endpoint;
+
+        uint32_t start = bench_cycle_count ();
+        error = aos_find_service (aos_service_init, &endpoint);
+        samples [count] = bench_cycle_count () - start;
+
+        if (err_is_ok (error)) {
+            error = cap_destroy (endpoint);
+            count++;
+        }
+    }
+    if (err_is_fail (error)) {
+        debug_printf ("lookup_benchmark: %s\n", err_getstring (error));
+    }
+    report ("find_service", count);
+}
+
+/// Cross-core round trip between init.0 and init.1.
+static void ikc_benchmark (void)
+{
+    struct aos_rpc* init = aos_rpc_get_init_channel ();
+
+    // The first call boots the second core, so don't measure it.
+    errval_t error = aos_rpc_ikc_ping (init, 0, NULL);
+
+    // The IKC part alone, as measured by init.0.
+    int count = 0;
+    while (err_is_ok (error) && count < IKC_SAMPLES) {
+        error = aos_rpc_ikc_ping (init, count, &samples [count]);
+        if (err_is_ok (error)) {
+            count++;
+        }
+    }
+    report ("ikc_round_trip", count);
+
+    // Including the LMP round trip to init.0.
+    count = 0;
+    while (err_is_ok (error) && count < IKC_SAMPLES) {
+        uint32_t start = bench_cycle_count ();
+        error = aos_rpc_ikc_ping (init, count, NULL);
+        samples [count] = bench_cycle_count () - start;
+        if (err_is_ok (error)) {
+            count++;
+        }
+    }
+    report ("ikc_ping_via_init", count);
+}
+
+/// Fill the log buffer with lines of printable characters.
+static void init_log_buffer (void)
+{
+    for (int i = 0; i < LOG_SIZE; i++) {
+        log_buffer [i] = ((i % 64) == 63) ? '\n' : 'a' + (i % 26);
+    }
+}
+
+/// Old terminal backend: one message per character.
+static void write_putchar (void)
+{
+    struct aos_rpc* serial = aos_rpc_get_serial_driver_channel ();
+    for (int i = 0; i < LOG_SIZE; i++) {
+        aos_rpc_serial_putchar (serial, log_buffer [i]);
+    }
+}
+
+/// Packed messages and bulk strings without stdio.
+static void write_direct (void)
+{
+    aos_rpc_serial_write (aos_rpc_get_serial_driver_channel (), log_buffer, LOG_SIZE);
+}
+
+/// Line-buffered stdout, as used by printf.
+static void write_stdio (void)
+{
+    fwrite (log_buffer, 1, LOG_SIZE, stdout);
+    fflush (stdout);
+}
+
+/// Total cycles for LOG_REPETITIONS writes of the log buffer.
+static uint64_t measure (void (*function) (void))
+{
+    uint64_t total = 0;
+    for (int i = 0; i < LOG_REPETITIONS; i++) {
+        // Sum up single repetitions, the counter may wrap around otherwise.
+        uint32_t start = bench_cycle_count ();
+        function ();
+        total += bench_cycle_count () - start;
+    }
+    return total;
+}
+
+static void serial_throughput_benchmark (void)
+{
+    if (aos_rpc_get_serial_driver_channel () == NULL) {
+        return;
+    }
+    init_log_buffer ();
+
+    uint64_t putchar_time = measure (write_putchar);
+    uint64_t direct_time = measure (write_direct);
+    uint64_t stdio_time = measure (write_stdio);
+
+    uint32_t bytes = LOG_SIZE * LOG_REPETITIONS;
+    printf ("\nSerial throughput (%u bytes, cycles):\n", bytes);
+    printf ("  putchar: %llu\n", putchar_time);
+    printf ("  write  : %llu\n", direct_time);
+    printf ("  stdio  : %llu\n", stdio_time);
+}
+
+int main (int argc, char *argv[])
+{
+    printf ("IPC benchmark started\n");
+
+    null_send_benchmark ();
+    ping_benchmark ("ping_scheduled", false);
+    ping_benchmark ("ping_donated", true);
+    for (int i = 0; i < STRING_SIZE_COUNT; i++) {
+        send_string_benchmark (string_sizes [i]);
+    }
+    printf ("\n");
+    ram_cap_benchmark ();
+    lookup_benchmark ();
+    ikc_benchmark ();
+
+    serial_throughput_benchmark ();
+
+    printf ("IPC benchmark finished\n");
+    return 0;
+}
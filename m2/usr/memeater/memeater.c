@@ -33,6 +33,7 @@ static void exec_cat        (char* const args);
 static void exec_cd         (char* const args);
 static void exec_echo       (char* const args);
 static void exec_exit       (char* const args);
+static void exec_free       (char* const args);
 static void exec_kill       (char* const args);
 static void exec_ledoff    (char* const args);
 static void exec_ledon     (char* const args);
@@ -41,6 +42,7 @@ static void exec_oncore     (char* const args);
 static void exec_ping       (char* const args);
 static void exec_ps         (char* const args);
 static void exec_run_memtest(char* const args);
+static void exec_stats      (char* const args);
 static void exec_test_string(char* const args);
 
 // Set of routines for AOS RPC API testing
@@ -53,6 +55,7 @@ static struct command_desc command_list[] =
     { exec_cd         , "cd"          },
     { exec_echo       , "echo"        },
     { exec_exit       , "exit"        },
+    { exec_free       , "free"        },
     { exec_kill       , "kill"        },
     { exec_ledoff    , "ledoff"     },
     { exec_ledon     , "ledon"      },
@@ -61,6 +64,7 @@ static struct command_desc command_list[] =
     { exec_ping       , "ping"        },
     { exec_ps         , "ps"          },
     { exec_run_memtest, "run_memtest" },
+    { exec_stats      , "stats"       },
     { exec_test_string, "test_string" }
 };
 
@@ -238,6 +242,23 @@ static void exec_exit(char* const args)
     shell_running = false;
 }
 
+static void exec_free(char* const args)
+{
+    printf(" Core\tFree KB\t\tUsed KB\t\tBorrowed KB\tLent KB\n");
+
+    for (coreid_t core = 0; core < 2; core++) {
+        struct aos_memory_stats stats;
+        errval_t err = aos_rpc_get_memory_stats(pm_channel, core, &stats);
+
+        if (err_is_ok(err)) {
+            printf(" %u\t%zu\t\t%zu\t\t%zu\t\t%zu\n", core, stats.free / 1024,
+                   stats.used / 1024, stats.borrowed / 1024, stats.lent / 1024);
+        } else {
+            printf(" %u\t---- Not running ----\n", core);
+        }
+    }
+}
+
 static void exec_kill(char* const args)
 {
     int number = atoi(args);
@@ -381,6 +402,16 @@ static void exec_run_memtest(char* const args)
     }
 }
 
+static void exec_stats(char* const args)
+{
+    // The servers print to their debug output.
+    aos_rpc_print_server_stats(pm_channel);
+    aos_rpc_print_server_stats(serial_channel);
+    if (filesystem_channel) {
+        aos_rpc_print_server_stats(filesystem_channel);
+    }
+}
+
 static void exec_test_string(char* const args)
 {
     errval_t error = aos_rpc_send_string 
@@ -456,16 +487,7 @@ int main(int argc, char *argv[])
 
 //     debug_printf ("Memeater started with %u args. Name: %s\n", argc, argv[0]);
 
-    filesystem_channel = malloc (sizeof (struct aos_rpc));
-    if (filesystem_channel) {
-        struct capref fs_cap;
-        error = aos_find_service (aos_service_filesystem, &fs_cap);
-        if (err_is_ok (error)) {
-            error = aos_rpc_init (filesystem_channel, fs_cap);
-        }
-    } else {
-        error = LIB_ERR_MALLOC_FAIL;
-    }
+    error = aos_rpc_get_service_channel (aos_service_filesystem, &filesystem_channel);
     if (err_is_fail (error)) {
         debug_printf ("ERROR: Connection to filesystem could not be established: %s\n", err_getstring (error));
     }
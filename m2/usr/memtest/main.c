@@ -37,8 +37,16 @@ int main(int argc, char *argv[])
 
     printf ("memtest: buffer filled.\n");
 
+    struct paging_stats stats;
+    paging_get_stats (get_current_paging_state (), &stats);
+    printf ("memtest: %u page faults, %u pages mapped ahead, %u swapped out, %u swapped in.\n",
+            stats.faults, stats.pages_mapped_ahead, stats.pages_swapped_out, stats.pages_swapped_in);
+
     free (mbuf);
 
+    paging_get_stats (get_current_paging_state (), &stats);
+    printf ("memtest: %u frames returned after free.\n", stats.frames_returned);
+
     printf ("memtest returned\n");
     return 0;
 }
@@ -11,6 +11,154 @@ static const uint32_t MBR_SECTOR_IDX = 0U; // MBR is always first sector
 
 static struct fat32_config my_config;
 
+// The SD card driver is not thread-safe, so every access to the card takes
+// sd_mutex. The FAT32 layer protects its own state, and the worker threads
+// only wait for each other while the card is busy.
+static struct thread_mutex sd_mutex = THREAD_MUTEX_INITIALIZER;
+
+// Number of worker threads serving filesystem requests.
+#define FILESYSTEM_WORKERS 2
+
+// The swap area is the first partition of this type, as on Linux.
+#define SWAP_PARTITION_TYPE 0x82
+#define SECTOR_SIZE 512
+#define SECTORS_PER_PAGE (BASE_PAGE_SIZE / SECTOR_SIZE)
+
+// Swap area in pages. It is found during startup, and the bitmap is protected by swap_mutex.
+// Each used slot belongs to the connection which paged out to it. Only that connection
+// can read, overwrite or free the slot. The slots of a connection are freed when it
+// is closed. Slots of domains which are gone are freed once the swap area is full.
+static uint32_t swap_start_sector = 0;
+static uint32_t swap_page_count = 0;
+static uint32_t* swap_bitmap = NULL; // A set bit marks a used swap slot.
+static struct lmp_chan** swap_owners = NULL;
+static uint32_t swap_next_free = 0;
+static struct thread_mutex swap_mutex = THREAD_MUTEX_INITIALIZER;
+
+/// Read a block for the FAT32 layer.
+static errval_t read_block (size_t block, void* buffer)
+{
+    thread_mutex_lock (&sd_mutex);
+    errval_t error = mmchs_read_block (block, buffer);
+    thread_mutex_unlock (&sd_mutex);
+    return error;
+}
+
+static inline bool swap_slot_used (uint32_t slot)
+{
+    return (swap_bitmap [slot / 32] & (1u << (slot % 32))) != 0;
+}
+
+/// Free all slots of 'owner', starting at 'first'. Needs swap_mutex.
+static void swap_free_owner (struct lmp_chan* owner, uint32_t first)
+{
+    for (uint32_t slot = first; slot < swap_page_count; slot++) {
+        if (swap_owners [slot] == owner) {
+            swap_bitmap [slot / 32] &= ~(1u << (slot % 32));
+            swap_owners [slot] = NULL;
+        }
+    }
+}
+
+/// Free the slots of connections whose client has exited. Needs swap_mutex.
+static void swap_free_dead_owners (void)
+{
+    struct lmp_chan* alive = NULL;
+
+    for (uint32_t slot = 0; slot < swap_page_count; slot++) {
+        struct lmp_chan* owner = swap_owners [slot];
+        if (!swap_slot_used (slot) || owner == alive) {
+            continue;
+        }
+
+        if (server_client_alive (owner)) {
+            alive = owner;
+        } else {
+            swap_free_owner (owner, slot);
+        }
+    }
+}
+
+/// Close handler: The slots of a closed connection can't be read back any more.
+static void swap_connection_closed (struct lmp_chan* channel)
+{
+    thread_mutex_lock (&swap_mutex);
+    swap_free_owner (channel, 0);
+    thread_mutex_unlock (&swap_mutex);
+}
+
+static errval_t swap_alloc_slot (struct lmp_chan* owner, uint32_t* slot)
+{
+    errval_t error = AOS_ERR_SWAP_FULL;
+    thread_mutex_lock (&swap_mutex);
+    for (uint32_t round = 0; round < 2 && err_is_fail (error); round++) {
+        if (round > 0) {
+            swap_free_dead_owners ();
+        }
+        for (uint32_t i = 0; i < swap_page_count && err_is_fail (error); i++) {
+            uint32_t candidate = (swap_next_free + i) % swap_page_count;
+            if (!swap_slot_used (candidate)) {
+                swap_bitmap [candidate / 32] |= (1u << (candidate % 32));
+                swap_owners [candidate] = owner;
+                swap_next_free = candidate + 1;
+                *slot = candidate;
+                error = SYS_ERR_OK;
+            }
+        }
+    }
+    thread_mutex_unlock (&swap_mutex);
+    return error;
+}
+
+/// Check that 'slot' has been allocated by 'owner'.
+static errval_t swap_check_owner (struct lmp_chan* owner, uint32_t slot)
+{
+    errval_t error = AOS_ERR_LMP_INVALID_ARGS;
+    thread_mutex_lock (&swap_mutex);
+    if (slot < swap_page_count && swap_slot_used (slot) && swap_owners [slot] == owner) {
+        error = SYS_ERR_OK;
+    }
+    thread_mutex_unlock (&swap_mutex);
+    return error;
+}
+
+static void swap_free_slot (uint32_t slot)
+{
+    thread_mutex_lock (&swap_mutex);
+    swap_bitmap [slot / 32] &= ~(1u << (slot % 32));
+    swap_owners [slot] = NULL;
+    thread_mutex_unlock (&swap_mutex);
+}
+
+static errval_t swap_transfer (uint32_t slot, void* page, bool write)
+{
+    errval_t error = SYS_ERR_OK;
+    uint32_t sector = swap_start_sector + slot * SECTORS_PER_PAGE;
+
+    thread_mutex_lock (&sd_mutex);
+    for (uint32_t i = 0; i < SECTORS_PER_PAGE && err_is_ok (error); i++) {
+        void* buffer = (char*) page + i * SECTOR_SIZE;
+        if (write) {
+            error = mmchs_write_block (sector + i, buffer);
+        } else {
+            error = mmchs_read_block (sector + i, buffer);
+        }
+    }
+    thread_mutex_unlock (&sd_mutex);
+    return error;
+}
+
+static errval_t get_swap_page (uint32_t memory_descriptor, void** page)
+{
+    uint32_t length = 0;
+    errval_t error = get_shared_buffer (memory_descriptor, page, &length);
+
+    if (err_is_ok (error) && length < BASE_PAGE_SIZE) {
+        error = AOS_ERR_LMP_INVALID_ARGS;
+    }
+    return error;
+}
+
 
 static void my_handler (struct lmp_chan* channel, struct lmp_recv_msg* message, struct capref capability, uint32_t message_type)
 {
@@ -22,9 +170,12 @@ static void my_handler (struct lmp_chan* channel, struct lmp_recv_msg* message,
     switch (message_type) {
         case AOS_RPC_OPEN_FILE:;
             {
-                char* path = (char*)(&message->words[2]);
+                char* path = NULL;
+                error = server_get_string (message, 2, &path);
 
-                error = fat32_open_file(&my_config, path, &file_descriptor);
+                if (err_is_ok (error)) {
+                    error = fat32_open_file(&my_config, path, &file_descriptor);
+                }
 
                 lmp_chan_send2(channel, 0, NULL_CAP, error, file_descriptor);
             }
@@ -56,13 +207,17 @@ static void my_handler (struct lmp_chan* channel, struct lmp_recv_msg* message,
             uint32_t result_buffer_length = 0;
             error = get_shared_buffer (memory_descriptor, &result_buffer, &result_buffer_length);
 
-            // TODO: Send back an error.
-            assert (size <= result_buffer_length);
+            if (err_is_ok (error) && size > result_buffer_length) {
+                error = AOS_ERR_LMP_INVALID_ARGS;
+            }
 
             size_t characters_read = result_buffer_length;
 
-             if (err_is_ok (error)) {
+            // The file contents are written directly into the shared buffer or bulk slot.
+            if (err_is_ok (error)) {
                 error = fat32_read_file (file_descriptor, position, size, result_buffer, &characters_read);
+            } else {
+                characters_read = 0;
             }
             lmp_chan_send2 (channel, 0, NULL_CAP, error, characters_read);
             break;
@@ -76,6 +231,63 @@ static void my_handler (struct lmp_chan* channel, struct lmp_recv_msg* message,
             }
             break;
 
+        case AOS_RPC_SWAP_OUT:;
+            {
+                uint32_t swap_slot = message -> words [2];
+                bool new_slot = (swap_slot == AOS_RPC_SWAP_NEW_SLOT);
+                void* page = NULL;
+                error = get_swap_page (message -> words [1], &page);
+
+                if (err_is_ok (error) && swap_page_count == 0) {
+                    error = AOS_ERR_SWAP_UNAVAILABLE;
+                }
+                if (err_is_ok (error) && new_slot) {
+                    error = swap_alloc_slot (channel, &swap_slot);
+                } else if (err_is_ok (error)) {
+                    error = swap_check_owner (channel, swap_slot);
+                }
+                if (err_is_ok (error)) {
+                    error = swap_transfer (swap_slot, page, true);
+                    if (err_is_fail (error) && new_slot) {
+                        swap_free_slot (swap_slot);
+                    }
+                }
+
+                lmp_chan_send2 (channel, 0, NULL_CAP, error, swap_slot);
+            }
+            break;
+        case AOS_RPC_SWAP_IN:;
+            {
+                uint32_t swap_slot = message -> words [2];
+                void* page = NULL;
+                error = get_swap_page (message -> words [1], &page);
+
+                if (err_is_ok (error)) {
+                    error = swap_check_owner (channel, swap_slot);
+                }
+                if (err_is_ok (error)) {
+                    error = swap_transfer (swap_slot, page, false);
+                }
+                if (err_is_ok (error)) {
+                    swap_free_slot (swap_slot);
+                }
+
+                lmp_chan_send1 (channel, 0, NULL_CAP, error);
+            }
+            break;
+        case AOS_RPC_SWAP_FREE:;
+            {
+                uint32_t swap_slot = message -> words [1];
+                error = swap_check_owner (channel, swap_slot);
+
+                if (err_is_ok (error)) {
+                    swap_free_slot (swap_slot);
+                }
+
+                lmp_chan_send1 (channel, 0, NULL_CAP, error);
+            }
+            break;
+
         default:;
             handle_unknown_message(channel, capability);
     }
@@ -105,10 +317,23 @@ static uint32_t parse_master_boot_record (sector_read_function_t read_function)
         uint32_t partition_start_sector_high = get_short (master_boot_record, 0x1be + 0xa);
 
         partition_start_sector = (partition_start_sector_high << 16) | partition_start_sector_low;
+
+        // Look for a swap partition in the other entries.
+        for (uint32_t entry = 0x1ce; entry < 0x1fe && swap_page_count == 0; entry += 0x10) {
+            uint8_t type = get_short (master_boot_record, entry + 0x4) & 0xff;
+            if (type == SWAP_PARTITION_TYPE) {
+                swap_start_sector = ((uint32_t) get_short (master_boot_record, entry + 0xa) << 16)
+                    | get_short (master_boot_record, entry + 0x8);
+                uint32_t sectors = ((uint32_t) get_short (master_boot_record, entry + 0xe) << 16)
+                    | get_short (master_boot_record, entry + 0xc);
+                swap_page_count = sectors / SECTORS_PER_PAGE;
+            }
+        }
     } else {
         debug_printf ("Warning! NULL-sector can't be read\n");
     }
     debug_printf_quiet ("partition_start_sector: %u\n", partition_start_sector);
+    debug_printf_quiet ("swap partition: sector %u, %u pages\n", swap_start_sector, swap_page_count);
 
     return partition_start_sector;
 }
@@ -118,13 +343,25 @@ errval_t start_filesystem_server (void)
 {
     errval_t error = SYS_ERR_OK;
 
-    error = fat32_init (&my_config, mmchs_read_block, parse_master_boot_record (mmchs_read_block));
+    error = fat32_init (&my_config, read_block, parse_master_boot_record (read_block));
 
     debug_printf ("FAT initialized\n");
 
+    // Domains can page out to the SD card if there's a swap partition.
+    if (err_is_ok (error) && swap_page_count > 0) {
+        swap_bitmap = calloc ((swap_page_count + 31) / 32, sizeof (uint32_t));
+        swap_owners = calloc (swap_page_count, sizeof (struct lmp_chan*));
+        if (swap_bitmap == NULL || swap_owners == NULL) {
+            swap_page_count = 0;
+        }
+    }
+    if (err_is_ok (error) && swap_page_count > 0) {
+        server_set_close_handler (swap_connection_closed);
+    }
+
     if (err_is_ok (error)) {
 //         test_fs (); // TODO remove when not needed any more.
-        error = start_server (aos_service_filesystem, my_handler);
+        error = start_server_with_workers (aos_service_filesystem, my_handler, FILESYSTEM_WORKERS);
     }
     return error;
 }
@@ -58,6 +58,9 @@ int main(int argc, char **argv)
     // Initializing the SD-Card
     //
 
+    // We are the swap device ourselves.
+    paging_disable_swap();
+
     // Getting the necessary capabilities from init
     struct capref argcn = {
         .cnode = cnode_root,
@@ -0,0 +1,48 @@
+/**
+ *\brief Print from the second core through the service proxy of init.
+ *
+ * Started on core 0, e.g. with "shell=proxy_print", it starts itself on core 1.
+ * There, the terminal output goes to the serial driver on core 0 through the
+ * proxy. The messages get no reply, so the proxy must not wait for one:
+ * More lines than AOS_RPC_MAX_PENDING have to come through.
+ */
+
+#include <barrelfish/aos_rpc.h>
+
+#include <stdio.h>
+
+#define PRINT_LINES (4 * AOS_RPC_MAX_PENDING)
+
+int main (int argc, char *argv[])
+{
+    if (disp_get_core_id () == 0) {
+        domainid_t domain;
+        errval_t error = aos_rpc_process_spawn (aos_rpc_get_init_channel (), "proxy_print", 1, &domain);
+        if (err_is_fail (error)) {
+            printf ("proxy_print: failed to spawn on core 1: %s\n", err_getstring (error));
+        }
+        return 0;
+    }
+
+    struct aos_rpc* serial = aos_rpc_get_serial_driver_channel ();
+    if (serial == NULL) {
+        debug_printf ("proxy_print: no serial driver\n");
+        return 1;
+    }
+
+    // Short lines, such that each one is a single AOS_RPC_SERIAL_WRITE message.
+    for (int i = 0; i < PRINT_LINES; i++) {
+        printf ("proxy_print: line %d\n", i);
+    }
+
+    // AOS_RPC_SERIAL_PUTCHAR doesn't get a reply either.
+    const char* text = "proxy_print: putchar\n";
+    for (int i = 0; i < PRINT_LINES; i++) {
+        for (const char* c = text; *c; c++) {
+            aos_rpc_serial_putchar (serial, *c);
+        }
+    }
+
+    printf ("proxy_print: done\n");
+    return 0;
+}
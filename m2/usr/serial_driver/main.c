@@ -36,27 +36,264 @@ static errval_t init_uart_driver (struct capref uart_cap)
     return error;
 }
 
-static char uart_getchar(void)
+// UART registers (offsets from dev_base).
+#define UART_RHR 0x00 // Receive holding register (read)
+#define UART_THR 0x00 // Transmit holding register (write)
+#define UART_IER 0x04 // Interrupt enable register
+#define UART_LSR 0x14 // Line status register
+
+#define UART_IER_RHR_IT 0x01 // Receive data interrupt
+#define UART_IER_THR_IT 0x02 // Transmit holding register empty interrupt
+#define UART_LSR_RX_FIFO_E 0x01 // At least one character in the receive FIFO
+#define UART_LSR_TX_FIFO_E 0x20 // Transmit holding register empty
+
+// UART3 is connected to SPI 74 of the GIC.
+#define UART_IRQ (32 + 74)
+
+#define RX_RING_SIZE 256
+#define TX_RING_SIZE 4096
+
+static inline volatile uint32_t* uart_register (uint32_t offset)
 {
-    volatile uint32_t* uart_lsr = (uint32_t*) (dev_base + 0x14);
-    volatile uint32_t* uart_rhr = (uint32_t*) (dev_base       );
+    return (volatile uint32_t*) (dev_base + offset);
+}
 
-    for (; ((*uart_lsr) & 0x01) == 0 ;);
+/**
+ * A simple ring buffer of characters.
+ */
+struct ring {
+    char* data;
+    uint32_t size;
+    uint32_t head; // Next character to read.
+    uint32_t count;
+};
 
-    return *uart_rhr;
+static char rx_data [RX_RING_SIZE];
+static char tx_data [TX_RING_SIZE];
+static struct ring rx_ring = { rx_data, RX_RING_SIZE, 0, 0 };
+static struct ring tx_ring = { tx_data, TX_RING_SIZE, 0, 0 };
+
+static inline bool ring_is_empty (struct ring* ring)
+{
+    return ring -> count == 0;
 }
 
-static void uart_putchar(char c)
+static inline bool ring_is_full (struct ring* ring)
+{
+    return ring -> count == ring -> size;
+}
+
+static inline void ring_push (struct ring* ring, char c)
 {
-    volatile uint32_t* uart_lsr = (uint32_t*) (dev_base + 0x14);
-    volatile uint32_t* uart_thr = (uint32_t*) (dev_base       );
+    assert (!ring_is_full (ring));
+    ring -> data [(ring -> head + ring -> count) % ring -> size] = c;
+    ring -> count++;
+}
+
+static inline char ring_pop (struct ring* ring)
+{
+    assert (!ring_is_empty (ring));
+    char c = ring -> data [ring -> head];
+    ring -> head = (ring -> head + 1) % ring -> size;
+    ring -> count--;
+    return c;
+}
+
+/// True if the UART interrupt could be registered. Otherwise we fall back to polling.
+static bool interrupts_enabled = false;
+
+/**
+ * A getchar request waiting for input.
+ */
+struct waiting_reader {
+    struct lmp_chan* channel;
+    struct waiting_reader* next;
+};
+
+/**
+ * The queue of waiting getchar requests of a single domain.
+ */
+struct reader_queue {
+    domainid_t domain;
+    struct waiting_reader* head;
+    struct waiting_reader* tail;
+    struct reader_queue* next;
+};
+
+static struct reader_queue* reader_queues = NULL;
 
-    if (c == '\n')
+static struct reader_queue* get_reader_queue (domainid_t domain, bool create)
+{
+    struct reader_queue* queue = reader_queues;
+    while (queue && queue -> domain != domain) {
+        queue = queue -> next;
+    }
+    if (queue == NULL && create) {
+        queue = calloc (1, sizeof (struct reader_queue));
+        if (queue) {
+            queue -> domain = domain;
+            queue -> next = reader_queues;
+            reader_queues = queue;
+        }
+    }
+    return queue;
+}
+
+/// Move characters from the receive FIFO into the receive ring.
+static void uart_receive (void)
+{
+    while ((*uart_register (UART_LSR) & UART_LSR_RX_FIFO_E) && !ring_is_full (&rx_ring)) {
+        ring_push (&rx_ring, *uart_register (UART_RHR));
+    }
+
+    // The interrupt is level-triggered, so it would fire again as soon as it's
+    // unmasked while input is left in the FIFO. Only ask for it while there's room.
+    if (interrupts_enabled) {
+        if (ring_is_full (&rx_ring)) {
+            *uart_register (UART_IER) &= ~UART_IER_RHR_IT;
+        } else {
+            *uart_register (UART_IER) |= UART_IER_RHR_IT;
+        }
+    }
+}
+
+/// Move characters from the transmit ring into the transmit FIFO.
+static void uart_transmit (void)
+{
+    while ((*uart_register (UART_LSR) & UART_LSR_TX_FIFO_E) && !ring_is_empty (&tx_ring)) {
+        *uart_register (UART_THR) = ring_pop (&tx_ring);
+    }
+
+    // Only ask for a transmit interrupt if there's something left to send.
+    if (interrupts_enabled) {
+        if (ring_is_empty (&tx_ring)) {
+            *uart_register (UART_IER) &= ~UART_IER_THR_IT;
+        } else {
+            *uart_register (UART_IER) |= UART_IER_THR_IT;
+        }
+    }
+}
+
+static void uart_putchar(char c)
+{
+    if (c == '\n') {
         uart_putchar('\r');
+    }
 
-    for (; ((*uart_lsr) & 0x20) == 0 ;);
+    // The ring is full, so we have to wait for the hardware to catch up.
+    while (ring_is_full (&tx_ring)) {
+        uart_transmit ();
+    }
+    ring_push (&tx_ring, c);
+    uart_transmit ();
 
-    *uart_thr = c;
+    if (!interrupts_enabled) {
+        // Without interrupts we have to push everything out right away.
+        while (!ring_is_empty (&tx_ring)) {
+            uart_transmit ();
+        }
+    }
+}
+
+/**
+ * Reply to waiting readers which are allowed to read, as long as there's input.
+ */
+static void serve_waiting_readers (void)
+{
+    for (struct reader_queue* queue = reader_queues; queue; queue = queue -> next) {
+
+        // Only the foreground domain may receive input.
+        bool may_read = (foreground_domain == 0 || queue -> domain == foreground_domain);
+
+        while (may_read && queue -> head) {
+
+            if (!interrupts_enabled) {
+                // Polling fallback: wait for the next character.
+                while (!(*uart_register (UART_LSR) & UART_LSR_RX_FIFO_E));
+                uart_receive ();
+            }
+            if (ring_is_empty (&rx_ring)) {
+                return;
+            }
+
+            struct waiting_reader* reader = queue -> head;
+            queue -> head = reader -> next;
+            if (queue -> head == NULL) {
+                queue -> tail = NULL;
+            }
+
+            lmp_chan_send2 (reader -> channel, 0, NULL_CAP, SYS_ERR_OK, ring_pop (&rx_ring));
+            free (reader);
+
+            // There's room again, pick up input which waited in the FIFO.
+            uart_receive ();
+        }
+    }
+}
+
+/// Park a getchar request until input for the domain arrives.
+static errval_t add_waiting_reader (struct lmp_chan* channel, domainid_t domain)
+{
+    struct reader_queue* queue = get_reader_queue (domain, true);
+    struct waiting_reader* reader = malloc (sizeof (struct waiting_reader));
+
+    if (queue == NULL || reader == NULL) {
+        free (reader);
+        return LIB_ERR_MALLOC_FAIL;
+    }
+
+    reader -> channel = channel;
+    reader -> next = NULL;
+    if (queue -> tail) {
+        queue -> tail -> next = reader;
+    } else {
+        queue -> head = reader;
+    }
+    queue -> tail = reader;
+    return SYS_ERR_OK;
+}
+
+static struct lmp_endpoint* irq_endpoint;
+
+static void uart_interrupt_handler (void* arg)
+{
+    // Consume the notification.
+    struct lmp_recv_buf buf = { .buflen = 0 };
+    errval_t error = lmp_endpoint_recv (irq_endpoint, &buf, NULL);
+    debug_printf_quiet ("UART interrupt: %s\n", err_getstring (error));
+
+    uart_receive ();
+    uart_transmit ();
+    serve_waiting_readers ();
+
+    // The kernel masked the interrupt on delivery.
+    error = invoke_irqtable_unmask (cap_irq, UART_IRQ);
+    if (err_is_fail (error)) {
+        debug_printf ("Failed to unmask UART interrupt: %s\n", err_getstring (error));
+    }
+
+    lmp_endpoint_register (irq_endpoint, get_default_waitset(), MKCLOSURE (uart_interrupt_handler, arg));
+}
+
+/// Route the UART interrupt to us. If this fails, the driver keeps polling.
+static errval_t init_uart_interrupts (void)
+{
+    struct capref endpoint_cap;
+
+    // A minimum-sized endpoint is enough, we don't need to buffer more than one notification.
+    errval_t error = endpoint_create (LMP_RECV_LENGTH, &endpoint_cap, &irq_endpoint);
+
+    if (err_is_ok (error)) {
+        error = lmp_endpoint_register (irq_endpoint, get_default_waitset(), MKCLOSURE (uart_interrupt_handler, NULL));
+    }
+    if (err_is_ok (error)) {
+        error = invoke_irqtable_set (cap_irq, UART_IRQ, endpoint_cap);
+    }
+    if (err_is_ok (error)) {
+        interrupts_enabled = true;
+        uart_receive (); // Enables the receive interrupt.
+    }
+    return error;
 }
 
 static void my_handler (struct lmp_chan* channel, struct lmp_recv_msg* message, struct capref capability, uint32_t message_type)
@@ -68,25 +305,34 @@ static void my_handler (struct lmp_chan* channel, struct lmp_recv_msg* message,
             char output_character = message -> words [1];
             uart_putchar (output_character);
             break;
+        case AOS_RPC_SERIAL_WRITE:;
+            uint32_t length = message -> words [1];
+            char* characters = (char*) &(message -> words [2]);
+            for (uint32_t i = 0; i < length && i < AOS_RPC_SERIAL_INLINE_LENGTH; i++) {
+                uart_putchar (characters [i]);
+            }
+            break;
         case AOS_RPC_SERIAL_GETCHAR:;
-            if (foreground_domain == 0 || message -> words [1] == foreground_domain) {
-                char input_character = uart_getchar ();
-                lmp_chan_send2 (channel, 0, NULL_CAP, SYS_ERR_OK, input_character);
+            // The reply is sent once input for the domain is available.
+            error = add_waiting_reader (channel, message -> words [1]);
+            if (err_is_ok (error)) {
+                serve_waiting_readers ();
             } else {
-                // TODO: let it wait!
-                // TODO: Proper error value.
-                error = -1;
                 lmp_chan_send2 (channel, 0, NULL_CAP, error, 0);
             }
             break;
         case AOS_RPC_SEND_STRING:;
             uint32_t memory_descriptor = message -> words [1];
             void* buffer;
-            error = get_shared_buffer (memory_descriptor, &buffer, NULL);
+            uint32_t buffer_size = 0;
+            error = get_shared_buffer (memory_descriptor, &buffer, &buffer_size);
             if (err_is_ok (error)) {
+                // Consume the string in place.
                 debug_printf_quiet ("Received a string:\n");
-                printf ("%s", (char*) buffer);
-                fflush (stdout);
+                char* string = buffer;
+                for (uint32_t i = 0; i < buffer_size && string [i] != '\0'; i++) {
+                    uart_putchar (string [i]);
+                }
                 debug_printf_quiet ("\nEnd of string:\n");
             }
             lmp_chan_send1 (channel, 0, NULL_CAP, error);
@@ -95,6 +341,8 @@ static void my_handler (struct lmp_chan* channel, struct lmp_recv_msg* message,
             foreground_domain = message -> words [1];
             debug_printf_quiet ("Setting Domain %u as foreground domain\n", foreground_domain);
             lmp_chan_send1 (channel, 0, NULL_CAP, SYS_ERR_OK);
+            // The new foreground domain may already be waiting for input.
+            serve_waiting_readers ();
             break;
         default:
             handle_unknown_message (channel, capability);
@@ -118,6 +366,13 @@ int main (int argc, char *argv[])
         error = init_uart_driver (frame);
     }
 
+    if (err_is_ok (error)) {
+        errval_t irq_error = init_uart_interrupts ();
+        if (err_is_fail (irq_error)) {
+            debug_printf ("UART interrupts not available, polling: %s\n", err_getstring (irq_error));
+        }
+    }
+
     // Register with init and start the event loop.
     if (err_is_ok (error)) {
         start_server (aos_service_serial, my_handler);